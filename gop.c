@@ -33,19 +33,36 @@ http://www.accre.vanderbilt.edu
 #include "assert_result.h"
 #include <apr_thread_mutex.h>
 #include <apr_thread_cond.h>
+#include <apr_atomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#endif
 #include "type_malloc.h"
 #include "log.h"
 #include "opque.h"
 #include "atomic_counter.h"
 #include "apr_wrapper.h"
+#include "gop_slab.h"
 
 //** Defined in opque.c
 void _opque_start_execution(opque_t *que);
+void _opque_submit_all(opque_t *que);
+void _opque_ring_init(que_data_t *q);
 void _opque_print_stack(Stack_t *stack);
+op_generic_t *_opque_finished_pop(que_data_t *q);
+int _opque_finished_count(que_data_t *q);
 extern pigeon_coop_t *_gop_control;
 
+int _gop_completed_successfully(op_generic_t *g);
+void _gop_dep_fail(op_generic_t *gop);
+
 op_status_t op_success_status = {OP_STATE_SUCCESS, 0};
 op_status_t op_failure_status = {OP_STATE_FAILURE, 0};
 op_status_t op_retry_status = {OP_STATE_RETRY, 0};
@@ -55,19 +72,432 @@ op_status_t op_invalid_host_status = {OP_STATE_INVALID_HOST, 0};
 //op_status_t op_cant_connect_status = {OP_STATE_CANT_CONNECT, 0};
 op_status_t op_cant_connect_status = {OP_STATE_FAILURE, OP_STATE_CANT_CONNECT};
 op_status_t op_error_status = {OP_STATE_ERROR, 0};
+op_status_t op_cancelled_status = {OP_STATE_FAILURE, OP_STATE_CANCELLED};
+
+int _gop_completion_mode = OP_CM_LOCKED;
+
+//***********************************************************************
+// Futex helpers used by OP_CM_ATOMIC ops to park on a completion.
+// Waiters don't sleep on the op's state word itself since the op can
+// be freed the moment it's flagged done, before the completion gets to
+// the wake.  Instead they sleep on a sequence word from a global table
+// picked by the op's address.  The completion bumps it after updating
+// the state and wakes everybody on it.  Ops sharing a word just get a
+// spurious wakeup.  Only Linux has futexes so everywhere else
+// OP_CM_ATOMIC is refused and these are never called.
+//***********************************************************************
+
+#define GOP_FUTEX_TABLE 64
+static atomic_int_t _gop_futex_seq[GOP_FUTEX_TABLE];
+
+#define _gop_futex_word(gop) (&(_gop_futex_seq[((uintptr_t)(gop) / sizeof(op_generic_t)) % GOP_FUTEX_TABLE]))
+
+#ifdef __linux__
+#define GOP_HAVE_FUTEX 1
+
+static void _gop_futex_wait(atomic_int_t *word, apr_uint32_t val, apr_interval_time_t dt)
+{
+    struct timespec ts, *tsp;
+
+    tsp = NULL;
+    if (dt > 0) {
+        ts.tv_sec = apr_time_sec(dt);
+        ts.tv_nsec = apr_time_usec(dt) * 1000;
+        tsp = &ts;
+    }
+
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+//** Only uses the op's address so it's safe after the op is gone
+static void _gop_futex_wake(op_generic_t *gop)
+{
+    atomic_int_t *word = _gop_futex_word(gop);
+
+    atomic_inc(*word);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+static void _gop_futex_wait(atomic_int_t *word, apr_uint32_t val, apr_interval_time_t dt)
+{
+    apr_sleep(100);
+}
+
+static void _gop_futex_wake(op_generic_t *gop)
+{
+    return;
+}
+
+#endif
+
+//***********************************************************************
+// Managed blockers.  An executor can install a blocker on its threads
+// so it's told whenever one of them is about to sleep in a gop wait and
+// can compensate by running something else in the meantime.
+//***********************************************************************
+
+apr_threadkey_t *_gop_blocker_key = NULL;
+
+//***********************************************************************
+// gop_blocker_[init|destroy] - Creates/destroys the thread blocker key
+//***********************************************************************
+
+void gop_blocker_init(apr_pool_t *pool)
+{
+    apr_threadkey_private_create(&_gop_blocker_key, NULL, pool);
+}
+
+void gop_blocker_destroy()
+{
+    if (_gop_blocker_key == NULL) return;
+    apr_threadkey_private_delete(_gop_blocker_key);
+    _gop_blocker_key = NULL;
+}
+
+//***********************************************************************
+// gop_blocker_set - Installs the blocker for the calling thread returning
+//    the previous one.  NULL clears it.
+//***********************************************************************
+
+gop_blocker_t *gop_blocker_set(gop_blocker_t *b)
+{
+    gop_blocker_t *prev = NULL;
+
+    if (_gop_blocker_key == NULL) return(NULL);
+
+    apr_threadkey_private_get((void **)&prev, _gop_blocker_key);
+    apr_threadkey_private_set(b, _gop_blocker_key);
+    return(prev);
+}
+
+//***********************************************************************
+// gop_block_[begin|end] - Brackets a blocking call notifying the thread's
+//    blocker, if any.  Can be called with gop locks held.
+//***********************************************************************
+
+void gop_block_begin(gop_block_t *blk)
+{
+    gop_blocker_t *b = NULL;
+
+    blk->b = NULL;
+    blk->token = 0;
+    if (_gop_blocker_key == NULL) return;
+
+    apr_threadkey_private_get((void **)&b, _gop_blocker_key);
+    if (b == NULL) return;
+
+    blk->b = b;
+    blk->token = b->begin(b->arg);
+}
+
+void gop_block_end(gop_block_t *blk)
+{
+    if (blk->b != NULL) blk->b->end(blk->b->arg, blk->token);
+}
+
+//***********************************************************************
+// _gop_blocker_current - Returns the calling thread's blocker if any
+//***********************************************************************
+
+gop_blocker_t *_gop_blocker_current()
+{
+    gop_blocker_t *b = NULL;
+
+    if (_gop_blocker_key != NULL) apr_threadkey_private_get((void **)&b, _gop_blocker_key);
+    return(b);
+}
+
+//***********************************************************************
+// _gop_park - Parks the caller on the gop using the blocker's park hook.
+//    Returns once woken with the gop lock held again.  Like a cond wait
+//    the caller has to recheck whatever it's waiting for.
+//    NOTE: The gop lock must be held
+//***********************************************************************
+
+void _gop_park(gop_control_t *ctl, gop_blocker_t *b)
+{
+    gop_parked_t p;
+
+    p.wake = NULL;
+    p.arg = NULL;
+    p.next = ctl->parked;
+    ctl->parked = &p;
+    b->park(b->arg, &p, ctl->lock);
+}
+
+//***********************************************************************
+// _gop_parked_wake - Wakes everybody parked on the gop
+//    NOTE: The gop lock must be held
+//***********************************************************************
+
+void _gop_parked_wake(gop_control_t *ctl)
+{
+    gop_parked_t *p, *next;
+
+    p = ctl->parked;
+    ctl->parked = NULL;
+    while (p != NULL) {
+        next = p->next;  //** p lives on the waiter's stack so get the next one 1st
+        p->wake(p->arg);
+        p = next;
+    }
+}
+
+//***********************************************************************
+// _gop_cond_broadcast - Wakes all the gop's waiters.  The gop lock must be held.
+//***********************************************************************
+
+void _gop_cond_broadcast(op_generic_t *gop)
+{
+    apr_thread_cond_broadcast(gop->base.ctl->cond);
+    if (gop->base.ctl->parked != NULL) _gop_parked_wake(gop->base.ctl);
+}
+
+//***********************************************************************
+// _gop_cond_[timed]wait - Waits on the gop's cond inside a managed block.
+//    Untimed waits park instead if the thread's blocker supports it.
+//    The gop lock must be held.
+//***********************************************************************
+
+void _gop_cond_wait(op_generic_t *gop)
+{
+    gop_blocker_t *b;
+    gop_block_t blk;
+
+    b = _gop_blocker_current();
+    if ((b != NULL) && (b->park != NULL)) {
+        _gop_park(gop->base.ctl, b);
+        return;
+    }
+
+    gop_block_begin(&blk);
+    apr_thread_cond_wait(gop->base.ctl->cond, gop->base.ctl->lock);
+    gop_block_end(&blk);
+}
+
+void _gop_cond_timedwait(op_generic_t *gop, apr_interval_time_t dt)
+{
+    gop_block_t blk;
+
+    gop_block_begin(&blk);
+    apr_thread_cond_timedwait(gop->base.ctl->cond, gop->base.ctl->lock, dt);
+    gop_block_end(&blk);
+}
+
+//***********************************************************************
+// _gop_state_update - Atomically sets and clears bits in the state word
+//    and returns the previous value
+//***********************************************************************
+
+apr_uint32_t _gop_state_update(op_generic_t *gop, apr_uint32_t set_bits, apr_uint32_t clear_bits)
+{
+    apr_uint32_t old, curr;
+
+    curr = atomic_get(gop->base.state);
+    do {
+        old = curr;
+        curr = atomic_cas(gop->base.state, (old | set_bits) & ~clear_bits, old);
+    } while (curr != old);
+
+    return(old);
+}
+
+//***********************************************************************
+// _gop_atomic_park - Untimed _gop_atomic_wait() using the blocker's park
+//    hook.  The op gets a lock so the completion knows where to find us.
+//    Returns 1 since the op always completes.
+//***********************************************************************
+
+int _gop_atomic_park(op_generic_t *gop, gop_blocker_t *b)
+{
+    gop_control_t *ctl = _gop_control_get(gop);
+    apr_uint32_t s;
+
+    apr_thread_mutex_lock(ctl->lock);
+    for (;;) {
+        s = atomic_get(gop->base.state);
+        if (s & OP_STATE_BIT_DONE) break;
 
+        if ((s & OP_STATE_BIT_WAITERS) == 0) {  //** The completion only looks for us if this is set
+            if (atomic_cas(gop->base.state, s | OP_STATE_BIT_WAITERS, s) != s) continue;
+        }
+
+        _gop_park(ctl, b);
+    }
+    apr_thread_mutex_unlock(ctl->lock);
+
+    return(1);
+}
+
+//***********************************************************************
+// _gop_atomic_wait - Parks the caller on the state word until the op
+//    completes or dt expires.  A dt of 0 waits forever.
+//    Returns 1 if the op completed and 0 on a timeout.
+//***********************************************************************
+
+int _gop_atomic_wait(op_generic_t *gop, apr_interval_time_t dt)
+{
+    apr_uint32_t s, seq;
+    apr_time_t end, left;
+    atomic_int_t *word;
+    gop_blocker_t *b;
+    gop_block_t blk;
+    int done, blocked;
+
+    if (dt == 0) {
+        b = _gop_blocker_current();
+        if ((b != NULL) && (b->park != NULL)) return(_gop_atomic_park(gop, b));
+    }
+
+    end = (dt > 0) ? apr_time_now() + dt : 0;
+    left = 0;
+    done = 1;
+    blocked = 0;
+    word = _gop_futex_word(gop);
+
+    for (;;) {
+        seq = atomic_get(*word);  //** Has to be read before the state so we can't miss the wake
+        s = atomic_get(gop->base.state);
+        if (s & OP_STATE_BIT_DONE) break;
+
+        if ((s & OP_STATE_BIT_WAITERS) == 0) {  //** Flag that we're parking
+            if (atomic_cas(gop->base.state, s | OP_STATE_BIT_WAITERS, s) != s) continue;
+            s |= OP_STATE_BIT_WAITERS;
+        }
+
+        if (dt > 0) {
+            left = end - apr_time_now();
+            if (left <= 0) {
+                done = 0;
+                break;
+            }
+        }
+
+        if (blocked == 0) {  //** Only tell the blocker once we really have to sleep
+            gop_block_begin(&blk);
+            blocked = 1;
+        }
+        _gop_futex_wait(word, seq, left);
+    }
+
+    if (blocked == 1) gop_block_end(&blk);
+
+    return(done);
+}
+
+//***********************************************************************
+// _gop_completing_wait - Waits until the op's completion is done touching
+//    it.  Unlike _gop_atomic_wait() this waits for COMPLETING to clear,
+//    not just DONE, since the completion wakes the waiters after DONE.
+//***********************************************************************
+
+void _gop_completing_wait(op_generic_t *gop)
+{
+    apr_uint32_t s, seq;
+    atomic_int_t *word;
+    gop_block_t blk;
+    int blocked;
+
+    word = _gop_futex_word(gop);
+    blocked = 0;
+
+    for (;;) {
+        seq = atomic_get(*word);
+        s = atomic_get(gop->base.state);
+        if ((s & OP_STATE_BIT_COMPLETING) == 0) break;
+
+        if ((s & OP_STATE_BIT_WAITERS) == 0) {  //** Flag that we're parking
+            if (atomic_cas(gop->base.state, s | OP_STATE_BIT_WAITERS, s) != s) continue;
+        }
+
+        if (blocked == 0) {
+            gop_block_begin(&blk);
+            blocked = 1;
+        }
+        _gop_futex_wait(word, seq, 0);
+    }
+
+    if (blocked == 1) gop_block_end(&blk);
+}
 
 //***********************************************************************
+// _gop_control_get - Returns the gop's lock/cond pair reserving one from
+//    the pigeon coop if needed.  OP_CM_ATOMIC ops only get one when
+//    somebody actually needs to lock them.
 //***********************************************************************
 
-int gd_shutdown = 0;
-apr_thread_t *gd_thread = NULL;
+gop_control_t *_gop_control_get(op_generic_t *gop)
+{
+    pigeon_coop_hole_t pch;
+    gop_control_t *ctl;
+
+    if (gop->base.ctl != NULL) return(gop->base.ctl);
+
+    pch = reserve_pigeon_coop_hole(_gop_control);
+    ctl = (gop_control_t *)pigeon_coop_hole_data(&pch);
+    ctl->pch = pch;
+    if (apr_atomic_casptr((volatile void **)&(gop->base.ctl), ctl, NULL) != NULL) {  //** Lost the race
+        release_pigeon_coop_hole(_gop_control, &(ctl->pch));
+    }
+
+    return(gop->base.ctl);
+}
+
+//***********************************************************************
+// gop_default_completion_mode_[set|get] - Completion mode used for new ops
+//***********************************************************************
+
+void gop_default_completion_mode_set(int mode)
+{
+#ifndef GOP_HAVE_FUTEX
+    if (mode == OP_CM_ATOMIC) {
+        gop_log_printf(0, "OP_CM_ATOMIC isn't supported on this platform.  Using OP_CM_LOCKED\n");
+        mode = OP_CM_LOCKED;
+    }
+#endif
+
+    _gop_completion_mode = mode;
+}
+
+int gop_default_completion_mode_get()
+{
+    return(_gop_completion_mode);
+}
+
+
+//***********************************************************************
+//***********************************************************************
+
+//** gop_dummy ops are completed either inline on the thread starting
+//** them or by one of the completion worker shards.  Ops are spread
+//** across the shards round robin so no single thread or lock
+//** serializes everything.
+
+#define GD_SHARDS_DEFAULT  4   //** Default number of completion workers
+#define GD_INLINE_MAX_DEPTH 8  //** Max nested inline completions before deferring to a worker
+
+typedef struct {
+    apr_thread_t *thread;
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *cond;
+    Stack_t *stack;
+    int shutdown;
+} gd_shard_t;
+
 apr_pool_t *gd_pool = NULL;
-apr_thread_mutex_t *gd_lock = NULL;
-apr_thread_cond_t *gd_cond = NULL;
-Stack_t *gd_stack = NULL;
+gd_shard_t *gd_shard = NULL;
+int gd_n_shards = GD_SHARDS_DEFAULT;   //** Requested number of workers
+int gd_n_running = 0;                  //** Number actually in gd_shard
+atomic_int_t gd_next_shard = 0;
+int gd_exec_mode = OP_EXEC_QUEUE;
+int _gop_waiter_help = 1;
+apr_threadkey_t *gd_depth_key = NULL;
 
 void _gop_dummy_submit_op(void *arg, op_generic_t *op);
+void _gop_dummy_submit_batch(void *arg, op_generic_t **ops, int n);
+void _gop_dummy_sync_exec(void *arg, op_generic_t *op);
 
 static portal_fn_t _gop_dummy_portal = {
     .dup_connect_context = NULL,
@@ -75,7 +505,9 @@ static portal_fn_t _gop_dummy_portal = {
     .connect = NULL,
     .close_connection = NULL,
     .sort_tasks = NULL,
-    .submit = _gop_dummy_submit_op
+    .submit = _gop_dummy_submit_op,
+    .sync_exec = _gop_dummy_sync_exec,
+    .submit_batch = _gop_dummy_submit_batch
 };
 
 static portal_context_t _gop_dummy_pc = {
@@ -102,32 +534,68 @@ static portal_context_t _gop_dummy_pc = {
 };
 
 //***********************************************************************
-// gd_thread_func - gop_dummy execution thread.  Just calls the
-//   gop_mark_completed() routine for the gops
+// gd_thread_func - gop_dummy completion worker.  Just calls the
+//   gop_mark_completed() routine for the gops on its shard
 //***********************************************************************
 
 void *gd_thread_func(apr_thread_t *th, void *data)
 {
+    gd_shard_t *s = (gd_shard_t *)data;
     op_generic_t *gop;
 
-    apr_thread_mutex_lock(gd_lock);
-    while (gd_shutdown == 0) {
+    apr_thread_mutex_lock(s->lock);
+    while (s->shutdown == 0) {
         //** Execute everything on the stack
-        while ((gop = (op_generic_t *)pop(gd_stack)) != NULL) {
-            log_printf(15, "DUMMY gid=%d status=%d\n", gop_id(gop), gop->base.status);
-            apr_thread_mutex_unlock(gd_lock);
-            gop_mark_completed(gop, gop->base.status);
-            apr_thread_mutex_lock(gd_lock);
+        while ((gop = (op_generic_t *)pop(s->stack)) != NULL) {
+            gop_log_printf(15, "DUMMY gid=%d status=%d\n", gop_id(gop), gop->base.status);
+            apr_thread_mutex_unlock(s->lock);
+            if (atomic_get(gop->base.dep_failed) != 0) {  //** Deferred dependency failure.  See _gop_dep_fail_deferred()
+                _gop_dep_fail(gop);
+            } else {
+                gop_mark_completed(gop, gop->base.status);
+            }
+            apr_thread_mutex_lock(s->lock);
         }
 
         //** Wait for more work
-        apr_thread_cond_wait(gd_cond, gd_lock);
+        apr_thread_cond_wait(s->cond, s->lock);
     }
-    apr_thread_mutex_unlock(gd_lock);
+    apr_thread_mutex_unlock(s->lock);
 
     return(NULL);
 }
 
+//***********************************************************************
+// gop_dummy_shards_set - Sets the number of gop_dummy completion workers.
+//    Must be called before init_opque_system().  Ignored once the workers
+//    are running.
+//***********************************************************************
+
+void gop_dummy_shards_set(int n)
+{
+    if (gd_shard != NULL) {
+        gop_log_printf(0, "Ignored since the workers are already running! n=%d running=%d\n", n, gd_n_running);
+        return;
+    }
+    gd_n_shards = (n < 1) ? 1 : n;
+}
+
+//***********************************************************************
+// gop_dummy_exec_mode_[set|get] - Execution mode used for new gop_dummy
+//    ops.  OP_EXEC_DIRECT completes them inline on the thread starting
+//    them whenever that's safe and OP_EXEC_QUEUE always hands them to
+//    a completion worker.  Can be changed per op with gop_set_exec_mode().
+//***********************************************************************
+
+void gop_dummy_exec_mode_set(int mode)
+{
+    gd_exec_mode = mode;
+}
+
+int gop_dummy_exec_mode_get()
+{
+    return(gd_exec_mode);
+}
 
 //***********************************************************************
 // gop_dummy_init - Initializes the gop_dummy portal
@@ -135,14 +603,24 @@ void *gd_thread_func(apr_thread_t *th, void *data)
 
 void gop_dummy_init()
 {
+    int i;
+    gd_shard_t *s;
+
     //** Make the variables
     assert_result(apr_pool_create(&gd_pool, NULL), APR_SUCCESS);
-    assert_result(apr_thread_mutex_create(&gd_lock, APR_THREAD_MUTEX_DEFAULT, gd_pool), APR_SUCCESS);
-    assert_result(apr_thread_cond_create(&gd_cond, gd_pool), APR_SUCCESS);
-    gd_stack = new_stack();
-
-    //** and launch the thread
-    thread_create_assert(&gd_thread, NULL, gd_thread_func, NULL, gd_pool);
+    apr_threadkey_private_create(&gd_depth_key, NULL, gd_pool);
+
+    gd_n_running = gd_n_shards;
+    type_malloc_clear(gd_shard, gd_shard_t, gd_n_running);
+    for (i=0; i<gd_n_running; i++) {
+        s = &(gd_shard[i]);
+        assert_result(apr_thread_mutex_create(&(s->lock), APR_THREAD_MUTEX_DEFAULT, gd_pool), APR_SUCCESS);
+        assert_result(apr_thread_cond_create(&(s->cond), gd_pool), APR_SUCCESS);
+        s->stack = new_stack();
+
+        //** and launch the thread
+        thread_create_assert(&(s->thread), NULL, gd_thread_func, (void *)s, gd_pool);
+    }
 }
 
 //***********************************************************************
@@ -152,53 +630,164 @@ void gop_dummy_init()
 void gop_dummy_destroy()
 {
     apr_status_t tstat;
+    int i;
+    gd_shard_t *s;
 
-//** Signal a shutdown
-    apr_thread_mutex_lock(gd_lock);
-    gd_shutdown = 1;
-    apr_thread_cond_broadcast(gd_cond);
-    apr_thread_mutex_unlock(gd_lock);
+    for (i=0; i<gd_n_running; i++) {
+        s = &(gd_shard[i]);
 
-//** Wait for the thread to complete
-    apr_thread_join(&tstat, gd_thread);
+        //** Signal a shutdown
+        apr_thread_mutex_lock(s->lock);
+        s->shutdown = 1;
+        apr_thread_cond_broadcast(s->cond);
+        apr_thread_mutex_unlock(s->lock);
+
+        //** Wait for the thread to complete
+        apr_thread_join(&tstat, s->thread);
+
+        //** Clean up
+        free_stack(s->stack, 0);
+        apr_thread_mutex_destroy(s->lock);
+        apr_thread_cond_destroy(s->cond);
+    }
 
-    //** Clean up;
-    free_stack(gd_stack, 0);
-    apr_thread_mutex_destroy(gd_lock);
-    apr_thread_cond_destroy(gd_cond);
+    free(gd_shard);
+    gd_shard = NULL;
+    gd_n_running = 0;
+    apr_threadkey_private_delete(gd_depth_key);
     apr_pool_destroy(gd_pool);
 }
 
 //***********************************************************************
-// _gop_dummy_submit - Dummy submit routine
+// _gd_shard_next - Returns the next shard to use
+//***********************************************************************
+
+gd_shard_t *_gd_shard_next()
+{
+    return(&(gd_shard[atomic_inc(gd_next_shard) % gd_n_running]));
+}
+
+//***********************************************************************
+// _gop_dummy_submit - Dummy submit routine.  This can be called with
+//   gop and que locks held so the op is always handed to a worker.
 //***********************************************************************
 
 void _gop_dummy_submit_op(void *arg, op_generic_t *op)
 {
-    int dolock = 0;
+    gd_shard_t *s = _gd_shard_next();
 
-    log_printf(15, "gid=%d\n", gop_id(op));
-//  if (op->base.cb != NULL) {  //** gop is on a q
-    apr_thread_mutex_lock(gd_lock);
-    push(gd_stack, op);
-    apr_thread_cond_signal(gd_cond);
-    apr_thread_mutex_unlock(gd_lock);
-    return;
-//  }
+    gop_log_printf(15, "gid=%d\n", gop_id(op));
+    apr_thread_mutex_lock(s->lock);
+    push(s->stack, op);
+    apr_thread_cond_signal(s->cond);
+    apr_thread_mutex_unlock(s->lock);
+}
+
+//***********************************************************************
+// _gop_dummy_submit_batch - Hands a que's worth of dummy ops to a
+//   single worker with one lock round trip
+//***********************************************************************
+
+void _gop_dummy_submit_batch(void *arg, op_generic_t **ops, int n)
+{
+    gd_shard_t *s = _gd_shard_next();
+    int i;
+
+    gop_log_printf(15, "n=%d\n", n);
+    apr_thread_mutex_lock(s->lock);
+    for (i=0; i<n; i++) push(s->stack, ops[i]);
+    apr_thread_cond_signal(s->cond);
+    apr_thread_mutex_unlock(s->lock);
+}
 
-//*-------* This isn't executed below -----------
+//***********************************************************************
+// _gd_inline_enter - Increments the thread's inline completion depth.
+//   Returns 1 if it's OK to complete inline and 0 if the max depth
+//   was hit.  _gd_inline_exit() must be called if 1 is returned.
+//***********************************************************************
+
+int _gd_inline_enter()
+{
+    void *ptr;
+    intptr_t depth;
+
+    apr_threadkey_private_get(&ptr, gd_depth_key);
+    depth = (intptr_t)ptr;
+    if (depth >= GD_INLINE_MAX_DEPTH) return(0);
+
+    apr_threadkey_private_set((void *)(depth+1), gd_depth_key);
+    return(1);
+}
 
-    if (apr_thread_mutex_trylock(op->base.ctl->lock) != APR_SUCCESS) dolock = 1;
-    unlock_gop(op);
+//***********************************************************************
+
+void _gd_inline_exit()
+{
+    void *ptr;
+
+    apr_threadkey_private_get(&ptr, gd_depth_key);
+    apr_threadkey_private_set((void *)((intptr_t)ptr - 1), gd_depth_key);
+}
+
+//***********************************************************************
+// _gop_dummy_sync_exec - Completes the op on the calling thread.  Used by
+//   gop_sync_exec() and gop_wait*() which have already dropped the
+//   gop lock.  If we're nested too deeply in other inline completions
+//   callbacks we fall back to a worker and wait on it instead.
+//***********************************************************************
 
-//log_printf(15, "dolock=%d gid=%d err=%d APR_SUCCESS=%d\n", dolock, gop_id(op), err, APR_SUCCESS);
+void _gop_dummy_sync_exec(void *arg, op_generic_t *op)
+{
     op->base.started_execution = 1;
+
+    if (_gd_inline_enter() == 0) {
+        _gop_dummy_submit_op(arg, op);
+        gop_waitall(op);
+        return;
+    }
+
+    if (gop_cancel_requested(op) == 1) op->base.status = op_cancelled_status;
+    gop_timestamp(op, GOP_TS_SUBMIT);
     gop_mark_completed(op, op->base.status);
+    _gd_inline_exit();
+}
 
-    if (dolock == 1) {
-        lock_gop(op);
-    } //** lock_gop is a macro so need the {}
-    return;
+//***********************************************************************
+// _gop_dummy_start_inline - Completes an OP_EXEC_DIRECT dummy op on the
+//   thread starting it.  Only done for ops that aren't on a que or waiting
+//   on dependencies since those are started with locks held.  Returns 0 if
+//   the op was handled and 1 if it should be started normally.
+//***********************************************************************
+
+int _gop_dummy_start_inline(op_generic_t *gop)
+{
+    if ((gop->base.parent_q != NULL) || (gop->base.dep_hold != 0)) return(1);
+    if (_gd_inline_enter() == 0) return(1);
+
+    if (gop->base.completion_mode != OP_CM_ATOMIC) {  //** lock_gop() is 2 statements
+        lock_gop(gop);
+    }
+    if (gop->base.started_execution != 0) {  //** Somebody beat us to it
+        if (gop->base.completion_mode != OP_CM_ATOMIC) {
+            unlock_gop(gop);
+        }
+        _gd_inline_exit();
+        return(0);
+    }
+    gop->base.started_execution = 1;
+    if (gop->base.completion_mode != OP_CM_ATOMIC) {
+        unlock_gop(gop);
+    }
+
+    gop_trace(GOP_TP_OP_START, gop_id(gop), gop_get_type(gop));
+    if (gop_cancel_requested(gop) == 1) gop->base.status = op_cancelled_status;
+    gop_timestamp(gop, GOP_TS_SUBMIT);
+
+    gop_log_printf(15, "DUMMY inline gid=%d status=%d\n", gop_id(gop), gop->base.status);
+    gop_mark_completed(gop, gop->base.status);
+    _gd_inline_exit();
+
+    return(0);
 }
 
 
@@ -210,7 +799,7 @@ void _gop_dummy_free(op_generic_t *gop, int mode)
 {
     gop_generic_free(gop, mode);  //** I free the actual op
 
-    if (mode == OP_DESTROY) free(gop);
+    if (mode == OP_DESTROY) gop_slab_free(gop);
 }
 
 //***********************************************************************
@@ -223,10 +812,10 @@ op_generic_t *gop_dummy(op_status_t state)
 {
     op_generic_t *gop;
 
-    type_malloc_clear(gop, op_generic_t, 1);
+    type_slab_malloc_clear(gop, op_generic_t, 1);
 
-    log_printf(15, " state=%d\n", state);
-    flush_log();
+    gop_log_printf(15, " state=%d\n", state);
+    gop_flush_log();
 
     gop_init(gop);
     gop->base.pc = &_gop_dummy_pc;
@@ -234,6 +823,7 @@ op_generic_t *gop_dummy(op_status_t state)
 //  gop->base.started_execution = 1;
     gop->base.free = _gop_dummy_free;
     gop->base.status = state;
+    gop->base.execution_mode = gd_exec_mode;
 //  gop_mark_completed(gop, state);
 
     return(gop);
@@ -251,6 +841,283 @@ void gop_callback_append(op_generic_t *gop, callback_t *cb)
     unlock_gop(gop);
 }
 
+//*************************************************************
+// gop_cancel_requested - Returns 1 if the op or any of the ques it's
+//    nested in has been cancelled
+//*************************************************************
+
+int gop_cancel_requested(op_generic_t *gop)
+{
+    opque_t *q;
+
+    while (gop != NULL) {
+        if (atomic_get(gop->base.cancelled) != 0) return(1);
+        q = gop->base.parent_q;
+        gop = (q == NULL) ? NULL : opque_get_gop(q);
+    }
+
+    return(0);
+}
+
+//*************************************************************
+// gop_has_ancestor - Returns 1 if the op is the ancestor or is nested
+//    somewhere below it
+//*************************************************************
+
+int gop_has_ancestor(op_generic_t *gop, op_generic_t *ancestor)
+{
+    opque_t *q;
+
+    while (gop != NULL) {
+        if (gop == ancestor) return(1);
+        q = gop->base.parent_q;
+        gop = (q == NULL) ? NULL : opque_get_gop(q);
+    }
+
+    return(0);
+}
+
+//*************************************************************
+// gop_waiter_help_set - Enables/disables waiters running queued ops
+//    they are waiting on themselves.  Enabled by default.
+//*************************************************************
+
+void gop_waiter_help_set(int enable)
+{
+    _gop_waiter_help = enable;
+}
+
+//*************************************************************
+// _gop_help - Runs one of the ops the caller is waiting on that's still
+//    queued in its portal, normally a TP reserve stack, on the calling
+//    thread.  This keeps waiting threads doing useful work instead of
+//    sleeping while the pool is saturated.  Returns 1 if an op was run.
+//    NOTE: No gop locks can be held!
+//*************************************************************
+
+int _gop_help(op_generic_t *gop)
+{
+    op_generic_t *hop;
+
+    if (_gop_waiter_help == 0) return(0);
+
+    hop = gop_portal_help(gop);
+    if (hop == NULL) return(0);
+
+    gop_log_printf(15, "gid=%d running gid=%d\n", gop_id(gop), gop_id(hop));
+    hop->base.pc->fn->sync_exec(hop->base.pc, hop);
+    return(1);
+}
+
+//*************************************************************
+// _gop_submit - Hands the op to its portal.  Cancelled ops are instead
+//    completed with op_cancelled_status by a gop_dummy worker so this
+//    is safe to call with que locks held.
+//*************************************************************
+
+void _gop_submit(op_generic_t *gop)
+{
+    if (gop_cancel_requested(gop) == 1) {
+        gop_log_printf(15, "gid=%d cancelled before submission\n", gop_id(gop));
+        gop->base.status = op_cancelled_status;
+        _gop_dummy_submit_op(NULL, gop);
+        return;
+    }
+
+    gop_timestamp(gop, GOP_TS_SUBMIT);
+    gop->base.pc->fn->submit(gop->base.pc->arg, gop);
+}
+
+//*************************************************************
+// gop_cancel - Cancels the op.  Ops not yet started are completed with
+//    op_cancelled_status when they are.  Ops queued in their portal are
+//    removed and completed with op_cancelled_status.  See
+//    gop_portal_cancel().  Ops already executing are left to finish normally.
+//    Ques are handed to opque_cancel().
+//
+//    Returns the number of ops cancelled immediately.
+//*************************************************************
+
+int gop_cancel(op_generic_t *gop)
+{
+    if (gop_get_type(gop) == Q_TYPE_QUE) return(opque_cancel(gop->q->opque));
+
+    atomic_set(gop->base.cancelled, 1);
+    if (gop_is_done(gop)) return(0);
+
+    gop_log_printf(15, "gid=%d started_execution=%d\n", gop_id(gop), gop->base.started_execution);
+
+    if (gop->base.started_execution == 0) {
+        if (gop->base.parent_q != NULL) return(0);  //** The que will catch it on submission
+        gop_start_execution(gop);  //** Nobody else will start it so do it now
+        return(1);
+    }
+
+    return(gop_portal_cancel(gop->base.pc, gop));
+}
+
+//*************************************************************
+// _gop_dep_fail - Fails an op or que because a dependency failed.
+//    Ques fail all their unstarted tasks which in turn fails the que.
+//*************************************************************
+
+void _gop_dep_fail(op_generic_t *gop)
+{
+    op_generic_t **tasks;
+    callback_t *cb;
+    int i, n;
+
+    gop_log_printf(15, "gid=%d failed dependency\n", gop_id(gop));
+
+    if (gop_get_type(gop) == Q_TYPE_OPERATION) {
+        gop_mark_completed(gop, op_failure_status);
+        return;
+    }
+
+    //** Pull the tasks off under the lock and fail them after since they
+    //** need it for their callbacks
+    lock_gop(gop);
+    gop->base.started_execution = 1;
+    _opque_ring_init(gop->q);
+    n = stack_size(gop->q->list);
+    type_malloc(tasks, op_generic_t *, n+1);
+    for (i=0; i<n; i++) {
+        cb = (callback_t *)pop(gop->q->list);
+        tasks[i] = (op_generic_t *)cb->priv;
+        tasks[i]->base.started_execution = 1;
+    }
+    unlock_gop(gop);
+
+    for (i=0; i<n; i++) {
+        if (tasks[i]->base.dep_hold != 0) {  //** Has its own dependencies so just drop the start hold
+            atomic_set(tasks[i]->base.dep_failed, 1);
+            if (atomic_dec(tasks[i]->base.n_deps) != 0) continue;
+        }
+        _gop_dep_fail(tasks[i]);
+    }
+    free(tasks);
+}
+
+//*************************************************************
+// _gop_dep_fail_deferred - Hands the failure to a gop_dummy worker.  The
+//    caller can be holding the op's or its que's lock, which failing it
+//    needs, so it's never done inline.  Same as cancelled ops in _gop_submit().
+//*************************************************************
+
+void _gop_dep_fail_deferred(op_generic_t *gop)
+{
+    gop_log_printf(15, "gid=%d deferring dependency failure\n", gop_id(gop));
+    _gop_dummy_submit_op(NULL, gop);
+}
+
+//*************************************************************
+// _gop_dep_release - Called once all the dependencies and the start
+//    request are done to submit or fail the op
+//*************************************************************
+
+void _gop_dep_release(op_generic_t *gop)
+{
+    if (atomic_get(gop->base.dep_failed) != 0) {
+        _gop_dep_fail_deferred(gop);
+    } else if (gop_get_type(gop) == Q_TYPE_QUE) {
+        lock_gop(gop);
+        _opque_submit_all(gop->q->opque);
+        unlock_gop(gop);
+    } else {
+        gop_log_printf(15, "gid=%d dependencies done so submitting\n", gop_id(gop));
+        _gop_submit(gop);
+    }
+}
+
+//*************************************************************
+// _gop_dep_start_hold - Called when the op is started.  Returns 1 if the
+//    op is being held for its dependencies or has been failed and 0 if
+//    it should be submitted now.
+//*************************************************************
+
+int _gop_dep_start_hold(op_generic_t *gop)
+{
+    if (gop->base.dep_hold == 0) return(0);
+
+    if (atomic_dec(gop->base.n_deps) != 0) return(1);  //** Still waiting
+
+    //** Everything is done
+    if (atomic_get(gop->base.dep_failed) != 0) {
+        _gop_dep_fail_deferred(gop);
+        return(1);
+    }
+
+    return(0);
+}
+
+//*************************************************************
+// _gop_dep_cb - Callback placed on a parent to release the child
+//*************************************************************
+
+void _gop_dep_cb(void *priv, int mode)
+{
+    op_generic_t *child = (op_generic_t *)priv;
+
+    if (mode != OP_STATE_SUCCESS) atomic_set(child->base.dep_failed, 1);
+
+    if (atomic_dec(child->base.n_deps) == 0) _gop_dep_release(child);
+}
+
+//*************************************************************
+// gop_add_dependency - Makes the child wait for the parent to complete
+//    before it's submitted.  A child can have any number of parents and
+//    is submitted when the last one completes and the child has been
+//    started normally, via gop_start_execution() or its opque.  If any
+//    parent fails the child is failed instead, which cascades to its
+//    own dependents.  Both can be ops or ques.
+//
+//    NOTE: The child must not have been started and must not be freed
+//      before its parents complete.  OP_CM_ATOMIC parents must not have
+//      been started either.
+//*************************************************************
+
+int gop_add_dependency(op_generic_t *child, op_generic_t *parent)
+{
+    callback_t *cb;
+    int status, done;
+
+    if (child->base.started_execution != 0) {
+        gop_log_printf(0, "ERROR child already started! child gid=%d parent gid=%d\n", gop_id(child), gop_id(parent));
+        return(1);
+    }
+
+    gop_log_printf(15, "child gid=%d parent gid=%d\n", gop_id(child), gop_id(parent));
+
+    //** The 1st dependency also adds the hold released by the start request
+    if (child->base.dep_hold == 0) {
+        child->base.dep_hold = 1;
+        atomic_inc(child->base.n_deps);
+    }
+    atomic_inc(child->base.n_deps);
+
+    type_malloc(cb, callback_t, 1);
+    callback_set(cb, _gop_dep_cb, child);
+
+    lock_gop(parent);
+    if (gop_get_type(parent) == Q_TYPE_QUE) {
+        done = ((parent->base.started_execution != 0) && (atomic_get(parent->q->nleft) == 0)) ? 1 : 0;
+    } else {
+        done = (gop_is_done(parent)) ? 1 : 0;
+    }
+
+    if (done) {  //** Already finished so just handle it now
+        status = _gop_completed_successfully(parent);
+        unlock_gop(parent);
+        free(cb);
+        _gop_dep_cb(child, status);
+    } else {
+        callback_append(&(parent->base.cb), cb);
+        unlock_gop(parent);
+    }
+
+    return(0);
+}
+
 //*************************************************************
 // gop_set_success_state - Sets the success state.  For internal
 //   callback use only.  Locking isn't used.
@@ -290,6 +1157,8 @@ int gop_completed_successfully(op_generic_t *g)
 {
     int status;
 
+    if (g->base.completion_mode == OP_CM_ATOMIC) return(_gop_completed_successfully(g));
+
     lock_gop(g);
     status = _gop_completed_successfully(g);
     unlock_gop(g);
@@ -307,7 +1176,7 @@ op_generic_t *gop_get_next_finished(op_generic_t *g)
 
     lock_gop(g);
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        gop = (op_generic_t *)pop(g->q->finished);
+        gop = _opque_finished_pop(g->q);
     } else {
         gop = NULL;
         if (g->base.failure_mode != OP_FM_GET_END) {
@@ -374,9 +1243,9 @@ int gop_tasks_finished(op_generic_t *g)
 
     lock_gop(g);
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        nf = stack_size(g->q->finished);
+        nf = _opque_finished_count(g->q);
     } else {
-        nf = (g->base.state == 1) ? 1 : 0;
+        nf = (gop_is_done(g)) ? 1 : 0;
     }
     unlock_gop(g);
 
@@ -394,9 +1263,9 @@ int gop_tasks_left(op_generic_t *g)
 
     lock_gop(g);
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        n = g->q->nleft;
+        n = atomic_get(g->q->nleft);
     } else {
-        n = (g->base.state == 1) ? 0 : 1;
+        n = (gop_is_done(g)) ? 0 : 1;
     }
     unlock_gop(g);
 
@@ -412,9 +1281,10 @@ void _gop_start_execution(op_generic_t *g)
     if (gop_get_type(g) == Q_TYPE_QUE) {
         _opque_start_execution(g->q->opque);
     } else if (g->base.started_execution == 0) {
-        log_printf(15, "gid=%d started_execution=%d\n", gop_get_id(g), g->base.started_execution);
+        gop_log_printf(15, "gid=%d started_execution=%d\n", gop_get_id(g), g->base.started_execution);
         g->base.started_execution = 1;
-        g->base.pc->fn->submit(g->base.pc->arg, g);
+        gop_trace(GOP_TP_OP_START, gop_id(g), gop_get_type(g));
+        if (_gop_dep_start_hold(g) == 0) _gop_submit(g);
     }
 }
 
@@ -424,6 +1294,15 @@ void _gop_start_execution(op_generic_t *g)
 
 void gop_start_execution(op_generic_t *g)
 {
+    if ((g->base.pc == &_gop_dummy_pc) && (g->base.execution_mode == OP_EXEC_DIRECT)) {
+        if (_gop_dummy_start_inline(g) == 0) return;
+    }
+
+    if (g->base.completion_mode == OP_CM_ATOMIC) {  //** Single op so no need to lock it
+        _gop_start_execution(g);
+        return;
+    }
+
     lock_gop(g);
     _gop_start_execution(g);
     unlock_gop(g);
@@ -441,6 +1320,50 @@ void gop_set_exec_mode(op_generic_t *g, int mode)
 }
 
 
+//*************************************************************
+// gop_set_priority - Sets the priority used when the gop is handed to
+//    a thread pool.  Setting it on a que applies to every task in it
+//    that doesn't have its own.  Should be called before the gop is started.
+//*************************************************************
+
+void gop_set_priority(op_generic_t *g, int priority)
+{
+    if ((priority < OP_PRIORITY_DEFAULT) || (priority > OP_PRIORITY_HIGH)) priority = OP_PRIORITY_DEFAULT;
+    g->base.priority = priority;
+}
+
+//*************************************************************
+// gop_priority - Returns the gop's effective priority.  If it doesn't
+//    have one it's inherited from the closest que up the tree that does.
+//*************************************************************
+
+int gop_priority(op_generic_t *g)
+{
+    while (g != NULL) {
+        if (g->base.priority != OP_PRIORITY_DEFAULT) return(g->base.priority);
+        g = (g->base.parent_q == NULL) ? NULL : opque_get_gop(g->base.parent_q);
+    }
+
+    return(OP_PRIORITY_NORMAL);
+}
+
+//*************************************************************
+// gop_set_completion_mode - Sets the gop's completion mode.  Should be
+//    called before the gop is started.  Ques always use OP_CM_LOCKED.
+//*************************************************************
+
+void gop_set_completion_mode(op_generic_t *g, int mode)
+{
+#ifndef GOP_HAVE_FUTEX
+    mode = OP_CM_LOCKED;
+#endif
+
+    if (gop_get_type(g) == Q_TYPE_QUE) mode = OP_CM_LOCKED;
+
+    g->base.completion_mode = mode;
+    if (mode == OP_CM_LOCKED) _gop_control_get(g);
+}
+
 //*************************************************************
 // gop_finished_submission - Mark que to stop accepting
 //     tasks.
@@ -453,8 +1376,8 @@ void gop_finished_submission(op_generic_t *g)
         g->q->finished_submission = 1;
 
         //** If nothing left to do trigger the condition in case anyone's waiting
-        if (g->q->nleft == 0) {
-            apr_thread_cond_broadcast(g->base.ctl->cond);
+        if (atomic_get(g->q->nleft) == 0) {
+            _gop_cond_broadcast(g);
         }
     }
     unlock_gop(g);
@@ -467,20 +1390,27 @@ void gop_finished_submission(op_generic_t *g)
 int gop_wait(op_generic_t *gop)
 {
     op_status_t status;
-//log_printf(15, "gop_wait: START gid=%d state=%d\n", gop_id(gop), gop->base.state);
+//gop_log_printf(15, "gop_wait: START gid=%d state=%d\n", gop_id(gop), gop->base.state);
+
+    if (gop->base.completion_mode == OP_CM_ATOMIC) {
+        _gop_atomic_wait(gop, 0);
+        status = gop_get_status(gop);
+        gop_log_printf(15, "gop_wait: FINISHED gid=%d status=%d err=%d\n", gop_id(gop), status.op_status, status.error_code);
+        return(status.op_status);
+    }
 
     lock_gop(gop);
 
-//log_printf(15, "gop_wait: after lock gid=%d state=%d\n", gop_id(gop), gop->base.state);
+//gop_log_printf(15, "gop_wait: after lock gid=%d state=%d\n", gop_id(gop), gop->base.state);
 
-    while (gop->base.state == 0) {
-        log_printf(15, "gop_wait: WHILE gid=%d state=%d\n", gop_id(gop), gop->base.state);
-        apr_thread_cond_wait(gop->base.ctl->cond, gop->base.ctl->lock); //** Sleep until something completes
+    while (gop_is_done(gop) == 0) {
+        gop_log_printf(15, "gop_wait: WHILE gid=%d state=%d\n", gop_id(gop), gop->base.state);
+        _gop_cond_wait(gop); //** Sleep until something completes
     }
 
     status = gop_get_status(gop);
 //  state = _gop_completed_successfully(gop);
-    log_printf(15, "gop_wait: FINISHED gid=%d status=%d err=%d\n", gop_id(gop), status.op_status, status.error_code);
+    gop_log_printf(15, "gop_wait: FINISHED gid=%d status=%d err=%d\n", gop_id(gop), status.op_status, status.error_code);
 
     unlock_gop(gop);
 
@@ -495,7 +1425,7 @@ void gop_free(op_generic_t *gop, int mode)
 {
     int type;
 
-    log_printf(15, "gop_free: gid=%d tid=%d\n", gop_id(gop), atomic_thread_id);
+    gop_log_printf(15, "gop_free: gid=%d tid=%d\n", gop_id(gop), atomic_thread_id);
     //** Get the status
     type = gop_get_type(gop);
     if (type == Q_TYPE_QUE) {
@@ -513,15 +1443,27 @@ void gop_free(op_generic_t *gop, int mode)
 
 void gop_set_auto_destroy(op_generic_t *gop, int val)
 {
-    int state;
+    apr_uint32_t state;
+
+    if (gop->base.completion_mode == OP_CM_ATOMIC) {
+        //** The state word decides who frees it.  Either us or the completion
+        gop->base.auto_destroy = val;
+        if (val == 1) {
+            state = _gop_state_update(gop, OP_STATE_BIT_AUTO_DESTROY, 0);
+        } else {
+            state = _gop_state_update(gop, 0, OP_STATE_BIT_AUTO_DESTROY);
+        }
+        if ((val == 1) && (state & OP_STATE_BIT_DONE)) gop_free(gop, OP_DESTROY);
+        return;
+    }
 
     lock_gop(gop);
     gop->base.auto_destroy = val;
-    state = gop->base.state;
+    state = gop_is_done(gop);
     unlock_gop(gop);
 
     //** Already completed go ahead and destroy it
-    if (state == 1) gop_free(gop, OP_DESTROY);
+    if (state != 0) gop_free(gop, OP_DESTROY);
 }
 
 //*************************************************************
@@ -532,11 +1474,13 @@ int gop_will_block(op_generic_t *g)
 {
     int status = 0;
 
+    if (g->base.completion_mode == OP_CM_ATOMIC) return((gop_is_done(g)) ? 0 : 1);
+
     lock_gop(g);
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        if ((stack_size(g->q->finished) == 0) && (g->q->nleft > 0)) status = 1;
+        if ((_opque_finished_count(g->q) == 0) && (atomic_get(g->q->nleft) > 0)) status = 1;
     } else {
-        if (g->base.state == 0) status = 1;
+        if (gop_is_done(g) == 0) status = 1;
     }
     unlock_gop(g);
 
@@ -552,49 +1496,70 @@ op_generic_t *gop_waitany(op_generic_t *g)
 {
     op_generic_t *gop = g;
     callback_t *cb;
+    int helped;
+
+    if (g->base.completion_mode == OP_CM_ATOMIC) {  //** Single op so just park on the state word
+        if ((g->base.pc->fn->sync_exec != NULL) && (g->base.started_execution == 0) && (g->base.dep_hold == 0) && (gop_cancel_requested(g) == 0)) {  //** See if we can directly exec
+            g->base.pc->fn->sync_exec(g->base.pc, g);
+        } else {
+            _gop_start_execution(g);  //** Make sure things have been submitted
+            _gop_help(g);  //** Run it ourselves if it's still queued
+            _gop_atomic_wait(g, 0);
+        }
+        return(g);
+    }
 
     lock_gop(g);
 
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        log_printf(15, "sync_exec_que_check gid=%d stack_size=%d started_exec=%d\n", gop_id(g), stack_size(g->q->opque->qd.list), g->base.started_execution);
-        if ((stack_size(g->q->opque->qd.list) == 1) && (g->base.started_execution == 0)) {  //** See if we can directly exec
+        gop_log_printf(15, "sync_exec_que_check gid=%d stack_size=%d started_exec=%d\n", gop_id(g), stack_size(g->q->opque->qd.list), g->base.started_execution);
+        if ((stack_size(g->q->opque->qd.list) == 1) && (g->base.started_execution == 0) && (g->base.dep_hold == 0)) {  //** See if we can directly exec
             g->base.started_execution = 1;
             cb = (callback_t *)pop(g->q->opque->qd.list);
             gop = (op_generic_t *)cb->priv;
-            log_printf(15, "sync_exec_que -- waiting for pgid=%d cgid=%d to complete\n", gop_id(g), gop_id(gop));
+            gop_log_printf(15, "sync_exec_que -- waiting for pgid=%d cgid=%d to complete\n", gop_id(g), gop_id(gop));
             unlock_gop(g);
             gop_waitany(gop);
-            pop(g->q->finished); //** Remove it from the finished list.
+            lock_gop(g);
+            _opque_finished_pop(g->q); //** Remove it from the finished list.
+            unlock_gop(g);
             return(gop);
         } else {
             _gop_start_execution(g);  //** Make sure things have been submitted
-            while (((gop = (op_generic_t *)pop(g->q->finished)) == NULL) && (g->q->nleft > 0)) {
-                apr_thread_cond_wait(g->base.ctl->cond, g->base.ctl->lock); //** Sleep until something completes
+            atomic_inc(g->q->n_waiting);  //** Completions only signal if somebody is waiting
+            while (((gop = _opque_finished_pop(g->q)) == NULL) && (atomic_get(g->q->nleft) > 0)) {
+                unlock_gop(g);
+                helped = _gop_help(g);  //** Run a queued child ourselves instead of sleeping
+                lock_gop(g);
+                if ((helped == 0) && (_opque_finished_count(g->q) == 0) && (atomic_get(g->q->nleft) > 0)) {  //** Recheck since the lock was dropped
+                    _gop_cond_wait(g); //** Sleep until something completes
+                }
             }
+            atomic_dec(g->q->n_waiting);
         }
 
-        if (gop != NULL) log_printf(15, "POP finished qid=%d gid=%d\n", gop_id(g), gop_id(gop));
-//log_printf(15, "Printing qid=%d finished stack\n", gop_id(g));
-//_opque_print_stack(g->q->finished);
+        if (gop != NULL) gop_log_printf(15, "POP finished qid=%d gid=%d\n", gop_id(g), gop_id(gop));
+//gop_log_printf(15, "Printing qid=%d finished stack\n", gop_id(g));
     } else {
-        log_printf(15, "gop_waitany: BEFORE (type=op) While gid=%d state=%d\n", gop_id(g), g->base.state);
-        flush_log();
-        if ((g->base.pc->fn->sync_exec != NULL) && (g->base.started_execution == 0)) {  //** See if we can directly exec
+        gop_log_printf(15, "gop_waitany: BEFORE (type=op) While gid=%d state=%d\n", gop_id(g), g->base.state);
+        gop_flush_log();
+        if ((g->base.pc->fn->sync_exec != NULL) && (g->base.started_execution == 0) && (g->base.dep_hold == 0) && (gop_cancel_requested(g) == 0)) {  //** See if we can directly exec
             unlock_gop(g);  //** Don't need this for a direct exec
-            log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(g));
+            gop_log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(g));
             g->base.pc->fn->sync_exec(g->base.pc, g);
-            log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(g), g->base.state);
+            gop_log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(g), g->base.state);
             return(g);
         } else {  //** Got to submit it normally
             unlock_gop(g);  //** It's a single task so no need to hold the lock.  Otherwise we can deadlock
             _gop_start_execution(g);  //** Make sure things have been submitted
+            _gop_help(g);  //** Run it ourselves if it's still queued
             lock_gop(g);  //** but we do need it for detecting when we're finished.
-            while (g->base.state == 0) {
-                apr_thread_cond_wait(g->base.ctl->cond, g->base.ctl->lock); //** Sleep until something completes
+            while (gop_is_done(g) == 0) {
+                _gop_cond_wait(g); //** Sleep until something completes
             }
         }
-        log_printf(15, "gop_waitany: AFTER (type=op) While gid=%d state=%d\n", gop_id(g), g->base.state);
-        flush_log();
+        gop_log_printf(15, "gop_waitany: AFTER (type=op) While gid=%d state=%d\n", gop_id(g), g->base.state);
+        gop_flush_log();
     }
     unlock_gop(g);
 
@@ -609,51 +1574,75 @@ op_generic_t *gop_waitany(op_generic_t *g)
 
 int gop_waitall(op_generic_t *g)
 {
-    int status;
+    int status, helped;
     op_generic_t *g2;
     callback_t *cb;
 
-//log_printf(15, "START gid=%d type=%d\n", gop_id(g), gop_get_type(g));
-    log_printf(5, "START gid=%d type=%d\n", gop_id(g), gop_get_type(g));
+//gop_log_printf(15, "START gid=%d type=%d\n", gop_id(g), gop_get_type(g));
+    gop_log_printf(5, "START gid=%d type=%d\n", gop_id(g), gop_get_type(g));
+
+    if (g->base.completion_mode == OP_CM_ATOMIC) {  //** Single op so just park on the state word
+        if ((g->base.pc->fn->sync_exec != NULL) && (g->base.started_execution == 0) && (g->base.dep_hold == 0) && (gop_cancel_requested(g) == 0)) {  //** See if we can directly exec
+            g->base.pc->fn->sync_exec(g->base.pc, g);
+        } else {
+            _gop_start_execution(g);  //** Make sure things have been submitted
+            _gop_help(g);  //** Run it ourselves if it's still queued
+            _gop_atomic_wait(g, 0);
+        }
+        status = _gop_completed_successfully(g);
+        gop_log_printf(15, "END gid=%d type=%d\n", gop_id(g), gop_get_type(g));
+        return(status);
+    }
+
     lock_gop(g);
 
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        log_printf(15, "sync_exec_que_check gid=%d stack_size=%d started_exec=%d\n", gop_id(g), stack_size(g->q->opque->qd.list), g->base.started_execution);
+        gop_log_printf(15, "sync_exec_que_check gid=%d stack_size=%d started_exec=%d\n", gop_id(g), stack_size(g->q->opque->qd.list), g->base.started_execution);
 
-        if ((stack_size(g->q->opque->qd.list) == 1) && (g->base.started_execution == 0)) {  //** See if we can directly exec
-            log_printf(15, "sync_exec_que -- waiting for gid=%d to complete\n", gop_id(g));
+        if ((stack_size(g->q->opque->qd.list) == 1) && (g->base.started_execution == 0) && (g->base.dep_hold == 0)) {  //** See if we can directly exec
+            gop_log_printf(15, "sync_exec_que -- waiting for gid=%d to complete\n", gop_id(g));
             cb = (callback_t *)pop(g->q->opque->qd.list);
             g2 = (op_generic_t *)cb->priv;
             unlock_gop(g);  //** Don't need this for a direct exec
             status = gop_waitall(g2);
-            log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(g), status);
+            gop_log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(g), status);
             return(status);
         } else {  //** Got to submit it normally
             _gop_start_execution(g);  //** Make sure things have been submitted
-            while (g->q->nleft > 0) {
-                apr_thread_cond_wait(g->base.ctl->cond, g->base.ctl->lock); //** Sleep until something completes
+            while (atomic_get(g->q->nleft) > 0) {
+                unlock_gop(g);
+                helped = _gop_help(g);  //** Run a queued child ourselves instead of sleeping
+                lock_gop(g);
+                if ((helped == 0) && (atomic_get(g->q->nleft) > 0)) {  //** Recheck since the lock was dropped
+                    _gop_cond_wait(g); //** Sleep until something completes
+                }
             }
         }
     } else {     //** Got a single task
-        if ((g->base.pc->fn->sync_exec != NULL) && (g->base.started_execution == 0)) {  //** See if we can directly exec
+        if ((g->base.pc->fn->sync_exec != NULL) && (g->base.started_execution == 0) && (g->base.dep_hold == 0) && (gop_cancel_requested(g) == 0)) {  //** See if we can directly exec
             unlock_gop(g);  //** Don't need this for a direct exec
-            log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(g));
+            gop_log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(g));
             g->base.pc->fn->sync_exec(g->base.pc, g);
             status = _gop_completed_successfully(g);
-            log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(g), status);
+            gop_log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(g), status);
             return(status);
         } else {  //** Got to submit it the normal way
             _gop_start_execution(g);  //** Make sure things have been submitted
-            while (g->base.state == 0) {
-                log_printf(15, "gop_waitall: WHILE gid=%d state=%d\n", gop_id(g), g->base.state);
-                apr_thread_cond_wait(g->base.ctl->cond, g->base.ctl->lock); //** Sleep until something completes
+            if (gop_is_done(g) == 0) {
+                unlock_gop(g);
+                _gop_help(g);  //** Run it ourselves if it's still queued
+                lock_gop(g);
+            }
+            while (gop_is_done(g) == 0) {
+                gop_log_printf(15, "gop_waitall: WHILE gid=%d state=%d\n", gop_id(g), g->base.state);
+                _gop_cond_wait(g); //** Sleep until something completes
             }
         }
     }
 
     status = _gop_completed_successfully(g);
 
-    log_printf(15, "END gid=%d type=%d\n", gop_id(g), gop_get_type(g));
+    gop_log_printf(15, "END gid=%d type=%d\n", gop_id(g), gop_get_type(g));
     unlock_gop(g);
 
     return(status);
@@ -671,22 +1660,29 @@ op_generic_t *gop_timed_waitany(op_generic_t *g, int dt)
     apr_interval_time_t adt = apr_time_from_sec(dt);
     int loop;
 
+    if (g->base.completion_mode == OP_CM_ATOMIC) {
+        _gop_start_execution(g);  //** Make sure things have been submitted
+        return((_gop_atomic_wait(g, adt) == 1) ? g : NULL);
+    }
+
     lock_gop(g);
     _gop_start_execution(g);  //** Make sure things have been submitted
 
     loop = 0;
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        while (((gop = (op_generic_t *)pop(g->q->finished)) == NULL) && (g->q->nleft > 0) && (loop == 0)) {
-            apr_thread_cond_timedwait(g->base.ctl->cond, g->base.ctl->lock, adt); //** Sleep until something completes
+        atomic_inc(g->q->n_waiting);  //** Completions only signal if somebody is waiting
+        while (((gop = _opque_finished_pop(g->q)) == NULL) && (atomic_get(g->q->nleft) > 0) && (loop == 0)) {
+            _gop_cond_timedwait(g, adt); //** Sleep until something completes
             loop++;
         }
+        atomic_dec(g->q->n_waiting);
     } else {
-        while ((g->base.state == 0) && (loop == 0)) {
-            apr_thread_cond_timedwait(g->base.ctl->cond, g->base.ctl->lock, adt); //** Sleep until something completes
+        while ((gop_is_done(g) == 0) && (loop == 0)) {
+            _gop_cond_timedwait(g, adt); //** Sleep until something completes
             loop++;
         }
 
-        if (g->base.state != 0) gop = g;
+        if (gop_is_done(g)) gop = g;
     }
     unlock_gop(g);
 
@@ -705,24 +1701,29 @@ int gop_timed_waitall(op_generic_t *g, int dt)
     int loop;
     apr_interval_time_t adt = apr_time_from_sec(dt);
 
+    if (g->base.completion_mode == OP_CM_ATOMIC) {
+        _gop_start_execution(g);  //** Make sure things have been submitted
+        return((_gop_atomic_wait(g, adt) == 1) ? _gop_completed_successfully(g) : OP_STATE_RETRY);
+    }
+
     lock_gop(g);
     _gop_start_execution(g);  //** Make sure things have been submitted
 
     loop = 0;
     if (gop_get_type(g) == Q_TYPE_QUE) {
-        while ((g->q->nleft > 0) && (loop == 0)) {
-            apr_thread_cond_timedwait(g->base.ctl->cond, g->base.ctl->lock, adt); //** Sleep until something completes
+        while ((atomic_get(g->q->nleft) > 0) && (loop == 0)) {
+            _gop_cond_timedwait(g, adt); //** Sleep until something completes
             loop++;
         }
 
-        status = (g->q->nleft > 0) ? OP_STATE_RETRY : _gop_completed_successfully(g);
+        status = (atomic_get(g->q->nleft) > 0) ? OP_STATE_RETRY : _gop_completed_successfully(g);
     } else {
-        while ((g->base.state == 0) && (loop == 0)) {
-            apr_thread_cond_timedwait(g->base.ctl->cond, g->base.ctl->lock, adt); //** Sleep until something completes
+        while ((gop_is_done(g) == 0) && (loop == 0)) {
+            _gop_cond_timedwait(g, adt); //** Sleep until something completes
             loop++;
         }
 
-        status = (g->base.state == 0) ? OP_STATE_RETRY : _gop_completed_successfully(g);
+        status = (gop_is_done(g) == 0) ? OP_STATE_RETRY : _gop_completed_successfully(g);
     }
 
     unlock_gop(g);
@@ -731,38 +1732,121 @@ int gop_timed_waitall(op_generic_t *g, int dt)
 }
 
 
+//*************************************************************
+// _gop_callbacks_run - Runs the gop's callbacks without holding its lock.
+//    The chain is detached first so anything appended while they run
+//    lands on a fresh chain and gets picked up on the next pass.  The
+//    executed callbacks are put back afterwards for gop_free() to clean up.
+//    NOTE: The gop should be locked on entry and is locked on return
+//*************************************************************
+
+void _gop_callbacks_run(op_generic_t *gop, int value)
+{
+    callback_t *cb, *done;
+
+    done = NULL;
+    while ((cb = gop->base.cb) != NULL) {
+        gop->base.cb = NULL;
+        unlock_gop(gop);
+
+        callback_execute(cb, value);
+
+        lock_gop(gop);
+        if (done == NULL) {
+            done = cb;
+        } else {
+            done->tail->next = cb;
+            done->tail = cb->tail;
+        }
+    }
+
+    gop->base.cb = done;
+}
+
 //*************************************************************
 // single_gop_mark_completed - Marks a single operation as completed and
-//   triggers any callbacks if needed
+//   triggers any callbacks if needed.  The callbacks are run without
+//   the lock and the op is only flagged as done once they finish.  Until
+//   then gop_free() waits on the COMPLETING bit.
 //*************************************************************
 
 void single_gop_mark_completed(op_generic_t *gop, op_status_t status)
 {
     op_common_t *base = &(gop->base);
+    gop_control_t *ctl;
+    apr_uint32_t state;
     int mode;
 
-    log_printf(15, "gop_mark_completed: START gid=%d status=%d\n", gop_id(gop), status);
+    gop_log_printf(15, "gop_mark_completed: START gid=%d status=%d\n", gop_id(gop), status);
+    gop_trace(GOP_TP_OP_DONE, gop_id(gop), status.op_status);
+
+#ifndef GOP_LATENCY_DISABLE
+    if ((gop->op != NULL) && (base->pc != NULL) && (base->pc->lat != NULL)) {
+        gop_timestamp(gop, GOP_TS_COMPLETE);
+        gop_latency_record(base->pc->lat, gop->op->cmd.host_id, base->ts);
+    }
+#endif
+
+    if (base->completion_mode == OP_CM_ATOMIC) {
+        //** Only use the lock if somebody else already needed it
+        ctl = base->ctl;
+        if (ctl != NULL) apr_thread_mutex_lock(ctl->lock);
+
+        //** Flag that we're still using the op so a free has to wait for us
+        _gop_state_update(gop, OP_STATE_BIT_COMPLETING, 0);
+
+        base->status = status;
+        if (ctl != NULL) {
+            _gop_callbacks_run(gop, base->status.op_status);
+        } else {
+            callback_execute(base->cb, base->status.op_status);
+        }
+        //** COMPLETING stays set so a free still waits while we wake everybody
+        state = _gop_state_update(gop, OP_STATE_BIT_DONE, 0);
+
+        //** Wake anybody parked on the op and see if we do an auto cleanup
+        if (state & OP_STATE_BIT_WAITERS) {
+            _gop_futex_wake(gop);
+            if (ctl != NULL) {
+                if (ctl->parked != NULL) _gop_parked_wake(ctl);
+            } else if (base->ctl != NULL) {  //** A parked waiter got a lock after we started
+                apr_thread_mutex_lock(base->ctl->lock);
+                _gop_parked_wake(base->ctl);
+                apr_thread_mutex_unlock(base->ctl->lock);
+            }
+        }
+
+        if (ctl != NULL) apr_thread_mutex_unlock(ctl->lock);
+
+        //** Once COMPLETING is cleared the op can be freed out from under us
+        if (_gop_state_update(gop, 0, OP_STATE_BIT_COMPLETING) & OP_STATE_BIT_WAITERS) _gop_futex_wake(gop);
+
+        if (state & OP_STATE_BIT_AUTO_DESTROY) gop_free(gop, OP_DESTROY);
+        return;
+    }
 
     lock_gop(gop);
-    log_printf(15, "gop_mark_completed: after lock gid=%d\n", gop_id(gop));
+    gop_log_printf(15, "gop_mark_completed: after lock gid=%d\n", gop_id(gop));
 
-    //** Store the status
+    //** Store the status and flag that a free has to wait for the callbacks
     base->status = status;
+    _gop_state_update(gop, OP_STATE_BIT_COMPLETING, 0);
 
     //** and trigger any callbacks
 
-    log_printf(15, "gop_mark_completed: before cb gid=%d op_status=%d\n", gop_id(gop), base->status.op_status);
+    gop_log_printf(15, "gop_mark_completed: before cb gid=%d op_status=%d\n", gop_id(gop), base->status.op_status);
 
-    callback_execute(base->cb, base->status.op_status);
+    _gop_callbacks_run(gop, base->status.op_status);
 
-    log_printf(15, "gop_mark_completed: after cb gid=%d op_success=%d\n", gop_id(gop), base->status.op_status);
+    gop_log_printf(15, "gop_mark_completed: after cb gid=%d op_success=%d\n", gop_id(gop), base->status.op_status);
 
-    base->state = 1;
+    state = _gop_state_update(gop, OP_STATE_BIT_DONE, OP_STATE_BIT_COMPLETING);
 
     //** Lastly trigger the signal. for anybody listening
-    apr_thread_cond_broadcast(gop->base.ctl->cond);
+    _gop_cond_broadcast(gop);
+    if (state & OP_STATE_BIT_WAITERS) _gop_futex_wake(gop);  //** Anybody in gop_free()
 
-    log_printf(15, "gop_mark_completed: after brodcast gid=%d\n", gop_id(gop));
+    gop_log_printf(15, "gop_mark_completed: after brodcast gid=%d\n", gop_id(gop));
 
     mode = gop_get_auto_destroy(gop);  //** Get the auto destroy status w/in the lock
 
@@ -809,21 +1893,21 @@ int gop_sync_exec(op_generic_t *gop)
     int err;
 
     if (gop->type == Q_TYPE_OPERATION) { //** Got an operation so see if we can directly exec it
-        if (gop->base.pc->fn->sync_exec != NULL) {  //** Yup we can!
-            log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(gop));
+        if ((gop->base.pc->fn->sync_exec != NULL) && (gop->base.dep_hold == 0) && (gop_cancel_requested(gop) == 0)) {  //** Yup we can!
+            gop_log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(gop));
             gop->base.pc->fn->sync_exec(gop->base.pc, gop);
             err = _gop_completed_successfully(gop);
-            log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(gop), err);
+            gop_log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(gop), err);
             gop_free(gop, OP_DESTROY);
             return(err);
         }
     }
 
-    log_printf(15, "waiting for gid=%d to complete\n", gop_id(gop));
+    gop_log_printf(15, "waiting for gid=%d to complete\n", gop_id(gop));
     err = gop_waitall(gop);
-    log_printf(15, "gid=%d completed with err=%d\n", gop_id(gop), err);
+    gop_log_printf(15, "gid=%d completed with err=%d\n", gop_id(gop), err);
     gop_free(gop, OP_DESTROY);
-    log_printf(15, "After gop destruction\n");
+    gop_log_printf(15, "After gop destruction\n");
 
     return(err);
 }
@@ -840,22 +1924,22 @@ op_status_t gop_sync_exec_status(op_generic_t *gop)
     op_status_t status;
 
     if (gop->type == Q_TYPE_OPERATION) { //** Got an operation so see if we can directly exec it
-        if (gop->base.pc->fn->sync_exec != NULL) {  //** Yup we can!
-            log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(gop));
+        if ((gop->base.pc->fn->sync_exec != NULL) && (gop->base.dep_hold == 0)) {  //** Yup we can!
+            gop_log_printf(15, "sync_exec -- waiting for gid=%d to complete\n", gop_id(gop));
             gop->base.pc->fn->sync_exec(gop->base.pc, gop);
             status = gop->base.status;
-            log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(gop), status.op_status);
+            gop_log_printf(15, "sync_exec -- gid=%d completed with err=%d\n", gop_id(gop), status.op_status);
             gop_free(gop, OP_DESTROY);
             return(status);
         }
     }
 
-    log_printf(15, "waiting for gid=%d to complete\n", gop_id(gop));
+    gop_log_printf(15, "waiting for gid=%d to complete\n", gop_id(gop));
     err = gop_waitall(gop);
     status = gop_get_status(gop);
-    log_printf(15, "gid=%d completed with err=%d\n", gop_id(gop), err);
+    gop_log_printf(15, "gid=%d completed with err=%d\n", gop_id(gop), err);
     gop_free(gop, OP_DESTROY);
-    log_printf(15, "After gop destruction\n");
+    gop_log_printf(15, "After gop destruction\n");
 
     return(status);
 }
@@ -868,12 +1952,19 @@ void gop_reset(op_generic_t *gop)
 {
     gop->base.id = atomic_global_counter();
 
-    unlock_gop(gop);
+    if (gop->base.ctl != NULL) {
+        unlock_gop(gop);
+    }
     gop->base.cb = NULL;
-    gop->base.state = 0;
+    atomic_set(gop->base.state, 0);
     gop->base.status = op_failure_status;
     gop->base.started_execution = 0;
     gop->base.auto_destroy = 0;
+    gop->base.dep_hold = 0;
+    atomic_set(gop->base.n_deps, 0);
+    atomic_set(gop->base.dep_failed, 0);
+    atomic_set(gop->base.cancelled, 0);
+    memset(gop->base.ts, 0, sizeof(gop->base.ts));
 }
 
 
@@ -883,20 +1974,17 @@ void gop_reset(op_generic_t *gop)
 
 void gop_init(op_generic_t *gop)
 {
-    pigeon_coop_hole_t pch;
-
     op_common_t *base = &(gop->base);
 
     type_memclear(gop, op_generic_t, 1);
 
     base->id = atomic_global_counter();
+    base->completion_mode = _gop_completion_mode;
 
-    log_printf(15, "gop ptr=%p gid=%d\n", gop, gop_id(gop));
+    gop_log_printf(15, "gop ptr=%p gid=%d\n", gop, gop_id(gop));
 
-    //** Get the control struct
-    pch = reserve_pigeon_coop_hole(_gop_control);
-    gop->base.ctl = (gop_control_t *)pigeon_coop_hole_data(&pch);
-    gop->base.ctl->pch = pch;
+    //** Get the control struct.  OP_CM_ATOMIC ops only get one if needed
+    if (base->completion_mode == OP_CM_LOCKED) _gop_control_get(gop);
 }
 
 
@@ -906,9 +1994,17 @@ void gop_init(op_generic_t *gop)
 
 void gop_generic_free(op_generic_t *gop, int mode)
 {
-    log_printf(20, "op_generic_free: before lock gid=%d\n", gop_get_id(gop));
+    //** If the op is still running its callbacks or waking its waiters then wait for it to finish
+    if (atomic_get(gop->base.state) & OP_STATE_BIT_COMPLETING) _gop_completing_wait(gop);
+
+    if (gop->base.ctl == NULL) {  //** OP_CM_ATOMIC op that never needed the lock
+        callback_destroy(gop->base.cb);
+        return;
+    }
+
+    gop_log_printf(20, "op_generic_free: before lock gid=%d\n", gop_get_id(gop));
     lock_gop(gop);  //** Make sure I own the lock just to be safe
-    log_printf(20, "op_generic_free: AFTER lock gid=%d\n", gop_get_id(gop));
+    gop_log_printf(20, "op_generic_free: AFTER lock gid=%d\n", gop_get_id(gop));
 
     callback_destroy(gop->base.cb);  //** Free the callback chain as well
 
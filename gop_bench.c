@@ -0,0 +1,366 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+//*************************************************************
+// gop_bench.c - Micro benchmark for the GOP engine.
+//
+//  Runs each case for every thread count and opque width requested and
+//  prints one CSV row per run.  A run is a series of batches of width
+//  ops.  Latency is per batch, from the first op being created until
+//  the batch has been waited on, so for width 1 it is the per op latency.
+//*************************************************************
+
+#define _log_module_index 132
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opque.h"
+#include "thread_pool.h"
+#include "gop_latency.h"
+#include "apr_wrapper.h"
+#include "log.h"
+#include "type_malloc.h"
+#include "fmttypes.h"
+
+#define BENCH_MAX_LIST 32
+#define BENCH_NESTED_CHUNK 8   //** Ops per inner que for the nested case
+
+typedef struct {
+    int nthreads;
+    int width;
+    int ops;
+    thread_pool_context_t *tpc;
+} bench_run_t;
+
+typedef int (*bench_fn_t)(bench_run_t *r);
+
+typedef struct {
+    char *name;
+    bench_fn_t fn;
+    int uses_tp;   //** Only run once with 0 threads if not
+} bench_case_t;
+
+//*************************************************************
+// bench_nop - Task executed by the thread pool cases
+//*************************************************************
+
+op_status_t bench_nop(void *arg, int id)
+{
+    return(op_success_status);
+}
+
+//*************************************************************
+//  bench_dummy - gop_dummy creation and completion
+//*************************************************************
+
+int bench_dummy(bench_run_t *r)
+{
+    opque_t *q;
+    int i, err;
+
+    q = new_opque();
+    for (i=0; i<r->width; i++) opque_add(q, gop_dummy(op_success_status));
+    err = (opque_waitall(q) == OP_STATE_SUCCESS) ? 0 : 1;
+    opque_free(q, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+//  bench_tp - Thread pool ops created with new_thread_pool_op
+//*************************************************************
+
+int bench_tp(bench_run_t *r)
+{
+    opque_t *q;
+    int i, err;
+
+    q = new_opque();
+    for (i=0; i<r->width; i++) opque_add(q, new_thread_pool_op(r->tpc, NULL, bench_nop, NULL, NULL, 1));
+    err = (opque_waitall(q) == OP_STATE_SUCCESS) ? 0 : 1;
+    opque_free(q, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+//  bench_nested - Thread pool ops split across inner ques of
+//     BENCH_NESTED_CHUNK ops which are all added to an outer que
+//*************************************************************
+
+int bench_nested(bench_run_t *r)
+{
+    opque_t *q, *sq;
+    int i, j, n, err;
+
+    q = new_opque();
+    for (i=0; i<r->width; i+=BENCH_NESTED_CHUNK) {
+        sq = new_opque();
+        n = r->width - i;
+        if (n > BENCH_NESTED_CHUNK) n = BENCH_NESTED_CHUNK;
+        for (j=0; j<n; j++) opque_add(sq, new_thread_pool_op(r->tpc, NULL, bench_nop, NULL, NULL, 1));
+        opque_add(q, opque_get_gop(sq));
+    }
+    err = (opque_waitall(q) == OP_STATE_SUCCESS) ? 0 : 1;
+    opque_free(q, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+//  bench_waitany - Drains the que one op at a time with gop_waitany
+//*************************************************************
+
+int bench_waitany(bench_run_t *r)
+{
+    opque_t *q;
+    op_generic_t *gop;
+    int i, n, err;
+
+    q = new_opque();
+    for (i=0; i<r->width; i++) opque_add(q, new_thread_pool_op(r->tpc, NULL, bench_nop, NULL, NULL, 1));
+    opque_start_execution(q);
+
+    n = 0;
+    err = 0;
+    while ((gop = opque_waitany(q)) != NULL) {
+        if (gop_completed_successfully(gop) != OP_STATE_SUCCESS) err = 1;
+        n++;
+    }
+    if (n != r->width) err = 1;
+    opque_free(q, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+//  bench_sync - Back to back gop_sync_exec calls
+//*************************************************************
+
+int bench_sync(bench_run_t *r)
+{
+    int i, err;
+
+    err = 0;
+    for (i=0; i<r->width; i++) {
+        if (gop_sync_exec(new_thread_pool_op(r->tpc, NULL, bench_nop, NULL, NULL, 1)) != OP_STATE_SUCCESS) err = 1;
+    }
+
+    return(err);
+}
+
+bench_case_t bench_cases[] = {
+    { "dummy", bench_dummy, 0 },
+    { "tp", bench_tp, 1 },
+    { "nested", bench_nested, 1 },
+    { "waitany", bench_waitany, 1 },
+    { "sync_exec", bench_sync, 1 },
+    { NULL, NULL, 0 }
+};
+
+//*************************************************************
+//  bench_run - Runs a single case and prints the CSV row
+//*************************************************************
+
+void bench_run(FILE *fd, bench_case_t *bc, bench_run_t *r)
+{
+    gop_histo_t *h;
+    apr_time_t start, t0, t1;
+    int i, nbatch, nerr;
+    double dt;
+
+    type_malloc_clear(h, gop_histo_t, 1);
+
+    nbatch = r->ops / r->width;
+    if (nbatch < 1) nbatch = 1;
+
+    nerr = 0;
+    start = apr_time_now();
+    t0 = start;
+    for (i=0; i<nbatch; i++) {
+        nerr += bc->fn(r);
+        t1 = apr_time_now();
+        gop_histo_add(h, t1 - t0);
+        t0 = t1;
+    }
+    dt = (double)(t0 - start) / APR_USEC_PER_SEC;
+    if (dt <= 0) dt = 1.0 / APR_USEC_PER_SEC;
+
+    fprintf(fd, "%s,%d,%d,%d,%lf,%lf," LU "," LU "," LU "," LU ",%u,%d\n",
+            bc->name, r->nthreads, r->width, nbatch*r->width, dt, (nbatch*r->width)/dt,
+            gop_histo_percentile(h, 50), gop_histo_percentile(h, 90), gop_histo_percentile(h, 99), gop_histo_percentile(h, 99.9),
+            h->max, nerr);
+    fflush(fd);
+
+    if (nerr > 0) log_printf(0, "ERROR: case=%s threads=%d width=%d had %d failed batches\n", bc->name, r->nthreads, r->width, nerr);
+
+    free(h);
+}
+
+//*************************************************************
+//  parse_list - Parses a comma separated list of positive ints
+//*************************************************************
+
+int parse_list(char *str, int *list)
+{
+    char *s, *token, *last;
+    int n;
+
+    s = strdup(str);
+    n = 0;
+    for (token = strtok_r(s, ",", &last); (token != NULL) && (n < BENCH_MAX_LIST); token = strtok_r(NULL, ",", &last)) {
+        list[n] = atoi(token);
+        if (list[n] > 0) n++;
+    }
+    free(s);
+
+    return(n);
+}
+
+//*************************************************************
+//*************************************************************
+
+int main(int argc, char **argv)
+{
+    int i, j, k, start_option, n_threads, n_widths, ops, warm;
+    int threads[BENCH_MAX_LIST], widths[BENCH_MAX_LIST];
+    char *only, tpname[64];
+    FILE *fd;
+    bench_case_t *bc;
+    bench_run_t r;
+
+    if (argc < 2) {
+        printf("gop_bench [-d log_level] [-t threads_list] [-w width_list] [-n ops] [-c case] [-o out.csv] [-warm] -run\n");
+        printf("   -t threads_list  Comma separated thread pool sizes. Default is 1,2,4,8\n");
+        printf("   -w width_list    Comma separated opque widths. Default is 1,16,256\n");
+        printf("   -n ops           Number of ops for each run. Default is 100000\n");
+        printf("   -c case          Only run the given case\n");
+        printf("   -o out.csv       Store the results in the file instead of stdout\n");
+        printf("   -warm            Do an untimed pass of each run first\n");
+        printf("   -run             Needed if no other options are given\n");
+        printf("\n");
+        printf("Cases:");
+        for (bc = bench_cases; bc->name != NULL; bc++) printf(" %s", bc->name);
+        printf("\n");
+        printf("CSV columns: case,threads,width,ops,secs,ops_per_sec,p50_us,p90_us,p99_us,p999_us,max_us,errors\n");
+        printf("   Latency is for each batch of width ops\n");
+        printf("   Set GOP_TP_EXECUTOR=apr|ws to pick the thread pool executor\n");
+        return(0);
+    }
+
+    n_threads = parse_list("1,2,4,8", threads);
+    n_widths = parse_list("1,16,256", widths);
+    ops = 100000;
+    only = NULL;
+    fd = stdout;
+    warm = 0;
+
+    i = 1;
+    do {
+        start_option = i;
+
+        if (strcmp(argv[i], "-d") == 0) { //** Enable debugging
+            i++;
+            set_log_level(atol(argv[i]));
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0) { //** Thread counts
+            i++;
+            n_threads = parse_list(argv[i], threads);
+            i++;
+        } else if (strcmp(argv[i], "-w") == 0) { //** Que widths
+            i++;
+            n_widths = parse_list(argv[i], widths);
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0) { //** Ops/run
+            i++;
+            ops = atol(argv[i]);
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0) { //** Single case
+            i++;
+            only = argv[i];
+            i++;
+        } else if (strcmp(argv[i], "-o") == 0) { //** Output file
+            i++;
+            fd = fopen(argv[i], "w");
+            if (fd == NULL) {
+                printf("ERROR: Unable to open %s\n", argv[i]);
+                return(1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "-warm") == 0) { //** Warm up pass
+            i++;
+            warm = 1;
+        } else if (strcmp(argv[i], "-run") == 0) {
+            i++;
+        }
+    } while ((start_option < i) && (i<argc));
+
+    if ((n_threads == 0) || (n_widths == 0) || (ops < 1)) {
+        printf("ERROR: Need at least one thread count, width, and op!\n");
+        return(1);
+    }
+
+    apr_wrapper_start();
+    init_opque_system();
+
+    fprintf(fd, "case,threads,width,ops,secs,ops_per_sec,p50_us,p90_us,p99_us,p999_us,max_us,errors\n");
+
+    r.ops = ops;
+    for (bc = bench_cases; bc->name != NULL; bc++) {
+        if ((only != NULL) && (strcmp(only, bc->name) != 0)) continue;
+
+        for (j=0; j < ((bc->uses_tp) ? n_threads : 1); j++) {
+            r.nthreads = (bc->uses_tp) ? threads[j] : 0;
+            r.tpc = NULL;
+            if (bc->uses_tp) {
+                snprintf(tpname, sizeof(tpname), "bench_%d", r.nthreads);
+                r.tpc = thread_pool_create_context(tpname, r.nthreads, r.nthreads, 1);
+            }
+
+            for (k=0; k<n_widths; k++) {
+                r.width = widths[k];
+                if (warm) {
+                    r.ops = r.width;
+                    bc->fn(&r);
+                    r.ops = ops;
+                }
+                bench_run(fd, bc, &r);
+            }
+
+            if (r.tpc != NULL) thread_pool_destroy_context(r.tpc);
+        }
+    }
+
+    if (fd != stdout) fclose(fd);
+
+    destroy_opque_system();
+    apr_wrapper_stop();
+
+    return(0);
+}
@@ -0,0 +1,379 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// gop_latency.c - Log-linear latency histograms.
+//
+//  Values are usec.  Below GOP_HISTO_SUB each value gets its own bucket.
+//  Above that every power of 2 is split into GOP_HISTO_SUB linear
+//  buckets so the relative error is bounded by 1/GOP_HISTO_SUB no matter
+//  the magnitude.  Everything is updated with atomics so recording never
+//  takes a lock.  The per host tables are grown by CAS and never moved
+//  so readers don't need a lock either.  Snapshots are plain copies and
+//  may be off by the few ops completing during the copy.
+//*************************************************************
+
+#define _log_module_index 131
+
+#include <stdlib.h>
+#include <string.h>
+#include <apr_atomic.h>
+#include "type_malloc.h"
+#include "log.h"
+#include "fmttypes.h"
+#include "opque.h"
+#include "gop_latency.h"
+
+static const char *_lat_names[GOP_LAT_MAX] = { "que", "wait", "dispatch", "service", "recv", "total" };
+
+//*************************************************************
+// gop_histo_bucket - Returns the bucket for the value
+//*************************************************************
+
+int gop_histo_bucket(apr_uint64_t v)
+{
+    int e;
+
+    if (v < GOP_HISTO_SUB) return((int)v);
+    if (v >= ((apr_uint64_t)1 << GOP_HISTO_MAX_BITS)) return(GOP_HISTO_BUCKETS-1);
+
+    e = 63 - __builtin_clzll(v);  //** Highest bit set
+    return((e - GOP_HISTO_SUB_BITS + 1)*GOP_HISTO_SUB + (int)((v >> (e - GOP_HISTO_SUB_BITS)) & (GOP_HISTO_SUB-1)));
+}
+
+//*************************************************************
+// gop_histo_bucket_value - Returns the smallest value in the bucket
+//*************************************************************
+
+apr_uint64_t gop_histo_bucket_value(int b)
+{
+    int e;
+
+    if (b < GOP_HISTO_SUB) return(b);
+
+    e = b / GOP_HISTO_SUB + GOP_HISTO_SUB_BITS - 1;
+    return((apr_uint64_t)(GOP_HISTO_SUB + (b % GOP_HISTO_SUB)) << (e - GOP_HISTO_SUB_BITS));
+}
+
+//*************************************************************
+// gop_histo_add - Adds the value to the histogram
+//*************************************************************
+
+void gop_histo_add(gop_histo_t *h, apr_uint64_t v)
+{
+    apr_uint32_t old, v32;
+
+    apr_atomic_inc32(&(h->bucket[gop_histo_bucket(v)]));
+    apr_atomic_inc32(&(h->count));
+
+    v32 = (v > 0xFFFFFFFF) ? 0xFFFFFFFF : (apr_uint32_t)v;
+    old = apr_atomic_read32(&(h->max));
+    while (v32 > old) {
+        if (apr_atomic_cas32(&(h->max), v32, old) == old) break;
+        old = apr_atomic_read32(&(h->max));
+    }
+}
+
+//*************************************************************
+// gop_histo_merge - Adds the src histogram's counts to dst.  dst should
+//    be private to the caller
+//*************************************************************
+
+void gop_histo_merge(gop_histo_t *dst, gop_histo_t *src)
+{
+    int i;
+
+    for (i=0; i<GOP_HISTO_BUCKETS; i++) {
+        dst->bucket[i] += apr_atomic_read32(&(src->bucket[i]));
+    }
+    dst->count += apr_atomic_read32(&(src->count));
+    if (apr_atomic_read32(&(src->max)) > dst->max) dst->max = apr_atomic_read32(&(src->max));
+}
+
+//*************************************************************
+// gop_histo_percentile - Returns the value at the percentile, 0-100.
+//    The top of the bucket it lands in is used, capped at the max seen.
+//*************************************************************
+
+apr_uint64_t gop_histo_percentile(gop_histo_t *h, double p)
+{
+    apr_uint64_t target, sum, v;
+    int i;
+
+    if (h->count == 0) return(0);
+
+    target = (apr_uint64_t)((p / 100.0) * h->count + 0.5);
+    if (target == 0) target = 1;
+
+    sum = 0;
+    for (i=0; i<GOP_HISTO_BUCKETS; i++) {
+        sum += h->bucket[i];
+        if (sum >= target) break;
+    }
+
+    if (i >= GOP_HISTO_BUCKETS-1) return(h->max);
+    v = gop_histo_bucket_value(i+1) - 1;
+    return((v > h->max) ? h->max : v);
+}
+
+//*************************************************************
+// gop_latency_table_create - Makes an empty latency table
+//*************************************************************
+
+gop_latency_table_t *gop_latency_table_create()
+{
+    gop_latency_table_t *t;
+
+    type_malloc_clear(t, gop_latency_table_t, 1);
+    return(t);
+}
+
+//*************************************************************
+// gop_latency_table_destroy - Destroys the table
+//*************************************************************
+
+void gop_latency_table_destroy(gop_latency_table_t *t)
+{
+    int i, j;
+
+    for (i=0; i<GOP_LAT_HOST_CHUNKS; i++) {
+        if (t->host[i] == NULL) continue;
+        for (j=0; j<GOP_LAT_HOST_CHUNK; j++) {
+            if (t->host[i][j] != NULL) free(t->host[i][j]);
+        }
+        free(t->host[i]);
+    }
+
+    free(t);
+}
+
+//*************************************************************
+// _lat_host - Returns the host's histograms creating them if needed.
+//    Returns NULL if the host isn't tracked.
+//*************************************************************
+
+static gop_latency_t *_lat_host(gop_latency_table_t *t, int host_id)
+{
+    gop_latency_t **chunk, **old_chunk, *lat, *old;
+    int c, i;
+
+    c = host_id / GOP_LAT_HOST_CHUNK;
+    i = host_id % GOP_LAT_HOST_CHUNK;
+    if ((host_id <= 0) || (c >= GOP_LAT_HOST_CHUNKS)) return(NULL);
+
+    chunk = t->host[c];
+    if (chunk == NULL) {
+        type_malloc_clear(chunk, gop_latency_t *, GOP_LAT_HOST_CHUNK);
+        old_chunk = apr_atomic_casptr((volatile void **)&(t->host[c]), chunk, NULL);
+        if (old_chunk != NULL) {  //** Somebody beat us to it
+            free(chunk);
+            chunk = old_chunk;
+        }
+    }
+
+    lat = chunk[i];
+    if (lat == NULL) {
+        type_malloc_clear(lat, gop_latency_t, 1);
+        old = apr_atomic_casptr((volatile void **)&(chunk[i]), lat, NULL);
+        if (old != NULL) {
+            free(lat);
+            lat = old;
+        }
+    }
+
+    return(lat);
+}
+
+//*************************************************************
+// _lat_add - Adds the phase deltas to the histograms
+//*************************************************************
+
+static void _lat_add(gop_latency_t *lat, apr_int64_t *dt)
+{
+    int i;
+
+    for (i=0; i<GOP_LAT_MAX; i++) {
+        if (dt[i] >= 0) gop_histo_add(&(lat->phase[i]), dt[i]);
+    }
+}
+
+//*************************************************************
+// gop_latency_record - Adds an op's timeline to the portal and host
+//    histograms.  A phase whose stamp wasn't reached is skipped and the
+//    time is charged to the previous phase instead.
+//*************************************************************
+
+void gop_latency_record(gop_latency_table_t *t, int host_id, apr_time_t *ts)
+{
+    apr_int64_t dt[GOP_LAT_MAX];
+    gop_latency_t *lat;
+    apr_time_t first;
+    int i, j;
+
+    //** Each phase runs from its stamp to the next one reached
+    for (i=0; i<GOP_LAT_TOTAL; i++) {
+        dt[i] = -1;
+        if (ts[i] == 0) continue;
+        for (j=i+1; j<GOP_TS_MAX; j++) {
+            if (ts[j] != 0) break;
+        }
+        if ((j < GOP_TS_MAX) && (ts[j] >= ts[i])) dt[i] = ts[j] - ts[i];
+    }
+
+    first = 0;
+    for (i=0; i<GOP_TS_COMPLETE; i++) {
+        if (ts[i] != 0) {
+            first = ts[i];
+            break;
+        }
+    }
+    dt[GOP_LAT_TOTAL] = ((first == 0) || (ts[GOP_TS_COMPLETE] < first)) ? -1 : ts[GOP_TS_COMPLETE] - first;
+
+    _lat_add(&(t->all), dt);
+
+    lat = _lat_host(t, host_id);
+    if (lat != NULL) _lat_add(lat, dt);
+}
+
+//*************************************************************
+// gop_latency_snapshot - Copies the host's histograms or the portal
+//    totals if host_id is 0.  Returns 0 on success and 1 if there's
+//    nothing recorded for the host.
+//*************************************************************
+
+int gop_latency_snapshot(gop_latency_table_t *t, int host_id, gop_latency_t *snap)
+{
+    gop_latency_t **chunk, *lat;
+    int c;
+
+    if (host_id == 0) {
+        memcpy(snap, &(t->all), sizeof(gop_latency_t));
+        return(0);
+    }
+
+    c = host_id / GOP_LAT_HOST_CHUNK;
+    if ((host_id < 0) || (c >= GOP_LAT_HOST_CHUNKS)) return(1);
+    chunk = t->host[c];
+    if (chunk == NULL) return(1);
+    lat = chunk[host_id % GOP_LAT_HOST_CHUNK];
+    if (lat == NULL) return(1);
+
+    memcpy(snap, lat, sizeof(gop_latency_t));
+    return(0);
+}
+
+//*************************************************************
+// gop_latency_hosts - Stores up to n host IDs with recorded latencies
+//    and returns the number stored
+//*************************************************************
+
+int gop_latency_hosts(gop_latency_table_t *t, int *ids, int n)
+{
+    int i, j, k;
+
+    k = 0;
+    for (i=0; i<GOP_LAT_HOST_CHUNKS; i++) {
+        if (t->host[i] == NULL) continue;
+        for (j=0; j<GOP_LAT_HOST_CHUNK; j++) {
+            if (t->host[i][j] == NULL) continue;
+            if (k >= n) return(k);
+            ids[k] = i*GOP_LAT_HOST_CHUNK + j;
+            k++;
+        }
+    }
+
+    return(k);
+}
+
+//*************************************************************
+// gop_latency_reset - Zeroes all the histograms
+//*************************************************************
+
+void gop_latency_reset(gop_latency_table_t *t)
+{
+    int i, j;
+
+    memset(&(t->all), 0, sizeof(gop_latency_t));
+    for (i=0; i<GOP_LAT_HOST_CHUNKS; i++) {
+        if (t->host[i] == NULL) continue;
+        for (j=0; j<GOP_LAT_HOST_CHUNK; j++) {
+            if (t->host[i][j] != NULL) memset(t->host[i][j], 0, sizeof(gop_latency_t));
+        }
+    }
+}
+
+//*************************************************************
+// gop_latency_name - Returns the phase's name
+//*************************************************************
+
+const char *gop_latency_name(int phase)
+{
+    return(((phase < 0) || (phase >= GOP_LAT_MAX)) ? "unknown" : _lat_names[phase]);
+}
+
+//*************************************************************
+// _lat_print - Prints a single set of histograms
+//*************************************************************
+
+static void _lat_print(int ll, const char *name, gop_latency_t *lat)
+{
+    gop_histo_t *h;
+    int i;
+
+    for (i=0; i<GOP_LAT_MAX; i++) {
+        h = &(lat->phase[i]);
+        if (h->count == 0) continue;
+        log_printf(ll, "  %s %-8s n=%u p50=" LU " p90=" LU " p99=" LU " p99.9=" LU " max=%u usec\n", name, _lat_names[i], h->count,
+                   gop_histo_percentile(h, 50), gop_histo_percentile(h, 90), gop_histo_percentile(h, 99), gop_histo_percentile(h, 99.9), h->max);
+    }
+}
+
+//*************************************************************
+// gop_latency_print - Dumps the portal and per host percentiles to the log
+//*************************************************************
+
+void gop_latency_print(int ll, const char *name, gop_latency_table_t *t)
+{
+    gop_latency_t snap;
+    const char *host;
+    int i, j;
+
+    log_printf(ll, "GOP latency for %s\n", name);
+    gop_latency_snapshot(t, 0, &snap);
+    _lat_print(ll, "ALL", &snap);
+
+    for (i=0; i<GOP_LAT_HOST_CHUNKS; i++) {
+        if (t->host[i] == NULL) continue;
+        for (j=0; j<GOP_LAT_HOST_CHUNK; j++) {
+            if (gop_latency_snapshot(t, i*GOP_LAT_HOST_CHUNK + j, &snap) != 0) continue;
+            host = gop_hostport_name(i*GOP_LAT_HOST_CHUNK + j);
+            _lat_print(ll, (host == NULL) ? "?" : host, &snap);
+        }
+    }
+}
@@ -0,0 +1,112 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// gop_latency.h - Per op timestamps and the log-linear latency
+//     histograms they're aggregated into for each portal and host
+//*************************************************************
+
+#include <apr_time.h>
+
+#ifndef __GOP_LATENCY_H_
+#define __GOP_LATENCY_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//** Op timeline stamps.  Any stamp not reached is left as 0
+#define GOP_TS_QUEUED     0  //** Added to an opque
+#define GOP_TS_SUBMIT     1  //** Handed to the portal
+#define GOP_TS_DEQUEUE    2  //** Pulled off the portal's que (hp->que, TP reserve/APR pool, MQ tasks)
+#define GOP_TS_SEND       3  //** Command sent
+#define GOP_TS_FIRST_BYTE 4  //** Response started arriving.  recv_phase routines can restamp it more precisely
+#define GOP_TS_COMPLETE   5  //** Marked completed
+#define GOP_TS_MAX        6
+
+//** Latency phases derived from the stamps.  Each runs until the next stamp
+//** reached, so for thread pool ops, which have no FIRST_BYTE, SERVICE is
+//** the execution time.
+#define GOP_LAT_QUE       0  //** QUEUED -> SUBMIT
+#define GOP_LAT_WAIT      1  //** SUBMIT -> DEQUEUE
+#define GOP_LAT_DISPATCH  2  //** DEQUEUE -> SEND
+#define GOP_LAT_SERVICE   3  //** SEND -> FIRST_BYTE
+#define GOP_LAT_RECV      4  //** FIRST_BYTE -> COMPLETE
+#define GOP_LAT_TOTAL     5  //** Earliest stamp -> COMPLETE
+#define GOP_LAT_MAX       6
+
+#define GOP_HISTO_SUB_BITS 3                        //** Linear sub-buckets per power of 2 as bits
+#define GOP_HISTO_SUB      (1<<GOP_HISTO_SUB_BITS)
+#define GOP_HISTO_MAX_BITS 40                       //** Largest value tracked is 2^40 usec.  Anything above lands in the last bucket
+#define GOP_HISTO_BUCKETS  ((GOP_HISTO_MAX_BITS - GOP_HISTO_SUB_BITS + 1) * GOP_HISTO_SUB)
+
+#define GOP_LAT_HOST_CHUNK  256   //** Hosts per chunk of the per host table
+#define GOP_LAT_HOST_CHUNKS 256   //** Max chunks.  Hosts with larger IDs are only counted in the portal totals
+
+typedef struct {        //** Log-linear histogram of usec values
+    apr_uint32_t count;
+    apr_uint32_t max;
+    apr_uint32_t bucket[GOP_HISTO_BUCKETS];
+} gop_histo_t;
+
+typedef struct {        //** Histograms for each phase
+    gop_histo_t phase[GOP_LAT_MAX];
+} gop_latency_t;
+
+typedef struct {        //** Portal latency table
+    gop_latency_t all;    //** Everything completed through the portal
+    gop_latency_t **host[GOP_LAT_HOST_CHUNKS];  //** Per host indexed by the interned host ID.  Created on demand
+} gop_latency_table_t;
+
+#ifdef GOP_LATENCY_DISABLE
+#define gop_timestamp(gop, n) do {} while (0)
+#else
+#define gop_timestamp(gop, n) (gop)->base.ts[n] = apr_time_now()
+#endif
+
+int gop_histo_bucket(apr_uint64_t v);
+apr_uint64_t gop_histo_bucket_value(int b);
+void gop_histo_add(gop_histo_t *h, apr_uint64_t v);
+void gop_histo_merge(gop_histo_t *dst, gop_histo_t *src);
+apr_uint64_t gop_histo_percentile(gop_histo_t *h, double p);
+
+gop_latency_table_t *gop_latency_table_create();
+void gop_latency_table_destroy(gop_latency_table_t *t);
+void gop_latency_record(gop_latency_table_t *t, int host_id, apr_time_t *ts);
+int gop_latency_snapshot(gop_latency_table_t *t, int host_id, gop_latency_t *snap);
+int gop_latency_hosts(gop_latency_table_t *t, int *ids, int n);
+void gop_latency_reset(gop_latency_table_t *t);
+const char *gop_latency_name(int phase);
+void gop_latency_print(int ll, const char *name, gop_latency_table_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,424 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// gop_slab.c - Size class slab allocator for the GOP hot objects.
+//
+//  Each thread gets its own cache holding a magazine (free list) per
+//  size class.  Objects always go back to the cache that carved them.
+//  Frees from the owning thread just push onto the magazine.  Frees from
+//  any other thread are pushed onto the owner's lock-free return queue
+//  which the owner drains in bulk the next time its magazine runs dry.
+//  When a thread exits its cache is parked on an orphan list and adopted
+//  by the next thread needing one, so returns to it are never lost.
+//*************************************************************
+
+#define _log_module_index 129
+
+#include <stdlib.h>
+#include <string.h>
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#include "assert_result.h"
+#include "type_malloc.h"
+#include "log.h"
+#include "fmttypes.h"
+#include "atomic_counter.h"
+#include "gop_slab.h"
+
+typedef struct gop_slab_cache_s gop_slab_cache_t;
+
+typedef struct {       //** Header placed in front of every object
+    gop_slab_cache_t *owner;  //** Cache the object belongs to.  NULL for oversize objects
+    int sclass;               //** Size class
+    int pad;
+} gop_slab_hdr_t;
+
+typedef struct gop_slab_link_s {  //** Overlaid on the body of a free object
+    struct gop_slab_link_s *next;
+} gop_slab_link_t;
+
+typedef struct {
+    gop_slab_link_t *magazine;   //** Free objects only the owner touches
+    volatile void *returned;     //** Objects freed by other threads
+    gop_slab_stats_t stats;
+} gop_slab_class_t;
+
+struct gop_slab_cache_s {
+    gop_slab_class_t sc[GOP_SLAB_N_CLASSES];
+    gop_slab_stats_t big;        //** Oversize allocations
+    void *slabs;                 //** Chunks owned by the cache.  The 1st word links them
+    gop_slab_cache_t *next_all;
+    gop_slab_cache_t *next_orphan;
+};
+
+static apr_size_t _slab_class_size[GOP_SLAB_N_CLASSES] = { 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+
+static atomic_int_t _slab_counter = 0;
+static apr_pool_t *_slab_pool = NULL;
+static apr_thread_mutex_t *_slab_lock = NULL;
+static apr_threadkey_t *_slab_key = NULL;
+static gop_slab_cache_t *_slab_all = NULL;
+static gop_slab_cache_t *_slab_orphans = NULL;
+static gop_slab_stats_t _slab_baseline[GOP_SLAB_N_CLASSES+1];
+
+#define _slab_hdr(ptr) ((gop_slab_hdr_t *)((char *)(ptr) - sizeof(gop_slab_hdr_t)))
+#define _slab_body(hdr) ((void *)((char *)(hdr) + sizeof(gop_slab_hdr_t)))
+
+//*************************************************************
+// _slab_cache_orphan - Called on thread exit to park the thread's cache
+//*************************************************************
+
+void _slab_cache_orphan(void *arg)
+{
+    gop_slab_cache_t *cache = (gop_slab_cache_t *)arg;
+
+    apr_thread_mutex_lock(_slab_lock);
+    cache->next_orphan = _slab_orphans;
+    _slab_orphans = cache;
+    apr_thread_mutex_unlock(_slab_lock);
+}
+
+//*************************************************************
+// _slab_cache_get - Returns the calling thread's cache creating it if needed
+//*************************************************************
+
+gop_slab_cache_t *_slab_cache_get()
+{
+    gop_slab_cache_t *cache = NULL;
+
+    apr_threadkey_private_get((void *)&cache, _slab_key);
+    if (cache != NULL) return(cache);
+
+    apr_thread_mutex_lock(_slab_lock);
+    if (_slab_orphans != NULL) {  //** Adopt an orphan if available
+        cache = _slab_orphans;
+        _slab_orphans = cache->next_orphan;
+        cache->next_orphan = NULL;
+    } else {
+        type_malloc_clear(cache, gop_slab_cache_t, 1);
+        cache->next_all = _slab_all;
+        _slab_all = cache;
+    }
+    apr_thread_mutex_unlock(_slab_lock);
+
+    apr_threadkey_private_set(cache, _slab_key);
+
+    return(cache);
+}
+
+//*************************************************************
+// _slab_class - Maps a size onto a size class.  -1 means oversize
+//*************************************************************
+
+static inline int _slab_class(apr_size_t size)
+{
+    int i;
+
+    for (i=0; i<GOP_SLAB_N_CLASSES; i++) {
+        if (size <= _slab_class_size[i]) return(i);
+    }
+
+    return(-1);
+}
+
+//*************************************************************
+// _slab_refill - Refills an empty magazine from the return queue or,
+//    failing that, a new slab
+//*************************************************************
+
+void _slab_refill(gop_slab_cache_t *cache, int sclass)
+{
+    gop_slab_class_t *c = &(cache->sc[sclass]);
+    gop_slab_link_t *list, *last;
+    gop_slab_hdr_t *hdr;
+    char *chunk, *ptr;
+    apr_size_t stride;
+    int i, n;
+
+    //** First see if anybody has given us something back
+    list = (gop_slab_link_t *)apr_atomic_xchgptr(&(c->returned), NULL);
+    if (list != NULL) {
+        n = 0;
+        for (last = list; last->next != NULL; last = last->next) n++;
+        c->stats.n_remote_free += n + 1;
+        c->magazine = list;
+        return;
+    }
+
+    //** Nope so carve up a new slab
+    stride = sizeof(gop_slab_hdr_t) + _slab_class_size[sclass];
+    type_malloc(chunk, char, GOP_SLAB_CHUNK_SIZE);
+    *(void **)chunk = cache->slabs;
+    cache->slabs = chunk;
+    c->stats.n_malloc++;
+    c->stats.n_slabs++;
+
+    n = (GOP_SLAB_CHUNK_SIZE - sizeof(gop_slab_hdr_t)) / stride;
+    ptr = chunk + sizeof(gop_slab_hdr_t);  //** Skip over the chunk link keeping the alignment
+    list = NULL;
+    for (i=0; i<n; i++) {
+        hdr = (gop_slab_hdr_t *)ptr;
+        hdr->owner = cache;
+        hdr->sclass = sclass;
+        last = (gop_slab_link_t *)_slab_body(hdr);
+        last->next = list;
+        list = last;
+        ptr += stride;
+    }
+
+    c->magazine = list;
+}
+
+//*************************************************************
+// gop_slab_malloc - Allocates an object
+//*************************************************************
+
+void *gop_slab_malloc(apr_size_t size)
+{
+    gop_slab_cache_t *cache = _slab_cache_get();
+    gop_slab_class_t *c;
+    gop_slab_link_t *obj;
+    gop_slab_hdr_t *hdr;
+    int sclass;
+
+    sclass = _slab_class(size);
+    if (sclass == -1) {  //** Too big so just malloc it
+        type_malloc(hdr, gop_slab_hdr_t, 1 + (size + sizeof(gop_slab_hdr_t) - 1) / sizeof(gop_slab_hdr_t));
+        hdr->owner = NULL;
+        hdr->sclass = -1;
+        cache->big.n_alloc++;
+        cache->big.n_malloc++;
+        return(_slab_body(hdr));
+    }
+
+    c = &(cache->sc[sclass]);
+    if (c->magazine == NULL) _slab_refill(cache, sclass);
+
+    obj = c->magazine;
+    c->magazine = obj->next;
+    c->stats.n_alloc++;
+
+    return((void *)obj);
+}
+
+//*************************************************************
+// gop_slab_malloc_clear - Allocates an object and zeroes it
+//*************************************************************
+
+void *gop_slab_malloc_clear(apr_size_t size)
+{
+    void *ptr = gop_slab_malloc(size);
+
+    memset(ptr, 0, size);
+    return(ptr);
+}
+
+//*************************************************************
+// gop_slab_free - Returns an object to its owning cache
+//*************************************************************
+
+void gop_slab_free(void *ptr)
+{
+    gop_slab_cache_t *cache;
+    gop_slab_class_t *c;
+    gop_slab_link_t *obj;
+    gop_slab_hdr_t *hdr;
+    void *head, *curr;
+
+    if (ptr == NULL) return;
+
+    hdr = _slab_hdr(ptr);
+    cache = _slab_cache_get();
+
+    if (hdr->owner == NULL) {  //** Oversize object
+        cache->big.n_free++;
+        free(hdr);
+        return;
+    }
+
+    obj = (gop_slab_link_t *)ptr;
+    if (hdr->owner == cache) {  //** It's ours so just put it back in the magazine
+        c = &(cache->sc[hdr->sclass]);
+        obj->next = c->magazine;
+        c->magazine = obj;
+        c->stats.n_free++;
+        return;
+    }
+
+    //** Somebody else's object so push it on their return queue
+    c = &(hdr->owner->sc[hdr->sclass]);
+    curr = (void *)c->returned;
+    do {
+        head = curr;
+        obj->next = (gop_slab_link_t *)head;
+        curr = apr_atomic_casptr(&(c->returned), obj, head);
+    } while (curr != head);
+}
+
+//*************************************************************
+// _slab_stats_add - Accumulates the counters
+//*************************************************************
+
+static void _slab_stats_add(gop_slab_stats_t *sum, gop_slab_stats_t *s)
+{
+    sum->n_alloc += s->n_alloc;
+    sum->n_free += s->n_free;
+    sum->n_remote_free += s->n_remote_free;
+    sum->n_malloc += s->n_malloc;
+    sum->n_slabs += s->n_slabs;
+}
+
+//*************************************************************
+// _slab_stats_sum - Sums the counters across all the caches.
+//    NOTE: _slab_lock should be held by the caller.  The counters are
+//    updated without locking so they are only approximate while in use.
+//*************************************************************
+
+static void _slab_stats_sum(gop_slab_stats_t *sum)
+{
+    gop_slab_cache_t *cache;
+    int i;
+
+    memset(sum, 0, sizeof(gop_slab_stats_t)*(GOP_SLAB_N_CLASSES+1));
+    for (i=0; i<GOP_SLAB_N_CLASSES; i++) sum[i].obj_size = _slab_class_size[i];
+
+    for (cache = _slab_all; cache != NULL; cache = cache->next_all) {
+        for (i=0; i<GOP_SLAB_N_CLASSES; i++) _slab_stats_add(&(sum[i]), &(cache->sc[i].stats));
+        _slab_stats_add(&(sum[GOP_SLAB_N_CLASSES]), &(cache->big));
+    }
+}
+
+//*************************************************************
+// gop_slab_stats_get - Stores the allocation counters for up to n size
+//    classes in stats.  The last entry, index GOP_SLAB_N_CLASSES, is the
+//    oversize class.  Returns the number of entries stored.
+//*************************************************************
+
+int gop_slab_stats_get(gop_slab_stats_t *stats, int n)
+{
+    gop_slab_stats_t sum[GOP_SLAB_N_CLASSES+1];
+    int i;
+
+    if (n > GOP_SLAB_N_CLASSES+1) n = GOP_SLAB_N_CLASSES+1;
+
+    apr_thread_mutex_lock(_slab_lock);
+    _slab_stats_sum(sum);
+    apr_thread_mutex_unlock(_slab_lock);
+
+    for (i=0; i<n; i++) {
+        stats[i] = sum[i];
+        stats[i].n_alloc -= _slab_baseline[i].n_alloc;
+        stats[i].n_free -= _slab_baseline[i].n_free;
+        stats[i].n_remote_free -= _slab_baseline[i].n_remote_free;
+        stats[i].n_malloc -= _slab_baseline[i].n_malloc;
+    }
+
+    return(n);
+}
+
+//*************************************************************
+// gop_slab_stats_reset - Zeroes the counters.  The slab count is a
+//    gauge and is left alone.
+//*************************************************************
+
+void gop_slab_stats_reset()
+{
+    apr_thread_mutex_lock(_slab_lock);
+    _slab_stats_sum(_slab_baseline);
+    apr_thread_mutex_unlock(_slab_lock);
+}
+
+//*************************************************************
+// gop_slab_stats_print - Dumps the counters to the log
+//*************************************************************
+
+void gop_slab_stats_print(int ll)
+{
+    gop_slab_stats_t stats[GOP_SLAB_N_CLASSES+1];
+    int i, n;
+
+    n = gop_slab_stats_get(stats, GOP_SLAB_N_CLASSES+1);
+
+    log_printf(ll, "GOP slab allocator stats\n");
+    for (i=0; i<n; i++) {
+        if (stats[i].n_alloc == 0) continue;
+        log_printf(ll, "  size=" ST " n_alloc=" LU " n_free=" LU " n_remote_free=" LU " n_malloc=" LU " n_slabs=" LU "\n",
+                   stats[i].obj_size, stats[i].n_alloc, stats[i].n_free, stats[i].n_remote_free, stats[i].n_malloc, stats[i].n_slabs);
+    }
+}
+
+//*************************************************************
+// gop_slab_init - Initializes the allocator
+//*************************************************************
+
+void gop_slab_init()
+{
+    if (atomic_inc(_slab_counter) != 0) return;
+
+    assert_result(apr_pool_create(&_slab_pool, NULL), APR_SUCCESS);
+    apr_thread_mutex_create(&_slab_lock, APR_THREAD_MUTEX_DEFAULT, _slab_pool);
+    apr_threadkey_private_create(&_slab_key, _slab_cache_orphan, _slab_pool);
+    memset(_slab_baseline, 0, sizeof(_slab_baseline));
+}
+
+//*************************************************************
+// gop_slab_destroy - Tears down the allocator releasing all the slabs.
+//    Any objects still outstanding are invalid after this.
+//*************************************************************
+
+void gop_slab_destroy()
+{
+    gop_slab_cache_t *cache, *next;
+    void *chunk, *cnext;
+
+    if (atomic_dec(_slab_counter) != 0) return;
+
+    log_printf(5, "Final allocation counts\n");
+    gop_slab_stats_print(5);
+
+    //** Remove the key first so exiting threads don't touch the caches
+    apr_threadkey_private_delete(_slab_key);
+
+    for (cache = _slab_all; cache != NULL; cache = next) {
+        next = cache->next_all;
+        for (chunk = cache->slabs; chunk != NULL; chunk = cnext) {
+            cnext = *(void **)chunk;
+            free(chunk);
+        }
+        free(cache);
+    }
+    _slab_all = NULL;
+    _slab_orphans = NULL;
+
+    apr_thread_mutex_destroy(_slab_lock);
+    apr_pool_destroy(_slab_pool);
+}
+
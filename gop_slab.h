@@ -0,0 +1,73 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// gop_slab.h - Size class slab allocator with per-thread
+//     magazines used for the hot GOP objects
+//*************************************************************
+
+#include <apr_pools.h>
+
+#ifndef __GOP_SLAB_H_
+#define __GOP_SLAB_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GOP_SLAB_N_CLASSES 11      //** Number of size classes.  Anything larger goes straight to malloc
+#define GOP_SLAB_CHUNK_SIZE 65536  //** Size of each slab carved into objects
+
+typedef struct {        //** Allocation counters for a single size class
+    apr_size_t obj_size;      //** Largest request handled by the class.  0 is used for the oversize class
+    apr_uint64_t n_alloc;     //** Objects handed out
+    apr_uint64_t n_free;      //** Objects returned by the owning thread
+    apr_uint64_t n_remote_free; //** Objects returned by a different thread
+    apr_uint64_t n_malloc;    //** Calls to malloc() needed to satisfy the requests
+    apr_uint64_t n_slabs;     //** Slabs currently allocated
+} gop_slab_stats_t;
+
+#define type_slab_malloc(var, type, count) var = (type *)gop_slab_malloc(sizeof(type)*(count))
+#define type_slab_malloc_clear(var, type, count) var = (type *)gop_slab_malloc_clear(sizeof(type)*(count))
+
+void gop_slab_init();
+void gop_slab_destroy();
+void *gop_slab_malloc(apr_size_t size);
+void *gop_slab_malloc_clear(apr_size_t size);
+void gop_slab_free(void *ptr);
+int gop_slab_stats_get(gop_slab_stats_t *stats, int n);
+void gop_slab_stats_reset();
+void gop_slab_stats_print(int ll);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
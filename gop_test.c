@@ -0,0 +1,1068 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+//*************************************************************
+// gop_test.c - Pass/fail tests for the GOP engine and thread pools.
+//
+//  Each case returns the number of errors it found.  The exit status is
+//  the number of failed cases so it can be run directly by ctest.
+//*************************************************************
+
+#define _log_module_index 138
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "opque.h"
+#include "thread_pool.h"
+#include "host_portal.h"
+#include "apr_wrapper.h"
+#include "atomic_counter.h"
+#include "log.h"
+#include "type_malloc.h"
+
+typedef int (*test_fn_t)(thread_pool_context_t *tpc);
+
+typedef struct {
+    char *name;
+    test_fn_t fn;
+} test_case_t;
+
+atomic_int_t test_ran;   //** Number of test_count ops that executed
+
+//*************************************************************
+// test_count - Op that just records that it ran
+//*************************************************************
+
+op_status_t test_count(void *arg, int id)
+{
+    atomic_inc(test_ran);
+    return(op_success_status);
+}
+
+//*************************************************************
+// test_failed_parent - Makes a parent op that has already failed
+//*************************************************************
+
+op_generic_t *test_failed_parent()
+{
+    op_generic_t *gop;
+
+    gop = gop_dummy(op_failure_status);
+    gop_waitall(gop);
+    return(gop);
+}
+
+//*************************************************************
+// test_dep_fail_op - Starts a child op after its parent already failed.
+//    The child must fail without running.
+//*************************************************************
+
+int test_dep_fail_op(thread_pool_context_t *tpc)
+{
+    op_generic_t *parent, *child;
+    int err = 0;
+
+    atomic_set(test_ran, 0);
+
+    //** Thread pool child
+    parent = test_failed_parent();
+    child = new_thread_pool_op(tpc, NULL, test_count, NULL, NULL, 1);
+    gop_add_dependency(child, parent);
+    if (gop_waitall(child) != OP_STATE_FAILURE) err++;
+    gop_free(child, OP_DESTROY);
+    gop_free(parent, OP_DESTROY);
+
+    //** gop_dummy child started explicitly
+    parent = test_failed_parent();
+    child = gop_dummy(op_success_status);
+    gop_add_dependency(child, parent);
+    gop_start_execution(child);
+    if (gop_waitall(child) != OP_STATE_FAILURE) err++;
+    gop_free(child, OP_DESTROY);
+    gop_free(parent, OP_DESTROY);
+
+    if (atomic_get(test_ran) != 0) err++;
+    return(err);
+}
+
+//*************************************************************
+// test_dep_fail_que - A que with fan-in from a good and a failed parent
+//    and an op inside a que depending on a failed parent.  Both are
+//    started after the parents finished.
+//*************************************************************
+
+int test_dep_fail_que(thread_pool_context_t *tpc)
+{
+    op_generic_t *good, *bad, *child;
+    opque_t *q;
+    int i, err = 0;
+
+    atomic_set(test_ran, 0);
+
+    //** Que depending on 2 parents, 1 of them failed
+    good = gop_dummy(op_success_status);
+    gop_waitall(good);
+    bad = test_failed_parent();
+    q = new_opque();
+    for (i=0; i<4; i++) opque_add(q, new_thread_pool_op(tpc, NULL, test_count, NULL, NULL, 1));
+    gop_add_dependency(opque_get_gop(q), good);
+    gop_add_dependency(opque_get_gop(q), bad);
+    if (opque_waitall(q) != OP_STATE_FAILURE) err++;
+    if (atomic_get(test_ran) != 0) err++;
+    opque_free(q, OP_DESTROY);
+    gop_free(good, OP_DESTROY);
+    gop_free(bad, OP_DESTROY);
+
+    //** Op in a que with a failed parent next to an independent op
+    bad = test_failed_parent();
+    q = new_opque();
+    child = new_thread_pool_op(tpc, NULL, test_count, NULL, NULL, 1);
+    gop_add_dependency(child, bad);
+    opque_add(q, child);
+    opque_add(q, new_thread_pool_op(tpc, NULL, test_count, NULL, NULL, 1));
+    if (opque_waitall(q) != OP_STATE_FAILURE) err++;
+    if (opque_tasks_failed(q) != 1) err++;
+    if (atomic_get(test_ran) != 1) err++;
+    opque_free(q, OP_DESTROY);
+    gop_free(bad, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+// test_dep_fanin - Child with several running parents is only
+//    submitted once they all succeed
+//*************************************************************
+
+#define TEST_FANIN 8
+
+atomic_int_t test_fanin_done;
+
+op_status_t test_fanin_parent(void *arg, int id)
+{
+    usleep(1000);
+    atomic_inc(test_fanin_done);
+    return(op_success_status);
+}
+
+op_status_t test_fanin_child(void *arg, int id)
+{
+    return((atomic_get(test_fanin_done) == TEST_FANIN) ? op_success_status : op_failure_status);
+}
+
+int test_dep_fanin(thread_pool_context_t *tpc)
+{
+    op_generic_t *child, *parent;
+    opque_t *q;
+    int i, err = 0;
+
+    atomic_set(test_fanin_done, 0);
+    q = new_opque();
+    child = new_thread_pool_op(tpc, NULL, test_fanin_child, NULL, NULL, 1);
+    for (i=0; i<TEST_FANIN; i++) {
+        parent = new_thread_pool_op(tpc, NULL, test_fanin_parent, NULL, NULL, 1);
+        gop_add_dependency(child, parent);
+        opque_add(q, parent);
+    }
+    opque_add(q, child);
+    if (opque_waitall(q) != OP_STATE_SUCCESS) err++;
+    opque_free(q, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+// test_que_poll - Waits for ques to finish with a poll loop on the
+//    completion FD.  Lots of small ques so the last task finishing
+//    races the poller.
+//*************************************************************
+
+op_status_t test_short(void *arg, int id)
+{
+    if (((intptr_t)arg % 4) == 0) usleep(100);
+    return(op_success_status);
+}
+
+int test_que_poll(thread_pool_context_t *tpc)
+{
+    opque_t *q;
+    op_generic_t *ops[16];
+    struct pollfd pfd;
+    int i, j, n, n_ops, got, err = 0;
+
+    for (i=0; i<500; i++) {
+        n_ops = 1 + (i % 3);
+        q = new_opque();
+        for (j=0; j<n_ops; j++) opque_add(q, new_thread_pool_op(tpc, NULL, test_short, (void *)(intptr_t)(i+j), NULL, 1));
+
+        pfd.fd = opque_completion_fd(q);
+        pfd.events = POLLIN;
+        opque_start_execution(q);
+
+        got = 0;
+        while (opque_tasks_left(q) > 0) {
+            if (poll(&pfd, 1, 5000) != 1) {  //** Never got woken for the end
+                log_printf(0, "ERROR: poll timed out! i=%d got=%d left=%d\n", i, got, opque_tasks_left(q));
+                err++;
+                break;
+            }
+            n = opque_completion_drain(q, ops, 16);
+            got += n;
+        }
+        got += opque_completion_drain(q, ops, 16);
+        if (got != n_ops) err++;
+
+        if (err == 0) {
+            opque_free(q, OP_DESTROY);
+        } else {
+            break;  //** Leave the que alone since it's in an unknown state
+        }
+    }
+
+    return(err);
+}
+
+//*************************************************************
+// test_que_wide - A que much wider than the finished ring drained with
+//    waitany while it's running.  Every op has to come out exactly once
+//    and the failed list has to hold just the failures.
+//*************************************************************
+
+#define TEST_WIDE_OPS (5*OPQUE_RING_MAX)
+
+op_status_t test_wide(void *arg, int id)
+{
+    return((((intptr_t)arg % 7) == 0) ? op_failure_status : op_success_status);
+}
+
+int test_que_wide(thread_pool_context_t *tpc)
+{
+    opque_t *q;
+    op_generic_t *gop;
+    char *seen;
+    int i, n, n_failed, err = 0;
+
+    type_malloc_clear(seen, char, TEST_WIDE_OPS);
+    q = new_opque();
+    for (i=0; i<TEST_WIDE_OPS; i++) {
+        gop = new_thread_pool_op(tpc, NULL, test_wide, (void *)(intptr_t)i, NULL, 1);
+        gop_set_myid(gop, i);
+        opque_add(q, gop);
+    }
+    opque_start_execution(q);
+
+    n = n_failed = 0;
+    while ((gop = opque_waitany(q)) != NULL) {
+        i = gop_get_myid(gop);
+        seen[i]++;
+        n++;
+        if (gop_get_status(gop).op_status != (((i % 7) == 0) ? OP_STATE_FAILURE : OP_STATE_SUCCESS)) err++;
+        if ((i % 7) == 0) n_failed++;
+    }
+    if (n != TEST_WIDE_OPS) {
+        log_printf(0, "ERROR: Only got %d of %d\n", n, TEST_WIDE_OPS);
+        err++;
+    }
+    for (i=0; i<TEST_WIDE_OPS; i++) {
+        if (seen[i] != 1) {
+            log_printf(0, "ERROR: op %d came out %d times\n", i, seen[i]);
+            err++;
+            break;
+        }
+    }
+
+    if (opque_tasks_failed(q) != n_failed) err++;
+    n = 0;
+    while ((gop = opque_get_next_failed(q)) != NULL) n++;
+    if (n != n_failed) {
+        log_printf(0, "ERROR: failed list has %d expected %d\n", n, n_failed);
+        err++;
+    }
+
+    opque_free(q, OP_DESTROY);
+    free(seen);
+
+    return(err);
+}
+
+//*************************************************************
+// test_atomic_free - OP_CM_ATOMIC ops freed the moment the wait returns
+//    so the free races the completion still waking us up
+//*************************************************************
+
+int test_atomic_free(thread_pool_context_t *tpc)
+{
+    op_generic_t *gop;
+    int i, mode, err = 0;
+
+    mode = gop_default_completion_mode_get();
+    gop_default_completion_mode_set(OP_CM_ATOMIC);
+
+    for (i=0; i<5000; i++) {
+        gop = new_thread_pool_op(tpc, NULL, test_short, (void *)(intptr_t)i, NULL, 1);
+        gop_start_execution(gop);
+        if (gop_waitall(gop) != OP_STATE_SUCCESS) err++;
+        gop_free(gop, OP_DESTROY);
+    }
+
+    gop_default_completion_mode_set(mode);
+
+    return(err);
+}
+
+//*************************************************************
+// test_dummy_direct - OP_EXEC_DIRECT dummies completed inline on the
+//    starting thread in both completion modes
+//*************************************************************
+
+int test_dummy_direct(thread_pool_context_t *tpc)
+{
+    op_generic_t *gop;
+    int i, j, cm, exec, err = 0;
+    int modes[2] = { OP_CM_LOCKED, OP_CM_ATOMIC };
+
+    cm = gop_default_completion_mode_get();
+    exec = gop_dummy_exec_mode_get();
+    gop_dummy_exec_mode_set(OP_EXEC_DIRECT);
+
+    for (j=0; j<2; j++) {
+        gop_default_completion_mode_set(modes[j]);
+        for (i=0; i<100; i++) {
+            gop = gop_dummy((i%2) ? op_success_status : op_failure_status);
+            gop_start_execution(gop);
+            if (gop_waitall(gop) != ((i%2) ? OP_STATE_SUCCESS : OP_STATE_FAILURE)) err++;
+            gop_free(gop, OP_DESTROY);
+        }
+    }
+
+    gop_default_completion_mode_set(cm);
+    gop_dummy_exec_mode_set(exec);
+
+    return(err);
+}
+
+//*************************************************************
+// test_dummy_cancel - A cancelled dummy run via its sync_exec has to
+//    complete with op_cancelled_status and not its original status.
+//    gop_sync_exec_status() goes straight to sync_exec so we flag it
+//    directly instead of gop_cancel() which would start it.
+//*************************************************************
+
+int test_dummy_cancel(thread_pool_context_t *tpc)
+{
+    op_generic_t *gop;
+    op_status_t status;
+    int i, err = 0;
+
+    for (i=0; i<10; i++) {
+        gop = gop_dummy(op_success_status);
+        atomic_set(gop->base.cancelled, 1);
+        status = gop_sync_exec_status(gop);
+        if ((status.op_status != op_cancelled_status.op_status) || (status.error_code != op_cancelled_status.error_code)) err++;
+    }
+
+    return(err);
+}
+
+//*************************************************************
+// test_adapt_direct - The adaptive controller on a context only fed
+//    direct tasks.  Their queue wait has to be sampled and an idle pool
+//    with no samples must hold its concurrency instead of shrinking.
+//*************************************************************
+
+atomic_int_t test_direct_done;
+
+void *test_direct_sleep(apr_thread_t *th, void *arg)
+{
+    usleep(500);
+    atomic_inc(test_direct_done);
+    return(NULL);
+}
+
+int test_adapt_direct(thread_pool_context_t *unused)
+{
+    thread_pool_context_t *tpc;
+    thread_pool_stats_t st;
+    void *args[64];
+    int i, err = 0;
+
+    tpc = thread_pool_create_context("adapt", 4, 4, 1);
+    thread_pool_adaptive_enable(tpc, 1, 0, apr_time_from_msec(5));
+
+    atomic_set(test_direct_done, 0);
+    for (i=0; i<64; i++) {
+        thread_pool_direct(tpc, test_direct_sleep, NULL);
+        args[i] = NULL;
+    }
+    thread_pool_direct_batch(tpc, test_direct_sleep, args, 64);
+    for (i=0; (i<1000) && (atomic_get(test_direct_done) < 128); i++) usleep(1000);
+    if (atomic_get(test_direct_done) != 128) err++;
+
+    thread_pool_stats_snapshot(tpc, &st);
+    if (st.wait.count < 128) {  //** Every direct task should have been sampled
+        log_printf(0, "ERROR: direct tasks not sampled! count=%d\n", (int)st.wait.count);
+        err++;
+    }
+
+    //** Now sit idle for a lot longer than it takes to shrink
+    usleep(400000);
+    thread_pool_stats_snapshot(tpc, &st);
+    if (st.adapt_n_shrink != 0) {
+        log_printf(0, "ERROR: shrank without samples! n_shrink=%d concurrency=%d\n", st.adapt_n_shrink, st.concurrency);
+        err++;
+    }
+
+    thread_pool_adaptive_disable(tpc);
+    thread_pool_destroy_context(tpc);
+
+    return(err);
+}
+
+//*************************************************************
+// test_adapt_ops - The adaptive controller on a context fed normal
+//    thread pool ops.  A trickle should sample the queue wait and let
+//    it shrink and then saturating it should make it grow again.
+//*************************************************************
+
+op_status_t test_adapt_sleep(void *arg, int id)
+{
+    usleep((intptr_t)arg);
+    return(op_success_status);
+}
+
+int test_adapt_ops(thread_pool_context_t *unused)
+{
+    thread_pool_context_t *tpc;
+    thread_pool_stats_t st;
+    op_generic_t *gop;
+    opque_t *q;
+    int i, err = 0;
+
+    tpc = thread_pool_create_context("adapt_ops", 4, 8, 1);
+    thread_pool_adaptive_enable(tpc, 1, 200, apr_time_from_msec(5));
+
+    //** Trickle them through 1 at a time so it shrinks
+    for (i=0; i<400; i++) {
+        gop = new_thread_pool_op(tpc, NULL, test_adapt_sleep, (void *)(intptr_t)100, NULL, 1);
+        gop_start_execution(gop);
+        gop_waitall(gop);
+        gop_free(gop, OP_DESTROY);
+        usleep(1000);
+    }
+
+    thread_pool_stats_snapshot(tpc, &st);
+    if (st.wait.count == 0) {
+        log_printf(0, "ERROR: thread pool ops not sampled!\n");
+        err++;
+    }
+    if (st.adapt_n_shrink == 0) {
+        log_printf(0, "ERROR: never shrank! concurrency=%d\n", st.concurrency);
+        err++;
+    }
+
+    //** Now swamp it so the wait goes way over the target
+    q = new_opque();
+    for (i=0; i<400; i++) opque_add(q, new_thread_pool_op(tpc, NULL, test_adapt_sleep, (void *)(intptr_t)2000, NULL, 1));
+    if (opque_waitall(q) != OP_STATE_SUCCESS) err++;
+    opque_free(q, OP_DESTROY);
+
+    thread_pool_stats_snapshot(tpc, &st);
+    if (st.adapt_n_grow == 0) {
+        log_printf(0, "ERROR: never grew! concurrency=%d wait_p90=%d\n", st.concurrency, (int)st.wait_p90);
+        err++;
+    }
+
+    thread_pool_adaptive_disable(tpc);
+    thread_pool_destroy_context(tpc);
+
+    return(err);
+}
+
+//*************************************************************
+// test_cancel_all - Cancels a que with most of its ops still queued and
+//    then hammers gop_portal_cancel_all() while another thread creates
+//    and destroys contexts underneath it.
+//*************************************************************
+
+#define TEST_CANCEL_OPS 200
+
+atomic_int_t test_churn_done;
+
+op_status_t test_cancel_sleep(void *arg, int id)
+{
+    usleep(2000);
+    atomic_inc(test_ran);
+    return(op_success_status);
+}
+
+void *test_context_churn(apr_thread_t *th, void *arg)
+{
+    thread_pool_context_t *tpc;
+    int i;
+
+    for (i=0; i<100; i++) {
+        tpc = thread_pool_create_context("churn", 1, 2, 1);
+        thread_pool_destroy_context(tpc);
+    }
+    atomic_set(test_churn_done, 1);
+    return(NULL);
+}
+
+int test_cancel_all(thread_pool_context_t *tpc)
+{
+    opque_t *q;
+    int i, ran, err = 0;
+
+    atomic_set(test_ran, 0);
+    q = new_opque();
+    for (i=0; i<TEST_CANCEL_OPS; i++) opque_add(q, new_thread_pool_op(tpc, NULL, test_cancel_sleep, NULL, NULL, 1));
+    opque_start_execution(q);
+    usleep(5000);
+    opque_cancel(q);
+    if (opque_waitall(q) != OP_STATE_FAILURE) err++;
+    ran = atomic_get(test_ran);
+    if (ran == TEST_CANCEL_OPS) {
+        log_printf(0, "ERROR: Nothing was cancelled!\n");
+        err++;
+    }
+    if (opque_tasks_failed(q) != TEST_CANCEL_OPS - ran) {
+        log_printf(0, "ERROR: ran=%d failed=%d\n", ran, opque_tasks_failed(q));
+        err++;
+    }
+    opque_free(q, OP_DESTROY);
+
+    //** Now race the context list
+    atomic_set(test_churn_done, 0);
+    thread_pool_direct(tpc, test_context_churn, NULL);
+    q = new_opque();
+    while (atomic_get(test_churn_done) == 0) {
+        opque_cancel(q);
+    }
+    opque_free(q, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+// test_hp_cancel - Ops parked in an hportal que of a portal without its
+//    own cancel routine.  The hportal has no connections so nothing runs
+//    them and gop_cancel()/opque_cancel() have to pull them off the que.
+//*************************************************************
+
+typedef struct {
+    op_generic_t gop;
+    op_data_t dop;
+} test_hp_op_t;
+
+void *test_hp_dup_connect(void *connect_context)
+{
+    return(NULL);
+}
+
+void test_hp_destroy_connect(void *connect_context)
+{
+    return;
+}
+
+void test_hp_submit(void *arg, op_generic_t *gop)
+{
+    submit_hp_que_op((portal_context_t *)arg, gop);
+}
+
+portal_fn_t test_hp_fn = {
+    .dup_connect_context = test_hp_dup_connect,
+    .destroy_connect_context = test_hp_destroy_connect,
+    .submit = test_hp_submit
+};
+
+void test_hp_free(op_generic_t *gop, int mode)
+{
+    gop_generic_free(gop, OP_FINALIZE);
+    if (mode == OP_DESTROY) free(gop->free_ptr);
+}
+
+op_generic_t *test_hp_op(portal_context_t *hpc)
+{
+    test_hp_op_t *op;
+    op_generic_t *gop;
+
+    type_malloc_clear(op, test_hp_op_t, 1);
+    gop = &(op->gop);
+    gop_init(gop);
+    gop->type = Q_TYPE_OPERATION;
+    gop->op = &(op->dop);
+    gop->free_ptr = op;
+    gop->base.free = test_hp_free;
+    gop->base.pc = hpc;
+    op->dop.pc = hpc;
+    op->dop.cmd.hostport = "localhost:6714";
+    op->dop.cmd.workload = 1;
+
+    return(gop);
+}
+
+int test_hp_cancel(thread_pool_context_t *tpc)
+{
+    portal_context_t *hpc;
+    op_generic_t *gop;
+    opque_t *q;
+    int i, n, err = 0;
+
+    hpc = create_hportal_context(&test_hp_fn);
+    hpc->arg = hpc;
+    hpc->max_workload = 1;
+    hpc->compact_interval = 3600;
+    hportal_context_publish(hpc);
+
+    //** Single op via gop_cancel()
+    gop = test_hp_op(hpc);
+    gop_start_execution(gop);
+    if (gop_cancel(gop) != 1) err++;
+    if (gop_waitall(gop) != OP_STATE_FAILURE) err++;
+    if (gop_get_status(gop).error_code != OP_STATE_CANCELLED) err++;
+    gop_free(gop, OP_DESTROY);
+
+    //** A que via opque_cancel()
+    q = new_opque();
+    for (i=0; i<20; i++) opque_add(q, test_hp_op(hpc));
+    opque_start_execution(q);
+    n = opque_cancel(q);
+    if (n != 20) {
+        log_printf(0, "ERROR: cancelled %d expected 20\n", n);
+        err++;
+    }
+    opque_waitall(q);
+    if (opque_tasks_failed(q) != 20) err++;
+    opque_free(q, OP_DESTROY);
+
+    destroy_hportal_context(hpc);
+
+    return(err);
+}
+
+//*************************************************************
+// test_dummy_shards - Changing the worker count after startup has to
+//    be ignored and the gop_dummy ops still complete
+//*************************************************************
+
+int test_dummy_shards(thread_pool_context_t *tpc)
+{
+    opque_t *q;
+    int i, err = 0;
+
+    gop_dummy_shards_set(64);
+    q = new_opque();
+    for (i=0; i<256; i++) opque_add(q, gop_dummy(op_success_status));
+    if (opque_waitall(q) != OP_STATE_SUCCESS) err++;
+    opque_free(q, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+// test_host_id - The cached host ID follows the hostport contents
+//*************************************************************
+
+int test_host_id(thread_pool_context_t *tpc)
+{
+    command_op_t cmd;
+    char hostport[32];
+    int id_a, id_b, err = 0;
+
+    memset(&cmd, 0, sizeof(cmd));
+    if (gop_host_id(&cmd) != 0) err++;
+
+    strcpy(hostport, "gop_test_a:6714");
+    cmd.hostport = hostport;
+    id_a = gop_host_id(&cmd);
+    if (id_a == 0) err++;
+
+    strcpy(hostport, "gop_test_b:6714");  //** Changed in place
+    id_b = gop_host_id(&cmd);
+    if ((id_b == 0) || (id_b == id_a)) err++;
+
+    cmd.hostport = strdup("gop_test_a:6714");  //** New string with the old contents
+    if (gop_host_id(&cmd) != id_a) err++;
+    free(cmd.hostport);
+
+    cmd.hostport = NULL;
+    if (gop_host_id(&cmd) != 0) err++;
+
+    return(err);
+}
+
+//*************************************************************
+// test_coro_park - Coroutine ops waiting on an unfinished gop have to
+//    park without holding a pool thread and all resume once it's done.
+//*************************************************************
+
+#define TEST_CORO_OPS 64
+
+op_status_t test_gate(void *arg, int id)
+{
+    usleep(200000);
+    return(op_success_status);
+}
+
+op_status_t test_coro_wait(void *arg, int id)
+{
+    op_generic_t *gate = (op_generic_t *)arg;
+
+    if (gop_waitall(gate) != OP_STATE_SUCCESS) return(op_failure_status);
+    atomic_inc(test_ran);
+    return(op_success_status);
+}
+
+int test_coro_park(thread_pool_context_t *tpc)
+{
+    thread_pool_stats_t st;
+    op_generic_t *gate;
+    opque_t *q;
+    int i, err = 0;
+
+    atomic_set(test_ran, 0);
+    gate = new_thread_pool_op(tpc, NULL, test_gate, NULL, NULL, 1);
+    gop_start_execution(gate);
+
+    q = new_opque();
+    for (i=0; i<TEST_CORO_OPS; i++) opque_add(q, new_thread_pool_coro_op(tpc, NULL, test_coro_wait, gate, NULL, 1));
+    opque_start_execution(q);
+
+    //** Way more waiters than threads so they only all get going by parking
+    for (i=0; i<100; i++) {
+        thread_pool_stats_snapshot(tpc, &st);
+        if (st.n_coro_parked == TEST_CORO_OPS) break;
+        usleep(1000);
+    }
+    if (st.n_coro_parked != TEST_CORO_OPS) {
+        log_printf(0, "ERROR: Not all parked! parked=%d coro=%d\n", st.n_coro_parked, st.n_coro);
+        err++;
+    }
+
+    if (opque_waitall(q) != OP_STATE_SUCCESS) err++;
+    if (atomic_get(test_ran) != TEST_CORO_OPS) err++;
+    thread_pool_stats_snapshot(tpc, &st);
+    if (st.n_coro_parked != 0) err++;
+
+    opque_free(q, OP_DESTROY);
+    gop_free(gate, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+// test_pfor - Parallel for has to hit every index exactly once and a
+//    parallel reduce has to get the right sum with the grain picked
+//    for it and with small explicit grains.
+//*************************************************************
+
+#define TEST_PFOR_N 100003
+
+atomic_int_t *test_pfor_hits;
+
+void test_pfor_body(int64_t lo, int64_t hi, void *arg)
+{
+    int64_t i;
+
+    for (i=lo; i<hi; i++) atomic_inc(test_pfor_hits[i]);
+}
+
+void test_reduce_body(int64_t lo, int64_t hi, void *partial, void *arg)
+{
+    int64_t i;
+
+    for (i=lo; i<hi; i++) *(int64_t *)partial += i;
+}
+
+void test_reduce_combine(void *result, void *partial, void *arg)
+{
+    *(int64_t *)result += *(int64_t *)partial;
+}
+
+int test_pfor(thread_pool_context_t *tpc)
+{
+    op_generic_t *gop;
+    int64_t grain[3] = { 0, 1, 97 };
+    int64_t i, sum;
+    int g, err = 0;
+
+    type_malloc(test_pfor_hits, atomic_int_t, TEST_PFOR_N);
+    for (g=0; g<3; g++) {
+        memset(test_pfor_hits, 0, sizeof(atomic_int_t)*TEST_PFOR_N);
+        gop = tp_parallel_for(tpc, 0, TEST_PFOR_N, grain[g], test_pfor_body, NULL);
+        if (gop_waitall(gop) != OP_STATE_SUCCESS) err++;
+        gop_free(gop, OP_DESTROY);
+        for (i=0; i<TEST_PFOR_N; i++) {
+            if (atomic_get(test_pfor_hits[i]) != 1) {
+                log_printf(0, "ERROR: grain=%d i=%d hits=%d\n", (int)grain[g], (int)i, atomic_get(test_pfor_hits[i]));
+                err++;
+                break;
+            }
+        }
+
+        sum = 0;
+        gop = tp_parallel_reduce(tpc, 0, TEST_PFOR_N, grain[g], test_reduce_body, test_reduce_combine, NULL, &sum, sizeof(sum));
+        if (gop_waitall(gop) != OP_STATE_SUCCESS) err++;
+        gop_free(gop, OP_DESTROY);
+        if (sum != (int64_t)TEST_PFOR_N*(TEST_PFOR_N-1)/2) {
+            log_printf(0, "ERROR: grain=%d sum=%ld\n", (int)grain[g], (long)sum);
+            err++;
+        }
+    }
+    free(test_pfor_hits);
+
+    return(err);
+}
+
+//*************************************************************
+// test_ws_steal - Tasks a worker pushes go on its own deque.  The
+//    other workers have to steal them.
+//*************************************************************
+
+#define TEST_STEAL_TASKS 200
+
+typedef struct {
+    thread_pool_context_t *tpc;
+    atomic_int_t n_done;
+    atomic_int_t ran_on[64];   //** Tasks each worker ran
+} test_steal_t;
+
+void *test_steal_task(apr_thread_t *th, void *arg)
+{
+    test_steal_t *ts = (test_steal_t *)arg;
+    tp_ws_worker_t *w;
+
+    usleep(500);
+    w = tp_ws_current_worker(ts->tpc->ws);
+    if ((w != NULL) && (w->id < 64)) atomic_inc(ts->ran_on[w->id]);
+    atomic_inc(ts->n_done);
+    return(NULL);
+}
+
+void *test_steal_spawn(apr_thread_t *th, void *arg)
+{
+    test_steal_t *ts = (test_steal_t *)arg;
+    void *args[TEST_STEAL_TASKS];
+    int i;
+
+    for (i=0; i<TEST_STEAL_TASKS; i++) args[i] = ts;
+    thread_pool_direct_batch(ts->tpc, test_steal_task, args, TEST_STEAL_TASKS);
+    return(NULL);
+}
+
+int test_ws_steal(thread_pool_context_t *unused)
+{
+    test_steal_t ts;
+    int i, n_workers, err = 0;
+
+    memset(&ts, 0, sizeof(ts));
+    ts.tpc = thread_pool_create_context_ex("ws_steal", 4, 4, 1, TP_EXEC_WS);
+
+    thread_pool_direct(ts.tpc, test_steal_spawn, &ts);
+    for (i=0; (i<5000) && (atomic_get(ts.n_done) < TEST_STEAL_TASKS); i++) usleep(1000);
+    if (atomic_get(ts.n_done) != TEST_STEAL_TASKS) {
+        log_printf(0, "ERROR: Only %d tasks ran\n", atomic_get(ts.n_done));
+        err++;
+    }
+
+    n_workers = 0;
+    for (i=0; i<64; i++) {
+        if (atomic_get(ts.ran_on[i]) > 0) n_workers++;
+    }
+    if ((atomic_get(ts.tpc->ws->n_steals) == 0) || (n_workers < 2)) {
+        log_printf(0, "ERROR: Nothing stolen! steals=%d n_workers=%d\n", atomic_get(ts.tpc->ws->n_steals), n_workers);
+        err++;
+    }
+
+    thread_pool_destroy_context(ts.tpc);
+
+    return(err);
+}
+
+//*************************************************************
+// test_ws_lanes - With every worker held up, HIGH tasks queued after
+//    LOW ones have to be started first once they're let go.
+//*************************************************************
+
+#define TEST_LANE_TASKS 8
+
+typedef struct {
+    atomic_int_t n_gated;
+    atomic_int_t open;
+    atomic_int_t seq;
+    int low_seq[TEST_LANE_TASKS];
+    int high_seq[TEST_LANE_TASKS];
+} test_lanes_t;
+
+test_lanes_t test_lanes;
+
+void *test_lane_gate(apr_thread_t *th, void *arg)
+{
+    atomic_inc(test_lanes.n_gated);
+    while (atomic_get(test_lanes.open) == 0) usleep(1000);
+    return(NULL);
+}
+
+void *test_lane_low(apr_thread_t *th, void *arg)
+{
+    test_lanes.low_seq[(intptr_t)arg] = atomic_inc(test_lanes.seq);
+    return(NULL);
+}
+
+void *test_lane_high(apr_thread_t *th, void *arg)
+{
+    test_lanes.high_seq[(intptr_t)arg] = atomic_inc(test_lanes.seq);
+    return(NULL);
+}
+
+int test_ws_lanes(thread_pool_context_t *unused)
+{
+    thread_pool_context_t *tpc;
+    int i, n_base, last_high, n_early, err = 0;
+
+    memset(&test_lanes, 0, sizeof(test_lanes));
+    tpc = thread_pool_create_context_ex("ws_lanes", 4, 4, 1, TP_EXEC_WS);
+    n_base = tpc->ws->n_base;
+
+    //** Tie up all the workers
+    for (i=0; i<n_base; i++) thread_pool_direct(tpc, test_lane_gate, NULL);
+    for (i=0; (i<5000) && (atomic_get(test_lanes.n_gated) < n_base); i++) usleep(1000);
+    if (atomic_get(test_lanes.n_gated) != n_base) err++;
+
+    for (i=0; i<TEST_LANE_TASKS; i++) thread_pool_direct_priority(tpc, OP_PRIORITY_LOW, test_lane_low, (void *)(intptr_t)i);
+    for (i=0; i<TEST_LANE_TASKS; i++) thread_pool_direct_priority(tpc, OP_PRIORITY_HIGH, test_lane_high, (void *)(intptr_t)i);
+    atomic_set(test_lanes.open, 1);
+
+    for (i=0; (i<5000) && (atomic_get(test_lanes.seq) < 2*TEST_LANE_TASKS); i++) usleep(1000);
+    if (atomic_get(test_lanes.seq) != 2*TEST_LANE_TASKS) err++;
+
+    //** The recording races the pick so allow one LOW per worker to sneak in
+    last_high = 0;
+    for (i=0; i<TEST_LANE_TASKS; i++) {
+        if (test_lanes.high_seq[i] > last_high) last_high = test_lanes.high_seq[i];
+    }
+    n_early = 0;
+    for (i=0; i<TEST_LANE_TASKS; i++) {
+        if (test_lanes.low_seq[i] < last_high) n_early++;
+    }
+    if (n_early >= n_base) {
+        log_printf(0, "ERROR: %d LOW tasks started before the last HIGH one\n", n_early);
+        err++;
+    }
+
+    thread_pool_destroy_context(tpc);
+
+    return(err);
+}
+
+test_case_t test_cases[] = {
+    { "dep_fail_op", test_dep_fail_op },
+    { "dep_fail_que", test_dep_fail_que },
+    { "dep_fanin", test_dep_fanin },
+    { "que_poll", test_que_poll },
+    { "que_wide", test_que_wide },
+    { "atomic_free", test_atomic_free },
+    { "dummy_direct", test_dummy_direct },
+    { "dummy_cancel", test_dummy_cancel },
+    { "adapt_direct", test_adapt_direct },
+    { "adapt_ops", test_adapt_ops },
+    { "cancel_all", test_cancel_all },
+    { "hp_cancel", test_hp_cancel },
+    { "dummy_shards", test_dummy_shards },
+    { "host_id", test_host_id },
+    { "coro_park", test_coro_park },
+    { "pfor", test_pfor },
+    { "ws_steal", test_ws_steal },
+    { "ws_lanes", test_ws_lanes },
+    { NULL, NULL }
+};
+
+//*************************************************************
+//*************************************************************
+
+int main(int argc, char **argv)
+{
+    int i, start_option, nfailed, err;
+    char *only;
+    test_case_t *tc;
+    thread_pool_context_t *tpc;
+
+    only = NULL;
+    i = 1;
+    while (i < argc) {
+        start_option = i;
+
+        if (strcmp(argv[i], "-d") == 0) { //** Enable debugging
+            i++;
+            set_log_level(atol(argv[i]));
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0) { //** Single case
+            i++;
+            only = argv[i];
+            i++;
+        } else if (strcmp(argv[i], "-h") == 0) { //** Print help
+            printf("gop_test [-d log_level] [-c case]\n");
+            printf("   Set GOP_TP_EXECUTOR=apr|ws to pick the thread pool executor\n");
+            printf("\n");
+            printf("Cases:");
+            for (tc = test_cases; tc->name != NULL; tc++) printf(" %s", tc->name);
+            printf("\n");
+            return(0);
+        }
+
+        if (start_option == i) break;
+    }
+
+    apr_wrapper_start();
+    init_opque_system();
+
+    tpc = thread_pool_create_context("gop_test", 4, 4, 8);
+
+    nfailed = 0;
+    for (tc = test_cases; tc->name != NULL; tc++) {
+        if ((only != NULL) && (strcmp(only, tc->name) != 0)) continue;
+        err = tc->fn(tpc);
+        printf("TEST: %s = %s", tc->name, (err == 0) ? "PASS\n" : "FAIL");
+        if (err != 0) {
+            printf(" errors=%d\n", err);
+            nfailed++;
+        }
+        fflush(stdout);
+    }
+
+    thread_pool_destroy_context(tpc);
+
+    destroy_opque_system();
+    apr_wrapper_stop();
+
+    printf("%s: %d failed\n", (nfailed == 0) ? "PASS" : "FAIL", nfailed);
+    return(nfailed);
+}
@@ -0,0 +1,352 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// gop_trace.c - Binary tracepoints.
+//
+//  Each thread records into its own ring so recording is just a couple
+//  of stores and an atomic increment with no locking or formatting.  A
+//  background dumper drains all the rings periodically and appends the
+//  raw records to the trace file.  If a ring fills before the dumper
+//  gets to it the new records are dropped and counted rather than
+//  blocking the caller.  gop_trace_decode() turns a trace file into text.
+//
+//  Rings are never freed since a thread may still be recording into one
+//  when tracing is stopped.  Rings from exited threads are parked on an
+//  orphan list and adopted by the next thread needing one.
+//*************************************************************
+
+#define _log_module_index 130
+
+#include <stdlib.h>
+#include <string.h>
+#include <apr_pools.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
+#include "assert_result.h"
+#include "type_malloc.h"
+#include "log.h"
+#include "fmttypes.h"
+#include "atomic_counter.h"
+#include "apr_wrapper.h"
+#include "gop_trace.h"
+
+typedef struct gop_trace_ring_s gop_trace_ring_t;
+
+struct gop_trace_ring_s {  //** Per thread ring
+    gop_trace_rec_t *rec;
+    apr_uint32_t mask;
+    apr_uint32_t tid;
+    atomic_int_t head;        //** Next slot to write.  Only changed by the owner
+    atomic_int_t tail;        //** Next slot to dump.  Only changed by the dumper
+    atomic_int_t n_dropped;   //** Records lost cause the ring was full
+    gop_trace_ring_t *next_all;
+    gop_trace_ring_t *next_orphan;
+};
+
+int _gop_trace_enabled = 0;
+
+static apr_pool_t *_trace_pool = NULL;
+static apr_thread_mutex_t *_trace_lock = NULL;
+static apr_thread_cond_t *_trace_cond = NULL;
+static apr_threadkey_t *_trace_key = NULL;
+static apr_thread_t *_trace_thread = NULL;
+static gop_trace_ring_t *_trace_all = NULL;
+static gop_trace_ring_t *_trace_orphans = NULL;
+static FILE *_trace_fd = NULL;
+static apr_interval_time_t _trace_dt = 0;
+static apr_uint32_t _trace_ring_size = GOP_TRACE_RING_SIZE;
+static apr_uint32_t _trace_next_tid = 0;
+static int _trace_shutdown = 0;
+
+static const char *_trace_names[GOP_TP_MAX] = {
+    "UNKNOWN", "OP_START", "OP_DONE", "QUE_DONE", "TP_EXEC", "TP_EXEC_END", "MQ_SEND", "MQ_RECV"
+};
+
+//*************************************************************
+// _trace_ring_orphan - Called on thread exit to park the thread's ring
+//*************************************************************
+
+void _trace_ring_orphan(void *arg)
+{
+    gop_trace_ring_t *ring = (gop_trace_ring_t *)arg;
+
+    apr_thread_mutex_lock(_trace_lock);
+    ring->next_orphan = _trace_orphans;
+    _trace_orphans = ring;
+    apr_thread_mutex_unlock(_trace_lock);
+}
+
+//*************************************************************
+// _trace_ring_get - Returns the calling thread's ring creating it if needed
+//*************************************************************
+
+gop_trace_ring_t *_trace_ring_get()
+{
+    gop_trace_ring_t *ring = NULL;
+
+    apr_threadkey_private_get((void *)&ring, _trace_key);
+    if (ring != NULL) return(ring);
+
+    apr_thread_mutex_lock(_trace_lock);
+    if (_trace_orphans != NULL) {  //** Adopt an orphan if available
+        ring = _trace_orphans;
+        _trace_orphans = ring->next_orphan;
+        ring->next_orphan = NULL;
+    } else {
+        type_malloc_clear(ring, gop_trace_ring_t, 1);
+        type_malloc(ring->rec, gop_trace_rec_t, _trace_ring_size);
+        ring->mask = _trace_ring_size - 1;
+        ring->tid = _trace_next_tid++;
+        ring->next_all = _trace_all;
+        _trace_all = ring;
+    }
+    apr_thread_mutex_unlock(_trace_lock);
+
+    apr_threadkey_private_set(ring, _trace_key);
+
+    return(ring);
+}
+
+//*************************************************************
+// _gop_trace_record - Records a tracepoint.  Use the gop_trace() macro
+//    instead so nothing is done unless tracing is enabled.
+//*************************************************************
+
+void _gop_trace_record(int id, apr_int64_t a, apr_int64_t b)
+{
+    gop_trace_ring_t *ring;
+    gop_trace_rec_t *r;
+    apr_uint32_t h;
+
+    ring = _trace_ring_get();
+
+    h = atomic_get(ring->head);
+    if ((apr_uint32_t)(h - atomic_get(ring->tail)) > ring->mask) {  //** Full so drop it
+        atomic_inc(ring->n_dropped);
+        return;
+    }
+
+    r = ring->rec + (h & ring->mask);
+    r->time = apr_time_now();
+    r->tid = ring->tid;
+    r->id = id;
+    r->a = a;
+    r->b = b;
+
+    atomic_inc(ring->head);  //** Publish it
+}
+
+//*************************************************************
+// _trace_drain - Writes everything in the rings to the trace file
+//    NOTE: _trace_lock should be held
+//*************************************************************
+
+void _trace_drain()
+{
+    gop_trace_ring_t *ring;
+    apr_uint32_t h, t, n, first, chunk;
+
+    for (ring = _trace_all; ring != NULL; ring = ring->next_all) {
+        t = atomic_get(ring->tail);
+        h = atomic_get(ring->head);
+        n = h - t;
+        if (n == 0) continue;
+
+        first = t & ring->mask;
+        chunk = ring->mask + 1 - first;
+        if (chunk > n) chunk = n;
+        fwrite(ring->rec + first, sizeof(gop_trace_rec_t), chunk, _trace_fd);
+        if (chunk < n) fwrite(ring->rec, sizeof(gop_trace_rec_t), n - chunk, _trace_fd);
+
+        atomic_set(ring->tail, h);  //** Hand the slots back
+    }
+
+    fflush(_trace_fd);
+}
+
+//*************************************************************
+// _trace_dumper_thread - Periodically drains the rings
+//*************************************************************
+
+void *_trace_dumper_thread(apr_thread_t *th, void *arg)
+{
+    apr_thread_mutex_lock(_trace_lock);
+    while (_trace_shutdown == 0) {
+        apr_thread_cond_timedwait(_trace_cond, _trace_lock, _trace_dt);
+        _trace_drain();
+    }
+    apr_thread_mutex_unlock(_trace_lock);
+
+    return(NULL);
+}
+
+//*************************************************************
+// gop_trace_start - Starts recording tracepoints to fname.  ring_size is
+//    the number of records buffered per thread and dt is how often the
+//    rings are dumped.  Use 0 for the defaults.  Returns 0 on success.
+//*************************************************************
+
+int gop_trace_start(const char *fname, int ring_size, apr_interval_time_t dt)
+{
+    gop_trace_hdr_t hdr;
+    apr_status_t err;
+    apr_uint32_t n;
+
+    if (_trace_pool == NULL) {
+        assert_result(apr_pool_create(&_trace_pool, NULL), APR_SUCCESS);
+        apr_thread_mutex_create(&_trace_lock, APR_THREAD_MUTEX_DEFAULT, _trace_pool);
+        apr_thread_cond_create(&_trace_cond, _trace_pool);
+        apr_threadkey_private_create(&_trace_key, _trace_ring_orphan, _trace_pool);
+    }
+
+    if (_trace_fd != NULL) {
+        log_printf(0, "ERROR tracing already started!\n");
+        return(1);
+    }
+
+    _trace_fd = fopen(fname, "w");
+    if (_trace_fd == NULL) {
+        log_printf(0, "ERROR unable to open trace file %s\n", fname);
+        return(1);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, GOP_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = GOP_TRACE_VERSION;
+    hdr.rec_size = sizeof(gop_trace_rec_t);
+    fwrite(&hdr, sizeof(hdr), 1, _trace_fd);
+
+    //** Only new rings pick up the size
+    if (ring_size <= 0) ring_size = GOP_TRACE_RING_SIZE;
+    for (n=16; n<(apr_uint32_t)ring_size; n <<= 1) {}
+    _trace_ring_size = n;
+    _trace_dt = (dt > 0) ? dt : apr_time_from_msec(100);
+    _trace_shutdown = 0;
+
+    thread_create_warn(err, &_trace_thread, NULL, _trace_dumper_thread, NULL, _trace_pool);
+
+    log_printf(1, "Tracing to %s ring_size=%u\n", fname, _trace_ring_size);
+    _gop_trace_enabled = 1;
+
+    return(0);
+}
+
+//*************************************************************
+// gop_trace_stop - Stops tracing and flushes anything left to the file
+//*************************************************************
+
+void gop_trace_stop()
+{
+    apr_status_t val;
+
+    if (_trace_fd == NULL) return;
+
+    _gop_trace_enabled = 0;
+
+    apr_thread_mutex_lock(_trace_lock);
+    _trace_shutdown = 1;
+    apr_thread_cond_signal(_trace_cond);
+    apr_thread_mutex_unlock(_trace_lock);
+    apr_thread_join(&val, _trace_thread);
+
+    apr_thread_mutex_lock(_trace_lock);
+    _trace_drain();
+    fclose(_trace_fd);
+    _trace_fd = NULL;
+    apr_thread_mutex_unlock(_trace_lock);
+
+    log_printf(1, "Tracing stopped.  dropped=" LU "\n", gop_trace_dropped());
+}
+
+//*************************************************************
+// gop_trace_dropped - Returns the number of records dropped cause a
+//    ring was full
+//*************************************************************
+
+apr_uint64_t gop_trace_dropped()
+{
+    gop_trace_ring_t *ring;
+    apr_uint64_t n;
+
+    if (_trace_lock == NULL) return(0);
+
+    n = 0;
+    apr_thread_mutex_lock(_trace_lock);
+    for (ring = _trace_all; ring != NULL; ring = ring->next_all) n += atomic_get(ring->n_dropped);
+    apr_thread_mutex_unlock(_trace_lock);
+
+    return(n);
+}
+
+//*************************************************************
+// gop_trace_name - Returns the tracepoint's name
+//*************************************************************
+
+const char *gop_trace_name(int id)
+{
+    if ((id <= 0) || (id >= GOP_TP_MAX)) return((id >= GOP_TP_USER) ? "USER" : _trace_names[0]);
+    return(_trace_names[id]);
+}
+
+//*************************************************************
+// gop_trace_decode - Prints the trace file as text to fd.  Each ring is
+//    dumped in order but records from different threads are interleaved
+//    by dump pass so sort on the time column if needed.
+//    Returns 0 on success.
+//*************************************************************
+
+int gop_trace_decode(const char *fname, FILE *fd)
+{
+    FILE *in;
+    gop_trace_hdr_t hdr;
+    gop_trace_rec_t r;
+
+    in = fopen(fname, "r");
+    if (in == NULL) {
+        log_printf(0, "ERROR unable to open trace file %s\n", fname);
+        return(1);
+    }
+
+    if ((fread(&hdr, sizeof(hdr), 1, in) != 1) || (memcmp(hdr.magic, GOP_TRACE_MAGIC, sizeof(hdr.magic)) != 0) ||
+            (hdr.version != GOP_TRACE_VERSION) || (hdr.rec_size != sizeof(gop_trace_rec_t))) {
+        log_printf(0, "ERROR invalid trace file %s\n", fname);
+        fclose(in);
+        return(1);
+    }
+
+    fprintf(fd, "#time_us tid tracepoint id a b\n");
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        fprintf(fd, TT " %u %s %u " I64T " " I64T "\n", r.time, r.tid, gop_trace_name(r.id), r.id, r.a, r.b);
+    }
+
+    fclose(in);
+    return(0);
+}
@@ -0,0 +1,104 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// gop_trace.h - Compile time log gating for the hot paths and
+//     binary tracepoints recorded into per-thread rings
+//*************************************************************
+
+#include <stdio.h>
+#include <apr_time.h>
+#include "log.h"
+
+#ifndef __GOP_TRACE_H_
+#define __GOP_TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//** Log calls in the hot paths above this level are compiled out.  Set via
+//** the GOP_LOG_LEVEL_MAX cmake option.  The runtime log level still applies.
+#ifndef GOP_LOG_LEVEL_MAX
+#define GOP_LOG_LEVEL_MAX 20
+#endif
+
+#define gop_log_printf(n, ...) do { if ((n) <= GOP_LOG_LEVEL_MAX) log_printf(n, __VA_ARGS__); } while (0)
+#define gop_flush_log() do { if ((GOP_LOG_LEVEL_MAX > 0) && (log_level() > 0)) flush_log(); } while (0)
+
+//** Built in tracepoints.  Applications can use anything from GOP_TP_USER on up
+#define GOP_TP_OP_START     1  //** a=gid b=type
+#define GOP_TP_OP_DONE      2  //** a=gid b=op_status
+#define GOP_TP_QUE_DONE     3  //** a=qid b=op_status or -1 if no callbacks
+#define GOP_TP_TP_EXEC      4  //** a=gid b=depth
+#define GOP_TP_TP_EXEC_END  5  //** a=gid b=op_status
+#define GOP_TP_MQ_SEND      6  //** a=nframes b=bytes
+#define GOP_TP_MQ_RECV      7  //** a=nframes b=bytes
+#define GOP_TP_MAX          8
+#define GOP_TP_USER         1000
+
+#define GOP_TRACE_MAGIC   "GOPTRACE"
+#define GOP_TRACE_VERSION 1
+#define GOP_TRACE_RING_SIZE 4096  //** Default records per thread.  Rounded up to a power of 2
+
+typedef struct {         //** Trace file header.  The records follow it
+    char magic[8];
+    apr_uint32_t version;
+    apr_uint32_t rec_size;
+} gop_trace_hdr_t;
+
+typedef struct {         //** A single trace record
+    apr_time_t time;       //** When it was recorded
+    apr_uint32_t tid;      //** Ring/thread id
+    apr_uint32_t id;       //** Tracepoint
+    apr_int64_t a;         //** Tracepoint arguments
+    apr_int64_t b;
+} gop_trace_rec_t;
+
+extern int _gop_trace_enabled;
+
+#ifdef GOP_TRACE_DISABLE
+#define gop_trace(id, a, b)
+#else
+#define gop_trace(id, a, b) do { if (_gop_trace_enabled) _gop_trace_record(id, (apr_int64_t)(a), (apr_int64_t)(b)); } while (0)
+#endif
+
+void _gop_trace_record(int id, apr_int64_t a, apr_int64_t b);
+int gop_trace_start(const char *fname, int ring_size, apr_interval_time_t dt);
+void gop_trace_stop();
+apr_uint64_t gop_trace_dropped();
+const char *gop_trace_name(int id);
+int gop_trace_decode(const char *fname, FILE *fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
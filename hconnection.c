@@ -309,6 +309,7 @@ void *hc_send_thread(apr_thread_t *th, void *data)
             if (stack_size(hc->pending_stack) == 0) atomic_set(hop->on_top, 1);
             unlock_hc(hc);
 
+            gop_timestamp(hsop, GOP_TS_SEND);
             finished = (hop->send_command != NULL) ? hop->send_command(hsop, ns) : op_success_status;
             log_printf(5, "hc_send_thread: after send command.. ns=%d gid=%d finisehd=%d\n", ns_getid(ns), gop_id(hsop), finished.op_status);
             if (finished.op_status == OP_STATE_SUCCESS) {
@@ -446,6 +447,7 @@ void *hc_recv_thread(apr_thread_t *th, void *data)
             }
 
             log_printf(5, "hc_recv_thread: before recv phase.. ns=%d gid=%d\n", ns_getid(ns), gop_id(hsop));
+            gop_timestamp(hsop, GOP_TS_FIRST_BYTE);  //** The recv_phase can restamp this once data actually arrives
             status = (hop->recv_phase != NULL) ? hop->recv_phase(hsop, ns) : op_success_status;
             hop->end_time = apr_time_now();
             log_printf(5, "hc_recv_thread: after recv phase.. ns=%d gid=%d finished=%d\n", ns_getid(ns), gop_id(hsop), status.op_status);
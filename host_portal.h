@@ -53,6 +53,7 @@ extern "C" {
  
 typedef struct {       //** Contains information about the depot including all connections
 char skey[512];         //** Search key used for lookups its "host:port:type:..." Same as for the op
+int host_id;            //** Interned skey.  Used for the fast lookups
 char host[512];         //** Hostname
 int oops_neg;           //** All the oops are just for tracking down a bug and should be removed once it's found and fixed.
 int oops_check;
@@ -132,6 +133,8 @@ void modify_hpc_thread_count(portal_context_t *hpc, int n);
 host_portal_t *create_hportal(portal_context_t *hpc, void *connect_context, char *hostport, int min_conn, int max_conn, apr_time_t dt_connect);
 portal_context_t *create_hportal_context(portal_fn_t *hpi);
 void destroy_hportal_context(portal_context_t *hpc);
+void hportal_context_publish(portal_context_t *hpc);
+void hportal_context_unpublish(portal_context_t *hpc);
 void finalize_hportal_context(portal_context_t *hpc);
 void shutdown_hportal(portal_context_t *hpc);
 void compact_dportals(portal_context_t *hpc);
@@ -141,6 +144,7 @@ void check_hportal_connections(host_portal_t *hp);
 int submit_hp_direct_op(portal_context_t *hpc, op_generic_t *op);
 int submit_hportal(host_portal_t *dp, op_generic_t *op, int addtotop, int release_master);
 int submit_hp_que_op(portal_context_t *hpc, op_generic_t *op);
+int hportal_cancel_ops(portal_context_t *hpc, op_generic_t *gop);
  
 //** Routines for hconnection.c
 #define trylock_hc(a) apr_thread_mutex_trylock(a->lock)
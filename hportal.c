@@ -45,6 +45,215 @@ http://www.accre.vanderbilt.edu
 #include "log.h"
 #include "string_token.h"
 
+//** Process wide hostport intern table
+static atomic_int_t _hp_intern_counter = 0;
+static apr_pool_t *_hp_intern_pool = NULL;
+static apr_thread_mutex_t *_hp_intern_lock = NULL;
+static apr_hash_t *_hp_intern_table = NULL;
+static char **_hp_intern_name = NULL;
+static int _hp_intern_n = 0;
+static int _hp_intern_max = 0;
+
+//** All the portal contexts.  Used by gop_portal_cancel_all() and gop_portal_help()
+static apr_thread_mutex_t *_hp_context_lock = NULL;
+static apr_thread_cond_t *_hp_context_cond = NULL;
+static Stack_t *_hp_context_list = NULL;
+
+//***************************************************************************
+// gop_hostport_init - Creates the hostport intern table
+//***************************************************************************
+
+void gop_hostport_init()
+{
+    if (atomic_inc(_hp_intern_counter) != 0) return;
+
+    assert_result(apr_pool_create(&_hp_intern_pool, NULL), APR_SUCCESS);
+    apr_thread_mutex_create(&_hp_intern_lock, APR_THREAD_MUTEX_DEFAULT, _hp_intern_pool);
+    _hp_intern_table = apr_hash_make(_hp_intern_pool);
+    _hp_intern_n = 1;  //** 0 is reserved for no host
+    _hp_intern_max = 64;
+    type_malloc_clear(_hp_intern_name, char *, _hp_intern_max);
+
+    apr_thread_mutex_create(&_hp_context_lock, APR_THREAD_MUTEX_DEFAULT, _hp_intern_pool);
+    apr_thread_cond_create(&_hp_context_cond, _hp_intern_pool);
+    _hp_context_list = new_stack();
+}
+
+//***************************************************************************
+// gop_hostport_destroy - Destroys the intern table.  All IDs are invalid after this.
+//***************************************************************************
+
+void gop_hostport_destroy()
+{
+    int i;
+
+    if (atomic_dec(_hp_intern_counter) != 0) return;
+
+    for (i=1; i<_hp_intern_n; i++) free(_hp_intern_name[i]);
+    free(_hp_intern_name);
+    _hp_intern_name = NULL;
+    _hp_intern_n = _hp_intern_max = 0;
+    free_stack(_hp_context_list, 0);
+    _hp_context_list = NULL;
+    apr_pool_destroy(_hp_intern_pool);
+}
+
+//***************************************************************************
+// gop_hostport_intern - Returns the unique ID for the hostport creating it
+//    if needed.  IDs are small, dense and never reused so they can be used
+//    to index tables directly.
+//***************************************************************************
+
+int gop_hostport_intern(const char *hostport)
+{
+    char *key;
+    int id;
+
+    apr_thread_mutex_lock(_hp_intern_lock);
+    id = (int)(intptr_t)apr_hash_get(_hp_intern_table, hostport, APR_HASH_KEY_STRING);
+    if (id == 0) {
+        if (_hp_intern_n == _hp_intern_max) {
+            _hp_intern_max *= 2;
+            _hp_intern_name = (char **)realloc(_hp_intern_name, sizeof(char *)*_hp_intern_max);
+            assert(_hp_intern_name != NULL);
+        }
+
+        id = _hp_intern_n++;
+        key = strdup(hostport);
+        _hp_intern_name[id] = key;
+        apr_hash_set(_hp_intern_table, key, APR_HASH_KEY_STRING, (void *)(intptr_t)id);
+        log_printf(15, "New hostport id=%d hostport=%s\n", id, hostport);
+    }
+    apr_thread_mutex_unlock(_hp_intern_lock);
+
+    return(id);
+}
+
+//***************************************************************************
+// gop_hostport_name - Returns the hostport for the ID or NULL if unknown
+//***************************************************************************
+
+const char *gop_hostport_name(int id)
+{
+    const char *name;
+
+    apr_thread_mutex_lock(_hp_intern_lock);
+    name = ((id > 0) && (id < _hp_intern_n)) ? _hp_intern_name[id] : NULL;
+    apr_thread_mutex_unlock(_hp_intern_lock);
+
+    return(name);
+}
+
+//***************************************************************************
+// gop_host_id - Returns the command's host ID interning the hostport the
+//    first time it's used.  Commands without a hostport get 0.  The cached
+//    ID is checked against the interned name so changing the hostport,
+//    in place or by pointing it at a new string, is always caught.
+//***************************************************************************
+
+int gop_host_id(command_op_t *cmd)
+{
+    if (cmd->hostport == NULL) {
+        cmd->host_id = 0;
+        cmd->host_id_src = NULL;
+    } else if ((cmd->host_id_src == NULL) || (strcmp(cmd->host_id_src, cmd->hostport) != 0)) {
+        cmd->host_id = gop_hostport_intern(cmd->hostport);
+        cmd->host_id_src = gop_hostport_name(cmd->host_id);
+    }
+
+    return(cmd->host_id);
+}
+
+//***************************************************************************
+// gop_portal_cancel - Cancels the queued ops for the op, or the que's
+//    descendants, in the portal context.  Uses the portal's cancel routine
+//    if it has one and otherwise pulls them off the context's hportal ques.
+//    Returns the number of ops cancelled.
+//***************************************************************************
+
+int gop_portal_cancel(portal_context_t *hpc, op_generic_t *gop)
+{
+    if (hpc->fn->cancel != NULL) return(hpc->fn->cancel(hpc->arg, gop));
+    if (hpc->table == NULL) return(0);  //** Static context like the gop_dummy one without any hportals
+    return(hportal_cancel_ops(hpc, gop));
+}
+
+//***************************************************************************
+// gop_portal_cancel_all - Calls gop_portal_cancel() on every portal
+//    context for the op or que.  Returns the number of ops cancelled.
+//***************************************************************************
+
+int gop_portal_cancel_all(op_generic_t *gop)
+{
+    portal_context_t **pcs, *hpc;
+    int i, n, ncancel;
+
+    if (_hp_context_list == NULL) return(0);  //** No portals so nothing to cancel
+
+    //** Snapshot the list since the cancel routines complete ops which
+    //** could make or destroy contexts.  Each context is marked busy so
+    //** hportal_context_unpublish() waits for us before it can go away.
+    apr_thread_mutex_lock(_hp_context_lock);
+    n = stack_size(_hp_context_list);
+    type_malloc(pcs, portal_context_t *, n+1);
+    i = 0;
+    move_to_top(_hp_context_list);
+    while ((hpc = (portal_context_t *)get_ele_data(_hp_context_list)) != NULL) {
+        hpc->n_busy++;
+        pcs[i] = hpc;
+        i++;
+        move_down(_hp_context_list);
+    }
+    apr_thread_mutex_unlock(_hp_context_lock);
+
+    ncancel = 0;
+    for (i=0; i<n; i++) {
+        ncancel += gop_portal_cancel(pcs[i], gop);
+    }
+
+    apr_thread_mutex_lock(_hp_context_lock);
+    for (i=0; i<n; i++) {
+        pcs[i]->n_busy--;
+    }
+    apr_thread_cond_broadcast(_hp_context_cond);
+    apr_thread_mutex_unlock(_hp_context_lock);
+    free(pcs);
+
+    log_printf(15, "gid=%d ncancel=%d\n", gop_id(gop), ncancel);
+    return(ncancel);
+}
+
+//***************************************************************************
+// gop_portal_help - Asks each portal context supporting it for a queued op
+//    that's the gop or one of its descendants.  The op is removed from the
+//    portal and returned for the caller to run with the portal's sync_exec.
+//    The help routines only pull the op off their queues so they are called
+//    with the list locked.  Returns NULL if nothing is available.
+//***************************************************************************
+
+op_generic_t *gop_portal_help(op_generic_t *gop)
+{
+    portal_context_t *hpc;
+    op_generic_t *hop;
+
+    if (_hp_context_list == NULL) return(NULL);
+
+    hop = NULL;
+    apr_thread_mutex_lock(_hp_context_lock);
+    move_to_top(_hp_context_list);
+    while ((hpc = (portal_context_t *)get_ele_data(_hp_context_list)) != NULL) {
+        if (hpc->fn->help != NULL) {
+            hop = hpc->fn->help(hpc->arg, gop);
+            if (hop != NULL) break;
+        }
+        move_down(_hp_context_list);
+    }
+    apr_thread_mutex_unlock(_hp_context_lock);
+
+    if (hop != NULL) log_printf(15, "gid=%d helping with gid=%d\n", gop_id(gop), gop_id(hop));
+    return(hop);
+}
+
 //***************************************************************************
 //  hportal_wait - Waits up to the specified time for the condition
 //***************************************************************************
@@ -137,6 +346,7 @@ host_portal_t *create_hportal(portal_context_t *hpc, void *connect_context, char
 
     hp->port = port;
     snprintf(hp->skey, sizeof(hp->skey), "%s", hostport);
+    hp->host_id = gop_hostport_intern(hostport);
     hp->connect_context = hpc->fn->dup_connect_context(connect_context);
 
     hp->context = hpc;
@@ -241,6 +451,50 @@ host_portal_t *_lookup_hportal(portal_context_t *hpc, char *hostport)
     return(hp);
 }
 
+//************************************************************************
+// _lookup_hportal_id - Same as _lookup_hportal() but uses the host ID
+//    NOTE: hpc->lock should be held
+//************************************************************************
+
+host_portal_t *_lookup_hportal_id(portal_context_t *hpc, int host_id)
+{
+    if (host_id >= hpc->id_table_size) return(NULL);
+    return((host_portal_t *)hpc->id_table[host_id]);
+}
+
+//************************************************************************
+// _hportal_table_add - Adds the hportal to the context's tables
+//    NOTE: hpc->lock should be held
+//************************************************************************
+
+void _hportal_table_add(portal_context_t *hpc, host_portal_t *hp)
+{
+    int n;
+
+    apr_hash_set(hpc->table, hp->skey, APR_HASH_KEY_STRING, (const void *)hp);
+
+    if (hp->host_id >= hpc->id_table_size) {
+        n = (hpc->id_table_size == 0) ? 64 : hpc->id_table_size;
+        while (n <= hp->host_id) n *= 2;
+        hpc->id_table = (void **)realloc(hpc->id_table, sizeof(void *)*n);
+        assert(hpc->id_table != NULL);
+        memset(hpc->id_table + hpc->id_table_size, 0, sizeof(void *)*(n - hpc->id_table_size));
+        hpc->id_table_size = n;
+    }
+    hpc->id_table[hp->host_id] = hp;
+}
+
+//************************************************************************
+// _hportal_table_remove - Removes the hportal from the context's tables
+//    NOTE: hpc->lock should be held
+//************************************************************************
+
+void _hportal_table_remove(portal_context_t *hpc, host_portal_t *hp)
+{
+    apr_hash_set(hpc->table, hp->skey, APR_HASH_KEY_STRING, NULL);
+    if (hp->host_id < hpc->id_table_size) hpc->id_table[hp->host_id] = NULL;
+}
+
 //************************************************************************
 //  create_hportal_context - Creates a new hportal context structure for use
 //************************************************************************
@@ -267,9 +521,51 @@ portal_context_t *create_hportal_context(portal_fn_t *imp)
     hpc->count = 0;
     set_net_timeout(&(hpc->dt), 1, 0);
 
+    hpc->lat = gop_latency_table_create();
+
+    gop_hostport_init();
+
     return(hpc);
 }
 
+//************************************************************************
+// hportal_context_publish - Adds the context to the list walked by the
+//    gop cancel and help routines.  Only call this once the owner has
+//    filled in fn and arg since they're used as soon as it's on the list.
+//************************************************************************
+
+void hportal_context_publish(portal_context_t *hpc)
+{
+    apr_thread_mutex_lock(_hp_context_lock);
+    push(_hp_context_list, hpc);
+    apr_thread_mutex_unlock(_hp_context_lock);
+}
+
+//************************************************************************
+// hportal_context_unpublish - Removes the context from the cancel/help list
+//    and waits for any gop_portal_cancel_all() still using it.  Safe to call
+//    if the context was never published.
+//************************************************************************
+
+void hportal_context_unpublish(portal_context_t *hpc)
+{
+    void *val;
+
+    apr_thread_mutex_lock(_hp_context_lock);
+    move_to_top(_hp_context_list);
+    while ((val = get_ele_data(_hp_context_list)) != NULL) {
+        if (val == hpc) {
+            delete_current(_hp_context_list, 0, 0);
+            break;
+        }
+        move_down(_hp_context_list);
+    }
+    while (hpc->n_busy > 0) {
+        apr_thread_cond_wait(_hp_context_cond, _hp_context_lock);
+    }
+    apr_thread_mutex_unlock(_hp_context_lock);
+}
+
 
 //************************************************************************
 // destroy_hportal_context - Destroys a hportal context structure
@@ -281,10 +577,13 @@ void destroy_hportal_context(portal_context_t *hpc)
     host_portal_t *hp;
     void *val;
 
+    hportal_context_unpublish(hpc);
+    gop_hostport_destroy();
+
     for (hi=apr_hash_first(hpc->pool, hpc->table); hi != NULL; hi = apr_hash_next(hi)) {
         apr_hash_this(hi, NULL, NULL, &val);
         hp = (host_portal_t *)val;
-        apr_hash_set(hpc->table, hp->skey, APR_HASH_KEY_STRING, NULL);
+        _hportal_table_remove(hpc, hp);
         destroy_hportal(hp);
     }
 
@@ -292,6 +591,8 @@ void destroy_hportal_context(portal_context_t *hpc)
 
     apr_hash_clear(hpc->table);
     apr_pool_destroy(hpc->pool);
+    if (hpc->id_table != NULL) free(hpc->id_table);
+    gop_latency_table_destroy(hpc->lat);
 
     free(hpc);
 
@@ -392,7 +693,7 @@ void shutdown_hportal(portal_context_t *hpc)
     for (hi=apr_hash_first(hpc->pool, hpc->table); hi != NULL; hi = apr_hash_next(hi)) {
         apr_hash_this(hi, NULL, NULL, &val);
         hp = (host_portal_t *)val;
-        apr_hash_set(hpc->table, hp->skey, APR_HASH_KEY_STRING, NULL);  //** This removes the key
+        _hportal_table_remove(hpc, hp);  //** This removes the key
 
         log_printf(15, "shutdown_hportal: Shutting down host=%s\n", hp->skey);
 
@@ -495,7 +796,7 @@ void compact_hportals(portal_context_t *hpc)
                 assert(stack_size(hp->conn_list) == 0);
             } else {
                 hportal_unlock(hp);
-                apr_hash_set(hpc->table, hp->skey, APR_HASH_KEY_STRING, NULL);  //** This removes the key
+                _hportal_table_remove(hpc, hp);  //** This removes the key
                 destroy_hportal(hp);
             }
         } else {
@@ -589,6 +890,7 @@ op_generic_t *_get_hportal_op(host_portal_t *hp)
         }
 
         pop(hp->que);  //** Actually pop it after the before_exec
+        gop_timestamp(hsop, GOP_TS_DEQUEUE);
 
         hp->workload = hp->workload - hop->workload;
     }
@@ -722,6 +1024,83 @@ void _hp_fail_tasks(host_portal_t *hp, op_status_t err_code)
 //  }
 }
 
+//*************************************************************************
+// _hp_cancel_que - Moves the cancelled ops in the hportal's que to the
+//       cancelled stack.  Returns the number moved.
+//       NOTE:  No locking is done!
+//*************************************************************************
+
+int _hp_cancel_que(host_portal_t *hp, Stack_t *cancelled)
+{
+    op_generic_t *hsop;
+    int n;
+
+    n = 0;
+    move_to_top(hp->que);
+    while ((hsop = (op_generic_t *)get_ele_data(hp->que)) != NULL) {
+        if (gop_cancel_requested(hsop) == 1) {
+            delete_current(hp->que, 0, 0);
+            hp->workload = hp->workload - hsop->op->cmd.workload;
+            push(cancelled, hsop);
+            n++;
+        } else {
+            move_down(hp->que);
+        }
+    }
+
+    return(n);
+}
+
+//*************************************************************************
+// hportal_cancel_ops - Removes all the queued ops for the op, or all the
+//       que's descendants, from the context's hportals and completes them
+//       with op_cancelled_status.  Ops already handed to a connection are
+//       left alone.  Used by gop_portal_cancel() for portals without their
+//       own cancel routine.  Returns the number of ops cancelled.
+//*************************************************************************
+
+int hportal_cancel_ops(portal_context_t *hpc, op_generic_t *gop)
+{
+    apr_hash_index_t *hi;
+    host_portal_t *hp, *shp;
+    Stack_t *cancelled;
+    op_generic_t *hsop;
+    void *val;
+    int n;
+
+    cancelled = new_stack();
+
+    n = 0;
+    apr_thread_mutex_lock(hpc->lock);
+    for (hi=apr_hash_first(NULL, hpc->table); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        hp = (host_portal_t *)val;
+
+        hportal_lock(hp);
+        n += _hp_cancel_que(hp, cancelled);
+
+        move_to_top(hp->direct_list);
+        while ((shp = (host_portal_t *)get_ele_data(hp->direct_list)) != NULL) {
+            hportal_lock(shp);
+            n += _hp_cancel_que(shp, cancelled);
+            hportal_unlock(shp);
+            move_down(hp->direct_list);
+        }
+        hportal_unlock(hp);
+    }
+    apr_thread_mutex_unlock(hpc->lock);
+
+    log_printf(15, "gid=%d ncancel=%d\n", gop_id(gop), n);
+
+    //** Complete them now that everything is unlocked
+    while ((hsop = (op_generic_t *)pop(cancelled)) != NULL) {
+        gop_mark_completed(hsop, op_cancelled_status);
+    }
+    free_stack(cancelled, 0);
+
+    return(n);
+}
+
 //*************************************************************************
 // check_hportal_connections - checks if the hportal has the appropriate
 //     number of connections and if not spawns them
@@ -827,7 +1206,7 @@ int submit_hp_direct_op(portal_context_t *hpc, op_generic_t *op)
     }
 
     //** Find it in the list or make a new one
-    hp = _lookup_hportal(hpc, hop->hostport);
+    hp = _lookup_hportal_id(hpc, gop_host_id(hop));
     if (hp == NULL) {
         log_printf(15, "submit_hp_direct_op: New host: %s\n", hop->hostport);
         hp = create_hportal(hpc, hop->connect_context, hop->hostport, 1, 1, apr_time_from_sec(1));
@@ -836,7 +1215,7 @@ int submit_hp_direct_op(portal_context_t *hpc, op_generic_t *op)
             apr_thread_mutex_unlock(hpc->lock);
             return(-1);
         }
-        apr_hash_set(hpc->table, hp->skey, APR_HASH_KEY_STRING, (const void *)hp);
+        _hportal_table_add(hpc, hp);
     }
 
     apr_thread_mutex_unlock(hpc->lock);
@@ -934,7 +1313,7 @@ int submit_hp_que_op(portal_context_t *hpc, op_generic_t *op)
     }
 
 //log_printf(1, "submit_hp_op: hpc=%p hpc->table=%p\n",hpc, hpc->table);
-    host_portal_t *hp = _lookup_hportal(hpc, hop->hostport);
+    host_portal_t *hp = _lookup_hportal_id(hpc, gop_host_id(hop));
     if (hp == NULL) {
         log_printf(15, "submit_hp_que_op: New host: %s\n", hop->hostport);
         hp = create_hportal(hpc, hop->connect_context, hop->hostport, hpc->min_threads, hpc->max_threads, hpc->dt_connect);
@@ -943,8 +1322,8 @@ int submit_hp_que_op(portal_context_t *hpc, op_generic_t *op)
             return(1);
         }
         log_printf(15, "submit_op: New host.. hp->skey=%s\n", hp->skey);
-        apr_hash_set(hpc->table, hp->skey, APR_HASH_KEY_STRING, (const void *)hp);
-        host_portal_t *hp2 = _lookup_hportal(hpc, hop->hostport);
+        _hportal_table_add(hpc, hp);
+        host_portal_t *hp2 = _lookup_hportal_id(hpc, gop_host_id(hop));
         log_printf(15, "submit_hp_que_op: after lookup hp2=%p\n", hp2);
     }
 
@@ -86,6 +86,7 @@ void *ongoing_heartbeat_thread(apr_thread_t *th, void *data)
         now = apr_time_now() - apr_time_from_sec(5);  //** Give our selves a little buffer
         log_printf(5, "Loop Start now=" TT "\n", apr_time_now());
         q = new_opque();
+        gop_set_priority(opque_get_gop(q), OP_PRIORITY_HIGH);  //** Heartbeats shouldn't wait behind bulk work
 //     opque_start_execution(q);
         for (hit = apr_hash_first(NULL, on->table); hit != NULL; hit = apr_hash_next(hit)) {
             apr_hash_this(hit, (const void **)&remote_hash, &id_len, (void **)&table);
@@ -35,17 +35,28 @@ http://www.accre.vanderbilt.edu
 #include "apr_wrapper.h"
 #include "random.h"
 #include "fmttypes.h"
+#include "gop_slab.h"
 
 //** Poll index for connection monitoring
 #define PI_CONN 0   //** Actual connection
 #define PI_EFD  1   //** Portal event FD for incoming tasks
 
+#define MQ_INCOMING_BATCH 11  //** Max messages consumed per mqc_process_incoming() pass
+
+typedef struct {  //** Tasks collected for a single batched dispatch
+    void **task;
+    int n;
+    int max;
+} mq_task_list_t;
+
 void _tp_submit_op(void *arg, op_generic_t *gop);
+int _tp_cancel(void *arg, op_generic_t *gop);
 int mq_conn_create(mq_portal_t *p, int dowait);
 void mq_conn_teardown(mq_conn_t *c);
 void mqc_heartbeat_dec(mq_conn_t *c, mq_heartbeat_entry_t *hb);
 void _mq_reap_closed(mq_portal_t *p);
 void *mqtp_failure(apr_thread_t *th, void *arg);
+void mq_inline_arg_free(void *arg);
 
 
 //--------------------------------------------------------------
@@ -162,13 +173,13 @@ void mq_stats_print(int ll, char *tag, mq_command_stats_t *a)
     char *fmt = "  %12s: %8d    %8d\n";
     char *command[MQS_SIZE] = { "PING", "PONG", "EXEC", "TRACKEXEC", "TRACKADDRESS", "RESPONSE", "HEARTBEAT", "UNKNOWN" };
 
-    log_printf(ll, "----------- Command Stats for %s --------------\n", tag);
-    log_printf(ll, "    Command     incoming    outgoing\n");
+    gop_log_printf(ll, "----------- Command Stats for %s --------------\n", tag);
+    gop_log_printf(ll, "    Command     incoming    outgoing\n");
     for (i=0; i< MQS_SIZE; i++) {
-        log_printf(ll, fmt, command[i], a->incoming[i], a->outgoing[i]);
+        gop_log_printf(ll, fmt, command[i], a->incoming[i], a->outgoing[i]);
     }
 
-    log_printf(ll, "----------------------------------------------------------------\n");
+    gop_log_printf(ll, "----------------------------------------------------------------\n");
 }
 
 
@@ -198,7 +209,7 @@ void mq_command_set(mq_command_table_t *table, void *cmd, int cmd_size, void *ar
 {
     mq_command_t *mqc;
 
-    log_printf(15, "command key = %d\n", ((char *)cmd)[0]);
+    gop_log_printf(15, "command key = %d\n", ((char *)cmd)[0]);
     apr_thread_mutex_lock(table->lock);
     if (fn != NULL) {
         mqc = apr_hash_get(table->table, cmd, cmd_size);
@@ -289,9 +300,9 @@ void mq_command_exec(mq_command_table_t *t, mq_task_t *task, void *key, int klen
 
     cmd = apr_hash_get(t->table, key, klen);
 
-    log_printf(3, "cmd=%p klen=%d\n", cmd, klen);
+    gop_log_printf(3, "cmd=%p klen=%d\n", cmd, klen);
     if (cmd == NULL) {
-        log_printf(0, "Unknown command!\n");
+        gop_log_printf(0, "Unknown command!\n");
 //display_msg_frames(task->msg); //testing to see if the worker is returning a message and it's getting dropped here
         if (t->fn_default != NULL) t->fn_default(t->arg_default, task);
     } else {
@@ -299,26 +310,86 @@ void mq_command_exec(mq_command_table_t *t, mq_task_t *task, void *key, int klen
     }
 }
 
+//**************************************************************
+// _mq_task_list_add - Adds a task to the list growing it as needed
+//**************************************************************
+
+void _mq_task_list_add(mq_task_list_t *l, mq_task_t *task)
+{
+    if (l->n == l->max) {
+        l->max = (l->max == 0) ? 64 : 2*l->max;
+        type_realloc(l->task, void *, l->max);
+    }
+    l->task[l->n] = task;
+    l->n++;
+}
+
+//**************************************************************
+// _mq_task_list_fail - Fails all the tasks in the list with a single
+//    batch and empties it
+//**************************************************************
+
+void _mq_task_list_fail(thread_pool_context_t *tp, mq_task_list_t *l)
+{
+    if (l->n > 0) thread_pool_direct_batch_priority(tp, OP_PRIORITY_HIGH, mqtp_failure, l->task, l->n);
+    if (l->task != NULL) free(l->task);
+    l->task = NULL;
+    l->n = l->max = 0;
+}
+
+//**************************************************************
+// _mq_fail_all - Fails all the portal's queued tasks with a single batch
+//    NOTE: The portal lock should be held
+//**************************************************************
+
+void _mq_fail_all(mq_portal_t *p)
+{
+    void **tasks;
+    int n;
+
+    n = stack_size(p->tasks);
+    if (n == 0) return;
+
+    type_malloc(tasks, void *, n);
+    n = 0;
+    while ((tasks[n] = pop(p->tasks)) != NULL) n++;
+
+    thread_pool_direct_batch_priority(p->tp, OP_PRIORITY_HIGH, mqtp_failure, tasks, n);
+    free(tasks);
+}
+
 //**************************************************************
 // mq_submit - Submits a task for processing
 //**************************************************************
 
 int mq_submit(mq_portal_t *p, mq_task_t *task)
+{
+    return(mq_submit_batch(p, &task, 1));
+}
+
+//**************************************************************
+// mq_submit_batch - Submits a collection of tasks for processing
+//    taking the portal lock and notifying the connections once
+//**************************************************************
+
+int mq_submit_batch(mq_portal_t *p, mq_task_t **tasks, int n)
 {
     char c;
-    int backlog, err;
-    mq_task_t *t;
+    int backlog, err, i;
     apr_thread_mutex_lock(p->lock);
 
 //** Do a quick check for connections that need to be reaped
     if (stack_size(p->closed_conn) > 0) _mq_reap_closed(p);
 
-//** Add the task and get the backlog
+//** Add the tasks and get the backlog
     move_to_bottom(p->tasks);
-    insert_below(p->tasks, task);
+    for (i=0; i<n; i++) {
+        if (tasks[i]->gop != NULL) tasks[i]->gop->op->cmd.host_id = p->host_id;
+        insert_below(p->tasks, tasks[i]);
+    }
     backlog = stack_size(p->tasks);
-    log_printf(2, "portal=%s backlog=%d active_conn=%d max_conn=%d total_conn=%d\n", p->host, backlog, p->active_conn, p->max_conn, p->total_conn);
-    flush_log();
+    gop_log_printf(2, "portal=%s backlog=%d active_conn=%d max_conn=%d total_conn=%d\n", p->host, backlog, p->active_conn, p->max_conn, p->total_conn);
+    gop_flush_log();
 
 //** Noitify the connections
     c = 1;
@@ -330,10 +401,8 @@ int mq_submit(mq_portal_t *p, mq_task_t *task)
         if (p->total_conn == 0) { //** No current connections so try and make one
             err = mq_conn_create(p, 1);
             if (err != 0) {  //** Fail everything
-                log_printf(1, "Host is dead so failing tasks host=%s\n", p->host);
-                while ((t = pop(p->tasks)) != NULL) {
-                    thread_pool_direct(p->tp, mqtp_failure, t);
-                }
+                gop_log_printf(1, "Host is dead so failing tasks host=%s\n", p->host);
+                _mq_fail_all(p);
             }
         } else if (p->total_conn < p->max_conn) {
             err = mq_conn_create(p, 0);
@@ -341,21 +410,39 @@ int mq_submit(mq_portal_t *p, mq_task_t *task)
     } else if (p->total_conn == 0) { //** No current connections so try and make one
         err = mq_conn_create(p, 1);
         if (err != 0) {  //** Fail everything
-            log_printf(1, "Host is dead so failing tasks host=%s\n", p->host);
-            while ((t = pop(p->tasks)) != NULL) {
-                thread_pool_direct(p->tp, mqtp_failure, t);
-            }
+            gop_log_printf(1, "Host is dead so failing tasks host=%s\n", p->host);
+            _mq_fail_all(p);
         }
     }
 
-    log_printf(2, "END portal=%s err=%d backlog=%d active_conn=%d total_conn=%d max_conn=%d\n", p->host, err, backlog, p->active_conn, p->total_conn, p->max_conn);
-    flush_log();
+    gop_log_printf(2, "END portal=%s err=%d backlog=%d active_conn=%d total_conn=%d max_conn=%d\n", p->host, err, backlog, p->active_conn, p->total_conn, p->max_conn);
+    gop_flush_log();
 
     apr_thread_mutex_unlock(p->lock);
 
     return(0);
 }
 
+//**************************************************************
+// _mq_client_portal_get - Returns the client portal for the host
+//    creating it if needed.
+//    NOTE: mqc->lock should be held by the caller
+//**************************************************************
+
+mq_portal_t *_mq_client_portal_get(mq_context_t *mqc, char *host, int size)
+{
+    mq_portal_t *p;
+
+    p = (mq_portal_t *)(apr_hash_get(mqc->client_portals, host, size));
+    if (p == NULL) {  //** New host so create the portal
+        gop_log_printf(10, "Creating MQ_CMODE_CLIENT portal for outgoing connections host = %s size = %d\n", host, size);
+        p = mq_portal_create(mqc, host, MQ_CMODE_CLIENT);
+        apr_hash_set(mqc->client_portals, p->host, APR_HASH_KEY_STRING, p);
+    }
+
+    return(p);
+}
+
 //**************************************************************
 // mq_task_send - Sends a task for processing
 //**************************************************************
@@ -375,12 +462,7 @@ int mq_task_send(mq_context_t *mqc, mq_task_t *task)
 
 //** Look up the portal
     apr_thread_mutex_lock(mqc->lock);
-    p = (mq_portal_t *)(apr_hash_get(mqc->client_portals, host, size));
-    if (p == NULL) {  //** New host so create the portal
-        log_printf(10, "Creating MQ_CMODE_CLIENT portal for outgoing connections host = %s size = %d\n", host, size);
-        p = mq_portal_create(mqc, host, MQ_CMODE_CLIENT);
-        apr_hash_set(mqc->client_portals, p->host, APR_HASH_KEY_STRING, p);
-    }
+    p = _mq_client_portal_get(mqc, host, size);
     apr_thread_mutex_unlock(mqc->lock);
 
     return(mq_submit(p, task));
@@ -392,10 +474,8 @@ int mq_task_send(mq_context_t *mqc, mq_task_t *task)
 
 void mq_task_destroy(mq_task_t *task)
 {
-    if (task->msg != NULL) mq_msg_destroy(task->msg);
-    if (task->response != NULL) mq_msg_destroy(task->response);
-    if (task->my_arg_free) task->my_arg_free(task->arg);
-    free(task);
+    mq_inline_arg_free(task);
+    gop_slab_free(task);
 }
 
 //**************************************************************
@@ -409,6 +489,20 @@ void mq_arg_free(void *arg)
     mq_task_destroy(task);
 }
 
+//**************************************************************
+// mq_inline_arg_free - Releases what the task holds but not the task
+//    itself.  Used for tasks stored inline in their op
+//**************************************************************
+
+void mq_inline_arg_free(void *arg)
+{
+    mq_task_t *task = (mq_task_t *)arg;
+
+    if (task->msg != NULL) mq_msg_destroy(task->msg);
+    if (task->response != NULL) mq_msg_destroy(task->response);
+    if (task->my_arg_free) task->my_arg_free(task->arg);
+}
+
 
 //**************************************************************
 // mq_task_set - Initializes a task for use
@@ -433,7 +527,7 @@ mq_task_t *mq_task_new(mq_context_t *ctx, mq_msg_t *msg, op_generic_t *gop, void
 {
     mq_task_t *task;
 
-    type_malloc_clear(task, mq_task_t, 1);
+    type_slab_malloc_clear(task, mq_task_t, 1);
 
     mq_task_set(task, ctx, msg, gop, arg, dt);
 
@@ -446,12 +540,16 @@ mq_task_t *mq_task_new(mq_context_t *ctx, mq_msg_t *msg, op_generic_t *gop, void
 
 op_generic_t *new_mq_op(mq_context_t *ctx, mq_msg_t *msg, op_status_t (*fn_response)(void *arg, int id), void *arg, void (*my_arg_free)(void *arg), int dt)
 {
+    op_generic_t *gop;
     mq_task_t *task;
 
-    task = mq_task_new(ctx, msg, NULL, arg, dt);
-    task->gop = new_thread_pool_op(ctx->tp, "mq", fn_response, task, mq_arg_free, 1);
+    //** The task lives inside the op so it's a single allocation
+    gop = new_thread_pool_inline_op(ctx->tp, "mq", fn_response, NULL, sizeof(mq_task_t), mq_inline_arg_free, 1);
+    if (ctx->coro_ops == 1) thread_pool_op_coro_set(gop, 1);  //** Handlers that wait on other gops park instead of holding a thread
+    task = tp_op_arg(gop);
+    mq_task_set(task, ctx, msg, gop, arg, dt);
     task->my_arg_free = my_arg_free;
-    return(task->gop);
+    return(gop);
 }
 
 
@@ -473,8 +571,8 @@ void *mqt_exec(apr_thread_t *th, void *arg)
     mq_msg_next(task->msg);     //** MQ command
     f = mq_msg_next(task->msg);     //** Skip the ID
     mq_get_frame(f, &key, &n);
-//log_printf(1, "execing sid=%s  EXEC SUBMIT now=" TT "\n", mq_id2str(key, n, b64, sizeof(b64)), apr_time_sec(apr_time_now()));  flush_log();
-    log_printf(1, "execing sid=%s\n", mq_id2str(key, n, b64, sizeof(b64)));
+//gop_log_printf(1, "execing sid=%s  EXEC SUBMIT now=" TT "\n", mq_id2str(key, n, b64, sizeof(b64)), apr_time_sec(apr_time_now()));  gop_flush_log();
+    gop_log_printf(1, "execing sid=%s\n", mq_id2str(key, n, b64, sizeof(b64)));
     f = mq_msg_next(task->msg); //** and get the user command
     mq_get_frame(f, &key, &n);
 
@@ -513,7 +611,21 @@ void *mqtp_failure(apr_thread_t *th, void *arg)
 }
 
 //**************************************************************
-//  mq_task_complete - Marks a task as complete and destroys it
+// mqtp_cancelled - Routine for completing a cancelled task
+//**************************************************************
+
+void *mqtp_cancelled(apr_thread_t *th, void *arg)
+{
+    mq_task_t *task = (mq_task_t *)arg;
+
+    gop_mark_completed(task->gop, op_cancelled_status);
+
+    return(NULL);
+}
+
+//**************************************************************
+//  mq_task_complete - Marks a task as complete and destroys it.  The
+//     completion runs on the HIGH lane like the batched failure paths.
 //**************************************************************
 
 void mq_task_complete(mq_conn_t *c, mq_task_t *task, int status)
@@ -521,9 +633,11 @@ void mq_task_complete(mq_conn_t *c, mq_task_t *task, int status)
     if (task->gop == NULL) {
         mq_task_destroy(task);
     } else if (status == OP_STATE_SUCCESS) {
-        thread_pool_direct(c->pc->tp, mqtp_success, task);
+        thread_pool_direct_priority(c->pc->tp, OP_PRIORITY_HIGH, mqtp_success, task);
     } else if (status == OP_STATE_FAILURE) {
-        thread_pool_direct(c->pc->tp, mqtp_failure, task);
+        thread_pool_direct_priority(c->pc->tp, OP_PRIORITY_HIGH, mqtp_failure, task);
+    } else if (status == OP_STATE_CANCELLED) {
+        thread_pool_direct_priority(c->pc->tp, OP_PRIORITY_HIGH, mqtp_cancelled, task);
     }
 }
 
@@ -539,33 +653,44 @@ void mqc_response(mq_conn_t *c, mq_msg_t *msg, int do_exec)
     mq_task_monitor_t *tn;
     char b64[1024];
 
-    log_printf(5, "start\n");
-    flush_log();
+    gop_log_printf(5, "start\n");
+    gop_flush_log();
 
     f = mq_msg_next(msg);  //** This should be the task ID
     mq_get_frame(f, (void **)&id, &size);
-    log_printf(5, "id_size=%d\n", size);
+    gop_log_printf(5, "id_size=%d\n", size);
 
 //** Find the task
     tn = apr_hash_get(c->waiting, id, size);
     if (tn == NULL) {  //** Nothing matches so drop it
-        log_printf(1, "ERROR: No matching ID! sid=%s\n", mq_id2str(id, size, b64, sizeof(b64)));
-        flush_log();
+        gop_log_printf(1, "ERROR: No matching ID! sid=%s\n", mq_id2str(id, size, b64, sizeof(b64)));
+        gop_flush_log();
         mq_msg_destroy(msg);
         return;
     }
 
 //** We have a match if we made it here
+    if (tn->task->gop != NULL) gop_timestamp(tn->task->gop, GOP_TS_FIRST_BYTE);
+
 //** Remove us from the waiting table
     apr_hash_set(c->waiting, id, size, NULL);
 
 //** and also dec the heartbeat entry
     if (tn->tracking != NULL) mqc_heartbeat_dec(c, tn->tracking);
 
+//** The task was cancelled while in flight so throw away the response
+    if ((tn->task->gop != NULL) && (gop_cancel_requested(tn->task->gop) == 1)) {
+        gop_log_printf(5, "Dropping response for cancelled gid=%d\n", gop_id(tn->task->gop));
+        mq_msg_destroy(msg);
+        mq_task_complete(c, tn->task, OP_STATE_CANCELLED);
+        free(tn);
+        return;
+    }
+
 //** Execute the task in the thread pool
     if(do_exec != 0) {
-        log_printf(5, "Submitting repsonse for exec gid=%d\n", gop_id(tn->task->gop));
-        flush_log();
+        gop_log_printf(5, "Submitting repsonse for exec gid=%d\n", gop_id(tn->task->gop));
+        gop_flush_log();
         tn->task->response = msg;
         _tp_submit_op(NULL, tn->task->gop);
     }
@@ -573,8 +698,8 @@ void mqc_response(mq_conn_t *c, mq_msg_t *msg, int do_exec)
 //** Free the tracking number container
     free(tn);
 
-    log_printf(5, "end\n");
-    flush_log();
+    gop_log_printf(5, "end\n");
+    gop_flush_log();
 }
 
 //**************************************************************
@@ -661,16 +786,16 @@ void mqc_trackaddress(mq_conn_t *c, mq_msg_t *msg)
 
     //** Find the task
     tn = apr_hash_get(c->waiting, id, size);
-    log_printf(5, "trackaddress status tn=%p id_size=%d\n", tn, size);
+    gop_log_printf(5, "trackaddress status tn=%p id_size=%d\n", tn, size);
     void *data;
     int i;
     for (f = mq_msg_first(msg), i=0; f != NULL; f = mq_msg_next(msg), i++) {
         mq_get_frame(f, &data, &n);
-        log_printf(5, "fsize[%d]=%d\n", i, n);
+        gop_log_printf(5, "fsize[%d]=%d\n", i, n);
     }
 
     if (tn != NULL) {
-        log_printf(5, "tn->tracking=%p\n", tn->tracking);
+        gop_log_printf(5, "tn->tracking=%p\n", tn->tracking);
         if (tn->tracking != NULL) goto cleanup;  //** Duplicate so drop and ignore
 
         //** Form the address key but first strip off the gunk we don't care about to determine the size
@@ -682,18 +807,18 @@ void mqc_trackaddress(mq_conn_t *c, mq_msg_t *msg)
 
         //** What's left is the address until an empty frame
         size = mq_msg_total_size(msg);
-        log_printf(5, " msg_total_size=%d frames=%d\n", size, stack_size(msg));
+        gop_log_printf(5, " msg_total_size=%d frames=%d\n", size, stack_size(msg));
         type_malloc_clear(address, char, size+1);
         n = 0;
         for (f=mq_msg_first(msg); f != NULL; f=mq_msg_next(msg)) {
             mq_get_frame(f, (void **)&id, &size);
-            log_printf(5, "ta element=%d\n", size);
+            gop_log_printf(5, "ta element=%d\n", size);
             memcpy(&(address[n]), id, size);
             n = n + size;
             if (size == 0) break;
         }
         address[n] = 0;
-        log_printf(5, "full address=%s\n", address);
+        gop_log_printf(5, "full address=%s\n", address);
 
 //** Remove anything else
         f = mq_msg_next(msg);
@@ -711,7 +836,7 @@ void mqc_trackaddress(mq_conn_t *c, mq_msg_t *msg)
             hb->key_size = n;
             hb->lut_id = atomic_global_counter();
 
-            log_printf(5, "trackaddress hb_lut=" LU "\n", hb->lut_id);
+            gop_log_printf(5, "trackaddress hb_lut=" LU "\n", hb->lut_id);
 //** Form the heartbeat msg
 //** Right now we just have the address which should have an empty last frame
             mq_msg_append_mem(msg, MQF_VERSION_KEY, MQF_VERSION_SIZE, MQF_MSG_KEEP_DATA);
@@ -754,7 +879,7 @@ int mqc_ping(mq_conn_t *c, mq_msg_t *msg)
 //void *data;
 //for (f = mq_msg_first(msg), i=0; f != NULL; f = mq_msg_next(msg), i++) {
 //  mq_get_frame(f, &data, &err);
-//  log_printf(5, "fsize[%d]=%d\n", i, err);
+//  gop_log_printf(5, "fsize[%d]=%d\n", i, err);
 //}
 
     //** Peel off the top frames and just leave the return address
@@ -811,8 +936,8 @@ void mqc_pong(mq_conn_t *c, mq_msg_t *msg)
         entry->last_check = apr_time_now();
     }
 
-    log_printf(5, "pong entry=%p ptr=%p\n", entry, ptr);
-//log_printf(5, "pong entry->key=%.10s\n", entry->key);
+    gop_log_printf(5, "pong entry=%p ptr=%p\n", entry, ptr);
+//gop_log_printf(5, "pong entry->key=%.10s\n", entry->key);
 //** Clean up
     mq_msg_destroy(msg);
 }
@@ -830,6 +955,9 @@ int mqc_heartbeat_cleanup(mq_conn_t *c)
     apr_hash_index_t *hi, *hit;
     mq_heartbeat_entry_t *entry;
     mq_task_monitor_t *tn;
+    mq_task_list_t failed;
+
+    memset(&failed, 0, sizeof(failed));
 
 //** Clean out the heartbeat info
 //** NOTE: using internal non-threadsafe iterator.  Should be ok in this case
@@ -852,18 +980,20 @@ int mqc_heartbeat_cleanup(mq_conn_t *c)
         apr_hash_set(c->waiting, key, klen, NULL);
 
 //** Submit the fail task
-        log_printf(1, "Failed task uuid=%s\n", c->mq_uuid);
-        flush_log();
-        log_printf(1, "Failed task tn->task=%p tn->task->gop=%p\n", tn->task, tn->task->gop);
-        flush_log();
+        gop_log_printf(1, "Failed task uuid=%s\n", c->mq_uuid);
+        gop_flush_log();
+        gop_log_printf(1, "Failed task tn->task=%p tn->task->gop=%p\n", tn->task, tn->task->gop);
+        gop_flush_log();
         assert(tn->task);
         assert(tn->task->gop);
-        thread_pool_direct(c->pc->tp, mqtp_failure, tn->task);
+        _mq_task_list_add(&failed, tn->task);
 
 //** Free the container. The mq_task_t is handled by the response
         free(tn);
     }
 
+    _mq_task_list_fail(c->pc->tp, &failed);
+
     return(1);
 }
 
@@ -906,6 +1036,7 @@ int mqc_heartbeat(mq_conn_t *c, int npoll)
     apr_hash_index_t *hi, *hit;
     mq_heartbeat_entry_t *entry;
     mq_task_monitor_t *tn;
+    mq_task_list_t failed;
     apr_time_t dt, dt_fail, dt_check;
     apr_time_t now;
     int n, pending_count, conn_dead, do_conn_hb;
@@ -913,12 +1044,13 @@ int mqc_heartbeat(mq_conn_t *c, int npoll)
 
     double dts;
     apr_time_t start = apr_time_now();
-    log_printf(6, "START host=%s\n", c->mq_uuid);
-    flush_log();
+    gop_log_printf(6, "START host=%s\n", c->mq_uuid);
+    gop_flush_log();
     dt_fail = apr_time_make(c->pc->heartbeat_failure, 0);
     dt_check = apr_time_make(c->pc->heartbeat_dt, 0);
     pending_count = 0;
     conn_dead = 0;
+    memset(&failed, 0, sizeof(failed));
 
     do_conn_hb = 0;  //** Keep track of if I'm HBing my direct uplink.
 
@@ -930,12 +1062,12 @@ int mqc_heartbeat(mq_conn_t *c, int npoll)
 
         now = apr_time_now();
         dt = now - entry->last_check;
-        log_printf(7, "hb->key=%s\n", entry->key);
+        gop_log_printf(7, "hb->key=%s\n", entry->key);
         if (dt > dt_fail) {  //** Dead connection so fail all the commands using it
             if (entry == c->hb_conn) conn_dead = 1;
             klen = apr_time_sec(dt);
-            log_printf(8, "hb->key=%s FAIL dt=%d\n", entry->key, klen);
-            log_printf(6, "before waiting size=%d\n", apr_hash_count(c->waiting));
+            gop_log_printf(8, "hb->key=%s FAIL dt=%d\n", entry->key, klen);
+            gop_log_printf(6, "before waiting size=%d\n", apr_hash_count(c->waiting));
 //** NOTE: using internal non-threadsafe iterator.  Should be ok in this case
             for (hit = apr_hash_first(NULL, c->waiting); hit != NULL; hit = apr_hash_next(hit)) {
                 apr_hash_this(hit, (const void **)&key, &klen, (void **)&tn);
@@ -944,20 +1076,20 @@ int mqc_heartbeat(mq_conn_t *c, int npoll)
                     apr_hash_set(c->waiting, key, klen, NULL);
 
 //** Submit the fail task
-                    log_printf(6, "Failed task uuid=%s sid=%s\n", c->mq_uuid, mq_id2str(key, klen, b64, sizeof(b64)));
-                    flush_log();
-                    log_printf(6, "Failed task tn->task=%p tn->task->gop=%p\n", tn->task, tn->task->gop);
-                    flush_log();
+                    gop_log_printf(6, "Failed task uuid=%s sid=%s\n", c->mq_uuid, mq_id2str(key, klen, b64, sizeof(b64)));
+                    gop_flush_log();
+                    gop_log_printf(6, "Failed task tn->task=%p tn->task->gop=%p\n", tn->task, tn->task->gop);
+                    gop_flush_log();
                     assert(tn->task);
                     assert(tn->task->gop);
-                    thread_pool_direct(c->pc->tp, mqtp_failure, tn->task);
+                    _mq_task_list_add(&failed, tn->task);
 
 //** Free the container. The mq_task_t is handled by the response
                     free(tn);
                 }
             }
 
-            log_printf(6, "after waiting size=%d\n", apr_hash_count(c->waiting));
+            gop_log_printf(6, "after waiting size=%d\n", apr_hash_count(c->waiting));
 
 //** Remove the entry and clean up
             apr_hash_set(c->heartbeat_dest, entry->key, entry->key_size, NULL);
@@ -967,7 +1099,7 @@ int mqc_heartbeat(mq_conn_t *c, int npoll)
             free(entry);
         } else if (dt > dt_check) {  //** Send a heartbeat check
             klen = apr_time_sec(dt);
-            log_printf(10, "hb->key=%s CHECK dt=%d\n", entry->key, klen);
+            gop_log_printf(10, "hb->key=%s CHECK dt=%d\n", entry->key, klen);
             if ((npoll == 1) && (entry == c->hb_conn)) {
                 do_conn_hb = 1;
                 goto next;  //** Skip local hb if finished
@@ -987,11 +1119,17 @@ next:
     now = apr_time_now();
 //** NOTE: using internal non-threadsafe iterator.  Should be ok in this case
     hi = apr_hash_first(NULL, c->waiting);
-    log_printf(6, "before waiting size=%d\n", apr_hash_count(c->waiting));
+    gop_log_printf(6, "before waiting size=%d\n", apr_hash_count(c->waiting));
     while (hi != NULL) {
         apr_hash_this(hi, (const void **)&key, &klen, (void **)&tn);
 
-        if (now > tn->task->timeout) {  //** Expired command
+        if (gop_cancel_requested(tn->task->gop) == 1) {  //** Cancelled so stop waiting on it
+            if (tn->tracking != NULL) mqc_heartbeat_dec(c, tn->tracking);
+            apr_hash_set(c->waiting, key, klen, NULL);
+            gop_log_printf(6, "Cancelled task uuid=%s gid=%d\n", c->mq_uuid, gop_id(tn->task->gop));
+            mq_task_complete(c, tn->task, OP_STATE_CANCELLED);
+            free(tn);
+        } else if (now > tn->task->timeout) {  //** Expired command
             if (tn->tracking != NULL) {  //** Tracking so dec the hb handle
                 mqc_heartbeat_dec(c, tn->tracking);
             }
@@ -1000,13 +1138,13 @@ next:
             apr_hash_set(c->waiting, key, klen, NULL);
 
 //** Submit the fail task
-            log_printf(6, "Failed task uuid=%s hash_count=%u sid=%s\n", c->mq_uuid, apr_hash_count(c->waiting), mq_id2str(key, klen, b64, sizeof(b64)));
-            flush_log();
-            log_printf(6, "Failed task tn->task=%p tn->task->gop=%p gid=%d\n", tn->task, tn->task->gop, gop_id(tn->task->gop));
-            flush_log();
+            gop_log_printf(6, "Failed task uuid=%s hash_count=%u sid=%s\n", c->mq_uuid, apr_hash_count(c->waiting), mq_id2str(key, klen, b64, sizeof(b64)));
+            gop_flush_log();
+            gop_log_printf(6, "Failed task tn->task=%p tn->task->gop=%p gid=%d\n", tn->task, tn->task->gop, gop_id(tn->task->gop));
+            gop_flush_log();
             assert(tn->task);
             assert(tn->task->gop);
-            thread_pool_direct(c->pc->tp, mqtp_failure, tn->task);
+            _mq_task_list_add(&failed, tn->task);
 
 //** Free the container. The mq_task_t is handled by the response
             free(tn);
@@ -1017,7 +1155,10 @@ next:
         hi = apr_hash_next(hi);
     }
 
-    log_printf(6, "after waiting size=%d\n", apr_hash_count(c->waiting));
+    gop_log_printf(6, "after waiting size=%d\n", apr_hash_count(c->waiting));
+
+//** Fail everything that timed out or lost its heartbeat in one go
+    _mq_task_list_fail(c->pc->tp, &failed);
 
     if (do_conn_hb == 1) {    //** Check if we HB the main uplink
         if ( ((pending_count == 0) && (npoll > 1)) ||
@@ -1038,7 +1179,7 @@ next:
 
     dts = apr_time_now() - start;
     dts /= APR_USEC_PER_SEC;
-    log_printf(10, "pending_count=%d npoll=%d conn_dead=%d do_conn_hb=%d n=%d dt=%lf\n", pending_count, npoll, conn_dead, do_conn_hb, n, dts);
+    gop_log_printf(10, "pending_count=%d npoll=%d conn_dead=%d do_conn_hb=%d n=%d dt=%lf\n", pending_count, npoll, conn_dead, do_conn_hb, n, dts);
     return(n+conn_dead);
 }
 
@@ -1052,96 +1193,101 @@ int mqc_process_incoming(mq_conn_t *c, int *nproc)
     mq_msg_t *msg;
     mq_frame_t *f;
     mq_task_t *task;
+    void *exec_task[MQ_INCOMING_BATCH];
     char *data;
-    int size;
+    int size, n_exec;
 
-    log_printf(5, "processing incoming start\n");
+    gop_log_printf(5, "processing incoming start\n");
 //** Process all that are on the wire
     msg = mq_msg_new();
     count = 0;
+    n_exec = 0;
     while ((n = mq_recv(c->sock, msg, MQ_DONTWAIT)) == 0) {
         count++;
-        log_printf(5, "Got a message count=%d\n", count);
+        gop_log_printf(5, "Got a message count=%d\n", count);
 //** verify we have an empty frame
         f = mq_msg_first(msg);
         mq_get_frame(f, (void **)&data, &size);
         if (size != 0) {
-            log_printf(0, "ERROR: Missing empty frame!\n");
+            gop_log_printf(0, "ERROR: Missing empty frame!\n");
 //mq_msg_destroy(msg);
             task = mq_task_new(c->pc->mqc, msg, NULL, c->pc, -1);
             mqt_exec(NULL, task);
             goto skip;
         }
 
-//log_printf(5, "111111111111111111111\n"); flush_log();
+//gop_log_printf(5, "111111111111111111111\n"); gop_flush_log();
 //** and the correct version
         f = mq_msg_next(msg);
         mq_get_frame(f, (void **)&data, &size);
         if (mq_data_compare(data, size, MQF_VERSION_KEY, MQF_VERSION_SIZE) != 0) {
-            log_printf(0, "ERROR: Invalid version!\n");
+            gop_log_printf(0, "ERROR: Invalid version!\n");
             mq_msg_destroy(msg);
             goto skip;
         }
 
-//log_printf(5, "222222222222222222\n"); flush_log();
+//gop_log_printf(5, "222222222222222222\n"); gop_flush_log();
 
 //** This is the command frame
         f = mq_msg_next(msg);
         mq_get_frame(f, (void **)&data, &size);
         if (mq_data_compare(MQF_PING_KEY, MQF_PING_SIZE, data, size) == 0) {
-            log_printf(15, "Processing MQF_PING_KEY\n");
-            flush_log();
+            gop_log_printf(15, "Processing MQF_PING_KEY\n");
+            gop_flush_log();
             c->stats.incoming[MQS_PING_INDEX]++;
             mqc_ping(c, msg);
         } else if (mq_data_compare(MQF_PONG_KEY, MQF_PONG_SIZE, data, size) == 0) {
-            log_printf(15, "Processing MQF_PONG_KEY\n");
-            flush_log();
+            gop_log_printf(15, "Processing MQF_PONG_KEY\n");
+            gop_flush_log();
             c->stats.incoming[MQS_PONG_INDEX]++;
             mqc_pong(c, msg);
         } else if (mq_data_compare(MQF_TRACKADDRESS_KEY, MQF_TRACKADDRESS_SIZE, data, size) == 0) {
-            log_printf(15, "Processing MQF_TRACKADDRESS_KEY\n");
-            flush_log();
+            gop_log_printf(15, "Processing MQF_TRACKADDRESS_KEY\n");
+            gop_flush_log();
             c->stats.incoming[MQS_TRACKADDRESS_INDEX]++;
             mqc_trackaddress(c, msg);
         } else if (mq_data_compare(MQF_RESPONSE_KEY, MQF_RESPONSE_SIZE, data, size) == 0) {
-            log_printf(15, "Processing MQF_RESPONSE_KEY\n");
-            flush_log();
+            gop_log_printf(15, "Processing MQF_RESPONSE_KEY\n");
+            gop_flush_log();
             c->stats.incoming[MQS_RESPONSE_INDEX]++;
             mqc_response(c, msg, 1);
         } else if ((mq_data_compare(MQF_EXEC_KEY, MQF_EXEC_SIZE, data, size) == 0) ||
                    (mq_data_compare(MQF_TRACKEXEC_KEY, MQF_TRACKEXEC_SIZE, data, size) == 0)) {
 
             if (mq_data_compare(MQF_TRACKEXEC_KEY, MQF_TRACKEXEC_SIZE, data, size) == 0) {
-                log_printf(15, "Processing MQF_TRACKEXEC_KEY\n");
-                flush_log();
+                gop_log_printf(15, "Processing MQF_TRACKEXEC_KEY\n");
+                gop_flush_log();
                 c->stats.incoming[MQS_TRACKEXEC_INDEX]++;
             } else {
-                log_printf(15, "Processing MQF_EXEC_KEY\n");
-                flush_log();
+                gop_log_printf(15, "Processing MQF_EXEC_KEY\n");
+                gop_flush_log();
                 c->stats.incoming[MQS_EXEC_INDEX]++;
 
             }
 
 //** It's up to the task to send any tracking information back.
-            log_printf(5, "Submiting task for execution\n");
-            task = mq_task_new(c->pc->mqc, msg, NULL, c->pc, -1);
-            thread_pool_direct(c->pc->tp, mqt_exec, task);
+            gop_log_printf(5, "Submiting task for execution\n");
+            exec_task[n_exec] = mq_task_new(c->pc->mqc, msg, NULL, c->pc, -1);
+            n_exec++;
         } else {   //** Unknwon command so drop it
-            log_printf(5, "ERROR: Unknown command.  Dropping\n");
+            gop_log_printf(5, "ERROR: Unknown command.  Dropping\n");
             c->stats.incoming[MQS_UNKNOWN_INDEX]++;
             mq_msg_destroy(msg);
             goto skip;
         }
 skip:
         msg = mq_msg_new(); //**  The old one is destroyed after it's consumed
-        if (count > 10) break;  //** Kick out for other processing
+        if (count >= MQ_INCOMING_BATCH) break;  //** Kick out for other processing
     }
 
     mq_msg_destroy(msg);  //** Clean up
 
+//** Dispatch the EXECs together
+    if (n_exec > 0) thread_pool_direct_batch(c->pc->tp, mqt_exec, exec_task, n_exec);
+
     *nproc += count;  //** Inc processed commands
-    log_printf(5, "processing incoming end n=%d\n", n);
-    flush_log();
+    gop_log_printf(5, "processing incoming end n=%d\n", n);
+    gop_flush_log();
 
     return(0);
 }
@@ -1176,17 +1322,19 @@ int mqc_process_task(mq_conn_t *c, int *npoll, int *nproc)
     apr_thread_mutex_unlock(c->pc->lock);
 
     if (i == -1) {
-        log_printf(1, "OOPS! read=-1 task=%p!\n", task);
+        gop_log_printf(1, "OOPS! read=-1 task=%p!\n", task);
     }
 
 //** Wind down triggered so return
     if (*npoll == 1) return(0);
 
     if (task == NULL) {
-        log_printf(0, "Nothing to do\n");
+        gop_log_printf(0, "Nothing to do\n");
         return(0);
     }
 
+    if (task->gop != NULL) gop_timestamp(task->gop, GOP_TS_DEQUEUE);
+
     (*nproc)++;  //** Inc processed commands
 
 //** Convert the MAx exec time in sec to an abs timeout in usec
@@ -1197,14 +1345,14 @@ int mqc_process_task(mq_conn_t *c, int *npoll, int *nproc)
 //** Skip over the address
     f = mq_msg_first(task->msg);
     mq_get_frame(f, (void **)&data, &size);
-    log_printf(10, "address length = %d\n", size);
+    gop_log_printf(10, "address length = %d\n", size);
     while ((f != NULL) && (size != 0)) {
         f = mq_msg_next(task->msg);
         mq_get_frame(f, (void **)&data, &size);
-        log_printf(10, "length = %d\n", size);
+        gop_log_printf(10, "length = %d\n", size);
     }
     if (f == NULL) { //** Bad command
-        log_printf(0, "Invalid command!\n");
+        gop_log_printf(0, "Invalid command!\n");
         return(1);
     }
 
@@ -1212,13 +1360,13 @@ int mqc_process_task(mq_conn_t *c, int *npoll, int *nproc)
     f = mq_msg_next(task->msg);
     mq_get_frame(f, (void **)&data, &size);
     if (mq_data_compare(data, size, MQF_VERSION_KEY, MQF_VERSION_SIZE) != 0) {  //** Bad version number
-        log_printf(0, "Invalid version!\n");
-        log_printf(0, "length = %d\n", size);
+        gop_log_printf(0, "Invalid version!\n");
+        gop_log_printf(0, "length = %d\n", size);
         return(1);
     }
 
-    log_printf(10, "MQF_VERSION_KEY found\n");
-    log_printf(5, "task pass_through = %d\n", task->pass_through);
+    gop_log_printf(10, "MQF_VERSION_KEY found\n");
+    gop_log_printf(5, "task pass_through = %d\n", task->pass_through);
 //** This is the command
     f = mq_msg_next(task->msg);
     mq_get_frame(f, (void **)&data, &size);
@@ -1229,30 +1377,31 @@ int mqc_process_task(mq_conn_t *c, int *npoll, int *nproc)
         mq_get_frame(f, (void **)&data, &size);
         tracking = 1;
 
-        log_printf(5, "tracking enabled id_size=%d\n", size);
+        gop_log_printf(5, "tracking enabled id_size=%d\n", size);
 
         c->stats.outgoing[MQS_TRACKEXEC_INDEX]++;
     } else if (mq_data_compare(data, size, MQF_EXEC_KEY, MQF_EXEC_SIZE) == 0) { //** We track it
         c->stats.outgoing[MQS_EXEC_INDEX]++;
-        log_printf(10, "MQF_EXEC_KEY found, num outgoing EXEC = %d\n", c->stats.outgoing[MQS_EXEC_INDEX]);
+        gop_log_printf(10, "MQF_EXEC_KEY found, num outgoing EXEC = %d\n", c->stats.outgoing[MQS_EXEC_INDEX]);
     } else if (mq_data_compare(data, size, MQF_RESPONSE_KEY, MQF_RESPONSE_SIZE) == 0) { //** Response
         c->stats.outgoing[MQS_RESPONSE_INDEX]++;
-        log_printf(10, "MQF_RESPONSE_KEY found, num outgoing RESPONSE = %d\n", c->stats.outgoing[MQS_RESPONSE_INDEX]);
+        gop_log_printf(10, "MQF_RESPONSE_KEY found, num outgoing RESPONSE = %d\n", c->stats.outgoing[MQS_RESPONSE_INDEX]);
     } else if (mq_data_compare(data, size, MQF_PING_KEY, MQF_PING_SIZE) == 0) {
         c->stats.outgoing[MQS_PING_INDEX]++;
-        log_printf(10, "MQF_PING_KEY found, num outgoing PING = %d\n", c->stats.outgoing[MQS_PING_INDEX]);
+        gop_log_printf(10, "MQF_PING_KEY found, num outgoing PING = %d\n", c->stats.outgoing[MQS_PING_INDEX]);
     } else if (mq_data_compare(data, size, MQF_PONG_KEY, MQF_PONG_SIZE) == 0) {
         c->stats.outgoing[MQS_PONG_INDEX]++;
-        log_printf(10, "MQF_PONG_KEY found, num outgoing PONG = %d\n", c->stats.outgoing[MQS_PONG_INDEX]);
+        gop_log_printf(10, "MQF_PONG_KEY found, num outgoing PONG = %d\n", c->stats.outgoing[MQS_PONG_INDEX]);
     } else {
         c->stats.outgoing[MQS_UNKNOWN_INDEX]++;
-        log_printf(10, "Unknown key found! key = %d\n", data);
+        gop_log_printf(10, "Unknown key found! key = %d\n", data);
     }
 
 //** Send it on
+    if (task->gop != NULL) gop_timestamp(task->gop, GOP_TS_SEND);
     i = mq_send(c->sock, task->msg, 0);
     if (i == -1) {
-        log_printf(0, "Error sending msg! errno=%d\n", errno);
+        gop_log_printf(0, "Error sending msg! errno=%d\n", errno);
         mq_task_complete(c, task, OP_STATE_FAILURE);
         return(1);
     }
@@ -1260,8 +1409,8 @@ int mqc_process_task(mq_conn_t *c, int *npoll, int *nproc)
     if (tracking == 0) {     //** Exec the callback if not tracked
         mq_task_complete(c, task, OP_STATE_SUCCESS);
     } else {                 //** Track the task
-        log_printf(1, "TRACKING id_size=%d sid=%s\n", size, mq_id2str(data, size, b64, sizeof(b64)));
-        if (task->gop != NULL) log_printf(1, "TRACKING gid=%d\n", gop_id(task->gop));
+        gop_log_printf(1, "TRACKING id_size=%d sid=%s\n", size, mq_id2str(data, size, b64, sizeof(b64)));
+        if (task->gop != NULL) gop_log_printf(1, "TRACKING gid=%d\n", gop_id(task->gop));
 //** Insert it in the monitoring table
         type_malloc_clear(tn, mq_task_monitor_t, 1);
         tn->task = task;
@@ -1289,7 +1438,7 @@ int mq_conn_make(mq_conn_t *c)
     apr_time_t start, dt;
     mq_heartbeat_entry_t *hb;
 
-    log_printf(5, "START host=%s\n", c->pc->host);
+    gop_log_printf(5, "START host=%s\n", c->pc->host);
 
 //** Determing the type of socket to make based on
 //** the mq_conn_t* passed in
@@ -1297,7 +1446,7 @@ int mq_conn_make(mq_conn_t *c)
 //** c->sock = mq_socket_new(c->pc->ctx, MQ_TRACE_ROUTER);
 //** Hardcoded MQ_TRACE_ROUTER socket type
     c->sock = mq_socket_new(c->pc->ctx, c->pc->socket_type);
-    log_printf(0, "host = %s, connect_mode = %d\n", c->pc->host, c->pc->connect_mode);
+    gop_log_printf(0, "host = %s, connect_mode = %d\n", c->pc->host, c->pc->connect_mode);
     if (c->pc->connect_mode == MQ_CMODE_CLIENT) {
         err = mq_connect(c->sock, c->pc->host);
     } else {
@@ -1349,7 +1498,7 @@ int mq_conn_make(mq_conn_t *c)
         dt = apr_time_sec(dt);
 
         if (dt > 5) {
-            log_printf(0, "ERROR: Failed sending task to host=%s\n", c->pc->host);
+            gop_log_printf(0, "ERROR: Failed sending task to host=%s\n", c->pc->host);
             goto fail;
         }
 
@@ -1398,7 +1547,7 @@ int mq_conn_make(mq_conn_t *c)
     }
 
 fail:
-    log_printf(5, "END status=%d dt=%d frame=%d\n", err, dt, frame);
+    gop_log_printf(5, "END status=%d dt=%d frame=%d\n", err, dt, frame);
     mq_msg_destroy(msg);
     return(err);
 }
@@ -1418,19 +1567,20 @@ void *mq_conn_thread(apr_thread_t *th, void *data)
     double proc_rate, dt;
     char v;
 
-//log_printf(2, "START: uuid=%s heartbeat_dt=%d\n", c->mq_uuid, c->pc->heartbeat_dt);
-    log_printf(2, "START: host=%s heartbeat_dt=%d\n", c->pc->host, c->pc->heartbeat_dt);
+//gop_log_printf(2, "START: uuid=%s heartbeat_dt=%d\n", c->mq_uuid, c->pc->heartbeat_dt);
+    gop_log_printf(2, "START: host=%s heartbeat_dt=%d\n", c->pc->host, c->pc->heartbeat_dt);
+    tp_cpuset_apply(c->pc->mqc->conn_cpuset);
 //** Try and make the connection
 //** Right now the portal is locked so this routine can assume that.
     oops = err = mq_conn_make(c);
-    log_printf(2, "START(2): uuid=%s oops=%d\n", c->mq_uuid, oops);
+    gop_log_printf(2, "START(2): uuid=%s oops=%d\n", c->mq_uuid, oops);
 
 
 //** Notify the parent about the connections status via c->cefd
 //** It is then safe to manipulate c->pc->lock
     v = (err == 0) ? 1 : 2;  //** Make 1 success and 2 failure
 
-    log_printf(5, "after conn_make err=%d\n", err);
+    gop_log_printf(5, "after conn_make err=%d\n", err);
 
     write(c->cefd[1], &v, 1);
 
@@ -1455,7 +1605,7 @@ void *mq_conn_thread(apr_thread_t *th, void *data)
 
     do {
         k = mq_poll(pfd, npoll, heartbeat_ms);
-        log_printf(5, "pfd[EFD]=%d pdf[CONN]=%d npoll=%d n=%d errno=%d\n", pfd[PI_EFD].revents, pfd[PI_CONN].revents, npoll, k, errno);
+        gop_log_printf(5, "pfd[EFD]=%d pdf[CONN]=%d npoll=%d n=%d errno=%d\n", pfd[PI_EFD].revents, pfd[PI_CONN].revents, npoll, k, errno);
 
         //k=1; //FIXME
         if (k > 0) {  //** Got an event so process it
@@ -1464,36 +1614,36 @@ void *mq_conn_thread(apr_thread_t *th, void *data)
             nprocessed += nproc;
             total_proc += nproc;
             //finished += mqc_process_task(c, &npoll, &nprocessed);
-            log_printf(5, "after process_task finished=%d\n", finished);
+            gop_log_printf(5, "after process_task finished=%d\n", finished);
             nincoming = 0;
             if (pfd[PI_CONN].revents != 0) finished += mqc_process_incoming(c, &nincoming);
             //finished += mqc_process_incoming(c, &nincoming);
             nprocessed += nincoming;
             total_incoming += nincoming;
-            log_printf(5, "after process_incoming finished=%d\n", finished);
+            gop_log_printf(5, "after process_incoming finished=%d\n", finished);
         } else if (k < 0) {
-            log_printf(0, "ERROR on socket uuid=%s errno=%d\n", c->mq_uuid, errno);
-            flush_log();
+            gop_log_printf(0, "ERROR on socket uuid=%s errno=%d\n", c->mq_uuid, errno);
+            gop_flush_log();
             goto cleanup;
         }
 
         if ((apr_time_now() > next_hb_check) || (npoll == 1)) {
             finished += mqc_heartbeat(c, npoll);
-            log_printf(5, "after heartbeat finished=%d\n", finished);
+            gop_log_printf(5, "after heartbeat finished=%d\n", finished);
 
-            log_printf(5, "hb_old=" LU "\n", next_hb_check);
+            gop_log_printf(5, "hb_old=" LU "\n", next_hb_check);
             next_hb_check = apr_time_now() + apr_time_from_sec(1);
-            log_printf(5, "hb_new=" LU "\n", next_hb_check);
+            gop_log_printf(5, "hb_new=" LU "\n", next_hb_check);
 
             //** Check if we've been busy enough to stay open
             dt = apr_time_now() - last_check;
             dt = dt / APR_USEC_PER_SEC;
             proc_rate = (1.0*nprocessed) / dt;
-            log_printf(5, "processing rate=%lf nproc=%d dt=%lf\n", proc_rate, nprocessed, dt);
+            gop_log_printf(5, "processing rate=%lf nproc=%d dt=%lf\n", proc_rate, nprocessed, dt);
             if ((proc_rate < c->pc->min_ops_per_sec) && (slow_exit == 0)) {
                 apr_thread_mutex_lock(c->pc->lock);
                 if (c->pc->active_conn > 1) {
-                    log_printf(5, "processing rate=%lf curr_con=%d\n", proc_rate, c->pc->active_conn);
+                    gop_log_printf(5, "processing rate=%lf curr_con=%d\n", proc_rate, c->pc->active_conn);
                     slow_exit = 1;
                     npoll = 1;  //** Don't get any new commands.  Just process the ones I already have
                     c->pc->active_conn--;  //** We do this hear so any other threads see me exiting
@@ -1513,8 +1663,8 @@ cleanup:
     //** Cleanup my struct but don'r free(c).
     //** This is done on portal cleanup
     mq_stats_print(2, c->mq_uuid, &(c->stats));
-    log_printf(2, "END: uuid=%s total_incoming=" I64T " total_processed=" I64T " oops=%d\n", c->mq_uuid, total_incoming, total_proc, oops);
-    flush_log();
+    gop_log_printf(2, "END: uuid=%s total_incoming=" I64T " total_processed=" I64T " oops=%d\n", c->mq_uuid, total_incoming, total_proc, oops);
+    gop_flush_log();
 
     mq_conn_teardown(c);
 
@@ -1531,8 +1681,8 @@ cleanup:
     push(c->pc->closed_conn, c);
     apr_thread_mutex_unlock(c->pc->lock);
 
-    log_printf(2, "END: final\n");
-    flush_log();
+    gop_log_printf(2, "END: final\n");
+    gop_flush_log();
 
 
     return(NULL);
@@ -1595,7 +1745,7 @@ int mq_conn_create(mq_portal_t *p, int dowait)
 
     for (retry=0; retry<3; retry++) {
         err = mq_conn_create_actual(p, dowait);
-        log_printf(1, "retry=%d err=%d host=%s\n", retry, err, p->host);
+        gop_log_printf(1, "retry=%d err=%d host=%s\n", retry, err, p->host);
 
         if (err == 0) break;  //** Kick out if we got a good connection
         apr_sleep(apr_time_from_sec(2));
@@ -1652,8 +1802,8 @@ void mq_portal_destroy(mq_portal_t *p)
 
 //** Tell how many connections to close
     apr_thread_mutex_lock(p->lock);
-    log_printf(2, "host=%s active_conn=%d total_conn=%d\n", p->host, p->active_conn, p->total_conn);
-    flush_log();
+    gop_log_printf(2, "host=%s active_conn=%d total_conn=%d\n", p->host, p->active_conn, p->total_conn);
+    gop_flush_log();
     p->n_close = p->active_conn;
     n = p->n_close;
     apr_thread_mutex_unlock(p->lock);
@@ -1669,8 +1819,8 @@ void mq_portal_destroy(mq_portal_t *p)
     }
     apr_thread_mutex_unlock(p->lock);
 
-    log_printf(2, "host=%s closed_size=%d total_conn=%d\n", p->host, stack_size(p->closed_conn), p->total_conn);
-    flush_log();
+    gop_log_printf(2, "host=%s closed_size=%d total_conn=%d\n", p->host, stack_size(p->closed_conn), p->total_conn);
+    gop_flush_log();
 
     //** Clean up 
     //** Don;t have to worry about locking cause no one else exists
@@ -1781,12 +1931,13 @@ mq_portal_t *mq_portal_create(mq_context_t *mqc, char *host, int connect_mode)
 {
     mq_portal_t *p;
 
-    log_printf(15, "New portal host=%s\n", host);
+    gop_log_printf(15, "New portal host=%s\n", host);
 
     type_malloc_clear(p, mq_portal_t, 1);
 
     p->mqc = mqc;
     p->host = strdup(host);
+    p->host_id = gop_hostport_intern(p->host);
     p->command_table = mq_command_table_new(NULL, NULL);
 
     if (connect_mode == MQ_CMODE_CLIENT) {
@@ -1829,36 +1980,37 @@ void mq_destroy_context(mq_context_t *mqc)
     mq_portal_t *p;
     void *val;
 
-    log_printf(5, "Shutting down client_portals\n");
-    flush_log();
+    gop_log_printf(5, "Shutting down client_portals\n");
+    gop_flush_log();
     for (hi=apr_hash_first(mqc->mpool, mqc->client_portals); hi != NULL; hi = apr_hash_next(hi)) {
         apr_hash_this(hi, NULL, NULL, &val);
         p = (mq_portal_t *)val;
         apr_hash_set(mqc->client_portals, p->host, APR_HASH_KEY_STRING, NULL);
-        log_printf(5, "destroying p->host=%s\n", p->host);
-        flush_log();
+        gop_log_printf(5, "destroying p->host=%s\n", p->host);
+        gop_flush_log();
         mq_portal_destroy(p);
     }
-    log_printf(5, "Shutting down server_portals\n");
-    flush_log();
+    gop_log_printf(5, "Shutting down server_portals\n");
+    gop_flush_log();
     for (hi=apr_hash_first(mqc->mpool, mqc->server_portals); hi != NULL; hi = apr_hash_next(hi)) {
         apr_hash_this(hi, NULL, NULL, &val);
         p = (mq_portal_t *)val;
         apr_hash_set(mqc->server_portals, p->host, APR_HASH_KEY_STRING, NULL);
-        log_printf(5, "destroying p->host=%s\n", p->host);
-        flush_log();
+        gop_log_printf(5, "destroying p->host=%s\n", p->host);
+        gop_flush_log();
         mq_portal_destroy(p);
     }
-    log_printf(5, "Completed portal shutdown\n");
-    flush_log();
+    gop_log_printf(5, "Completed portal shutdown\n");
+    gop_flush_log();
     //sleep(1);
-    //log_printf(5, "AFTER SLEEP\n"); flush_log();
+    //gop_log_printf(5, "AFTER SLEEP\n"); gop_flush_log();
 
     mq_stats_print(2, "Portal total", &(mqc->stats));
 
     apr_hash_clear(mqc->client_portals);
 
     thread_pool_destroy_context(mqc->tp);
+    tp_cpuset_destroy(mqc->conn_cpuset);
 
     apr_thread_mutex_destroy(mqc->lock);
     apr_pool_destroy(mqc->mpool);
@@ -1866,8 +2018,8 @@ void mq_destroy_context(mq_context_t *mqc)
     free(mqc);
 
     //sleep(1);
-    log_printf(5, "AFTER SLEEP2\n");
-    flush_log();
+    gop_log_printf(5, "AFTER SLEEP2\n");
+    gop_flush_log();
 }
 
 //**************************************************************
@@ -1879,11 +2031,125 @@ void _mq_submit_op(void *arg, op_generic_t *gop)
     thread_pool_op_t *op = gop_get_tp(gop);
     mq_task_t *task = (mq_task_t *)op->arg;
 
-    log_printf(15, "gid=%d\n", gop_id(gop));
+    gop_log_printf(15, "gid=%d\n", gop_id(gop));
 
     mq_task_send(task->ctx, task);
 }
 
+//**************************************************************
+// _mq_submit_batch_op - GOP batch submit routine for MQ objects.
+//    The portals are resolved under a single context lock and
+//    each portal then gets all its tasks in one mq_submit_batch().
+//**************************************************************
+
+void _mq_submit_batch_op(void *arg, op_generic_t **gops, int n)
+{
+    mq_context_t *mqc;
+    mq_portal_t **portal;
+    mq_task_t **tasks, **batch;
+    mq_frame_t *f;
+    mq_portal_t *p;
+    char *host;
+    int i, j, size, nt;
+
+    if (n <= 0) return;
+
+    type_malloc(portal, mq_portal_t *, n);
+    type_malloc(tasks, mq_task_t *, n);
+    type_malloc(batch, mq_task_t *, n);
+
+    //** All the ops share the portal context so they share the MQ context as well
+    mqc = ((mq_task_t *)((thread_pool_op_t *)gop_get_tp(gops[0]))->arg)->ctx;
+
+    gop_log_printf(15, "n=%d gid[0]=%d\n", n, gop_id(gops[0]));
+
+    apr_thread_mutex_lock(mqc->lock);
+    for (i=0; i<n; i++) {
+        tasks[i] = (mq_task_t *)((thread_pool_op_t *)gop_get_tp(gops[i]))->arg;
+        f = mq_msg_first(tasks[i]->msg);
+        if (f == NULL) {  //** No address so it's ignored just like mq_task_send() does
+            portal[i] = NULL;
+            continue;
+        }
+        mq_get_frame(f, (void **)&host, &size);
+        portal[i] = _mq_client_portal_get(mqc, host, size);
+    }
+    apr_thread_mutex_unlock(mqc->lock);
+
+    //** Now hand each portal its tasks keeping the submission order
+    for (i=0; i<n; i++) {
+        p = portal[i];
+        if (p == NULL) continue;
+
+        nt = 0;
+        for (j=i; j<n; j++) {
+            if (portal[j] == p) {
+                batch[nt] = tasks[j];
+                portal[j] = NULL;
+                nt++;
+            }
+        }
+        mq_submit_batch(p, batch, nt);
+    }
+
+    free(batch);
+    free(tasks);
+    free(portal);
+}
+
+//**************************************************************
+// _mq_cancel_op - GOP cancel routine for MQ objects.  Tasks still
+//    waiting to be sent are pulled from the portals.  Tasks already sent
+//    are dropped from the connection's waiting table by its thread on the
+//    next heartbeat check or when the response arrives.
+//**************************************************************
+
+int _mq_cancel_op(void *arg, op_generic_t *gop)
+{
+    mq_context_t *mqc = (mq_context_t *)arg;
+    apr_hash_index_t *hi;
+    mq_portal_t *p;
+    mq_task_t *task;
+    Stack_t *cancelled;
+    void *val;
+    int n;
+
+    cancelled = new_stack();
+
+    n = 0;
+    apr_thread_mutex_lock(mqc->lock);
+    for (hi=apr_hash_first(NULL, mqc->client_portals); hi != NULL; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        p = (mq_portal_t *)val;
+
+        apr_thread_mutex_lock(p->lock);
+        move_to_top(p->tasks);
+        while ((task = (mq_task_t *)get_ele_data(p->tasks)) != NULL) {
+            if ((task->gop != NULL) && (gop_cancel_requested(task->gop) == 1)) {
+                delete_current(p->tasks, 0, 0);
+                push(cancelled, task);
+                n++;
+            } else {
+                move_down(p->tasks);
+            }
+        }
+        apr_thread_mutex_unlock(p->lock);
+    }
+    apr_thread_mutex_unlock(mqc->lock);
+
+    gop_log_printf(15, "gid=%d ncancel=%d\n", gop_id(gop), n);
+
+    while ((task = (mq_task_t *)pop(cancelled)) != NULL) {
+        thread_pool_direct_priority(mqc->tp, OP_PRIORITY_HIGH, mqtp_cancelled, task);
+    }
+    free_stack(cancelled, 0);
+
+    //** Also get any responses waiting on the TP reserve stacks
+    n += _tp_cancel(mqc->tp, gop);
+
+    return(n);
+}
+
 //**************************************************************
 //  mq_create_context - Creates a new MQ pool
 //**************************************************************
@@ -1891,6 +2157,8 @@ void _mq_submit_op(void *arg, op_generic_t *gop)
 mq_context_t *mq_create_context(inip_file_t *ifd, char *section)
 {
     mq_context_t *mqc;
+    char *str;
+    int executor, n;
 
     type_malloc_clear(mqc, mq_context_t, 1);
 
@@ -1899,6 +2167,7 @@ mq_context_t *mq_create_context(inip_file_t *ifd, char *section)
     mqc->min_threads = inip_get_integer(ifd, section, "min_threads", 2);
     mqc->max_threads = inip_get_integer(ifd, section, "max_threads", 20);
     mqc->max_recursion = inip_get_integer(ifd, section, "max_recursion", 5);
+    mqc->max_compensation = inip_get_integer(ifd, section, "max_compensation", -1);
     mqc->backlog_trigger = inip_get_integer(ifd, section, "backlog_trigger", 100);
     mqc->heartbeat_dt = inip_get_integer(ifd, section, "heartbeat_dt", 5);
     mqc->heartbeat_failure = inip_get_integer(ifd, section, "heartbeat_failure", 60);
@@ -1907,16 +2176,49 @@ mq_context_t *mq_create_context(inip_file_t *ifd, char *section)
     // New socket_type parameter
     mqc->socket_type = inip_get_integer(ifd, section, "socket_type", MQ_TRACE_ROUTER);
 
+    //** Thread pool executor: apr or ws.  Uses the TP default if not given
+    str = inip_get_string(ifd, section, "tp_executor", NULL);
+    executor = thread_pool_executor_parse(str);
+    if (str != NULL) free(str);
+
     apr_pool_create(&(mqc->mpool), NULL);
     apr_thread_mutex_create(&(mqc->lock), APR_THREAD_MUTEX_DEFAULT, mqc->mpool);
 
     //** Make the thread pool.  All GOP commands run through here.  We replace
     //**  the TP submit routine with our own.
-    mqc->tp = thread_pool_create_context("mq", mqc->min_threads, mqc->max_threads, mqc->max_recursion);
+    mqc->tp = thread_pool_create_context_ex("mq", mqc->min_threads, mqc->max_threads, mqc->max_recursion, executor);
+    if (mqc->max_compensation >= 0) thread_pool_max_compensation_set(mqc->tp, mqc->max_compensation);
+
+    //** CPU pinning.  Lists look like "0-7,16-23".  tp_numa splits the ws executor across the NUMA nodes
+    str = inip_get_string(ifd, section, "tp_cpus", NULL);
+    thread_pool_affinity_set(mqc->tp, str, inip_get_integer(ifd, section, "tp_numa", 0));
+    if (str != NULL) free(str);
+    str = inip_get_string(ifd, section, "conn_cpus", NULL);
+    mqc->conn_cpuset = tp_cpuset_parse(str);
+    if (str != NULL) free(str);
+
+    //** Adaptive sizing of the response pool between min_threads and max_threads
+    if (inip_get_integer(ifd, section, "tp_adaptive", 0) == 1) {
+        thread_pool_adaptive_enable(mqc->tp, mqc->min_threads,
+                                    inip_get_integer(ifd, section, "tp_target_wait_us", TP_ADAPT_TARGET_WAIT),
+                                    apr_time_from_msec(inip_get_integer(ifd, section, "tp_adaptive_interval_ms", 100)));
+    }
+
+    //** Run the response handlers on coroutines so the pool can be sized to the cores
+    mqc->coro_ops = inip_get_integer(ifd, section, "tp_coro", 0);
+    n = inip_get_integer(ifd, section, "tp_coro_stack_kb", 0);
+    if (n > 0) thread_pool_coro_stack_size_set(mqc->tp, 1024 * (size_t)n);
+
     mqc->pcfn = *(mqc->tp->pc->fn);
     mqc->pcfn.submit = _mq_submit_op;
+    mqc->pcfn.submit_batch = _mq_submit_batch_op;
     mqc->pcfn.sync_exec = NULL;
+    mqc->pcfn.cancel = _mq_cancel_op;
+    mqc->pcfn.help = NULL;  //** Ops go out over the wire so there's nothing to run locally
+    hportal_context_unpublish(mqc->tp->pc);  //** Swap fn and arg as a pair while nobody can see them
     mqc->tp->pc->fn = &(mqc->pcfn);
+    mqc->tp->pc->arg = mqc;
+    hportal_context_publish(mqc->tp->pc);
     assert_result_not_null(mqc->client_portals = apr_hash_make(mqc->mpool));
     assert_result_not_null(mqc->server_portals = apr_hash_make(mqc->mpool));
 
@@ -261,6 +261,7 @@ struct mq_portal_s {   //** Container for managing connections to a single host
     int counter;               //** Connections counter
     int n_close;               //** Number of connections being requested to close
     int socket_type;           //** Socket type
+    int host_id;               //** Interned host used to bin the task latencies
     uint64_t n_ops;            //** Operation count
     double min_ops_per_sec;    //** Minimum ops/sec needed to keep a connection open.
     Stack_t *tasks;            //** List of tasks
@@ -285,6 +286,9 @@ struct mq_context_s {      //** Main MQ context
     int min_threads;           //** Min number of worker threads
     int max_threads;           //** Max number of worker threads
     int max_recursion;         //** Max recursion depth expected to eliminate GOP tree deadlocks
+    int max_compensation;      //** Max extra threads to cover workers blocked in a gop wait.  -1 uses the TP default
+    tp_cpuset_t *conn_cpuset;  //** CPUs the connection threads are pinned to or NULL for any
+    int coro_ops;              //** If 1 response handlers run on coroutines.  See new_thread_pool_coro_op()
     int backlog_trigger;       //** Number of backlog ops to trigger a new connection
     int heartbeat_dt;          //** Heartbeat interval
     int heartbeat_failure;     //** Missing heartbeat DT for failure classification
@@ -375,6 +379,7 @@ void mq_command_table_set_default(mq_command_table_t *table, void *arg, mq_fn_ex
 
 int mq_task_send(mq_context_t *mqc, mq_task_t *task);
 int mq_submit(mq_portal_t *p, mq_task_t *task);
+int mq_submit_batch(mq_portal_t *p, mq_task_t **tasks, int n);
 int mq_portal_install(mq_context_t *mqc, mq_portal_t *p);
 void mq_portal_remove(mq_context_t *mqc, mq_portal_t *p);
 void mq_portal_destroy(mq_portal_t *p);
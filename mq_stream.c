@@ -53,14 +53,14 @@ op_status_t mqs_response_client_more(void *task_arg, int tid)
     mq_stream_t *mqs = (mq_stream_t *)task->arg;
     op_status_t status = op_success_status;
 
-    log_printf(5, "START msid=%d\n", mqs->msid);
+    gop_log_printf(5, "START msid=%d\n", mqs->msid);
 
     //** Parse the response
     mq_remove_header(task->response, 1);
 
     //** Wait for a notification that the data can be processed
     apr_thread_mutex_lock(mqs->lock);
-    log_printf(5, "INIT STATUS msid=%d waiting=%d processed=%d\n", mqs->msid, mqs->waiting, mqs->processed);
+    gop_log_printf(5, "INIT STATUS msid=%d waiting=%d processed=%d\n", mqs->msid, mqs->waiting, mqs->processed);
     mqs->transfer_packets++;
     mqs->waiting = 0;
     apr_thread_cond_broadcast(mqs->cond);
@@ -88,7 +88,7 @@ op_status_t mqs_response_client_more(void *task_arg, int tid)
 
     apr_thread_mutex_unlock(mqs->lock);
 
-    log_printf(5, "END msid=%d status=%d %d\n", mqs->msid, status.op_status, status.error_code);
+    gop_log_printf(5, "END msid=%d status=%d %d\n", mqs->msid, status.op_status, status.error_code);
 
     return(status);
 }
@@ -109,7 +109,7 @@ void mq_stream_read_request(mq_stream_t *mqs)
         apr_thread_cond_create(&(mqs->cond), mqs->mpool);
     }
 
-    log_printf(5, "msid=%d want_more=%c\n", mqs->msid, mqs->want_more);
+    gop_log_printf(5, "msid=%d want_more=%c\n", mqs->msid, mqs->want_more);
 
     //** Form the message
     msg = mq_make_exec_core_msg(mqs->remote_host, 1);
@@ -153,7 +153,7 @@ int mq_stream_read_wait(mq_stream_t *mqs)
 
     //** Flag the just processed gop to clean up
     apr_thread_mutex_lock(mqs->lock);
-    log_printf(5, "START msid=%d waiting=%d processed=%d gop_processed=%p\n", mqs->msid, mqs->waiting, mqs->processed, mqs->gop_processed);
+    gop_log_printf(5, "START msid=%d waiting=%d processed=%d gop_processed=%p\n", mqs->msid, mqs->waiting, mqs->processed, mqs->gop_processed);
     if (mqs->gop_processed != NULL) mqs->processed = 1;
     apr_thread_cond_broadcast(mqs->cond);
 
@@ -169,19 +169,19 @@ int mq_stream_read_wait(mq_stream_t *mqs)
     }
 
     if (err != 0) {
-        log_printf(2, "ERROR no more data available!\n");
+        gop_log_printf(2, "ERROR no more data available!\n");
         return(-1);
     }
 
     //** Now handle the waiting gop
     apr_thread_mutex_lock(mqs->lock);
-    log_printf(5, "before loop msid=%d waiting=%d processed=%d\n", mqs->msid, mqs->waiting, mqs->processed);
+    gop_log_printf(5, "before loop msid=%d waiting=%d processed=%d\n", mqs->msid, mqs->waiting, mqs->processed);
 
     while (mqs->waiting == 1) {
-        log_printf(5, "LOOP msid=%d waiting=%d processed=%d\n", mqs->msid, mqs->waiting, mqs->processed);
+        gop_log_printf(5, "LOOP msid=%d waiting=%d processed=%d\n", mqs->msid, mqs->waiting, mqs->processed);
         if (gop_will_block(mqs->gop_waiting) == 0)  { //** Oops!  failed request
             status = gop_get_status(mqs->gop_waiting);
-            log_printf(2, "msid=%d gid=%d status=%d\n", mqs->msid, gop_id(mqs->gop_waiting), status.op_status);
+            gop_log_printf(2, "msid=%d gid=%d status=%d\n", mqs->msid, gop_id(mqs->gop_waiting), status.op_status);
             if (status.op_status != OP_STATE_SUCCESS) {
                 mqs->waiting = -3;
                 err = 1;
@@ -214,7 +214,7 @@ int mq_stream_read_wait(mq_stream_t *mqs)
     if ((mqs->gop_processed == NULL) && (mqs->data != NULL)) {
         if ((mqs->data[MQS_STATE_INDEX] == MQS_MORE) && (mqs->want_more == MQS_MORE)) {
             err = 3;
-            log_printf(0, "ERROR: MQS gop processed=waiting=NULL  want_more set!!!!!! err=%d\n", err);
+            gop_log_printf(0, "ERROR: MQS gop processed=waiting=NULL  want_more set!!!!!! err=%d\n", err);
             fprintf(stderr, "ERROR: MQS gop processed=waiting=NULL want_more set!!!!!! err=%d\n", err);
         }
     }
@@ -226,7 +226,7 @@ int mq_stream_read_wait(mq_stream_t *mqs)
         }
     }
 
-    log_printf(5, "err=%d\n", err);
+    gop_log_printf(5, "err=%d\n", err);
     return(err);
 }
 
@@ -246,7 +246,7 @@ int mq_stream_read(mq_stream_t *mqs, void *rdata, int len)
     err = 0;
     do {
         nbytes = pack_read(mqs->pack, &(data[dpos]), nleft);
-        log_printf(2, "msid=%d len=%d nleft=%d dpos=%d nbytes=%d err=%d\n", mqs->msid, len, nleft, dpos, nbytes, err);
+        gop_log_printf(2, "msid=%d len=%d nleft=%d dpos=%d nbytes=%d err=%d\n", mqs->msid, len, nleft, dpos, nbytes, err);
 
         if (nbytes >= 0) {  //** Read some data
             nleft -= nbytes;
@@ -254,7 +254,7 @@ int mq_stream_read(mq_stream_t *mqs, void *rdata, int len)
 
             if (nleft > 0) {  //** Need to wait for more data
                 err = mq_stream_read_wait(mqs);
-                log_printf(2, "msid=%d after read_wait len=%d nleft=%d dpos=%d nbytes=%d err=%d\n", mqs->msid, len, nleft, dpos, nbytes, err);
+                gop_log_printf(2, "msid=%d after read_wait len=%d nleft=%d dpos=%d nbytes=%d err=%d\n", mqs->msid, len, nleft, dpos, nbytes, err);
             }
 
         } else {
@@ -277,7 +277,7 @@ int64_t mq_stream_read_varint(mq_stream_t *mqs, int *error)
 
     for (i=0; i<16; i++) {
         err = mq_stream_read(mqs, &(buffer[i]), 1);
-//log_printf(15, "i=%d buffer[i]=%u varint_need_more=%d, err=%d bpos=%d\n", i, buffer[i], varint_need_more(buffer[i]), err, mqs->bpos);
+//gop_log_printf(15, "i=%d buffer[i]=%u varint_need_more=%d, err=%d bpos=%d\n", i, buffer[i], varint_need_more(buffer[i]), err, mqs->bpos);
         if (err != 0) break;
         if (varint_need_more(buffer[i]) == 0) break;
     }
@@ -290,7 +290,7 @@ int64_t mq_stream_read_varint(mq_stream_t *mqs, int *error)
         *error = err;
     }
 
-    log_printf(15, "value=" I64T "\n", value);
+    gop_log_printf(15, "value=" I64T "\n", value);
 
     return(value);
 }
@@ -302,7 +302,7 @@ int64_t mq_stream_read_varint(mq_stream_t *mqs, int *error)
 void mq_stream_read_destroy(mq_stream_t *mqs)
 {
 
-    log_printf(1, "START msid=%d\n", mqs->msid);
+    gop_log_printf(1, "START msid=%d\n", mqs->msid);
 
     if (mqs->mpool == NULL) {  //** Nothing to do
         pack_destroy(mqs->pack);
@@ -317,9 +317,9 @@ void mq_stream_read_destroy(mq_stream_t *mqs)
 
     //** Consume all the current data and request the pending
     while ((mqs->gop_processed != NULL) || (mqs->gop_waiting != NULL)) {
-        log_printf(1, "Clearing pending processed=%d waiting=%p msid=%d\n", mqs->gop_processed, mqs->gop_waiting, mqs->msid);
-        if (mqs->gop_processed != NULL) log_printf(1, "processed gid=%d\n", gop_id(mqs->gop_processed));
-        if (mqs->gop_waiting != NULL) log_printf(1, "waiting gid=%d\n", gop_id(mqs->gop_waiting));
+        gop_log_printf(1, "Clearing pending processed=%d waiting=%p msid=%d\n", mqs->gop_processed, mqs->gop_waiting, mqs->msid);
+        if (mqs->gop_processed != NULL) gop_log_printf(1, "processed gid=%d\n", gop_id(mqs->gop_processed));
+        if (mqs->gop_waiting != NULL) gop_log_printf(1, "waiting gid=%d\n", gop_id(mqs->gop_waiting));
         mqs->want_more = MQS_ABORT;
         apr_thread_mutex_unlock(mqs->lock);
         mq_stream_read_wait(mqs);
@@ -328,14 +328,14 @@ void mq_stream_read_destroy(mq_stream_t *mqs)
 
     if (log_level() >= 15) {
         char *rhost = mq_address_to_string(mqs->remote_host);
-        log_printf(15, "remote_host as string = %s\n", rhost);
+        gop_log_printf(15, "remote_host as string = %s\n", rhost);
         if (rhost) free(rhost);
     }
     if (mqs->remote_host != NULL) mq_ongoing_host_dec(mqs->ongoing, mqs->remote_host, mqs->host_id, mqs->hid_len);
 
     apr_thread_mutex_unlock(mqs->lock);
 
-    log_printf(2, "msid=%d transfer_packets=%d\n", mqs->msid, mqs->transfer_packets);
+    gop_log_printf(2, "msid=%d transfer_packets=%d\n", mqs->msid, mqs->transfer_packets);
 
     //** Clean up
     if (mqs->stream_id != NULL) free(mqs->stream_id);
@@ -372,7 +372,7 @@ mq_stream_t *mq_stream_read_create(mq_context_t *mqc, mq_ongoing_t *on, char *ho
 
     if (log_level() > 5) {
         char *str = mq_address_to_string(remote_host);
-        log_printf(5, "remote_host=%s\n", str);
+        gop_log_printf(5, "remote_host=%s\n", str);
         if (str) free(str);
     }
 
@@ -383,34 +383,34 @@ mq_stream_t *mq_stream_read_create(mq_context_t *mqc, mq_ongoing_t *on, char *ho
     memcpy(mqs->stream_id, &(mqs->data[MQS_HANDLE_INDEX]), mqs->sid_len);
 
     ptype = (mqs->data[MQS_PACK_INDEX] == MQS_PACK_COMPRESS) ? PACK_COMPRESS : PACK_NONE;
-    log_printf(1, "msid=%d ptype=%d pack_type=%c\n", mqs->msid, ptype, mqs->data[MQS_PACK_INDEX]);
+    gop_log_printf(1, "msid=%d ptype=%d pack_type=%c\n", mqs->msid, ptype, mqs->data[MQS_PACK_INDEX]);
     mqs->pack = pack_create(ptype, PACK_READ, &(mqs->data[MQS_HEADER]), mqs->len - MQS_HEADER);
 
-    log_printf(5, "data_len=%d more=%c MQS_HEADER=%d\n", mqs->len, mqs->data[MQS_STATE_INDEX], MQS_HEADER);
+    gop_log_printf(5, "data_len=%d more=%c MQS_HEADER=%d\n", mqs->len, mqs->data[MQS_STATE_INDEX], MQS_HEADER);
 
     unsigned char buffer[1024];
     int n = (50 > mqs->len) ? mqs->len : 50;
-    log_printf(5, "printing 1st 50 bytes mqsbuf=%s\n", mq_id2str((char *)mqs->data, n, (char *)buffer, 1024));
+    gop_log_printf(5, "printing 1st 50 bytes mqsbuf=%s\n", mq_id2str((char *)mqs->data, n, (char *)buffer, 1024));
 
     if (mqs->data[MQS_STATE_INDEX] == MQS_MORE) { //** More data coming so ask for it
-        log_printf(5, "issuing read request\n");
+        gop_log_printf(5, "issuing read request\n");
 
         mqs->remote_host = mq_msg_new();
         mq_msg_append_msg(mqs->remote_host, remote_host, MQF_MSG_AUTO_FREE);
 
         if (log_level() >=15) {
             char *rhost = mq_address_to_string(mqs->remote_host);
-            log_printf(15, "remote_host as string = %s\n", rhost);
+            gop_log_printf(15, "remote_host as string = %s\n", rhost);
             if (rhost) free(rhost);
         }
 
-        log_printf(5, "before ongoing_inc\n");
+        gop_log_printf(5, "before ongoing_inc\n");
         mq_ongoing_host_inc(mqs->ongoing, mqs->remote_host, mqs->host_id, mqs->hid_len, mqs->timeout);
-        log_printf(5, "after ongoing_inc\n");
+        gop_log_printf(5, "after ongoing_inc\n");
         mq_stream_read_request(mqs);
     }
 
-    log_printf(5, "END\n");
+    gop_log_printf(5, "END\n");
 
     return(mqs);
 }
@@ -434,7 +434,7 @@ int mqs_write_send(mq_stream_t *mqs, mq_msg_t *address, mq_frame_t *fid)
 
     if (mqs->data == NULL) return(-1);
 
-    log_printf(1, "msid=%d address frame count=%d state_index=%c\n", mqs->msid, stack_size(address), mqs->data[MQS_STATE_INDEX]);
+    gop_log_printf(1, "msid=%d address frame count=%d state_index=%c\n", mqs->msid, stack_size(address), mqs->data[MQS_STATE_INDEX]);
     response = mq_make_response_core_msg(address, fid);
     mq_msg_append_mem(response, mqs->data, MQS_HEADER + pack_used(mqs->pack), MQF_MSG_AUTO_FREE);
     mq_msg_append_mem(response, NULL, 0, MQF_MSG_KEEP_DATA);  //** Empty frame
@@ -444,10 +444,10 @@ int mqs_write_send(mq_stream_t *mqs, mq_msg_t *address, mq_frame_t *fid)
 //if (n > 50) n = 50;
 //int i;
 //n=MQS_HEADER;
-//for (i=0; i<MQS_HEADER; i++) log_printf(2, "i=%d c=%c\n", i, mqs->data[i]);
-//log_printf(2, "printing 1st 50 bytes mqsbuf=%s\n", mq_id2str((char *)mqs->data, n, buffer, 1024));
+//for (i=0; i<MQS_HEADER; i++) gop_log_printf(2, "i=%d c=%c\n", i, mqs->data[i]);
+//gop_log_printf(2, "printing 1st 50 bytes mqsbuf=%s\n", mq_id2str((char *)mqs->data, n, buffer, 1024));
 
-    log_printf(2, "nbytes=%d more=%c\n", pack_used(mqs->pack), mqs->data[MQS_STATE_INDEX]);
+    gop_log_printf(2, "nbytes=%d more=%c\n", pack_used(mqs->pack), mqs->data[MQS_STATE_INDEX]);
 
     mqs->unsent_data = 0;
     if (mqs->data[MQS_STATE_INDEX] == MQS_MORE) {
@@ -469,11 +469,11 @@ int mqs_write_send(mq_stream_t *mqs, mq_msg_t *address, mq_frame_t *fid)
 
     err = mq_submit(mqs->server_portal, mq_task_new(mqs->mqc, response, NULL, NULL, 30));
     if (err != 0) {
-        log_printf(5, "ERROR with mq_submit=%d\n", err);
+        gop_log_printf(5, "ERROR with mq_submit=%d\n", err);
         mqs->want_more = MQS_ABORT;
     }
 
-//flush_log();
+//gop_flush_log();
 //sleep(5);
     return(err);
 }
@@ -487,7 +487,7 @@ void *mqs_flusher_thread(apr_thread_t *th, void *arg)
     mq_stream_t *mqs = (mq_stream_t *)arg;
     apr_time_t wakeup;
 
-    log_printf(1, "START: msid=%d\n", mqs->msid);
+    gop_log_printf(1, "START: msid=%d\n", mqs->msid);
 
     //** Figure out when to flush
     if (mqs->timeout > 60) {
@@ -503,7 +503,7 @@ void *mqs_flusher_thread(apr_thread_t *th, void *arg)
     mqs->waiting = 1;
     if (mqs->ready == 0) apr_thread_cond_timedwait(mqs->cond, mqs->lock, wakeup);
 
-    log_printf(5, "msid=%d want_more=%c state_index=%c data=%p\n", mqs->msid, mqs->want_more, mqs->data[MQS_STATE_INDEX], mqs->data);
+    gop_log_printf(5, "msid=%d want_more=%c state_index=%c data=%p\n", mqs->msid, mqs->want_more, mqs->data[MQS_STATE_INDEX], mqs->data);
     //** Form the message. NOTE that the rest of the message is the address
     if (mqs->want_more == MQS_ABORT) {
         if (mqs->data != NULL) mqs->data[MQS_STATE_INDEX] = mqs->want_more;
@@ -521,7 +521,7 @@ void *mqs_flusher_thread(apr_thread_t *th, void *arg)
 
     apr_thread_mutex_unlock(mqs->lock);
 
-    log_printf(1, "END: msid=%d\n", mqs->msid);
+    gop_log_printf(1, "END: msid=%d\n", mqs->msid);
 
 //** We can exit now cause it's up to the caller to send a new request
 //** Which will be handled by the callback
@@ -546,7 +546,7 @@ void mqs_server_more_cb(void *arg, mq_task_t *task)
     int64_t timeout;
 
 
-    log_printf(5, "START\n");
+    gop_log_printf(5, "START\n");
 
     msg = task->msg;  //** Don't have to worry about msg cleanup.  It's handled at a higher level
     err = -1;
@@ -562,14 +562,14 @@ void mqs_server_more_cb(void *arg, mq_task_t *task)
 
     fmqs = mq_msg_pop(msg);  //** This is the MQS handle
     mq_get_frame(fmqs, (void **)&data, &len);
-    log_printf(5, "id_size=%d handle_len=%d\n", id_size, len);
+    gop_log_printf(5, "id_size=%d handle_len=%d\n", id_size, len);
     key = *(intptr_t *)data;
     if ((mqs = mq_ongoing_get(ongoing, (char *)id, id_size, key)) == NULL) {
-        log_printf(5, "Invalid handle!\n");
+        gop_log_printf(5, "Invalid handle!\n");
         goto fail;
     }
 
-    log_printf(1, "msid=%d\n", mqs->msid);
+    gop_log_printf(1, "msid=%d\n", mqs->msid);
 
     f = mq_msg_pop(msg);     //** This is the mode MQS_MORE or MQS_ABORT along with the timeout
     mq_get_frame(f, (void **)&data, &len);
@@ -579,11 +579,11 @@ void mqs_server_more_cb(void *arg, mq_task_t *task)
         } else if (data[0] == MQS_ABORT) {
             mode = MQS_ABORT;
         } else {
-            log_printf(5, "Invalid mode! Triggering an abort. mode=%c\n", data[0]);
+            gop_log_printf(5, "Invalid mode! Triggering an abort. mode=%c\n", data[0]);
             mode = MQS_ABORT;
         }
     } else {
-        log_printf(5, "Invalid mode size=%d! Triggering an abort.\n", len);
+        gop_log_printf(5, "Invalid mode size=%d! Triggering an abort.\n", len);
         mode = MQS_ABORT;
     }
 
@@ -611,7 +611,7 @@ void mqs_server_more_cb(void *arg, mq_task_t *task)
     }
     wakeup += apr_time_now();
 
-    log_printf(1, "Waiting for application to consume data msid=%d\n", mqs->msid);
+    gop_log_printf(1, "Waiting for application to consume data msid=%d\n", mqs->msid);
     err = 0;
     while ((mqs->ready == 0) && (mqs->want_more == MQS_MORE)) {
         apr_thread_cond_timedwait(mqs->cond, mqs->lock, apr_time_from_sec(1));
@@ -619,9 +619,9 @@ void mqs_server_more_cb(void *arg, mq_task_t *task)
             err = 1;     //** Kick out and send whatever's there
             mqs->ready = 1;
         }
-        log_printf(1, "msid=%d err=%d ready=%d want_more=%c\n", mqs->msid, err, mqs->ready, mqs->want_more);
+        gop_log_printf(1, "msid=%d err=%d ready=%d want_more=%c\n", mqs->msid, err, mqs->ready, mqs->want_more);
     }
-    log_printf(1, "Application has consumed the data msid=%d err=%d\n", mqs->msid, err);
+    gop_log_printf(1, "Application has consumed the data msid=%d err=%d\n", mqs->msid, err);
 
     //** Form the message. NOTE that the rest of the message is the address
     if (mqs->want_more == MQS_ABORT) {
@@ -633,7 +633,7 @@ void mqs_server_more_cb(void *arg, mq_task_t *task)
     err = mqs_write_send(mqs, msg, fid);
 
     if (err != 0) {
-        log_printf(5, "ERROR during send! Triggering an abort.\n");
+        gop_log_printf(5, "ERROR during send! Triggering an abort.\n");
         mqs->want_more = MQS_ABORT;
     }
 
@@ -649,7 +649,7 @@ void mqs_server_more_cb(void *arg, mq_task_t *task)
     mq_ongoing_release(ongoing, (char *)id, id_size, key);  //** Do this to avoiud a deadlock on failure in mqs_on_fail()
 
 fail:
-    log_printf(1, "END msid=%d\n", err);
+    gop_log_printf(1, "END msid=%d\n", err);
 
     mq_frame_destroy(fuid);
     mq_frame_destroy(fmqs);
@@ -676,10 +676,10 @@ int mq_stream_write_flush(mq_stream_t *mqs)
     apr_thread_cond_broadcast(mqs->cond);
 
     //** Now wait for the pending call acknowledgement
-    log_printf(1, "Flushing stream msid=%d now=" TT " timeout(s)=%d waiting=%d\n", mqs->msid, apr_time_now(), mqs->timeout, mqs->waiting);
+    gop_log_printf(1, "Flushing stream msid=%d now=" TT " timeout(s)=%d waiting=%d\n", mqs->msid, apr_time_now(), mqs->timeout, mqs->waiting);
     while (mqs->waiting == 0) {
         if (((mqs->want_more == MQS_ABORT) || (mqs->data == NULL) || mqs->dead_connection == 1))  { //** Oops! No client request or abort flagged
-            if (apr_time_now() > expire) log_printf(0, "EXPIRED msid=%d now=" TT " expire= " TT " timeout(s)=%d\n", mqs->msid, apr_time_now(), expire, mqs->timeout);
+            if (apr_time_now() > expire) gop_log_printf(0, "EXPIRED msid=%d now=" TT " expire= " TT " timeout(s)=%d\n", mqs->msid, apr_time_now(), expire, mqs->timeout);
             mqs->waiting = -3;
             err = 1;
         } else {
@@ -689,10 +689,10 @@ int mq_stream_write_flush(mq_stream_t *mqs)
 
     while ((mqs->ready == 1) && (mqs->waiting != -3)) {
         apr_thread_cond_timedwait(mqs->cond, mqs->lock, dt);
-        log_printf(1, "waiting for send to complete msid=%d ready=%d now=" TT " timeout(s)=%d\n", mqs->msid, mqs->ready, apr_time_now(), mqs->timeout);
+        gop_log_printf(1, "waiting for send to complete msid=%d ready=%d now=" TT " timeout(s)=%d\n", mqs->msid, mqs->ready, apr_time_now(), mqs->timeout);
     }
 
-    log_printf(1, "Stream flush completed.  mqs->waiting=%d msid=%d want_more=%c dead=%d data=%p now=" TT "\n", mqs->waiting, mqs->msid, mqs->want_more, mqs->dead_connection, mqs->data, apr_time_now());
+    gop_log_printf(1, "Stream flush completed.  mqs->waiting=%d msid=%d want_more=%c dead=%d data=%p now=" TT "\n", mqs->waiting, mqs->msid, mqs->want_more, mqs->dead_connection, mqs->data, apr_time_now());
 
     if ((err == 0) && (mqs->waiting < -1)) err = 1;  //** Check if sending had an error
 
@@ -734,18 +734,18 @@ int mq_stream_write(mq_stream_t *mqs, void *vdata, int len)
         apr_thread_mutex_lock(mqs->lock);
     }
 
-    log_printf(5, "START bpos=%d len=%d msid=%d\n", pack_used(mqs->pack), len, mqs->msid);
+    gop_log_printf(5, "START bpos=%d len=%d msid=%d\n", pack_used(mqs->pack), len, mqs->msid);
 
     do {
         grew_space = 0;
         nbytes = mqs->len - pack_used(mqs->pack) - MQS_HEADER;
-        log_printf(5, "nbytes=%d mqs->len=%d mqs->max_size=%d\n", nbytes, mqs->len, mqs->max_size);
+        gop_log_printf(5, "nbytes=%d mqs->len=%d mqs->max_size=%d\n", nbytes, mqs->len, mqs->max_size);
         if (nbytes < nleft) { //** See if we can grow the space
             if (mqs->len < mqs->max_size) {
                 nbytes = 2 * mqs->len + nleft;
                 if (nbytes > mqs->max_size) nbytes = mqs->max_size;
 
-                log_printf(5, "growing space=%d\n", nbytes);
+                gop_log_printf(5, "growing space=%d\n", nbytes);
                 type_realloc(mqs->data, unsigned char, nbytes);
                 mqs->len = nbytes;
                 pack_write_resized(mqs->pack, &(mqs->data[MQS_HEADER]), mqs->len - MQS_HEADER);
@@ -754,7 +754,7 @@ int mq_stream_write(mq_stream_t *mqs, void *vdata, int len)
         }
 
         nbytes = pack_write(mqs->pack, &(data[dpos]), nleft);
-        log_printf(5, "nbytes_packed=%d nleft=%d mqs->len=%d\n", nbytes, nleft, mqs->len);
+        gop_log_printf(5, "nbytes_packed=%d nleft=%d mqs->len=%d\n", nbytes, nleft, mqs->len);
         if (nbytes > 0) {  //** Stored some data
             nleft -= nbytes;
             dpos += nbytes;
@@ -781,12 +781,12 @@ int mq_stream_write(mq_stream_t *mqs, void *vdata, int len)
                 apr_thread_mutex_lock(mqs->lock);
             }
         } else if (mqs->shutdown == 1) {  //** Last write so signal it
-            log_printf(5, "Doing final flush sent_data=%d msid=%d\n", mqs->msid, mqs->sent_data);
+            gop_log_printf(5, "Doing final flush sent_data=%d msid=%d\n", mqs->msid, mqs->sent_data);
             err = 0;
             do {
                 //** Last set of writes so flush everything
                 nbytes = pack_write_flush(mqs->pack);
-                log_printf(5, "msid=%d pack_write_flush=%d\n", mqs->msid, nbytes);
+                gop_log_printf(5, "msid=%d pack_write_flush=%d\n", mqs->msid, nbytes);
                 if ((nbytes == PACK_FINISHED) || (nbytes == PACK_ERROR)) {
                     if (nbytes == PACK_ERROR) pack_consumed(mqs->pack);  //** Remove garbage data
                     mqs->want_more = MQS_FINISHED;
@@ -816,12 +816,12 @@ int mq_stream_write(mq_stream_t *mqs, void *vdata, int len)
                 }
             } while (nbytes != PACK_FINISHED);
 fail:
-            log_printf(5, "msid=%d after final flush want_more=%c pack=%d err=%d\n", mqs->msid, mqs->want_more, nbytes, err);
+            gop_log_printf(5, "msid=%d after final flush want_more=%c pack=%d err=%d\n", mqs->msid, mqs->want_more, nbytes, err);
 
         }
     } while ((nleft > 0) && (err == 0));
 
-    log_printf(5, "END msid=%d bpos=%d\n", mqs->msid, pack_used(mqs->pack));
+    gop_log_printf(5, "END msid=%d bpos=%d\n", mqs->msid, pack_used(mqs->pack));
     if (mqs->mpool != NULL) {
         apr_thread_mutex_unlock(mqs->lock);
     }
@@ -853,7 +853,7 @@ void mq_stream_write_destroy(mq_stream_t *mqs)
     apr_status_t status;
     int abort_error = 0;
 
-    log_printf(1, "Destroying stream msid=%d\n", mqs->msid);
+    gop_log_printf(1, "Destroying stream msid=%d\n", mqs->msid);
 
     //** Change the flag which signals we don't want anything else
     if (mqs->mpool != NULL) {
@@ -873,18 +873,18 @@ void mq_stream_write_destroy(mq_stream_t *mqs)
     }
 
     if (mqs->flusher_thread != NULL) { //** Shut down the flusher
-        log_printf(1, "Waiting for flusher to complete msid=%d\n", mqs->msid);
+        gop_log_printf(1, "Waiting for flusher to complete msid=%d\n", mqs->msid);
 
         apr_thread_cond_broadcast(mqs->cond);
         apr_thread_mutex_unlock(mqs->lock);
         apr_thread_join(&status, mqs->flusher_thread);
-        log_printf(1, "flusher shut down msid=%d\n", mqs->msid);
+        gop_log_printf(1, "flusher shut down msid=%d\n", mqs->msid);
 
         apr_thread_mutex_lock(mqs->lock); //** Re-acuire the lock
     }
 
 
-    log_printf(2, "msid=%d sent_data=%d abort_error=%d oo=%p mpool=%p transfer_packets=%d\n", mqs->msid, mqs->sent_data, abort_error, mqs->oo, mqs->mpool, mqs->transfer_packets);
+    gop_log_printf(2, "msid=%d sent_data=%d abort_error=%d oo=%p mpool=%p transfer_packets=%d\n", mqs->msid, mqs->sent_data, abort_error, mqs->oo, mqs->mpool, mqs->transfer_packets);
 
     if (mqs->mpool != NULL) {
         apr_thread_mutex_unlock(mqs->lock);    //** Release the lock in case the ongoing cleanup thread is trying to clean up as well
@@ -906,7 +906,7 @@ void mq_stream_write_destroy(mq_stream_t *mqs)
     pack_destroy(mqs->pack);
     if (mqs->unsent_data == 1) free(mqs->data);
 
-    log_printf(5, "END msid=%d\n", mqs->msid);
+    gop_log_printf(5, "END msid=%d\n", mqs->msid);
     free(mqs);
 
     return;
@@ -948,10 +948,10 @@ mq_stream_t *mq_stream_write_create(mq_context_t *mqc, mq_portal_t *server_porta
     key = (intptr_t)mqs;
     memcpy(&(mqs->data[MQS_HANDLE_INDEX]), &key, sizeof(key));
     ptype = (mqs->data[MQS_PACK_INDEX] == MQS_PACK_COMPRESS) ? PACK_COMPRESS : PACK_NONE;
-    log_printf(1, "msid=%d ptype=%d pack_type=%c\n", mqs->msid, ptype, mqs->data[MQS_PACK_INDEX]);
+    gop_log_printf(1, "msid=%d ptype=%d pack_type=%c\n", mqs->msid, ptype, mqs->data[MQS_PACK_INDEX]);
     mqs->pack = pack_create(ptype, PACK_WRITE, &(mqs->data[MQS_HEADER]), mqs->len-MQS_HEADER);
 
-    log_printf(5, "initial used bpos=%d\n", pack_used(mqs->pack));
+    gop_log_printf(5, "initial used bpos=%d\n", pack_used(mqs->pack));
 
     //** Launch the flusher now if requested
     if (launch_flusher == 1) {
@@ -72,7 +72,7 @@ int zero_native_bind(mq_socket_t *socket, const char *format, ...)
     n = errno;
     va_end(args);
 
-    log_printf(0, "id=!%s! err=%d errno=%d\n", id, err, n);
+    gop_log_printf(0, "id=!%s! err=%d errno=%d\n", id, err, n);
 
     return((err == -1) ? -1 : 0);
 }
@@ -93,7 +93,7 @@ int zero_native_connect(mq_socket_t *socket, const char *format, ...)
         snprintf(buf, 255, format, args);
         snprintf(id, 255, "%s:" I64T , buf, random_int(1, 1000000));
         zsocket_set_identity(socket->arg, id);
-        log_printf(4, "Unique hostname created = %s\n", id);
+        gop_log_printf(4, "Unique hostname created = %s\n", id);
     }
 
     err = zsocket_connect(socket->arg, format, args);
@@ -142,11 +142,11 @@ int zero_native_send(mq_socket_t *socket, mq_msg_t *msg, int flags)
     n = 0;
     f = mq_msg_first(msg);
     if (f->len > 1) {
-        log_printf(5, "dest=!%.*s! nframes=%d\n", f->len, (char *)(f->data), stack_size(msg));
-        flush_log();
+        gop_log_printf(5, "dest=!%.*s! nframes=%d\n", f->len, (char *)(f->data), stack_size(msg));
+        gop_flush_log();
     } else {
-        log_printf(5, "dest=(single byte) nframes=%d\n", stack_size(msg));
-        flush_log();
+        gop_log_printf(5, "dest=(single byte) nframes=%d\n", stack_size(msg));
+        gop_flush_log();
     }
 
     while ((fn = mq_msg_next(msg)) != NULL) {
@@ -157,11 +157,11 @@ int zero_native_send(mq_socket_t *socket, mq_msg_t *msg, int flags)
                 if (errno == EHOSTUNREACH) usleep(100);
             }
             loop++;
-            log_printf(5, "sending frame=%d len=%d bytes=%d errno=%d loop=%d\n", count, f->len, bytes, errno, loop);
-            flush_log();
+            gop_log_printf(5, "sending frame=%d len=%d bytes=%d errno=%d loop=%d\n", count, f->len, bytes, errno, loop);
+            gop_flush_log();
             if (f->len>0) {
-                log_printf(5, "byte=%uc\n", (unsigned char)f->data[0]);
-                flush_log();
+                gop_log_printf(5, "byte=%uc\n", (unsigned char)f->data[0]);
+                gop_flush_log();
             }
         } while ((bytes == -1) && (loop < 10));
         n += bytes;
@@ -171,10 +171,12 @@ int zero_native_send(mq_socket_t *socket, mq_msg_t *msg, int flags)
 
     if (f != NULL) n += zmq_send(socket->arg, f->data, f->len, 0);
 
+    gop_trace(GOP_TP_MQ_SEND, count + 1, n);
+
     if (f != NULL) {
-        log_printf(5, "last frame frame=%d len=%d ntotal=%d\n", count, f->len, n);
+        gop_log_printf(5, "last frame frame=%d len=%d ntotal=%d\n", count, f->len, n);
     } else {
-        log_printf(0, "ERROR: missing last frame!\n");
+        gop_log_printf(0, "ERROR: missing last frame!\n");
     }
     return((n>0) ? 0 : -1);
 }
@@ -192,7 +194,7 @@ int zero_native_recv(mq_socket_t *socket, mq_msg_t *msg, int flags)
     if ((flags & MQ_DONTWAIT) > 0) {
         more = 0;
         rc = zmq_getsockopt (socket->arg, ZMQ_EVENTS, &more, &msize);
-        log_printf(5, "more=" I64T "\n", more);
+        gop_log_printf(5, "more=" I64T "\n", more);
         assert (rc == 0);
         if ((more & ZMQ_POLLIN) == 0) return(-1);
     }
@@ -205,7 +207,7 @@ int zero_native_recv(mq_socket_t *socket, mq_msg_t *msg, int flags)
         rc = zmq_msg_init(&(f->zmsg));
         assert (rc == 0);
         rc = zmq_msg_recv(&(f->zmsg), socket->arg, flags);
-        log_printf(15, "rc=%d errno=%d\n", rc, errno);
+        gop_log_printf(15, "rc=%d errno=%d\n", rc, errno);
         assert (rc != -1);
 
         rc = zmq_getsockopt (socket->arg, ZMQ_RCVMORE, &more, &msize);
@@ -218,10 +220,11 @@ int zero_native_recv(mq_socket_t *socket, mq_msg_t *msg, int flags)
         mq_msg_append_frame(msg, f);
         n += f->len;
         nframes++;
-        log_printf(5, "more=" I64T "\n", more);
+        gop_log_printf(5, "more=" I64T "\n", more);
     } while (more > 0);
 
-    log_printf(5, "total bytes=%d nframes=%d\n", n, nframes);
+    gop_log_printf(5, "total bytes=%d nframes=%d\n", n, nframes);
+    gop_trace(GOP_TP_MQ_RECV, nframes, n);
 
     return((n>0) ? 0 : -1);
 }
@@ -380,7 +383,7 @@ mq_socket_t *zero_create_simple_router_socket(mq_socket_context_t *ctx)
 mq_socket_t *zero_create_socket(mq_socket_context_t *ctx, int stype)
 {
     mq_socket_t *s = NULL;
-    log_printf(15, "\t\tstype=%d\n", stype);
+    gop_log_printf(15, "\t\tstype=%d\n", stype);
     switch (stype) {
     case MQ_DEALER:
     case MQ_PAIR:
@@ -396,7 +399,7 @@ mq_socket_t *zero_create_socket(mq_socket_context_t *ctx, int stype)
         s = zero_create_round_robin_socket(ctx);
         break;
     default:
-        log_printf(0, "Unknown socket type: %d\n", stype);
+        gop_log_printf(0, "Unknown socket type: %d\n", stype);
         free(s);
         s = NULL;
     }
@@ -413,11 +416,11 @@ void zero_socket_context_destroy(mq_socket_context_t *ctx)
     //** Kludge to get around race issues in 0mq when closing sockets manually vs letting
     //** zctx_destroy() close them
 //  sleep(1);
-    log_printf(5, "after sleep\n");
-    flush_log();
+    gop_log_printf(5, "after sleep\n");
+    gop_flush_log();
     zctx_destroy((zctx_t **)&(ctx->arg));
-    log_printf(5, "after zctx_destroy\n");
-    flush_log();
+    gop_log_printf(5, "after zctx_destroy\n");
+    gop_flush_log();
     free(ctx);
 }
 
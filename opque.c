@@ -33,12 +33,24 @@ http://www.accre.vanderbilt.edu
 #include "assert_result.h"
 #include <apr_thread_mutex.h>
 #include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
+#include <apr_atomic.h>
+#include <apr_env.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "type_malloc.h"
 #include "log.h"
 #include "opque.h"
 #include "atomic_counter.h"
+#include "gop_slab.h"
 
 void opque_free(opque_t *q, int mode);
 void gop_dummy_init();
@@ -49,6 +61,14 @@ atomic_int_t _opque_counter = 0;
 apr_pool_t *_opque_pool = NULL;
 pigeon_coop_t *_gop_control = NULL;
 
+//** Defined in gop.c
+int _gop_dep_start_hold(op_generic_t *gop);
+void _gop_submit(op_generic_t *gop);
+void _gop_callbacks_run(op_generic_t *gop, int value);
+void _gop_cond_broadcast(op_generic_t *gop);
+
+void _opque_submit_all(opque_t *que);
+
 //*************************************************************
 //  _opque_print_stack - Prints the list stack
 //*************************************************************
@@ -62,12 +82,159 @@ void _opque_print_stack(Stack_t *stack)
 
     move_to_top(stack);
     while ((gop = (op_generic_t *)get_ele_data(stack)) != NULL) {
-        log_printf(15, "    i=%d gid=%d type=%d\n", i, gop_id(gop), gop_get_type(gop));
+        gop_log_printf(15, "    i=%d gid=%d type=%d\n", i, gop_id(gop), gop_get_type(gop));
         i++;
         move_down(stack);
     }
 
-    if (stack_size(stack) != i) log_printf(0, "Stack size mismatch! stack_size=%d i=%d\n", stack_size(stack), i);
+    if (stack_size(stack) != i) gop_log_printf(0, "Stack size mismatch! stack_size=%d i=%d\n", stack_size(stack), i);
+}
+
+//*************************************************************
+// _opque_ring_init - Sizes and creates the finished ring.  Called
+//    when the que starts executing.
+//    NOTE: The que should be locked
+//*************************************************************
+
+void _opque_ring_init(que_data_t *q)
+{
+    opque_ring_slot_t *slot;
+    apr_uint32_t i, n, want;
+
+    if (q->ring.slot != NULL) return;
+
+    want = atomic_get(q->nleft);
+    if (want > OPQUE_RING_MAX) want = OPQUE_RING_MAX;
+    for (n=OPQUE_RING_MIN; n<want; n <<= 1) {}
+
+    type_malloc(slot, opque_ring_slot_t, n);
+    for (i=0; i<n; i++) {
+        atomic_set(slot[i].seq, i);
+        slot[i].gop = NULL;
+    }
+
+    q->ring.mask = n - 1;
+    q->ring.head = 0;
+    atomic_set(q->ring.tail, 0);
+    apr_atomic_xchgptr((volatile void **)&(q->ring.slot), slot);  //** Publish it last
+}
+
+//*************************************************************
+// _opque_ring_put - Adds a finished task to the ring without locking.
+//    Returns 0 on success and 1 if the ring is full or doesn't exist.
+//*************************************************************
+
+int _opque_ring_put(opque_ring_t *r, op_generic_t *gop)
+{
+    opque_ring_slot_t *s;
+    apr_uint32_t pos, seq, curr;
+    int diff;
+
+    if (r->slot == NULL) return(1);
+
+    pos = atomic_get(r->tail);
+    for (;;) {
+        s = &(r->slot[pos & r->mask]);
+        seq = atomic_get(s->seq);
+        diff = (int)(seq - pos);
+        if (diff == 0) {  //** Free slot so try and claim it
+            curr = atomic_cas(r->tail, pos+1, pos);
+            if (curr == pos) break;
+            pos = curr;
+        } else if (diff < 0) {  //** Ring is full
+            return(1);
+        } else {  //** Somebody else got it first
+            pos = atomic_get(r->tail);
+        }
+    }
+
+    s->gop = gop;
+    atomic_set(s->seq, pos+1);  //** Publish it
+    return(0);
+}
+
+//*************************************************************
+// _opque_ring_get - Removes the next finished task from the ring or
+//    returns NULL if it's empty.
+//    NOTE: The que should be locked since there is only 1 consumer
+//*************************************************************
+
+op_generic_t *_opque_ring_get(opque_ring_t *r)
+{
+    opque_ring_slot_t *s;
+    op_generic_t *gop;
+
+    if (r->slot == NULL) return(NULL);
+
+    s = &(r->slot[r->head & r->mask]);
+    if (atomic_get(s->seq) != r->head + 1) return(NULL);
+
+    gop = s->gop;
+    atomic_set(s->seq, r->head + r->mask + 1);  //** Hand the slot back to the producers
+    r->head++;
+
+    return(gop);
+}
+
+//*************************************************************
+// _opque_efd_signal - Makes the completion FD readable
+//*************************************************************
+
+void _opque_efd_signal(que_data_t *q)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+
+    if (atomic_get(q->efd_ready) == 0) return;
+
+    //** If it's full it's already readable so the error can be ignored
+    if (write(q->efd[1], &one, sizeof(one)) != sizeof(one)) {
+        gop_log_printf(15, "efd write skipped errno=%d\n", errno);
+    }
+}
+
+//*************************************************************
+// _opque_efd_clear - Clears any pending completion notifications
+//*************************************************************
+
+void _opque_efd_clear(que_data_t *q)
+{
+    char buf[64];
+
+    if (atomic_get(q->efd_ready) == 0) return;
+
+    while (read(q->efd[0], buf, sizeof(buf)) > 0) {}
+}
+
+//*************************************************************
+// _opque_finished_pop - Returns the next finished task or NULL
+//    NOTE: The que should be locked
+//*************************************************************
+
+op_generic_t *_opque_finished_pop(que_data_t *q)
+{
+    op_generic_t *gop;
+
+    gop = _opque_ring_get(&(q->ring));
+    if (gop == NULL) gop = (op_generic_t *)pop(q->finished);
+
+    return(gop);
+}
+
+//*************************************************************
+// _opque_finished_count - Returns the number of finished tasks
+//    NOTE: The que should be locked
+//*************************************************************
+
+int _opque_finished_count(que_data_t *q)
+{
+    int n;
+
+    n = (q->ring.slot == NULL) ? 0 : (int)(atomic_get(q->ring.tail) - q->ring.head);
+    return(n + stack_size(q->finished));
 }
 
 
@@ -114,10 +281,26 @@ void gop_control_free(void *arg, int size, void *data)
 
 void init_opque_system()
 {
-    log_printf(15, "init_opque_system: counter=%d\n", _opque_counter);
+    char *eval;
+
+    gop_log_printf(15, "init_opque_system: counter=%d\n", _opque_counter);
     if (atomic_inc(_opque_counter) == 0) {   //** Only init if needed
         assert_result(apr_pool_create(&_opque_pool, NULL), APR_SUCCESS);
+        gop_slab_init();
+        gop_hostport_init();
         _gop_control = new_pigeon_coop("gop_control", 50, sizeof(gop_control_t), NULL, gop_control_new, gop_control_free);
+
+        //** See if the default completion mode is being overridden
+        eval = NULL;
+        apr_env_get(&eval, "GOP_COMPLETION_MODE", _opque_pool);
+        if ((eval != NULL) && (strcasecmp(eval, "atomic") == 0)) gop_default_completion_mode_set(OP_CM_ATOMIC);
+
+        //** and if tracing should be enabled
+        eval = NULL;
+        apr_env_get(&eval, "GOP_TRACE", _opque_pool);
+        if (eval != NULL) gop_trace_start(eval, 0, 0);
+
+        gop_blocker_init(_opque_pool);
         gop_dummy_init();
         atomic_init();
     }
@@ -130,11 +313,15 @@ void init_opque_system()
 
 void destroy_opque_system()
 {
-    log_printf(15, "destroy_opque_system: counter=%d\n", _opque_counter);
+    gop_log_printf(15, "destroy_opque_system: counter=%d\n", _opque_counter);
     if (atomic_dec(_opque_counter) == 0) {   //** Only wipe if not used
+        gop_trace_stop();
         destroy_pigeon_coop(_gop_control);
+        gop_blocker_destroy();
         apr_pool_destroy(_opque_pool);
         gop_dummy_destroy();
+        gop_hostport_destroy();
+        gop_slab_destroy();
         atomic_destroy();
 
     }
@@ -146,78 +333,116 @@ void destroy_opque_system()
 
 void _opque_cb(void *v, int mode)
 {
-    int type, n;
+    int type, n, curr, cb_mode;
     op_status_t success;
     op_generic_t *gop = (op_generic_t *)v;
     que_data_t *q = &(gop->base.parent_q->qd);
 
-    log_printf(15, "_opque_cb: START qid=%d gid=%d\n", gop_id(&(q->opque->op)), gop_id(gop));
+    gop_log_printf(15, "_opque_cb: START qid=%d gid=%d\n", gop_id(&(q->opque->op)), gop_id(gop));
 
     //** Get the status (gop is already locked)
     type = gop_get_type(gop);
     if (type == Q_TYPE_QUE) {
         n = stack_size(gop->q->failed);
-        log_printf(15, "_opque_cb: qid=%d gid=%d  stack_size(q->failed)=%d gop->status=%d\n", gop_id(&(q->opque->op)), gop_id(gop), n, gop->base.status.op_status);
+        gop_log_printf(15, "_opque_cb: qid=%d gid=%d  stack_size(q->failed)=%d gop->status=%d\n", gop_id(&(q->opque->op)), gop_id(gop), n, gop->base.status.op_status);
         success = (n == 0) ? gop->base.status : op_failure_status;
     } else {
         success = gop->base.status;
     }
 
-    lock_opque(q);
+    //** Flag that we're using the que so it can't be freed out from under us
+    atomic_inc(q->n_cb);
+
+    gop_log_printf(15, "_opque_cb: qid=%d gid=%d success=%d gop_type(gop)=%d\n", gop_id(&(q->opque->op)), gop_id(gop), success, gop_get_type(gop));
 
-    log_printf(15, "_opque_cb: qid=%d gid=%d success=%d gop_type(gop)=%d\n", gop_id(&(q->opque->op)), gop_id(gop), success, gop_get_type(gop));
+    if (success.op_status == OP_STATE_FAILURE) { //** Push it on the failed list if needed
+        lock_opque(q);
+        push(q->failed, gop);
+        unlock_opque(q);
+    }
 
+    //** It always goes on the finished list.  Only take the lock if the ring is full.
+    gop_log_printf(15, "PUSH finished gid=%d qid=%d\n", gop_id(gop), gop_id(&(q->opque->op)));
+    if (_opque_ring_put(&(q->ring), gop) != 0) {
+        lock_opque(q);
+        move_to_bottom(q->finished);
+        insert_below(q->finished, gop);
+        unlock_opque(q);
+    }
+    _opque_efd_signal(q);
+
+    //** The consumer is free to destroy gop now so don't touch it anymore.
+    //** Waiters check nleft under the lock so the final decrement has to
+    //** be done with it held.  Everything else is lock free.
+    n = atomic_get(q->nleft);
+    while (n > 1) {
+        curr = atomic_cas(q->nleft, n-1, n);
+        if (curr == n) break;
+        n = curr;
+    }
 
-    //** It always goes on the finished list
-    move_to_bottom(q->finished);
-    insert_below(q->finished, gop);
+    if (n > 1) {
+        //** Not finished but wake anybody waiting for a task
+        if (atomic_get(q->n_waiting) > 0) {
+            lock_opque(q);
+            _gop_cond_broadcast(&(q->opque->op));
+            unlock_opque(q);
+        }
 
-    log_printf(15, "PUSH finished gid=%d qid=%d\n", gop_id(gop), gop_id(&(q->opque->op)));
-    log_printf(15, "Printing finished stack for qid=%d\n", gop_id(&(q->opque->op)));
-    if (log_level() > 15) _opque_print_stack(q->finished);
+        atomic_dec(q->n_cb);
+        return;
+    }
 
-    if (success.op_status == OP_STATE_FAILURE) push(q->failed, gop); //** Push it on the failed list if needed
+    lock_opque(q);
 
-    q->nleft--;
-    log_printf(15, "_opque_cb: qid=%d gid=%d nleft=%d stack_size(q->failed)=%d stack_size(q->finished)=%d\n", gop_id(&(q->opque->op)), gop_id(gop), q->nleft, stack_size(q->failed), stack_size(q->finished));
-    flush_log();
+    gop_log_printf(15, "_opque_cb: qid=%d nleft=%d stack_size(q->failed)=%d n_finished=%d\n", gop_id(&(q->opque->op)), atomic_get(q->nleft), stack_size(q->failed), _opque_finished_count(q));
+    gop_flush_log();
 
-    if (q->nleft <= 0) {  //** we're finished
+    //** If we're finished the que's callbacks are run without the lock.  The
+    //** last task is held in nleft until they're done so waiters don't see
+    //** the que as finished early and any parent que only ever needs its own lock.
+    cb_mode = -1;
+    if ((int)atomic_get(q->nleft) <= 1) {  //** we're finished
         if (stack_size(q->failed) == 0) {
             q->opque->op.base.status = op_success_status;
-            callback_execute(q->opque->op.base.cb, OP_STATE_SUCCESS);
-
-            //** Lastly trigger the signal. for anybody listening
-            apr_thread_cond_broadcast(q->opque->op.base.ctl->cond);
+            cb_mode = OP_STATE_SUCCESS;
         } else if (q->opque->op.base.retries == 0) {  //** How many times we're retried
             //** Trigger the callbacks
             q->opque->op.base.retries++;
-            q->nleft = 0;
+            atomic_set(q->nleft, 0);
             q->opque->op.base.failure_mode = 0;
-            callback_execute(&(q->failure_cb), OP_STATE_FAILURE);  //** Attempt to fix things
+            callback_execute(&(q->failure_cb), OP_STATE_FAILURE);  //** Attempt to fix things.  This one needs the lock
 
             if (q->opque->op.base.failure_mode == 0) {  //** No retry
                 q->opque->op.base.status = op_failure_status;
-                callback_execute(q->opque->op.base.cb, OP_STATE_FAILURE);  //**Execute the other CBs
-                apr_thread_cond_broadcast(q->opque->op.base.ctl->cond);  //** and fail for good
+                cb_mode = OP_STATE_FAILURE;
+                atomic_inc(q->nleft);  //** Hold the que open while the other CBs run
+            } else {
+                //** If retrying don't send the broadcast
+                gop_log_printf(15, "_opque_cb: RETRY END qid=%d\n", gop_id(&(q->opque->op)));
+                gop_flush_log();
+                unlock_opque(q);
+                atomic_dec(q->n_cb);
+                return;
             }
-
-            //** If retrying don't send the broadcast
-            log_printf(15, "_opque_cb: RETRY END qid=%d gid=%d\n", gop_id(&(q->opque->op)), gop_id(gop));
-            flush_log();
-        } else {
-            //** Finished with errors but trigger the signal for anybody listening
-            apr_thread_cond_broadcast(q->opque->op.base.ctl->cond);
         }
-    } else {
-        //** Not finished but trigger the signal for anybody listening
-        apr_thread_cond_broadcast(q->opque->op.base.ctl->cond);
     }
 
-    log_printf(15, "_opque_cb: END qid=%d gid=%d\n", gop_id(&(q->opque->op)), gop_id(gop));
-    flush_log();
+    gop_trace(GOP_TP_QUE_DONE, gop_id(&(q->opque->op)), cb_mode);
+    if (cb_mode != -1) _gop_callbacks_run(&(q->opque->op), cb_mode);
+
+    atomic_dec(q->nleft);
+
+    //** Lastly trigger the signal. for anybody listening.  The FD is signalled
+    //** again since a poller could have drained the last task before nleft hit 0.
+    _gop_cond_broadcast(&(q->opque->op));
+    _opque_efd_signal(q);
+
+    gop_log_printf(15, "_opque_cb: END qid=%d\n", gop_id(&(q->opque->op)));
+    gop_flush_log();
 
     unlock_opque(q);
+    atomic_dec(q->n_cb);
 }
 
 //*************************************************************
@@ -246,18 +471,23 @@ void init_opque(opque_t *q)
 
     gop_init(gop);
 
-    log_printf(15, "init_opque: qid=%d\n", gop_id(gop));
+    gop_log_printf(15, "init_opque: qid=%d\n", gop_id(gop));
 
     //**Set up the pointers
     gop->q = que;
     gop->q->opque = q;
 
     q->op.type = Q_TYPE_QUE;
+    gop_set_completion_mode(gop, OP_CM_LOCKED);  //** Ques need the lock for their lists
 
     que->list = new_stack();
     que->finished = new_stack();
     que->failed = new_stack();
-    que->nleft = 0;
+    atomic_set(que->nleft, 0);
+    atomic_set(que->n_waiting, 0);
+    atomic_set(que->n_cb, 0);
+    atomic_set(que->efd_ready, 0);
+    que->efd[0] = que->efd[1] = -1;
     que->nsubmitted = 0;
     gop->base.retries = 0;
 //  que->started_execution = 0;
@@ -290,12 +520,12 @@ void free_finished_stack(Stack_t *stack, int mode)
 
     gop = (op_generic_t *)pop(stack);
     while (gop != NULL) {
-//log_printf(15, "gid=%d\n", gop_id(gop));
+//gop_log_printf(15, "gid=%d\n", gop_id(gop));
         if (gop->type == Q_TYPE_QUE) {
-//log_printf(15, "free_opque_stack: gop->type=QUE\n"); flush_log();
+//gop_log_printf(15, "free_opque_stack: gop->type=QUE\n"); gop_flush_log();
             opque_free(gop->q->opque, mode);
         } else {
-//log_printf(15, "free_opque_stack: gop->type=OPER\n"); flush_log();
+//gop_log_printf(15, "free_opque_stack: gop->type=OPER\n"); gop_flush_log();
 //DONE in op_generic_destroy        callback_destroy(gop->base.cb);  //** Free the callback chain as well
             if (gop->base.free != NULL) gop->base.free(gop, mode);
         }
@@ -318,12 +548,12 @@ void free_list_stack(Stack_t *stack, int mode)
     cb = (callback_t *)pop(stack);
     while (cb != NULL) {
         gop = (op_generic_t *)cb->priv;
-        log_printf(15, "gid=%d\n", gop_id(gop));
+        gop_log_printf(15, "gid=%d\n", gop_id(gop));
         if (gop->type == Q_TYPE_QUE) {
-//log_printf(15, "free_opque_stack: gop->type=QUE\n"); flush_log();
+//gop_log_printf(15, "free_opque_stack: gop->type=QUE\n"); gop_flush_log();
             opque_free(gop->q->opque, mode);
         } else {
-//log_printf(15, "free_opque_stack: gop->type=OPER\n"); flush_log();
+//gop_log_printf(15, "free_opque_stack: gop->type=OPER\n"); gop_flush_log();
 //DONE in op_generic_destroy        callback_destroy(gop->base.cb);  //** Free the callback chain as well
             if (gop->base.free != NULL) gop->base.free(gop, mode);
         }
@@ -343,11 +573,27 @@ void free_list_stack(Stack_t *stack, int mode)
 void opque_free(opque_t *opq, int mode)
 {
     que_data_t *q = &(opq->qd);
+    op_generic_t *gop;
 
-    log_printf(15, "qid=%d nfin=%d nlist=%d nfailed=%d\n", gop_id(&(opq->op)), stack_size(q->finished), stack_size(q->list), stack_size(q->failed));
+    gop_log_printf(15, "qid=%d nfin=%d nlist=%d nfailed=%d\n", gop_id(&(opq->op)), _opque_finished_count(q), stack_size(q->list), stack_size(q->failed));
 
     lock_opque(&(opq->qd));  //** Lock it to make sure Everything is finished and safe to free
 
+    //** Wait for any completions still wrapping up
+    while (atomic_get(q->n_cb) > 0) {
+        unlock_opque(&(opq->qd));
+        apr_thread_yield();
+        lock_opque(&(opq->qd));
+    }
+
+    //** Move anything left in the ring to the overflow so it gets freed as well
+    while ((gop = _opque_ring_get(&(q->ring))) != NULL) push(q->finished, gop);
+    if (q->ring.slot != NULL) free(q->ring.slot);
+
+    //** Close the completion FDs if used
+    if (q->efd[0] != -1) close(q->efd[0]);
+    if ((q->efd[1] != -1) && (q->efd[1] != q->efd[0])) close(q->efd[1]);
+
     //** Free the stacks
     free_stack(q->failed, 0);
     free_finished_stack(q->finished, mode);
@@ -376,17 +622,18 @@ int internal_opque_add(opque_t *que, op_generic_t *gop, int dolock)
 
     if (dolock != 0) lock_opque(q);
 
-    log_printf(15, "opque_add: qid=%d gid=%d\n", que->op.base.id, gop_get_id(gop));
+    gop_log_printf(15, "opque_add: qid=%d gid=%d\n", que->op.base.id, gop_get_id(gop));
 
     //** Add the list CB to the the op
 //  lock_gop(gop)
     gop->base.parent_q = que;
+    gop_timestamp(gop, GOP_TS_QUEUED);
     callback_append(&(gop->base.cb), cb);
 //  unlock_gop(gop)
 
     //**Add the op to the q
     q->nsubmitted++;
-    q->nleft++;
+    atomic_inc(q->nleft);
     if (q->opque->op.base.started_execution == 0) {
         move_to_bottom(q->list);
         insert_below(q->list, (void *)cb);
@@ -396,9 +643,10 @@ int internal_opque_add(opque_t *que, op_generic_t *gop, int dolock)
 
     if (q->opque->op.base.started_execution == 1) {
         if (gop->type == Q_TYPE_OPERATION) {
-            log_printf(15, "gid=%d started_execution=%d\n", gop_get_id(gop), gop->base.started_execution);
+            gop_log_printf(15, "gid=%d started_execution=%d\n", gop_get_id(gop), gop->base.started_execution);
             gop->base.started_execution = 1;
-            gop->base.pc->fn->submit(gop->base.pc->arg, gop);
+            gop_trace(GOP_TP_OP_START, gop_id(gop), gop_get_type(gop));
+            if (_gop_dep_start_hold(gop) == 0) _gop_submit(gop);
         } else {  //** It's a queue
             opque_start_execution(gop->q->opque);
         }
@@ -416,6 +664,125 @@ int opque_add(opque_t *que, op_generic_t *gop)
     return(internal_opque_add(que, gop, 1));
 }
 
+//*************************************************************
+// opque_cancel - Cancels all the que's tasks including nested ques.
+//    Tasks not yet submitted are completed with op_cancelled_status when
+//    the que is started and tasks queued in a portal are pulled back.
+//    Tasks already executing finish normally.
+//
+//    Returns the number of tasks cancelled immediately.
+//*************************************************************
+
+int opque_cancel(opque_t *que)
+{
+    op_generic_t *gop = opque_get_gop(que);
+    int started, n;
+
+    atomic_set(gop->base.cancelled, 1);
+
+    lock_gop(gop);
+    started = gop->base.started_execution;
+    n = stack_size(que->qd.list);
+    unlock_gop(gop);
+
+    gop_log_printf(15, "qid=%d started_execution=%d\n", gop_id(gop), started);
+
+    if (started == 0) {
+        if (gop->base.parent_q != NULL) return(0);  //** The parent will catch it on submission
+        gop_start_execution(gop);  //** Flushes everything through as cancelled
+        return(n);
+    }
+
+    return(gop_portal_cancel_all(gop));
+}
+
+//*************************************************************
+// opque_completion_fd - Returns a file descriptor that is readable
+//    whenever the que has finished tasks waiting.  It's designed to
+//    be used in an external poll loop together with
+//    opque_completion_drain().  Uses an eventfd when available and a
+//    pipe otherwise.  The FD is owned by the que and closed when the
+//    que is freed.  Returns -1 on error.
+//    NOTE: The que still has to be started with opque_start_execution()
+//*************************************************************
+
+int opque_completion_fd(opque_t *que)
+{
+    que_data_t *q = &(que->qd);
+    int fd;
+
+    lock_opque(q);
+    if (atomic_get(q->efd_ready) == 1) {
+        fd = q->efd[0];
+        unlock_opque(q);
+        return(fd);
+    }
+
+#ifdef __linux__
+    q->efd[0] = q->efd[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (q->efd[0] == -1) {
+        gop_log_printf(0, "ERROR creating eventfd! qid=%d errno=%d\n", gop_id(opque_get_gop(que)), errno);
+        unlock_opque(q);
+        return(-1);
+    }
+#else
+    if (pipe(q->efd) != 0) {
+        gop_log_printf(0, "ERROR creating pipe! qid=%d errno=%d\n", gop_id(opque_get_gop(que)), errno);
+        q->efd[0] = q->efd[1] = -1;
+        unlock_opque(q);
+        return(-1);
+    }
+    fcntl(q->efd[0], F_SETFL, fcntl(q->efd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(q->efd[1], F_SETFL, fcntl(q->efd[1], F_GETFL) | O_NONBLOCK);
+#endif
+
+    atomic_set(q->efd_ready, 1);
+
+    //** Anything that finished before the FD existed needs flagging
+    if ((_opque_finished_count(q) > 0) || (atomic_get(q->nleft) == 0)) _opque_efd_signal(q);
+
+    fd = q->efd[0];
+    unlock_opque(q);
+
+    return(fd);
+}
+
+//*************************************************************
+// opque_completion_drain - Non-blocking drain of the finished tasks.
+//    Stores up to max finished tasks in ops and returns the number
+//    stored.  The completion FD is cleared and re-armed if tasks are
+//    left over.  Use opque_tasks_left() to see if the que is done.
+//*************************************************************
+
+int opque_completion_drain(opque_t *que, op_generic_t **ops, int max)
+{
+    que_data_t *q = &(que->qd);
+    op_generic_t *gop;
+    int n;
+
+    lock_opque(q);
+
+    //** Clear the FD first so anything finishing while we drain re-arms it
+    _opque_efd_clear(q);
+
+    n = 0;
+    while (n < max) {
+        gop = _opque_finished_pop(q);
+        if (gop == NULL) break;
+        ops[n] = gop;
+        n++;
+    }
+
+    //** Keep it readable if there's still more to get
+    if (_opque_finished_count(q) > 0) _opque_efd_signal(q);
+
+    unlock_opque(q);
+
+    gop_log_printf(15, "qid=%d n=%d\n", gop_id(opque_get_gop(que)), n);
+
+    return(n);
+}
+
 //*************************************************************
 // opque_completion_status - Returns the que status
 //*************************************************************
@@ -432,16 +799,58 @@ op_status_t opque_completion_status(opque_t *que)
     return(status);
 }
 
+//*************************************************************
+// _opque_submit_grouped - Submits the ops grouping them by portal so
+//    portals supporting submit_batch get them all in one call.
+//    The original order is kept within each portal.
+//    NOTE: The ops array is overwritten.
+//*************************************************************
+
+void _opque_submit_grouped(op_generic_t **ops, int n)
+{
+    portal_context_t *pc;
+    op_generic_t **rest;
+    int i, nb, nr;
+
+    type_malloc(rest, op_generic_t *, n);
+
+    while (n > 0) {
+        //** Split off everything using the same portal as the 1st op
+        pc = ops[0]->base.pc;
+        nb = 0;
+        nr = 0;
+        for (i=0; i<n; i++) {
+            if (ops[i]->base.pc == pc) {
+                ops[nb] = ops[i];
+                nb++;
+            } else {
+                rest[nr] = ops[i];
+                nr++;
+            }
+        }
+
+        gop_log_printf(15, "pc=%p n=%d\n", pc, nb);
+        if (pc->fn->submit_batch != NULL) {
+            pc->fn->submit_batch(pc->arg, ops, nb);
+        } else {
+            for (i=0; i<nb; i++) pc->fn->submit(pc->arg, ops[i]);
+        }
+
+        //** Move on to the rest
+        memcpy(ops, rest, sizeof(op_generic_t *)*nr);
+        n = nr;
+    }
+
+    free(rest);
+}
+
 //*************************************************************
 // _opque_start_execution - Routine for submitting ques for exec
 //*************************************************************
 
 void _opque_start_execution(opque_t *que)
 {
-    int n, i;
-    callback_t *cb;
     op_generic_t *gop;
-    que_data_t *q = &(que->qd);
 
     gop = opque_get_gop(que);
     if (gop->base.started_execution != 0) {
@@ -450,95 +859,180 @@ void _opque_start_execution(opque_t *que)
 
     gop->base.started_execution = 1;
 
+    if (_gop_dep_start_hold(gop) != 0) return;  //** Still waiting on dependencies
+
+    _opque_submit_all(que);
+}
+
+//*************************************************************
+// _opque_submit_all - Submits all the que's tasks.  Tasks still
+//    waiting on dependencies are left for their parents to submit.
+//    NOTE: The que should be locked
+//*************************************************************
+
+void _opque_submit_all(opque_t *que)
+{
+    int n, i, n_ops;
+    callback_t *cb;
+    op_generic_t *gop;
+    op_generic_t **ops;
+    que_data_t *q = &(que->qd);
+
+    _opque_ring_init(q);
+
     n = stack_size(q->list);
+    if (n == 0) return;
+
+    type_malloc(ops, op_generic_t *, n);
+    n_ops = 0;
+
     move_to_top(q->list);
     for (i=0; i<n; i++) {
         cb = (callback_t *)pop(q->list);
         gop = (op_generic_t *)cb->priv;
         if (gop->type == Q_TYPE_OPERATION) {
-            log_printf(15, "qid=%d gid=%d\n",gop_id(opque_get_gop(que)), gop_get_id(gop));
+            gop_log_printf(15, "qid=%d gid=%d\n",gop_id(opque_get_gop(que)), gop_get_id(gop));
             gop->base.started_execution = 1;
-            gop->base.pc->fn->submit(gop->base.pc->arg, gop);
+            gop_trace(GOP_TP_OP_START, gop_id(gop), gop_get_type(gop));
+            if (_gop_dep_start_hold(gop) != 0) continue;  //** Parents will submit it
+            if (gop_cancel_requested(gop) == 1) {  //** Cancelled so don't bother the portal
+                _gop_submit(gop);
+                continue;
+            }
+            gop_timestamp(gop, GOP_TS_SUBMIT);
+            ops[n_ops] = gop;
+            n_ops++;
         } else {  //** It's a queue
-            log_printf(15, "qid=%d Q gid=%d\n",gop_id(opque_get_gop(que)), gop_get_id(gop));
+            gop_log_printf(15, "qid=%d Q gid=%d\n",gop_id(opque_get_gop(que)), gop_get_id(gop));
             lock_opque(gop->q);
             _opque_start_execution(gop->q->opque);
             unlock_opque(gop->q);
         }
     }
 
+    if (n_ops > 0) _opque_submit_grouped(ops, n_ops);
+    free(ops);
+
 //  unlock_opque(q);
 }
 
 //*************************************************************
-// compare_ops - Compares the ops for sorting
+// _sort_radix_pass - Stable counting sort of the entries on an 8 bit
+//    digit of the key.  Returns 0 if the pass was skipped cause every
+//    entry has the same digit.
 //*************************************************************
 
-int compare_ops(const void *arg1, const void *arg2)
-{
-    int cmp;
+typedef struct {   //** Entry used by default_sort_ops()
     callback_t *cb;
-    op_generic_t *gop;
-    command_op_t *c1, *c2;
-
-    cb = (callback_t *)arg1;
-    gop = (op_generic_t *)cb->priv;
-    c1 = &(gop->op->cmd);
-    cb = (callback_t *)arg2;
-    gop = (op_generic_t *)cb->priv;
-    c2 = &(gop->op->cmd);
-
-    cmp = strcmp(c1->hostport, c2->hostport);
-    if (cmp == 0) {  //** Same depot so compare size
-        if (c1->cmp_size > c2->cmp_size) {
-            cmp = 1;
-        } else if (c1->cmp_size < c2->cmp_size) {
-            cmp = -1;
-        }
+    apr_uint32_t key;
+} _sort_ent_t;
+
+int _sort_radix_pass(_sort_ent_t *src, _sort_ent_t *dest, int n, int shift)
+{
+    int count[257];
+    int i, d;
+
+    memset(count, 0, sizeof(count));
+    for (i=0; i<n; i++) count[((src[i].key >> shift) & 0xFF) + 1]++;
+
+    for (d=0; d<256; d++) {
+        if (count[d+1] == n) return(0);  //** All the same digit
+        if (count[d+1] != 0) break;
     }
 
-    return(cmp);
-}
+    for (d=0; d<256; d++) count[d+1] += count[d];
+    for (i=0; i<n; i++) {
+        d = (src[i].key >> shift) & 0xFF;
+        dest[count[d]++] = src[i];
+    }
 
+    return(1);
+}
 
 //*************************************************************
 // default_sort_ops - Default routine to sort ops.
-//   Ops are sorted to group ops for the same host together in
-//   descending amount of work.
+//   Ops are sorted to group ops for the same host together and
+//   in increasing cmp_size within each host.  Everything is done
+//   with counting sorts using the interned host IDs so it's linear
+//   in the number of ops.
 //*************************************************************
 
 void default_sort_ops(void *arg, opque_t *que)
 {
-    int i, n, count;
-    callback_t **array;
+    int i, n, count, nb, slot, mask;
+    int *hid, *bucket, *bstart;
     callback_t *cb;
     void *ptr;
     op_generic_t *gop;
+    _sort_ent_t *ent, *tmp, *swap;
     que_data_t *q = &(que->qd);
     Stack_t *q_list = new_stack();
+
     n = stack_size(q->list);
-    type_malloc(array, callback_t *, n);
+    type_malloc(ent, _sort_ent_t, n+1);
+    type_malloc(tmp, _sort_ent_t, n+1);
 
-    //**Create the linear array used for qsort
+    //**Create the linear array of ops with the size as the key.  The sign
+    //** bit is flipped so negative sizes order correctly as unsigned
     count = 0;
     for (i=0; i<n; i++) {
         cb = (callback_t *)pop(q->list);
         gop = (op_generic_t *)cb->priv;
         if (gop->type == Q_TYPE_OPERATION) {
-            array[count] = cb;
+            ent[count].cb = cb;
+            ent[count].key = ((apr_uint32_t)gop->op->cmd.cmp_size) ^ 0x80000000;
             count++;
         } else {
             push(q_list, cb);
         }
     }
 
-    //** Now sort the linear array **
-    qsort((void *)array, count, sizeof(callback_t *), compare_ops);
+    //** Order by size using an LSD radix sort
+    for (i=0; i<32; i += 8) {
+        if (_sort_radix_pass(ent, tmp, count, i) == 1) {
+            swap = ent;
+            ent = tmp;
+            tmp = swap;
+        }
+    }
+
+    //** Map the host IDs onto dense buckets in order of first appearance
+    //** using a small open addressed table
+    for (mask=16; mask < 2*count; mask <<= 1) {}
+    type_malloc(hid, int, mask);
+    type_malloc(bucket, int, mask);
+    type_malloc(bstart, int, count+1);
+    for (i=0; i<mask; i++) hid[i] = -1;
+    mask--;
+
+    nb = 0;
+    for (i=0; i<count; i++) {
+        gop = (op_generic_t *)ent[i].cb->priv;
+        n = gop_host_id(&(gop->op->cmd));
+        slot = (n * 0x9E3779B1U) & mask;
+        while ((hid[slot] != -1) && (hid[slot] != n)) slot = (slot + 1) & mask;
+        if (hid[slot] == -1) {
+            hid[slot] = n;
+            bucket[slot] = nb;
+            bstart[nb] = 0;
+            nb++;
+        }
+        ent[i].key = bucket[slot];
+        bstart[ent[i].key]++;
+    }
+
+    //** Stable scatter into the host buckets which keeps the size order
+    n = 0;
+    for (i=0; i<nb; i++) {
+        slot = bstart[i];
+        bstart[i] = n;
+        n += slot;
+    }
+    for (i=0; i<count; i++) tmp[bstart[ent[i].key]++] = ent[i];
 
     //** Now place them back on the list **
     for (i=0; i<count; i++) {
-        push(q->list, (void *)array[i]);
-//    log_printf(15, "sort_io_list: i=%d hostdepot=%s size=%d\n", i, array[i]->hop.hostport, array[i]->hop.cmp_size);
+        push(q->list, (void *)tmp[i].cb);
     }
 
     //** with the que on the top.
@@ -547,7 +1041,11 @@ void default_sort_ops(void *arg, opque_t *que)
     }
 
     free_stack(q_list, 0);
-    free(array);
+    free(hid);
+    free(bucket);
+    free(bstart);
+    free(ent);
+    free(tmp);
 }
 
 
@@ -43,6 +43,8 @@ http://www.accre.vanderbilt.edu
 #include "stack.h"
 #include "callback.h"
 #include "pigeon_coop.h"
+#include "gop_trace.h"
+#include "gop_latency.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -62,6 +64,7 @@ typedef struct op_generic_s op_generic_t;
 #define OP_STATE_INVALID_HOST 60
 #define OP_STATE_CANT_CONNECT 70
 #define OP_STATE_ERROR    80
+#define OP_STATE_CANCELLED 90
 
 #define Q_TYPE_OPERATION 50
 #define Q_TYPE_QUE       51
@@ -75,10 +78,30 @@ typedef struct op_generic_s op_generic_t;
 #define OP_EXEC_QUEUE    100
 #define OP_EXEC_DIRECT   101
 
+#define OP_CM_LOCKED     200   //** Completion uses the pigeon coop lock/cond pair
+#define OP_CM_ATOMIC     201   //** Completion uses the atomic state word and futex parking
+
+#define OP_PRIORITY_DEFAULT 0  //** Inherit from the parent que or OP_PRIORITY_NORMAL if there isn't one
+#define OP_PRIORITY_LOW     1  //** Bulk work.  Runs when nothing more important is waiting
+#define OP_PRIORITY_NORMAL  2
+#define OP_PRIORITY_HIGH    3  //** Latency critical work like internal completions and heartbeats
+
+#define OP_STATE_BIT_DONE         1  //** Op has completed
+#define OP_STATE_BIT_WAITERS      2  //** Somebody is parked on the state word
+#define OP_STATE_BIT_AUTO_DESTROY 4  //** Destroy the op on completion (OP_CM_ATOMIC only)
+#define OP_STATE_BIT_COMPLETING   8  //** Completion is still using the op.  Callbacks or waking the waiters
+
+typedef struct gop_parked_s {  //** Waiter parked on a gop without blocking its thread.  See gop_blocker_t
+    void (*wake)(void *arg);   //** Called with the gop lock held when the waiter should recheck
+    void *arg;
+    struct gop_parked_s *next;
+} gop_parked_t;
+
 typedef struct {
     apr_thread_mutex_t *lock;  //** shared lock
     apr_thread_cond_t *cond;   //** shared condition variable
     pigeon_coop_hole_t  pch;   //** Pigeon coop hole for the lock and cond
+    gop_parked_t *parked;      //** Parked waiters.  Woken along with the cond
 } gop_control_t;
 
 typedef struct {       //** Generic opcode status
@@ -94,9 +117,12 @@ extern op_status_t op_timeout_status;
 extern op_status_t op_invalid_host_status;
 extern op_status_t op_cant_connect_status;
 extern op_status_t op_error_status;
+extern op_status_t op_cancelled_status;
 
 typedef struct {   //** Command operation
     char *hostport; //** Depot hostname:port:type:...  Unique string for host/connect_context
+    int host_id;    //** Interned hostport.  Filled in by gop_host_id()
+    const char *host_id_src; //** Interned name for host_id.  Compared with hostport to catch changes
     void *connect_context;   //** Private information needed to make a host connection
     int  cmp_size;  //** Used for ordering commands within the same host
     apr_time_t timeout;    //** Command timeout
@@ -124,11 +150,30 @@ typedef struct {  //** Hportal specific implementation
     void (*sort_tasks)(void *arg, opque_t *q);        //** optional
     void (*submit)(void *arg, op_generic_t *op);
     void (*sync_exec)(void *arg, op_generic_t *op);   //** optional
+    void (*submit_batch)(void *arg, op_generic_t **ops, int n);   //** optional.  All ops share the same portal
+    int (*cancel)(void *arg, op_generic_t *gop);   //** optional.  Removes queued ops of gop, or its descendants if a que.  Returns the number cancelled
+    op_generic_t *(*help)(void *arg, op_generic_t *gop);  //** optional.  Removes and returns a queued op of gop, or its descendants, for the waiter to run with sync_exec
 } portal_fn_t;
 
+typedef struct {  //** Managed blocker.  Told when one of its threads is about to block in a gop wait
+    int (*begin)(void *arg);             //** Called before blocking.  Returns a token handed to end()
+    void (*end)(void *arg, int token);   //** Called after waking
+    void (*park)(void *arg, gop_parked_t *p, apr_thread_mutex_t *lock);  //** Optional.  Used instead of blocking for untimed waits.
+                                         //** Called with lock held and p on the gop's parked list.  Must set p->wake and
+                                         //** p->arg before releasing the lock and return with it held once woken.
+    void *arg;
+} gop_blocker_t;
+
+typedef struct {  //** Single blocking call in progress
+    gop_blocker_t *b;
+    int token;
+} gop_block_t;
+
 typedef struct {             //** Handle for maintaining all the ecopy connections
     apr_thread_mutex_t *lock;
     apr_hash_t *table;         //** Table containing the depot_portal structs
+    void **id_table;           //** Same as table but indexed by the interned host ID
+    int id_table_size;
     apr_pool_t *pool;          //** Memory pool for hash table
     apr_time_t min_idle;       //** Idle time before closing connection
     atomic_int_t running_threads;       //** currently running # of connections
@@ -148,6 +193,8 @@ typedef struct {             //** Handle for maintaining all the ecopy connectio
     Net_timeout_t dt;          //** Default wait time
     void *arg;
     portal_fn_t *fn;       //** Actual implementaion for application
+    gop_latency_table_t *lat;  //** Latency histograms for the ops completed through the portal
+    int n_busy;                //** gop_portal_cancel_all() calls in flight.  Protected by the context list lock
 } portal_context_t;
 
 typedef struct {
@@ -158,21 +205,48 @@ typedef struct {
     int retries;           //** Upon failure how many times we've retried
     int id;                //** Op's global id.  Can be changed by use but generally should use my_id
     int my_id;             //** User/Application settable id.  Defaults to id.
-    int state;             //** Command state 0=submitted 1=completed
+    atomic_int_t state;    //** Command state word.  OP_STATE_BIT_DONE is set on completion
     int started_execution; //** If 1 the tasks have already been submitted for execution
     int execution_mode;    //** Execution mode OP_EXEC_QUEUE | OP_EXEC_DIRECT
+    int completion_mode;   //** Completion mode OP_CM_LOCKED | OP_CM_ATOMIC
+    int priority;          //** OP_PRIORITY_* used when the op is handed to a thread pool.  See gop_priority()
+    int dep_hold;          //** Set once the op has dependencies.  See gop_add_dependency()
+    atomic_int_t n_deps;   //** Unfinished dependencies plus 1 for the start request
+    atomic_int_t dep_failed; //** Set if any dependency failed
+    atomic_int_t cancelled; //** Set by gop_cancel()/opque_cancel().  Also applies to all descendants
+    apr_time_t ts[GOP_TS_MAX]; //** Timeline stamps.  See gop_latency.h
     int auto_destroy;      //** If 1 then automatically call the free fn to destroy the object
-    gop_control_t *ctl;    //** Lock and condition struct
+    gop_control_t *ctl;    //** Lock and condition struct.  Lazily reserved for OP_CM_ATOMIC ops
     void *user_priv;           //** Optional user supplied handle
     void (*free)(op_generic_t *d, int mode);
     portal_context_t *pc;
 } op_common_t;
 
+#define OPQUE_RING_MIN   16     //** Min size of the finished ring
+#define OPQUE_RING_MAX   4096   //** Max size of the finished ring.  Anything beyond goes on the overflow
+
+typedef struct {
+    atomic_int_t seq;      //** Slot sequence number.  Pos+1 when full
+    op_generic_t *gop;
+} opque_ring_slot_t;
+
+typedef struct {       //** Bounded MPSC ring for finished tasks.  Producers are lock free.
+    opque_ring_slot_t *slot;  //** Ring slots.  NULL until the que starts executing
+    apr_uint32_t mask;     //** Ring size - 1
+    apr_uint32_t head;     //** Next slot to consume.  Protected by the que lock
+    atomic_int_t tail;     //** Next slot to fill
+} opque_ring_t;
+
 typedef struct {
     Stack_t *list;         //** List of tasks
-    Stack_t *finished;     //** lists that have completed and not yet processed
+    opque_ring_t ring;     //** Tasks that have completed and not yet processed
+    Stack_t *finished;     //** Overflow for finished tasks if the ring is full.  Protected by the que lock
     Stack_t *failed;       //** All lists that fail are also placed here
-    int nleft;             //** Number of lists left to be processed
+    atomic_int_t nleft;    //** Number of lists left to be processed
+    atomic_int_t n_waiting; //** Number of threads waiting for a finished task
+    atomic_int_t n_cb;     //** Number of completion callbacks in progress
+    atomic_int_t efd_ready; //** Set once the completion FDs below are valid
+    int efd[2];            //** Completion notification FDs. [0]=read end, [1]=write end
     int nsubmitted;        //** Nunmber of submitted tasks (doesn't count sub q's)
     int finished_submission; //** No more tasks will be submitted so it's safe to free the data when finished
 //   int success;             //** Only used if no failed tasks occur to determine success
@@ -207,12 +281,12 @@ extern atomic_int_t _opque_counter;
 
 #define _op_set_status(v, opstat, errcode) (v).op_status = opstat; (v).error_code = errcode
 
-#define lock_opque(q)   log_printf(15, "lock_opque: qid=%d\n", (q)->opque->op.base.id); apr_thread_mutex_lock((q)->opque->op.base.ctl->lock)
-#define unlock_opque(q) log_printf(15, "unlock_opque: qid=%d\n", (q)->opque->op.base.id); apr_thread_mutex_unlock((q)->opque->op.base.ctl->lock)
+#define lock_opque(q)   gop_log_printf(15, "lock_opque: qid=%d\n", (q)->opque->op.base.id); apr_thread_mutex_lock((q)->opque->op.base.ctl->lock)
+#define unlock_opque(q) gop_log_printf(15, "unlock_opque: qid=%d\n", (q)->opque->op.base.id); apr_thread_mutex_unlock((q)->opque->op.base.ctl->lock)
 //#define lock_opque(q)   apr_thread_mutex_lock((q)->opque->op.base.ctl->lock)
 //#define unlock_opque(q) apr_thread_mutex_unlock((q)->opque->op.base.ctl->lock)
-#define lock_gop(gop)   log_printf(15, "lock_gop: gid=%d\n", (gop)->base.id); apr_thread_mutex_lock((gop)->base.ctl->lock)
-#define unlock_gop(gop) log_printf(15, "unlock_gop: gid=%d\n", (gop)->base.id); apr_thread_mutex_unlock((gop)->base.ctl->lock)
+#define lock_gop(gop)   gop_log_printf(15, "lock_gop: gid=%d\n", (gop)->base.id); apr_thread_mutex_lock(_gop_control_get(gop)->lock)
+#define unlock_gop(gop) gop_log_printf(15, "unlock_gop: gid=%d\n", (gop)->base.id); apr_thread_mutex_unlock((gop)->base.ctl->lock)
 //#define lock_gop(gop)   apr_thread_mutex_lock((gop)->base.ctl->lock)
 //#define unlock_gop(gop) apr_thread_mutex_unlock((gop)->base.ctl->lock)
 #define gop_id(gop) (gop)->base.id
@@ -224,6 +298,8 @@ extern atomic_int_t _opque_counter;
 #define gop_get_myid(gop) (gop)->base.my_id
 #define gop_set_myid(gop, newval) (gop)->base.my_id = newval
 #define gop_get_type(gop) (gop)->type
+#define gop_is_done(gop) (atomic_get((gop)->base.state) & OP_STATE_BIT_DONE)
+#define gop_get_completion_mode(gop) (gop)->base.completion_mode
 //#define opque_set_success_state(q, state) (q)->qd.success = state
 #define opque_get_gop(q) &((q)->op)
 #define opque_failure_callback_set(q, fn, priv) callback_set(&(q->failure_cb), fn, priv)
@@ -253,6 +329,8 @@ void gop_simple_cb(void *v, int mode);
 void opque_set_failure_mode(opque_t *q, int value);
 int opque_get_failure_mode(opque_t *q);
 op_status_t opque_completion_status(opque_t *q);
+int opque_completion_fd(opque_t *q);
+int opque_completion_drain(opque_t *q, op_generic_t **ops, int max);
 void opque_set_arg(opque_t *q, void *arg);
 void *opque_get_arg(opque_t *q);
 opque_t *new_opque();
@@ -262,7 +340,16 @@ void destroy_opque_system();
 void opque_free(opque_t *que, int mode);
 int opque_add(opque_t *que, op_generic_t *gop);
 int internal_opque_add(opque_t *que, op_generic_t *gop, int dolock);
+int opque_cancel(opque_t *q);
 void default_sort_ops(void *arg, opque_t *que);
+void gop_hostport_init();
+void gop_hostport_destroy();
+int gop_hostport_intern(const char *hostport);
+const char *gop_hostport_name(int id);
+int gop_host_id(command_op_t *cmd);
+int gop_portal_cancel(portal_context_t *hpc, op_generic_t *gop);
+int gop_portal_cancel_all(op_generic_t *gop);
+op_generic_t *gop_portal_help(op_generic_t *gop);
 
 op_generic_t *gop_dummy(op_status_t state);
 void gop_free(op_generic_t *gop, int mode);
@@ -282,6 +369,15 @@ int gop_timed_waitall(op_generic_t *g, int dt);
 void gop_start_execution(op_generic_t *gop);
 void gop_finished_submission(op_generic_t *gop);
 void gop_set_exec_mode(op_generic_t *g, int mode);
+void gop_set_completion_mode(op_generic_t *g, int mode);
+void gop_set_priority(op_generic_t *g, int priority);
+int gop_priority(op_generic_t *g);
+void gop_default_completion_mode_set(int mode);
+int gop_default_completion_mode_get();
+void gop_dummy_exec_mode_set(int mode);
+int gop_dummy_exec_mode_get();
+void gop_dummy_shards_set(int n);
+gop_control_t *_gop_control_get(op_generic_t *gop);
 
 int gop_completed_successfully(op_generic_t *gop);
 
@@ -292,6 +388,16 @@ void gop_reset(op_generic_t *gop);
 void gop_init(op_generic_t *gop);
 void gop_generic_free(op_generic_t *gop, int mode);
 void gop_callback_append(op_generic_t *gop, callback_t *cb);
+int gop_add_dependency(op_generic_t *child, op_generic_t *parent);
+int gop_cancel(op_generic_t *gop);
+int gop_cancel_requested(op_generic_t *gop);
+int gop_has_ancestor(op_generic_t *gop, op_generic_t *ancestor);
+void gop_waiter_help_set(int enable);
+void gop_blocker_init(apr_pool_t *pool);
+void gop_blocker_destroy();
+gop_blocker_t *gop_blocker_set(gop_blocker_t *b);
+void gop_block_begin(gop_block_t *blk);
+void gop_block_end(gop_block_t *blk);
 apr_time_t gop_exec_time(op_generic_t *gop);
 apr_time_t gop_start_time(op_generic_t *gop);
 apr_time_t gop_end_time(op_generic_t *gop);
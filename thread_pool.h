@@ -34,7 +34,11 @@ http://www.accre.vanderbilt.edu
 #include "opque.h"
 #include "host_portal.h"
 #include "atomic_counter.h"
+#include "thread_pool_ws.h"
+#include "thread_pool_affinity.h"
+#include "gop_latency.h"
 #include <apr_thread_pool.h>
+#include <ucontext.h>
 
 #ifndef __THREAD_POOL_H_
 #define __THREAD_POOL_H_
@@ -48,12 +52,105 @@ extern "C" {
 #define TP_E_NOP               -1
 #define TP_E_IGNORE            -2
 
+#define TP_EXEC_DEFAULT        -1   //** Use the default set with thread_pool_default_executor_set() or GOP_TP_EXECUTOR
+#define TP_EXEC_APR             0   //** APR thread pool.  Single task list and lock
+#define TP_EXEC_WS              1   //** Work stealing executor with per worker deques
+
+#define TP_COMPENSATION_DEFAULT 256 //** Default max extra threads started to cover pool threads blocked in a gop wait
+
+#define TP_CORO_STACK_DEFAULT   (256*1024)  //** Default coroutine stack size.  See thread_pool_coro_stack_size_set()
+#define TP_CORO_IDLE_MAX        256 //** Idle coroutine stacks kept per context for reuse
+
+#define TP_PFOR_LOCKS           16  //** Lock stripes shared by a context's parallel loops.  See tp_parallel_for()
+
+#define TP_STATS_SHARDS         16  //** Stat shards per context.  Threads are spread across them by thread ID
+#define TP_STATS_DEPTHS         32  //** Max recursion depths reported in a stats snapshot
+
+typedef struct {        //** One shard of a context's stats.  Only the threads hashed to it touch it
+    gop_histo_t wait;       //** Submit -> start of execution in usec.  Only while stats are enabled
+    gop_histo_t exec;       //** Execution time in usec.  Only while stats are enabled
+    atomic_int_t n_exec;    //** Ops that started executing
+    atomic_int_t n_done;    //** and finished
+} tp_stats_shard_t;
+
+#define TP_ADAPT_INTERVAL       apr_time_from_msec(100)  //** Default adaptive controller sampling interval
+#define TP_ADAPT_TARGET_WAIT    1000  //** Default queue wait p90 target in usec.  Grow when above it and shrink when well below
+#define TP_ADAPT_UP_INTERVALS   2     //** Consecutive intervals over the target before growing
+#define TP_ADAPT_DOWN_INTERVALS 10    //** Consecutive quiet intervals before shrinking
+#define TP_ADAPT_HOLD_INTERVALS 20    //** Intervals to hold off growing after a grow that didn't help throughput
+
+typedef struct {        //** Adaptive concurrency controller.  See thread_pool_adaptive_enable()
+    apr_pool_t *mpool;
+    apr_thread_t *thread;
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *cond;
+    int shutdown;
+    int min_concurrency;            //** Range the controller moves the limit in
+    int max_concurrency;            //** The limit the context was created with
+    apr_interval_time_t interval;   //** Sampling interval
+    apr_interval_time_t target_wait;//** Queue wait p90 target
+    int up_count;                   //** Consecutive intervals wanting to grow
+    int down_count;                 //** and shrink
+    int hold;                       //** Intervals left before growing is allowed again
+    int last_action;                //** Change made on the last interval.  +n grew, -1 shrank, 0 held
+    apr_uint32_t n_grow;
+    apr_uint32_t n_shrink;
+    double rate;                    //** Completions/sec over the last interval
+    double rate_before_grow;        //** Rate when we last grew
+    apr_uint64_t wait_p90;          //** Queue wait p90 over the last interval
+    apr_uint64_t n_samples;         //** Queue wait samples over the last interval.  Holds if there were none
+    apr_uint64_t last_completed;
+    apr_time_t last_time;
+    gop_histo_t last_wait;          //** Merged wait histogram at the last sample
+} tp_adapt_t;
+
+typedef struct {        //** Point in time view of a context.  See thread_pool_stats_snapshot()
+    int enabled;                //** Latency histograms are being collected
+    int n_queued;               //** Ops waiting to run: n_overflow + n_exec_queued
+    int n_overflow;             //** Ops waiting on the reserve stacks
+    int n_exec_queued;          //** Tasks waiting in the executor
+    int n_running;              //** Ops holding a concurrency slot
+    int n_executing;            //** Ops currently executing
+    int concurrency;            //** Current concurrency limit including compensation
+    int n_threads;              //** Executor threads
+    int n_active_threads;       //** Executor threads running a task
+    int n_idle_threads;         //** Executor threads waiting for work
+    int n_blocked;              //** Pool threads blocked in a gop wait
+    int n_compensating;         //** Extra concurrency granted for blocked threads
+    apr_uint64_t n_submitted;
+    apr_uint64_t n_completed;
+    apr_uint64_t n_direct;
+    int n_depths;                           //** Depths reported below.  The last one includes anything deeper
+    int reserve_depth[TP_STATS_DEPTHS];     //** Ops waiting on each depth's reserve stack
+    int overflow_running[TP_STATS_DEPTHS];  //** 1 if an op of the depth is running in an overflow slot
+    apr_uint64_t wait_p50, wait_p90, wait_p99, wait_max;  //** Queue wait percentiles in usec
+    apr_uint64_t exec_p50, exec_p90, exec_p99, exec_max;  //** Execution time percentiles in usec
+    gop_histo_t wait;           //** Merged queue wait histogram
+    gop_histo_t exec;           //** Merged execution time histogram
+    int adapt_enabled;          //** Adaptive controller is running.  The rest are only valid if it is
+    int adapt_min;              //** Concurrency range it works in
+    int adapt_max;
+    int adapt_last_action;      //** Last change.  +n grew, -1 shrank, 0 held
+    int adapt_hold;             //** Intervals left before growing is allowed again
+    apr_uint32_t adapt_n_grow;
+    apr_uint32_t adapt_n_shrink;
+    apr_uint64_t adapt_wait_p90;//** Queue wait p90 over the last interval in usec
+    double adapt_rate;          //** Completions/sec over the last interval
+    int n_coro;                 //** Coroutine ops running
+    int n_coro_parked;          //** and how many of those are parked in a gop wait
+} thread_pool_stats_t;
+
 typedef struct {
     char *name;
     portal_context_t *pc;
-    apr_thread_pool_t *tp;
-    Stack_t **reserve_stack;
-    int *overflow_running_depth;
+    apr_thread_pool_t *tp;   //** Used for TP_EXEC_APR
+    tp_ws_t *ws;             //** Used for TP_EXEC_WS
+    int executor;            //** TP_EXEC_APR | TP_EXEC_WS
+    apr_thread_mutex_t *lock;      //** Protects the reserve stacks and overflow slots
+    Stack_t **reserve_stack;       //** Ops waiting for a slot.  One stack per depth
+    atomic_int_t *reserve_bits;    //** Bitmap of the non-empty reserve stacks
+    atomic_int_t *running_bits;    //** Bitmap of the depths running in overflow slots
+    int n_bit_words;
     atomic_int_t n_overflow;
     atomic_int_t n_ops;
     atomic_int_t n_completed;
@@ -65,7 +162,30 @@ typedef struct {
     int min_threads;
     int max_threads;
     int recursion_depth;
-    int max_concurrency;
+    int max_concurrency;            //** Ops allowed to run at once.  Moved by the adaptive controller if enabled
+    gop_blocker_t blocker;          //** Installed on pool threads so they report blocking gop waits
+    atomic_int_t n_blocked;         //** Pool threads currently blocked in a gop wait
+    atomic_int_t n_compensating;    //** Extra concurrency currently granted to cover blocked threads
+    atomic_int_t n_compensated;     //** Total times compensation was granted
+    int max_compensation;           //** Hard cap on n_compensating
+    tp_cpuset_t *cpuset;            //** CPUs the APR executor threads are pinned to or NULL.  The ws executor tracks its own
+    int affinity_gen;               //** Bumped every time cpuset changes.  Threads compare it with the one they applied
+    int stats_enabled;              //** Collect the wait/exec histograms
+    tp_stats_shard_t *stats_shard;  //** TP_STATS_SHARDS of them
+    tp_adapt_t *adapt;              //** Adaptive concurrency controller or NULL
+    apr_thread_mutex_t *lane_lock;  //** Protects the lanes below
+    tp_ws_deque_t lane[TP_LANES];   //** Priority lanes in front of the APR executor.  The ws executor has its own
+    int lane_picks;                 //** Tasks picked from the lanes.  Drives the fairness
+    int lanes_used;                 //** Set once a non-NORMAL task shows up.  Until then tasks skip the lanes
+    apr_thread_mutex_t *coro_lock;  //** Protects the idle coroutine list
+    struct tp_coro_s *coro_idle;    //** Idle coroutines kept for reuse
+    int n_coro_idle;
+    size_t coro_stack_size;         //** Stack size for new coroutines
+    atomic_int_t n_coro;            //** Coroutine ops running
+    atomic_int_t n_coro_parked;     //** and how many of those are parked in a gop wait
+    apr_thread_mutex_t *pfor_lock[TP_PFOR_LOCKS];  //** Parallel loop slot locks
+    apr_thread_cond_t *pfor_cond[TP_PFOR_LOCKS];   //** and where the loop's op waits for the last chunks
+    atomic_int_t pfor_seq;          //** Spreads the loops across the stripes
 } thread_pool_context_t;
 
 typedef struct {
@@ -78,19 +198,99 @@ typedef struct {
     int depth;
     int parent_tid;
     int via_submit;
-    int overflow_slot;
+    int overflow_slot;     //** Depth bit held in running_bits or -1
+    int coro;              //** Run fn on a coroutine.  See new_thread_pool_coro_op()
+    apr_time_t submitted;  //** When it was handed to the pool if stats are on.  Independent of the gop latency timeline
 } thread_pool_op_t;
 
+#define TP_OP_INLINE_MAX 512  //** Max caller state stored inline in an op.  See new_thread_pool_inline_op()
+
+typedef struct {        //** Op with the caller's state stored right behind it
+    thread_pool_op_t op;
+    char state[] __attribute__((aligned(16)));
+} tp_inline_op_t;
+
+typedef struct {        //** Batch of direct tasks handed to the APR executor.  See thread_pool_direct_batch()
+    thread_pool_context_t *tpc;
+    apr_thread_start_t fn;  //** NULL if the tasks are on the context's lanes
+    int n;
+    atomic_int_t next;      //** Next task to claim
+    atomic_int_t refs;      //** Runners still going
+    apr_time_t submitted;   //** When it was pushed if the queue wait is being sampled or 0
+    void *arg[];            //** Task args if fn is set
+} tp_batch_t;
+
+typedef struct {        //** Direct task wrapped so its queue wait can be sampled.  Only used while stats are enabled
+    thread_pool_context_t *tpc;
+    apr_thread_start_t fn;
+    void *arg;
+    apr_time_t submitted;
+} tp_direct_t;
+
+#define TP_CORO_RUNNING 0
+#define TP_CORO_PARKED  1
+#define TP_CORO_DONE    2
+
+typedef struct tp_coro_s {  //** Coroutine a thread pool op runs on
+    ucontext_t ctx;                 //** Coroutine's saved context
+    ucontext_t sched;               //** Pool thread that last switched it in
+    char *stack;                    //** Stack with a guard page at the bottom
+    size_t stack_size;              //** Usable stack size
+    thread_pool_context_t *tpc;
+    op_generic_t *gop;              //** Op being run
+    apr_thread_t *th;               //** Pool thread it's running on
+    int state;                      //** TP_CORO_*
+    int depth;                      //** Thread local recursion depth while switched out
+    apr_thread_mutex_t *park_lock;  //** gop lock the pool thread releases once we're switched out
+    gop_blocker_t blocker;          //** Parks untimed gop waits and compensates for timed ones
+    gop_blocker_t *saved_blocker;   //** Blocker in effect when switched out
+    struct tp_coro_s *next;         //** Idle list
+} tp_coro_t;
+
 #define tp_get_gop(top) &((top)->gop)
+#define tp_concurrency(tpc) ((tpc)->max_concurrency + (int)atomic_get((tpc)->n_compensating))  //** Current concurrency limit
 #define gop_get_tp(gop) (gop)->op->priv
+#define tp_op_arg(gop) ((thread_pool_op_t *)gop_get_tp(gop))->arg  //** fn's arg.  For inline ops this is the inline state
+#define tp_lane(priority) ((priority) - OP_PRIORITY_LOW)  //** Maps an OP_PRIORITY_* to its TP_LANE_*
 //#define tp_gop_id(top) ((thread_pool_op_t *)((gop)->op->priv))->id
 
 int thread_pool_direct(thread_pool_context_t *tpc, apr_thread_start_t fn, void *arg);
+int thread_pool_direct_priority(thread_pool_context_t *tpc, int priority, apr_thread_start_t fn, void *arg);
+int thread_pool_direct_batch(thread_pool_context_t *tpc, apr_thread_start_t fn, void **args, int n);
+int thread_pool_direct_batch_priority(thread_pool_context_t *tpc, int priority, apr_thread_start_t fn, void **args, int n);
+
+op_generic_t *new_thread_pool_coro_op(thread_pool_context_t *tpc, char *que, op_status_t (*fn)(void *arg, int id), void *arg, void (*my_op_free)(void *arg), int workload);
+void thread_pool_coro_stack_size_set(thread_pool_context_t *tpc, size_t size);
+tp_coro_t *tp_coro_current();
+void *tp_coro_exec(apr_thread_t *th, op_generic_t *gop);
+void tp_coro_system_init(apr_pool_t *mpool);
+void tp_coro_system_destroy();
+void tp_coro_context_init(thread_pool_context_t *tpc);
+void tp_coro_context_destroy(thread_pool_context_t *tpc);
+
+op_generic_t *tp_parallel_for(thread_pool_context_t *tpc, int64_t begin, int64_t end, int64_t grain, void (*fn)(int64_t lo, int64_t hi, void *arg), void *arg);
+op_generic_t *tp_parallel_reduce(thread_pool_context_t *tpc, int64_t begin, int64_t end, int64_t grain, void (*fn)(int64_t lo, int64_t hi, void *partial, void *arg),
+                                 void (*combine)(void *result, void *partial, void *arg), void *arg, void *result, int size);
+void tp_pfor_context_init(thread_pool_context_t *tpc);
+void tp_pfor_context_destroy(thread_pool_context_t *tpc);
 
 int set_thread_pool_op(thread_pool_op_t *op, thread_pool_context_t *tpc, char *que, op_status_t (*fn)(void *arg, int id), void *arg, void (*my_op_free)(void *arg), int workload);
 op_generic_t *new_thread_pool_op(thread_pool_context_t *tpc, char *que, op_status_t (*fn)(void *arg, int id), void *arg, void (*my_op_free)(void *arg), int workload);
+op_generic_t *new_thread_pool_inline_op(thread_pool_context_t *tpc, char *que, op_status_t (*fn)(void *arg, int id), const void *state, int size, void (*destructor)(void *state), int workload);
+void thread_pool_op_coro_set(op_generic_t *gop, int coro);
 
 thread_pool_context_t *thread_pool_create_context(char *tp_name, int min_threads, int max_threads, int max_recursion);
+thread_pool_context_t *thread_pool_create_context_ex(char *tp_name, int min_threads, int max_threads, int max_recursion, int executor);
+void thread_pool_default_executor_set(int executor);
+void thread_pool_max_compensation_set(thread_pool_context_t *tpc, int n);
+void thread_pool_affinity_set(thread_pool_context_t *tpc, const char *cpus, int numa);
+void thread_pool_stats_enable(thread_pool_context_t *tpc, int enable);
+void thread_pool_stats_reset(thread_pool_context_t *tpc);
+void thread_pool_stats_snapshot(thread_pool_context_t *tpc, thread_pool_stats_t *st);
+void thread_pool_stats_log(int ll, thread_pool_context_t *tpc);
+void thread_pool_adaptive_enable(thread_pool_context_t *tpc, int min_concurrency, apr_interval_time_t target_wait, apr_interval_time_t interval);
+void thread_pool_adaptive_disable(thread_pool_context_t *tpc);
+int thread_pool_executor_parse(const char *name);
 void thread_pool_destroy_context(thread_pool_context_t *tpc);
 
 void  *thread_pool_exec_fn(apr_thread_t *th, void *data);
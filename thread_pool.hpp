@@ -0,0 +1,111 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// thread_pool.hpp - C++ helpers for building thread pool ops from
+//     callables.  The callable is moved into the op's inline storage
+//     (see new_thread_pool_inline_op()) so move-only captures work and
+//     no separate arg allocation is needed.  Init-captures like the one
+//     below need C++14.  Under C++11 use a functor with the move-only
+//     object as a member instead.
+//
+//     op_generic_t *gop = tp_closure_op(tpc, [buf = std::move(buf)](int id) {
+//         return (buf->size() > 0) ? op_success_status : op_failure_status;
+//     });
+//*************************************************************
+
+#ifndef __THREAD_POOL_HPP_
+#define __THREAD_POOL_HPP_
+
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cxxabi.h>
+#include "thread_pool.h"
+
+namespace tp_closure_detail {
+
+//** Trampoline that runs the callable stored in the op.  Exceptions can't cross into the C code so they fail the op.
+//** Thread cancellation unwinds with a forced unwind that has to keep going or the runtime aborts.
+template <typename F>
+op_status_t tp_closure_call(void *arg, int id)
+{
+    try {
+        return((*static_cast<F *>(arg))(id));
+#ifdef __GLIBCXX__
+    } catch (abi::__forced_unwind &) {
+        throw;
+#endif
+    } catch (...) {
+        return(op_failure_status);
+    }
+}
+
+//** Destroys the callable when the op is freed
+template <typename F>
+void tp_closure_destroy(void *arg)
+{
+    static_cast<F *>(arg)->~F();
+}
+
+} // namespace tp_closure_detail
+
+//*************************************************************
+// tp_closure_op - Makes a thread pool op that runs fn(id) and returns its
+//     op_status_t.  fn is moved or copied into the op and destroyed with it.
+//     Set coro to run it on a coroutine.  See new_thread_pool_coro_op()
+//*************************************************************
+
+template <typename F>
+op_generic_t *tp_closure_op(thread_pool_context_t *tpc, F &&fn, int workload = 1, int coro = 0)
+{
+    typedef typename std::decay<F>::type closure_t;
+    op_generic_t *gop;
+
+    static_assert(sizeof(closure_t) <= TP_OP_INLINE_MAX, "Closure is too big to store inline in a thread pool op");
+    static_assert(alignof(closure_t) <= 16, "Closure alignment is larger than the inline op storage provides");
+
+    //** The destructor is only hooked up once the closure is constructed in case that throws
+    gop = new_thread_pool_inline_op(tpc, NULL, tp_closure_detail::tp_closure_call<closure_t>, NULL, sizeof(closure_t), NULL, workload);
+    try {
+        new (tp_op_arg(gop)) closure_t(std::forward<F>(fn));
+    } catch (...) {
+        gop_free(gop, OP_DESTROY);
+        throw;
+    }
+
+    if (!std::is_trivially_destructible<closure_t>::value) {
+        static_cast<thread_pool_op_t *>(gop_get_tp(gop))->my_op_free = tp_closure_detail::tp_closure_destroy<closure_t>;
+    }
+    if (coro) thread_pool_op_coro_set(gop, 1);
+
+    return(gop);
+}
+
+#endif
@@ -0,0 +1,254 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// thread_pool_adapt.c - Optional controller that moves a context's
+//     concurrency limit between a min and the limit it was created with.
+//
+//  Every interval it looks at the queue wait p90 and the completion rate
+//  since the last sample.  It grows, by a quarter of the current limit,
+//  when ops are queued and the wait has been over the target for
+//  TP_ADAPT_UP_INTERVALS in a row.  If a grow didn't raise throughput
+//  by at least 5% more growing is held off for TP_ADAPT_HOLD_INTERVALS
+//  since the bottleneck is elsewhere.  It shrinks by 1 after
+//  TP_ADAPT_DOWN_INTERVALS in a row with nothing queued, the wait well
+//  under the target and spare concurrency.
+//*************************************************************
+
+#define _log_module_index 135
+
+#include <string.h>
+#include <apr_pools.h>
+#include <apr_thread_proc.h>
+#include "assert_result.h"
+#include "apr_wrapper.h"
+#include "thread_pool.h"
+#include "type_malloc.h"
+#include "log.h"
+#include "fmttypes.h"
+
+void _tp_executor_resize(thread_pool_context_t *tpc);
+void _tpc_overflow_kick(thread_pool_context_t *tpc);
+
+//*************************************************************
+// _tp_adapt_sample - Gets the wait p90, completion rate, and queue length
+//    since the last sample
+//*************************************************************
+
+int _tp_adapt_sample(thread_pool_context_t *tpc, tp_adapt_t *a)
+{
+    gop_histo_t cur, delta;
+    apr_uint64_t completed;
+    apr_time_t now, dt;
+    int i, n_threads, n_idle, n_queued;
+
+    memset(&cur, 0, sizeof(cur));
+    for (i=0; i<TP_STATS_SHARDS; i++) {
+        gop_histo_merge(&cur, &(tpc->stats_shard[i].wait));
+    }
+
+    //** Only want what happened this interval
+    memset(&delta, 0, sizeof(delta));
+    if (cur.count >= a->last_wait.count) {  //** Skip it if the stats were reset
+        for (i=0; i<GOP_HISTO_BUCKETS; i++) {
+            delta.bucket[i] = cur.bucket[i] - a->last_wait.bucket[i];
+        }
+        delta.count = cur.count - a->last_wait.count;
+        delta.max = cur.max;
+    }
+    a->last_wait = cur;
+    a->n_samples = delta.count;
+    a->wait_p90 = gop_histo_percentile(&delta, 90);
+
+    now = apr_time_now();
+    dt = now - a->last_time;
+    completed = atomic_get(tpc->n_completed);
+    a->rate = (dt > 0) ? (double)(completed - a->last_completed) * APR_USEC_PER_SEC / dt : 0;
+    a->last_completed = completed;
+    a->last_time = now;
+
+    n_queued = 0;
+    if (tpc->executor == TP_EXEC_WS) {
+        tp_ws_counts(tpc->ws, &n_threads, &n_idle, &n_queued);
+    } else {
+        n_queued = apr_thread_pool_tasks_count(tpc->tp);
+    }
+
+    return(n_queued + atomic_get(tpc->n_overflow));
+}
+
+//*************************************************************
+// _tp_adapt_step - Runs one interval of the controller
+//*************************************************************
+
+void _tp_adapt_step(thread_pool_context_t *tpc, tp_adapt_t *a)
+{
+    int n_queued, conc, n, step;
+
+    n_queued = _tp_adapt_sample(tpc, a);
+    conc = tpc->max_concurrency;
+
+    //** Did the last grow pay off?
+    if ((a->last_action > 0) && (a->rate < 1.05 * a->rate_before_grow)) a->hold = TP_ADAPT_HOLD_INTERVALS;
+    if (a->hold > 0) a->hold--;
+
+    if (a->n_samples == 0) {  //** Nothing was dequeued so there's nothing to go on
+        a->up_count = 0;
+        a->down_count = 0;
+    } else if ((n_queued > 0) && (a->wait_p90 > (apr_uint64_t)a->target_wait)) {
+        a->up_count++;
+        a->down_count = 0;
+    } else if ((n_queued == 0) && (a->wait_p90 < (apr_uint64_t)a->target_wait/4) && ((int)atomic_get(tpc->n_running) < conc)) {
+        a->down_count++;
+        a->up_count = 0;
+    } else {
+        a->up_count = 0;
+        a->down_count = 0;
+    }
+
+    n = conc;
+    if ((a->up_count >= TP_ADAPT_UP_INTERVALS) && (a->hold == 0) && (conc < a->max_concurrency)) {
+        step = conc / 4;
+        if (step < 1) step = 1;
+        n = conc + step;
+        if (n > a->max_concurrency) n = a->max_concurrency;
+        a->rate_before_grow = a->rate;
+        a->up_count = 0;
+        a->n_grow++;
+    } else if ((a->down_count >= TP_ADAPT_DOWN_INTERVALS) && (conc > a->min_concurrency)) {
+        n = conc - 1;
+        a->down_count = 0;
+        a->hold = 0;
+        a->n_shrink++;
+    }
+    a->last_action = n - conc;
+
+    if (n == conc) return;
+
+    log_printf(5, "tpc=%s concurrency %d -> %d wait_p90=" LU " rate=%lf n_queued=%d\n", tpc->name, conc, n, a->wait_p90, a->rate, n_queued);
+
+    apr_thread_mutex_lock(tpc->lock);
+    tpc->max_concurrency = n;
+    _tp_executor_resize(tpc);
+    if (n > conc) _tpc_overflow_kick(tpc);
+    apr_thread_mutex_unlock(tpc->lock);
+}
+
+//*************************************************************
+// _tp_adapt_thread - Controller thread
+//*************************************************************
+
+void *_tp_adapt_thread(apr_thread_t *th, void *arg)
+{
+    thread_pool_context_t *tpc = (thread_pool_context_t *)arg;
+    tp_adapt_t *a = tpc->adapt;
+
+    apr_thread_mutex_lock(a->lock);
+    while (a->shutdown == 0) {
+        apr_thread_cond_timedwait(a->cond, a->lock, a->interval);
+        if (a->shutdown == 1) break;
+
+        apr_thread_mutex_unlock(a->lock);
+        _tp_adapt_step(tpc, a);
+        apr_thread_mutex_lock(a->lock);
+    }
+    apr_thread_mutex_unlock(a->lock);
+
+    return(NULL);
+}
+
+//*************************************************************
+// thread_pool_adaptive_enable - Starts the adaptive controller for the
+//    context.  The limit moves between min_concurrency and the limit the
+//    context was created with.  Uses TP_ADAPT_TARGET_WAIT and
+//    TP_ADAPT_INTERVAL if target_wait or interval are <= 0.  The queue
+//    wait comes from the stats histograms so they're turned on as well.
+//*************************************************************
+
+void thread_pool_adaptive_enable(thread_pool_context_t *tpc, int min_concurrency, apr_interval_time_t target_wait, apr_interval_time_t interval)
+{
+    tp_adapt_t *a;
+    int i;
+
+    if (tpc->adapt != NULL) thread_pool_adaptive_disable(tpc);
+
+    type_malloc_clear(a, tp_adapt_t, 1);
+    assert_result(apr_pool_create(&(a->mpool), NULL), APR_SUCCESS);
+    apr_thread_mutex_create(&(a->lock), APR_THREAD_MUTEX_DEFAULT, a->mpool);
+    apr_thread_cond_create(&(a->cond), a->mpool);
+
+    a->max_concurrency = tpc->max_concurrency;
+    a->min_concurrency = (min_concurrency < 1) ? 1 : min_concurrency;
+    if (a->min_concurrency > a->max_concurrency) a->min_concurrency = a->max_concurrency;
+    a->target_wait = (target_wait > 0) ? target_wait : TP_ADAPT_TARGET_WAIT;
+    a->interval = (interval > 0) ? interval : TP_ADAPT_INTERVAL;
+    a->last_time = apr_time_now();
+    a->last_completed = atomic_get(tpc->n_completed);
+    for (i=0; i<TP_STATS_SHARDS; i++) {
+        gop_histo_merge(&(a->last_wait), &(tpc->stats_shard[i].wait));
+    }
+
+    tpc->stats_enabled = 1;
+    tpc->adapt = a;
+
+    thread_create_assert(&(a->thread), NULL, _tp_adapt_thread, (void *)tpc, a->mpool);
+
+    log_printf(5, "tpc=%s min=%d max=%d target_wait=" TT " interval=" TT "\n", tpc->name, a->min_concurrency, a->max_concurrency, a->target_wait, a->interval);
+}
+
+//*************************************************************
+// thread_pool_adaptive_disable - Stops the controller and puts the
+//    concurrency limit back where it started
+//*************************************************************
+
+void thread_pool_adaptive_disable(thread_pool_context_t *tpc)
+{
+    tp_adapt_t *a = tpc->adapt;
+    apr_status_t value;
+
+    if (a == NULL) return;
+
+    apr_thread_mutex_lock(a->lock);
+    a->shutdown = 1;
+    apr_thread_cond_signal(a->cond);
+    apr_thread_mutex_unlock(a->lock);
+    apr_thread_join(&value, a->thread);
+
+    apr_thread_mutex_lock(tpc->lock);
+    tpc->adapt = NULL;
+    tpc->max_concurrency = a->max_concurrency;
+    _tp_executor_resize(tpc);
+    _tpc_overflow_kick(tpc);
+    apr_thread_mutex_unlock(tpc->lock);
+
+    apr_thread_mutex_destroy(a->lock);
+    apr_thread_cond_destroy(a->cond);
+    apr_pool_destroy(a->mpool);
+    free(a);
+}
@@ -0,0 +1,295 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// thread_pool_affinity.c - CPU set parsing, thread pinning and the
+//     CPU -> NUMA node table.  The node layout comes from sysfs so
+//     there's no libnuma dependency.  On anything but Linux pinning is
+//     a no-op and everything looks like a single node.
+//*************************************************************
+
+#define _log_module_index 134
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+#include "type_malloc.h"
+#include "log.h"
+#include "thread_pool_affinity.h"
+
+#define TP_NUMA_MAX_NODES 64
+
+static int _tp_n_nodes = 0;           //** NUMA nodes found.  0 if unknown
+static int _tp_n_cpus = 0;            //** Size of the CPU -> node table
+static int *_tp_cpu_node = NULL;      //** CPU -> node table
+static tp_cpuset_t *_tp_node_cpus[TP_NUMA_MAX_NODES];
+
+//*************************************************************
+// tp_cpuset_parse - Parses a CPU list like "0-7,16-23".  Returns NULL
+//    if the list is empty, "all" or invalid.
+//*************************************************************
+
+tp_cpuset_t *tp_cpuset_parse(const char *str)
+{
+    tp_cpuset_t *cs;
+    const char *p;
+    char *end;
+    int size, i, lo, hi;
+
+    if (str == NULL) return(NULL);
+    if (strcmp(str, "all") == 0) return(NULL);
+
+    type_malloc_clear(cs, tp_cpuset_t, 1);
+    size = 16;
+    type_malloc(cs->cpu, int, size);
+
+    p = str;
+    while (*p != 0) {
+        while (isspace(*p) || (*p == ',')) p++;
+        if (*p == 0) break;
+
+        lo = strtol(p, &end, 10);
+        if ((end == p) || (lo < 0)) goto fail;
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtol(p, &end, 10);
+            if ((end == p) || (hi < lo)) goto fail;
+            p = end;
+        }
+        if ((*p != 0) && (*p != ',') && !isspace(*p)) goto fail;
+
+        for (i=lo; i<=hi; i++) {
+            if (cs->n == size) {
+                size = 2*size;
+                type_realloc(cs->cpu, int, size);
+            }
+            cs->cpu[cs->n] = i;
+            cs->n++;
+        }
+    }
+
+    if (cs->n == 0) {
+        tp_cpuset_destroy(cs);
+        return(NULL);
+    }
+
+    return(cs);
+
+fail:
+    log_printf(0, "Invalid CPU list: %s\n", str);
+    tp_cpuset_destroy(cs);
+    return(NULL);
+}
+
+//*************************************************************
+
+tp_cpuset_t *tp_cpuset_dup(tp_cpuset_t *cs)
+{
+    tp_cpuset_t *d;
+
+    if (cs == NULL) return(NULL);
+
+    type_malloc(d, tp_cpuset_t, 1);
+    d->n = cs->n;
+    type_malloc(d->cpu, int, cs->n);
+    memcpy(d->cpu, cs->cpu, sizeof(int)*cs->n);
+
+    return(d);
+}
+
+//*************************************************************
+
+void tp_cpuset_destroy(tp_cpuset_t *cs)
+{
+    if (cs == NULL) return;
+
+    if (cs->cpu != NULL) free(cs->cpu);
+    free(cs);
+}
+
+//*************************************************************
+// tp_cpuset_apply - Pins the calling thread to the CPU set.
+//    Returns 0 on success.
+//*************************************************************
+
+int tp_cpuset_apply(tp_cpuset_t *cs)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    int i, err;
+
+    if (cs == NULL) return(0);
+
+    CPU_ZERO(&set);
+    for (i=0; i<cs->n; i++) {
+        if (cs->cpu[i] < CPU_SETSIZE) CPU_SET(cs->cpu[i], &set);
+    }
+
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        log_printf(0, "ERROR pinning thread! err=%d n_cpus=%d cpu[0]=%d\n", err, cs->n, cs->cpu[0]);
+        return(1);
+    }
+
+    return(0);
+#else
+    return((cs == NULL) ? 0 : 1);
+#endif
+}
+
+//*************************************************************
+// tp_affinity_system_init - Loads the NUMA node layout from sysfs
+//*************************************************************
+
+void tp_affinity_system_init()
+{
+    FILE *fd;
+    char fname[128], line[4096];
+    int node, i, max_cpu;
+
+    if (_tp_n_nodes > 0) return;
+
+    max_cpu = -1;
+    for (node=0; node<TP_NUMA_MAX_NODES; node++) {
+        snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/cpulist", node);
+        fd = fopen(fname, "r");
+        if (fd == NULL) break;
+        line[0] = 0;
+        if (fgets(line, sizeof(line), fd) == NULL) line[0] = 0;
+        fclose(fd);
+
+        _tp_node_cpus[node] = tp_cpuset_parse(line);
+        for (i=0; (_tp_node_cpus[node] != NULL) && (i<_tp_node_cpus[node]->n); i++) {
+            if (_tp_node_cpus[node]->cpu[i] > max_cpu) max_cpu = _tp_node_cpus[node]->cpu[i];
+        }
+    }
+    _tp_n_nodes = node;
+
+    //** Make the reverse table
+    _tp_n_cpus = max_cpu + 1;
+    if (_tp_n_cpus > 0) {
+        type_malloc(_tp_cpu_node, int, _tp_n_cpus);
+        for (i=0; i<_tp_n_cpus; i++) _tp_cpu_node[i] = 0;
+        for (node=0; node<_tp_n_nodes; node++) {
+            for (i=0; (_tp_node_cpus[node] != NULL) && (i<_tp_node_cpus[node]->n); i++) {
+                _tp_cpu_node[_tp_node_cpus[node]->cpu[i]] = node;
+            }
+        }
+    }
+
+    log_printf(5, "n_nodes=%d n_cpus=%d\n", _tp_n_nodes, _tp_n_cpus);
+}
+
+//*************************************************************
+
+void tp_affinity_system_destroy()
+{
+    int i;
+
+    for (i=0; i<_tp_n_nodes; i++) {
+        tp_cpuset_destroy(_tp_node_cpus[i]);
+        _tp_node_cpus[i] = NULL;
+    }
+    if (_tp_cpu_node != NULL) free(_tp_cpu_node);
+    _tp_cpu_node = NULL;
+    _tp_n_cpus = 0;
+    _tp_n_nodes = 0;
+}
+
+//*************************************************************
+// tp_numa_nodes - Returns the number of NUMA nodes.  Always at least 1.
+//*************************************************************
+
+int tp_numa_nodes()
+{
+    return((_tp_n_nodes > 0) ? _tp_n_nodes : 1);
+}
+
+//*************************************************************
+// tp_numa_node_cpuset - Returns a new CPU set with the node's CPUs that
+//    are also in the mask, if given.  NULL if there aren't any.
+//*************************************************************
+
+tp_cpuset_t *tp_numa_node_cpuset(int node, tp_cpuset_t *mask)
+{
+    tp_cpuset_t *cs, *ns;
+    int i, j;
+
+    if ((node < 0) || (node >= _tp_n_nodes) || (_tp_node_cpus[node] == NULL)) return(NULL);
+
+    ns = _tp_node_cpus[node];
+    if (mask == NULL) return(tp_cpuset_dup(ns));
+
+    type_malloc_clear(cs, tp_cpuset_t, 1);
+    type_malloc(cs->cpu, int, ns->n);
+    for (i=0; i<ns->n; i++) {
+        for (j=0; j<mask->n; j++) {
+            if (ns->cpu[i] == mask->cpu[j]) {
+                cs->cpu[cs->n] = ns->cpu[i];
+                cs->n++;
+                break;
+            }
+        }
+    }
+
+    if (cs->n == 0) {
+        tp_cpuset_destroy(cs);
+        return(NULL);
+    }
+
+    return(cs);
+}
+
+//*************************************************************
+// tp_numa_current_node - Returns the NUMA node the caller is running on
+//    or -1 if unknown
+//*************************************************************
+
+int tp_numa_current_node()
+{
+#ifdef __linux__
+    int cpu;
+
+    if (_tp_n_nodes <= 1) return((_tp_n_nodes == 1) ? 0 : -1);
+
+    cpu = sched_getcpu();
+    if ((cpu < 0) || (cpu >= _tp_n_cpus)) return(-1);
+
+    return(_tp_cpu_node[cpu]);
+#else
+    return(-1);
+#endif
+}
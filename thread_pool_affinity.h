@@ -0,0 +1,61 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// thread_pool_affinity.h - CPU sets and NUMA node lookup used to pin
+//     thread pool workers and MQ connection threads
+//*************************************************************
+
+#ifndef __THREAD_POOL_AFFINITY_H_
+#define __THREAD_POOL_AFFINITY_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {        //** Set of CPUs a thread can be pinned to
+    int n;                //** Number of CPUs in the set
+    int *cpu;             //** CPU ids
+} tp_cpuset_t;
+
+void tp_affinity_system_init();
+void tp_affinity_system_destroy();
+tp_cpuset_t *tp_cpuset_parse(const char *str);
+tp_cpuset_t *tp_cpuset_dup(tp_cpuset_t *cs);
+void tp_cpuset_destroy(tp_cpuset_t *cs);
+int tp_cpuset_apply(tp_cpuset_t *cs);
+int tp_numa_nodes();
+tp_cpuset_t *tp_numa_node_cpuset(int node, tp_cpuset_t *mask);
+int tp_numa_current_node();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -30,17 +30,21 @@ http://www.accre.vanderbilt.edu
 #define _log_module_index 122
 
 #include <assert.h>
+#include <string.h>
 #include "assert_result.h"
 #include <apr_pools.h>
 #include <apr_thread_proc.h>
 #include <apr_thread_pool.h>
 #include <apr_env.h>
+#include <apr_atomic.h>
 #include "apr_wrapper.h"
 #include "opque.h"
 #include "thread_pool.h"
 #include "network.h"
 #include "log.h"
 #include "type_malloc.h"
+#include "gop_slab.h"
+#include "fmttypes.h"
 
 void  *thread_pool_exec_fn(apr_thread_t *th, void *arg);
 void *_tp_dup_connect_context(void *connect_context);
@@ -48,9 +52,15 @@ void _tp_destroy_connect_context(void *connect_context);
 int _tp_connect(NetStream_t *ns, void *connect_context, char *host, int port, Net_timeout_t timeout);
 void _tp_close_connection(NetStream_t *ns);
 op_generic_t *_tpc_overflow_next(thread_pool_context_t *tpc);
+void _tpc_reserve_push(thread_pool_context_t *tpc, op_generic_t *gop);
+void _tpc_reserve_check(thread_pool_context_t *tpc, int depth);
+void _tpc_overflow_release(thread_pool_context_t *tpc, thread_pool_op_t *op);
 
 void _tp_op_free(op_generic_t *op, int mode);
 void _tp_submit_op(void *arg, op_generic_t *op);
+void _tp_submit_batch(void *arg, op_generic_t **ops, int n);
+int _tp_cancel(void *arg, op_generic_t *gop);
+op_generic_t *_tp_help(void *arg, op_generic_t *gop);
 
 static portal_fn_t _tp_base_portal = {
     .dup_connect_context = _tp_dup_connect_context,
@@ -59,19 +69,28 @@ static portal_fn_t _tp_base_portal = {
     .close_connection = _tp_close_connection,
     .sort_tasks = default_sort_ops,
     .submit = _tp_submit_op,
-    .sync_exec = thread_pool_exec_fn
+    .sync_exec = thread_pool_exec_fn,
+    .submit_batch = _tp_submit_batch,
+    .cancel = _tp_cancel,
+    .help = _tp_help
 };
 
+//** APR priority each lane's runner is pushed with so they also order against tasks that skipped the lanes
+static int _tp_lane_apr_priority[TP_LANES] = { APR_THREAD_TASK_PRIORITY_LOW, APR_THREAD_TASK_PRIORITY_NORMAL, APR_THREAD_TASK_PRIORITY_HIGH };
+
 void thread_pool_stats_make();
 void thread_pool_stats_print();
 
 atomic_int_t _tp_context_count = 0;
-apr_thread_mutex_t *_tp_lock = NULL;
+apr_thread_mutex_t *_tp_lock = NULL;  //** Only protects the global stats.  Each context has its own lock
 apr_pool_t *_tp_pool = NULL;
 int _tp_stats = 0;
+static atomic_int_t _tp_affinity_gen = 0;
+int _tp_default_executor = TP_EXEC_APR;
 
 extern apr_threadkey_t *thread_local_stats_key;
 extern apr_threadkey_t *thread_local_depth_key;
+extern apr_threadkey_t *thread_local_affinity_key;
 
 //***************************************************************************
 
@@ -106,6 +125,255 @@ void thread_pool_stats_init()
     }
 }
 
+//**********************************************************
+// thread_pool_executor_parse - Converts the executor name to its type.
+//     Returns TP_EXEC_DEFAULT if unknown.
+//**********************************************************
+
+int thread_pool_executor_parse(const char *name)
+{
+    if (name == NULL) return(TP_EXEC_DEFAULT);
+    if (strcmp(name, "apr") == 0) return(TP_EXEC_APR);
+    if (strcmp(name, "ws") == 0) return(TP_EXEC_WS);
+
+    log_printf(0, "Unknown thread pool executor %s.  Using the default\n", name);
+    return(TP_EXEC_DEFAULT);
+}
+
+//**********************************************************
+// thread_pool_default_executor_set - Sets the executor used by contexts
+//     created with TP_EXEC_DEFAULT.  GOP_TP_EXECUTOR=apr|ws overrides it
+//     when the first context is created.
+//**********************************************************
+
+void thread_pool_default_executor_set(int executor)
+{
+    _tp_default_executor = executor;
+}
+
+//**********************************************************
+// thread_pool_executor_init - Checks the environment for the default executor
+//**********************************************************
+
+void thread_pool_executor_init()
+{
+    char *eval;
+    int executor;
+
+    eval = NULL;
+    apr_env_get(&eval, "GOP_TP_EXECUTOR", _tp_pool);
+    executor = thread_pool_executor_parse(eval);
+    if (executor != TP_EXEC_DEFAULT) _tp_default_executor = executor;
+
+    tp_ws_system_init(_tp_pool);
+    tp_coro_system_init(_tp_pool);
+    tp_affinity_system_init();
+}
+
+//*************************************************************
+// _tp_lane_runner - APR task that runs the next task from the context's
+//    lanes.  One is pushed for every task placed on the lanes so there's
+//    always something waiting for it.  Lanes are checked highest 1st
+//    except every TP_LANE_FAIR'th pick which goes lowest 1st.
+//*************************************************************
+
+void *_tp_lane_runner(apr_thread_t *th, void *arg)
+{
+    thread_pool_context_t *tpc = (thread_pool_context_t *)arg;
+    tp_ws_task_t t;
+    int i, lane, fair, found;
+
+    found = 0;
+    apr_thread_mutex_lock(tpc->lane_lock);
+    tpc->lane_picks++;
+    fair = ((tpc->lane_picks % TP_LANE_FAIR) == 0) ? 1 : 0;
+    for (i=0; i<TP_LANES; i++) {
+        lane = (fair == 1) ? i : TP_LANES-1-i;
+        found = _ws_ring_pop(&(tpc->lane[lane]), &t);
+        if (found == 1) break;
+    }
+    apr_thread_mutex_unlock(tpc->lane_lock);
+
+    if (found == 1) t.fn(th, t.arg);
+
+    return(NULL);
+}
+
+//*************************************************************
+// _tp_push_lane - Hands the task to the context's executor on the
+//    given TP_LANE_*.  The APR executor doesn't bother with the lanes
+//    until something other than a NORMAL task shows up.
+//*************************************************************
+
+apr_status_t _tp_push_lane(thread_pool_context_t *tpc, int lane, apr_thread_start_t fn, void *arg)
+{
+    tp_ws_task_t t;
+
+    if (tpc->executor == TP_EXEC_WS) {
+        tp_ws_push_lane(tpc->ws, lane, fn, arg);
+        return(APR_SUCCESS);
+    }
+
+    if ((lane == TP_LANE_NORMAL) && (tpc->lanes_used == 0)) {
+        return(apr_thread_pool_push(tpc->tp, fn, arg, APR_THREAD_TASK_PRIORITY_NORMAL, NULL));
+    }
+
+    tpc->lanes_used = 1;
+    t.fn = fn;
+    t.arg = arg;
+    apr_thread_mutex_lock(tpc->lane_lock);
+    _ws_ring_push(&(tpc->lane[lane]), &t);
+    apr_thread_mutex_unlock(tpc->lane_lock);
+
+    return(apr_thread_pool_push(tpc->tp, _tp_lane_runner, tpc, _tp_lane_apr_priority[lane], NULL));
+}
+
+//*************************************************************
+// _tp_direct_wait_add - Records a direct task's queue wait in the calling
+//    thread's stats shard.  Direct tasks never go through
+//    thread_pool_exec_fn() so they have to be sampled here or the
+//    adaptive controller never sees them.
+//*************************************************************
+
+void _tp_direct_wait_add(thread_pool_context_t *tpc, apr_time_t submitted)
+{
+    if (submitted == 0) return;
+
+    gop_histo_add(&(tpc->stats_shard[(unsigned int)atomic_thread_id % TP_STATS_SHARDS].wait), apr_time_now() - submitted);
+}
+
+//*************************************************************
+// _tp_direct_runner - Runs a wrapped direct task after sampling its wait
+//*************************************************************
+
+void *_tp_direct_runner(apr_thread_t *th, void *arg)
+{
+    tp_direct_t *d = (tp_direct_t *)arg;
+    apr_thread_start_t fn = d->fn;
+    void *task_arg = d->arg;
+
+    _tp_direct_wait_add(d->tpc, d->submitted);
+    gop_slab_free(d);
+
+    return(fn(th, task_arg));
+}
+
+//*************************************************************
+// _tp_batch_runner - APR task that runs batch tasks until they're all
+//    claimed.  If the batch has no fn the tasks are on the lanes and each
+//    claim runs the next lane task instead.  The last runner out frees it.
+//*************************************************************
+
+void *_tp_batch_runner(apr_thread_t *th, void *arg)
+{
+    tp_batch_t *b = (tp_batch_t *)arg;
+    int i;
+
+    while ((i = atomic_inc(b->next)) < b->n) {
+        _tp_direct_wait_add(b->tpc, b->submitted);
+        if (b->fn != NULL) {
+            b->fn(th, b->arg[i]);
+        } else {
+            _tp_lane_runner(th, b->tpc);
+        }
+    }
+
+    if (atomic_dec(b->refs) == 0) free(b);
+
+    return(NULL);
+}
+
+//*************************************************************
+// _tp_push_batch_lane - Hands n tasks sharing the same fn to the
+//    context's executor on the given TP_LANE_*.  The APR executor gets
+//    at most one runner per thread instead of a task apiece.  Any runner
+//    that makes it in works through the whole batch so an error is only
+//    returned if none did, in which case none of the tasks will run.
+//*************************************************************
+
+apr_status_t _tp_push_batch_lane(thread_pool_context_t *tpc, int lane, apr_thread_start_t fn, void **args, int n)
+{
+    apr_status_t err, aerr;
+    tp_batch_t *b;
+    tp_ws_task_t t;
+    int i, k, lanes, n_ok;
+
+    if (n <= 0) return(APR_SUCCESS);
+
+    //** If the wait is being sampled the ws executor gets runners as well
+    if ((tpc->executor == TP_EXEC_WS) && (tpc->stats_enabled == 0)) {
+        tp_ws_push_batch(tpc->ws, lane, fn, args, n);
+        return(APR_SUCCESS);
+    }
+
+    //** Tasks go on the lanes just like single pushes so the fairness holds
+    lanes = ((tpc->executor == TP_EXEC_APR) && ((lane != TP_LANE_NORMAL) || (tpc->lanes_used == 1))) ? 1 : 0;
+    if (lanes == 1) {
+        tpc->lanes_used = 1;
+        b = malloc(sizeof(tp_batch_t));
+    } else {
+        b = malloc(sizeof(tp_batch_t) + n*sizeof(void *));
+        memcpy(b->arg, args, n*sizeof(void *));
+    }
+    assert(b != NULL);
+
+    k = (n < tpc->max_threads) ? n : tpc->max_threads;
+    b->tpc = tpc;
+    b->fn = (lanes == 1) ? NULL : fn;
+    b->n = n;
+    atomic_set(b->next, 0);
+    atomic_set(b->refs, k);
+    b->submitted = (tpc->stats_enabled == 1) ? apr_time_now() : 0;
+
+    //** The lane lock is held until the tasks are on the lane so the
+    //** runners can't get to it first.  They only go on if a runner made it.
+    if (lanes == 1) apr_thread_mutex_lock(tpc->lane_lock);
+
+    err = APR_SUCCESS;
+    n_ok = 0;
+    for (i=0; i<k; i++) {
+        if (tpc->executor == TP_EXEC_WS) {
+            tp_ws_push_lane(tpc->ws, lane, _tp_batch_runner, b);
+            aerr = APR_SUCCESS;
+        } else {
+            aerr = apr_thread_pool_push(tpc->tp, _tp_batch_runner, b, _tp_lane_apr_priority[lane], NULL);
+        }
+        if (aerr == APR_SUCCESS) {
+            n_ok++;
+        } else {
+            err = aerr;
+        }
+    }
+
+    if (lanes == 1) {
+        if (n_ok > 0) {
+            t.fn = fn;
+            for (i=0; i<n; i++) {
+                t.arg = args[i];
+                _ws_ring_push(&(tpc->lane[lane]), &t);
+            }
+        }
+        apr_thread_mutex_unlock(tpc->lane_lock);
+    }
+
+    //** Drop the references of the runners that didn't make it
+    if (n_ok < k) {
+        log_printf(0, "ERROR: Only pushed %d of %d runners! n=%d err=%d\n", n_ok, k, n, err);
+        if (apr_atomic_add32(&(b->refs), -(k - n_ok)) == (apr_uint32_t)(k - n_ok)) free(b);
+    }
+
+    return((n_ok > 0) ? APR_SUCCESS : err);
+}
+
+//*************************************************************
+// _tp_push_op - Hands the op to the context's executor on its priority's lane
+//*************************************************************
+
+apr_status_t _tp_push_op(thread_pool_context_t *tpc, op_generic_t *gop)
+{
+    return(_tp_push_lane(tpc, tp_lane(gop_priority(gop)), thread_pool_exec_fn, gop));
+}
+
 //*************************************************************
 
 portal_fn_t default_tp_imp()
@@ -130,7 +398,7 @@ void _tp_op_free(op_generic_t *gop, int mode)
 
     if (top->dop.cmd.hostport) free(top->dop.cmd.hostport);
 
-    if (mode == OP_DESTROY) free(gop->free_ptr);
+    if (mode == OP_DESTROY) gop_slab_free(gop->free_ptr);
     log_printf(15, "_tp_op_free: gid=%d END\n", id);
     flush_log();
 
@@ -141,6 +409,7 @@ void _tp_op_free(op_generic_t *gop, int mode)
 void _tp_submit_op(void *arg, op_generic_t *gop)
 {
     thread_pool_op_t *op = gop_get_tp(gop);
+    thread_pool_context_t *tpc;
     apr_status_t aerr;
     int running;
 
@@ -148,33 +417,25 @@ void _tp_submit_op(void *arg, op_generic_t *gop)
 
     atomic_inc(op->tpc->n_submitted);
     op->via_submit = 1;
+    if (op->tpc->stats_enabled == 1) op->submitted = apr_time_now();  //** For the queue wait stats
     running = atomic_inc(op->tpc->n_running) + 1;
 
-    if (running > op->tpc->max_concurrency) {
-        apr_thread_mutex_lock(_tp_lock);
-        atomic_inc(op->tpc->n_overflow);
-        if (op->depth >= op->tpc->recursion_depth) {  //** Check if we hit the max recursion
-            log_printf(0, "GOP has a recursion depth >= max specified in the TP!!!! gop depth=%d  TPC max=%d\n", op->depth, op->tpc->recursion_depth);
-            push(op->tpc->reserve_stack[op->tpc->recursion_depth-1], gop);  //** Need to do the push and overflow check
-        } else {
-            push(op->tpc->reserve_stack[op->depth], gop);  //** Need to do the push and overflow check
-        }
-        gop = _tpc_overflow_next(op->tpc);             //** along with the submit or rollback atomically
+    if (running > tp_concurrency(op->tpc)) {
+        tpc = op->tpc;
+        apr_thread_mutex_lock(tpc->lock);
+        _tpc_overflow_release(tpc, op);   //** Undo any old overflow slot before parking it
+        _tpc_reserve_push(tpc, gop);      //** Need to do the push and overflow check
+        gop = _tpc_overflow_next(tpc);    //** along with the submit or rollback atomically
 
         if (gop) {
-            op = gop_get_tp(gop);
-            aerr = apr_thread_pool_push(op->tpc->tp, thread_pool_exec_fn, gop, APR_THREAD_TASK_PRIORITY_NORMAL, NULL);
+            aerr = _tp_push_op(tpc, gop);
         } else {
-            atomic_dec(op->tpc->n_running);  //** We didn't actually submit anything
-            if (op->overflow_slot != -1) {   //** Check if we need to undo our overflow slot
-                op->tpc->overflow_running_depth[op->overflow_slot] = -1;
-            }
-
+            atomic_dec(tpc->n_running);  //** We didn't actually submit anything
             aerr = APR_SUCCESS;
         }
-        apr_thread_mutex_unlock(_tp_lock);
+        apr_thread_mutex_unlock(tpc->lock);
     } else {
-        aerr = apr_thread_pool_push(op->tpc->tp, thread_pool_exec_fn, gop, APR_THREAD_TASK_PRIORITY_NORMAL, NULL);
+        aerr = _tp_push_op(op->tpc, gop);
     }
 
     if (aerr != APR_SUCCESS) {
@@ -182,6 +443,81 @@ void _tp_submit_op(void *arg, op_generic_t *gop)
     }
 }
 
+//*************************************************************
+// _tp_submit_batch - Submits a batch of ops all from the same TPC.
+//    The concurrency for the whole batch is reserved at once and
+//    anything overflowing is placed on the reserve stacks with a
+//    single pass through the context lock.
+//*************************************************************
+
+void _tp_submit_batch(void *arg, op_generic_t **ops, int n)
+{
+    thread_pool_context_t *tpc;
+    thread_pool_op_t *op;
+    op_generic_t *gop;
+    apr_status_t aerr;
+    apr_time_t now;
+    int i, running, n_direct;
+
+    if (n <= 0) return;
+
+    op = gop_get_tp(ops[0]);
+    tpc = op->tpc;
+
+    log_printf(15, "_tp_submit_batch: n=%d gid[0]=%d\n", n, gop_id(ops[0]));
+
+    if (tpc->stats_enabled == 1) {  //** For the queue wait stats
+        now = apr_time_now();
+        for (i=0; i<n; i++) {
+            op = gop_get_tp(ops[i]);
+            op->submitted = now;
+        }
+    }
+
+    apr_atomic_add32(&(tpc->n_submitted), n);
+    running = apr_atomic_add32(&(tpc->n_running), n) + n;
+
+    //** Figure out how many can go straight to the pool
+    n_direct = n - (running - tp_concurrency(tpc));
+    if (n_direct > n) n_direct = n;
+    if (n_direct < 0) n_direct = 0;
+
+    for (i=0; i<n_direct; i++) {
+        op = gop_get_tp(ops[i]);
+        op->via_submit = 1;
+        aerr = _tp_push_op(tpc, ops[i]);
+        if (aerr != APR_SUCCESS) {
+            log_printf(0, "ERROR submiting task!  aerr=%d gid=%d\n", aerr, gop_id(ops[i]));
+        }
+    }
+
+    if (n_direct == n) return;
+
+    //** The rest overflow so stash them and see what can run.  Same as
+    //** _tp_submit_op() any old overflow slot is undone first.
+    apr_thread_mutex_lock(tpc->lock);
+    for (i=n_direct; i<n; i++) {
+        op = gop_get_tp(ops[i]);
+        op->via_submit = 1;
+        _tpc_overflow_release(tpc, op);
+        _tpc_reserve_push(tpc, ops[i]);
+    }
+
+    //** Each overflowed op holds a running slot.  Either use it or give it back
+    for (i=n_direct; i<n; i++) {
+        gop = _tpc_overflow_next(tpc);
+        if (gop) {
+            aerr = _tp_push_op(tpc, gop);
+            if (aerr != APR_SUCCESS) {
+                log_printf(0, "ERROR submiting task!  aerr=%d gid=%d\n", aerr, gop_id(gop));
+            }
+        } else {
+            atomic_dec(tpc->n_running);  //** We didn't actually submit anything
+        }
+    }
+    apr_thread_mutex_unlock(tpc->lock);
+}
+
 //********************************************************************
 
 void *_tp_dup_connect_context(void *connect_context)
@@ -213,13 +549,388 @@ void _tp_close_connection(NetStream_t *ns)
 }
 
 //*************************************************************
-// thread_pool_direct - Bypasses the _tp_exec GOP wrapper
-//     and directly submits the task to the APR thread pool
+// _tp_cancel - Pulls any cancelled ops waiting on the reserve stacks
+//    and completes them.  Ops already handed to the APR pool are caught
+//    by thread_pool_exec_fn() instead.
 //*************************************************************
 
-int thread_pool_direct(thread_pool_context_t *tpc, apr_thread_start_t fn, void *arg)
+int _tp_cancel(void *arg, op_generic_t *gop)
+{
+    thread_pool_context_t *tpc = (thread_pool_context_t *)arg;
+    op_generic_t *op;
+    Stack_t *cancelled;
+    int i, n;
+
+    if (tpc == NULL) return(0);  //** Context is still being built
+
+    cancelled = new_stack();
+
+    n = 0;
+    apr_thread_mutex_lock(tpc->lock);
+    for (i=0; i<tpc->recursion_depth; i++) {
+        move_to_top(tpc->reserve_stack[i]);
+        while ((op = (op_generic_t *)get_ele_data(tpc->reserve_stack[i])) != NULL) {
+            if (gop_cancel_requested(op) == 1) {
+                delete_current(tpc->reserve_stack[i], 0, 0);
+                atomic_dec(tpc->n_overflow);
+                push(cancelled, op);
+                n++;
+            } else {
+                move_down(tpc->reserve_stack[i]);
+            }
+        }
+        _tpc_reserve_check(tpc, i);
+    }
+    apr_thread_mutex_unlock(tpc->lock);
+
+    log_printf(15, "_tp_cancel: gid=%d ncancel=%d\n", gop_id(gop), n);
+
+    while ((op = (op_generic_t *)pop(cancelled)) != NULL) {
+        atomic_inc(tpc->n_completed);
+        gop_mark_completed(op, op_cancelled_status);
+    }
+    free_stack(cancelled, 0);
+
+    return(n);
+}
+
+//*************************************************************
+// _tp_help - Pulls the deepest op of gop, or its descendants, waiting on
+//    the reserve stacks so a waiting thread can run it itself instead of
+//    sleeping until a pool thread frees up.  The op doesn't hold a
+//    running slot so it's flagged as not via_submit.
+//*************************************************************
+
+op_generic_t *_tp_help(void *arg, op_generic_t *gop)
+{
+    thread_pool_context_t *tpc = (thread_pool_context_t *)arg;
+    op_generic_t *op;
+    thread_pool_op_t *top;
+    int i;
+
+    if (tpc == NULL) return(NULL);  //** Context is still being built
+    if (atomic_get(tpc->n_overflow) == 0) return(NULL);
+
+    op = NULL;
+    apr_thread_mutex_lock(tpc->lock);
+    for (i=tpc->recursion_depth-1; (i>=0) && (op == NULL); i--) {
+        move_to_top(tpc->reserve_stack[i]);
+        while ((op = (op_generic_t *)get_ele_data(tpc->reserve_stack[i])) != NULL) {
+            if (gop_has_ancestor(op, gop) == 1) {
+                delete_current(tpc->reserve_stack[i], 0, 0);
+                atomic_dec(tpc->n_overflow);
+                _tpc_reserve_check(tpc, i);
+                break;
+            }
+            move_down(tpc->reserve_stack[i]);
+        }
+    }
+    apr_thread_mutex_unlock(tpc->lock);
+
+    if (op != NULL) {
+        top = gop_get_tp(op);
+        top->via_submit = 0;
+        top->overflow_slot = -1;
+        log_printf(15, "_tp_help: gid=%d helping with gid=%d\n", gop_id(gop), gop_id(op));
+    }
+
+    return(op);
+}
+
+//*************************************************************
+// _tp_executor_resize - Resizes the executor to match the current
+//    concurrency limit and compensation
+//
+//  NOTE: The context lock should be held on entry!!!
+//*************************************************************
+
+void _tp_executor_resize(thread_pool_context_t *tpc)
+{
+    int n = atomic_get(tpc->n_compensating);
+
+    if (tpc->executor == TP_EXEC_WS) {
+        tp_ws_extra_set(tpc->ws, n);
+    } else {
+        apr_thread_pool_thread_max_set(tpc->tp, tpc->max_concurrency + tpc->recursion_depth + n);
+    }
+}
+
+//*************************************************************
+// _tpc_overflow_kick - Starts any reserve stack ops the current
+//    concurrency limit allows.  Used after the limit is raised.
+//
+//  NOTE: The context lock should be held on entry!!!
+//*************************************************************
+
+void _tpc_overflow_kick(thread_pool_context_t *tpc)
+{
+    op_generic_t *gop;
+    apr_status_t aerr;
+
+    while ((gop = _tpc_overflow_next(tpc)) != NULL) {
+        atomic_inc(tpc->n_running);
+        aerr = _tp_push_op(tpc, gop);
+        if (aerr != APR_SUCCESS) {
+            log_printf(0, "ERROR submiting task!  aerr=%d gid=%d\n", aerr, gop_id(gop));
+        }
+    }
+}
+
+//*************************************************************
+// _tp_block_begin - Managed blocker hook called when a pool thread is
+//    about to block in a gop wait.  If the cap allows, the concurrency is
+//    bumped by one and an extra executor thread is made available so
+//    queued ops keep flowing while we sleep.  Returns 1 if compensation
+//    was granted.
+//*************************************************************
+
+int _tp_block_begin(void *arg)
+{
+    thread_pool_context_t *tpc = (thread_pool_context_t *)arg;
+    int n;
+
+    atomic_inc(tpc->n_blocked);
+
+    do {
+        n = atomic_get(tpc->n_compensating);
+        if (n >= tpc->max_compensation) {
+            log_printf(1, "tpc=%s compensation cap hit n_blocked=%d max_compensation=%d\n", tpc->name, atomic_get(tpc->n_blocked), tpc->max_compensation);
+            return(0);
+        }
+    } while (atomic_cas(tpc->n_compensating, n+1, n) != (apr_uint32_t)n);
+    atomic_inc(tpc->n_compensated);
+
+    log_printf(15, "tpc=%s n_blocked=%d n_compensating=%d\n", tpc->name, atomic_get(tpc->n_blocked), n+1);
+
+    apr_thread_mutex_lock(tpc->lock);
+    _tp_executor_resize(tpc);
+    _tpc_overflow_kick(tpc);  //** Start anything waiting that the extra concurrency allows
+    apr_thread_mutex_unlock(tpc->lock);
+
+    return(1);
+}
+
+//*************************************************************
+// _tp_block_end - Managed blocker hook called once the pool thread wakes
+//    up.  Gives back any compensation it was granted.
+//*************************************************************
+
+void _tp_block_end(void *arg, int token)
+{
+    thread_pool_context_t *tpc = (thread_pool_context_t *)arg;
+
+    atomic_dec(tpc->n_blocked);
+    if (token == 0) return;
+
+    atomic_dec(tpc->n_compensating);
+
+    apr_thread_mutex_lock(tpc->lock);
+    _tp_executor_resize(tpc);
+    apr_thread_mutex_unlock(tpc->lock);
+}
+
+//*************************************************************
+// thread_pool_max_compensation_set - Sets the max number of extra threads
+//    the context can add to cover pool threads blocked in a gop wait.
+//    0 disables compensation.  For the work stealing executor it can't
+//    exceed the spares allocated at creation, max_threads.
+//*************************************************************
+
+void thread_pool_max_compensation_set(thread_pool_context_t *tpc, int n)
+{
+    if (n < 0) n = 0;
+    if ((tpc->executor == TP_EXEC_WS) && (n > tpc->ws->n_workers - tpc->ws->n_base)) n = tpc->ws->n_workers - tpc->ws->n_base;
+
+    tpc->max_compensation = n;
+}
+
+//*************************************************************
+// thread_pool_affinity_set - Pins the context's threads to the CPU list,
+//    "0-7,16-23" for example, or NULL/"all" for any CPU.  If numa is set
+//    the work stealing executor splits its workers across the NUMA nodes
+//    and sends submissions from outside the pool to the submitter's node.
+//    The APR executor has a single task list so it only uses the CPU list
+//    and pins each thread the 1st time it runs one of our ops.  Direct
+//    tasks (thread_pool_direct*()) skip the op wrapper so under APR they
+//    only run pinned on threads that have already run an op.
+//    Should be called before any ops are submitted.
+//*************************************************************
+
+void thread_pool_affinity_set(thread_pool_context_t *tpc, const char *cpus, int numa)
 {
-    int err = apr_thread_pool_push(tpc->tp, fn, arg, APR_THREAD_TASK_PRIORITY_NORMAL, NULL);
+    tp_cpuset_t *cs;
+
+    cs = tp_cpuset_parse(cpus);
+
+    if (tpc->executor == TP_EXEC_WS) {
+        tp_ws_affinity_set(tpc->ws, cs, numa);
+        tp_cpuset_destroy(cs);
+    } else {
+        if (numa == 1) log_printf(1, "NUMA routing needs the ws executor.  Only pinning.  tpc=%s\n", tpc->name);
+        tp_cpuset_destroy(tpc->cpuset);
+        tpc->cpuset = cs;
+        tpc->affinity_gen = atomic_inc(_tp_affinity_gen) + 1;  //** Unique across contexts and never 0
+    }
+}
+
+//*************************************************************
+// thread_pool_stats_enable - Turns the context's wait/exec histograms on
+//    or off.  Can be flipped at any time.  Everything else in the
+//    snapshot is always tracked.  GOP_TP_STATS turns them on at creation.
+//*************************************************************
+
+void thread_pool_stats_enable(thread_pool_context_t *tpc, int enable)
+{
+    tpc->stats_enabled = (enable) ? 1 : 0;
+}
+
+//*************************************************************
+// thread_pool_stats_reset - Clears the wait/exec histograms
+//*************************************************************
+
+void thread_pool_stats_reset(thread_pool_context_t *tpc)
+{
+    int i;
+
+    for (i=0; i<TP_STATS_SHARDS; i++) {
+        memset(&(tpc->stats_shard[i].wait), 0, sizeof(gop_histo_t));
+        memset(&(tpc->stats_shard[i].exec), 0, sizeof(gop_histo_t));
+    }
+}
+
+//*************************************************************
+// thread_pool_stats_snapshot - Fills in a point in time view of the
+//    context merging the per thread shards
+//*************************************************************
+
+void thread_pool_stats_snapshot(thread_pool_context_t *tpc, thread_pool_stats_t *st)
+{
+    tp_stats_shard_t *shard;
+    int i, d, n_done;
+
+    memset(st, 0, sizeof(thread_pool_stats_t));
+
+    st->enabled = tpc->stats_enabled;
+    st->n_overflow = atomic_get(tpc->n_overflow);
+    st->n_running = atomic_get(tpc->n_running);
+    st->concurrency = tp_concurrency(tpc);
+    st->n_blocked = atomic_get(tpc->n_blocked);
+    st->n_compensating = atomic_get(tpc->n_compensating);
+    st->n_submitted = atomic_get(tpc->n_submitted);
+    st->n_completed = atomic_get(tpc->n_completed);
+    st->n_direct = atomic_get(tpc->n_direct);
+    st->n_coro = atomic_get(tpc->n_coro);
+    st->n_coro_parked = atomic_get(tpc->n_coro_parked);
+
+    //** Executor threads and tasks
+    if (tpc->executor == TP_EXEC_WS) {
+        tp_ws_counts(tpc->ws, &(st->n_threads), &(st->n_idle_threads), &(st->n_exec_queued));
+    } else {
+        st->n_idle_threads = apr_thread_pool_idle_count(tpc->tp);
+        st->n_threads = apr_thread_pool_busy_count(tpc->tp) + st->n_idle_threads;
+        st->n_exec_queued = apr_thread_pool_tasks_count(tpc->tp);
+    }
+    st->n_active_threads = st->n_threads - st->n_idle_threads;
+    st->n_queued = st->n_overflow + st->n_exec_queued;
+
+    //** Merge the shards
+    for (i=0; i<TP_STATS_SHARDS; i++) {
+        shard = &(tpc->stats_shard[i]);
+        n_done = atomic_get(shard->n_done);  //** Done 1st so executing can't go negative
+        st->n_executing += (int)atomic_get(shard->n_exec) - n_done;
+        gop_histo_merge(&(st->wait), &(shard->wait));
+        gop_histo_merge(&(st->exec), &(shard->exec));
+    }
+
+    //** Reserve stack occupancy
+    st->n_depths = (tpc->recursion_depth > TP_STATS_DEPTHS) ? TP_STATS_DEPTHS : tpc->recursion_depth;
+    apr_thread_mutex_lock(tpc->lock);
+    for (i=0; i<tpc->recursion_depth; i++) {
+        d = (i < TP_STATS_DEPTHS) ? i : TP_STATS_DEPTHS-1;
+        st->reserve_depth[d] += stack_size(tpc->reserve_stack[i]);
+        if (atomic_get(tpc->running_bits[i>>5]) & (1U << (i & 31))) st->overflow_running[d] = 1;
+    }
+
+    //** And what the adaptive controller's been up to
+    if (tpc->adapt != NULL) {
+        st->adapt_enabled = 1;
+        st->adapt_min = tpc->adapt->min_concurrency;
+        st->adapt_max = tpc->adapt->max_concurrency;
+        st->adapt_last_action = tpc->adapt->last_action;
+        st->adapt_hold = tpc->adapt->hold;
+        st->adapt_n_grow = tpc->adapt->n_grow;
+        st->adapt_n_shrink = tpc->adapt->n_shrink;
+        st->adapt_wait_p90 = tpc->adapt->wait_p90;
+        st->adapt_rate = tpc->adapt->rate;
+    }
+    apr_thread_mutex_unlock(tpc->lock);
+
+    st->wait_p50 = gop_histo_percentile(&(st->wait), 50);
+    st->wait_p90 = gop_histo_percentile(&(st->wait), 90);
+    st->wait_p99 = gop_histo_percentile(&(st->wait), 99);
+    st->wait_max = st->wait.max;
+    st->exec_p50 = gop_histo_percentile(&(st->exec), 50);
+    st->exec_p90 = gop_histo_percentile(&(st->exec), 90);
+    st->exec_p99 = gop_histo_percentile(&(st->exec), 99);
+    st->exec_max = st->exec.max;
+}
+
+//*************************************************************
+// thread_pool_stats_log - Logs a snapshot of the context
+//*************************************************************
+
+void thread_pool_stats_log(int ll, thread_pool_context_t *tpc)
+{
+    thread_pool_stats_t st;
+    int i;
+
+    thread_pool_stats_snapshot(tpc, &st);
+
+    log_printf(ll, "--------Thread Pool %s----------\n", (tpc->name == NULL) ? "tp" : tpc->name);
+    log_printf(ll, "Queued: %d (reserve: %d  executor: %d)  Running: %d  Executing: %d  Concurrency: %d\n",
+               st.n_queued, st.n_overflow, st.n_exec_queued, st.n_running, st.n_executing, st.concurrency);
+    log_printf(ll, "Threads: %d (active: %d  idle: %d)  Blocked: %d  Compensating: %d\n",
+               st.n_threads, st.n_active_threads, st.n_idle_threads, st.n_blocked, st.n_compensating);
+    log_printf(ll, "Submitted: " LU "  Completed: " LU "  Direct: " LU "\n", st.n_submitted, st.n_completed, st.n_direct);
+    if (st.n_coro > 0) log_printf(ll, "Coroutines: %d  parked: %d\n", st.n_coro, st.n_coro_parked);
+    if (st.enabled) {
+        log_printf(ll, "Wait usec  p50: " LU "  p90: " LU "  p99: " LU "  max: " LU "  n: %u\n", st.wait_p50, st.wait_p90, st.wait_p99, st.wait_max, st.wait.count);
+        log_printf(ll, "Exec usec  p50: " LU "  p90: " LU "  p99: " LU "  max: " LU "  n: %u\n", st.exec_p50, st.exec_p90, st.exec_p99, st.exec_max, st.exec.count);
+    }
+    if (st.adapt_enabled) {
+        log_printf(ll, "Adaptive  range: %d-%d  grows: %u  shrinks: %u  last: %d  hold: %d  wait_p90: " LU "  rate: %lf\n",
+                   st.adapt_min, st.adapt_max, st.adapt_n_grow, st.adapt_n_shrink, st.adapt_last_action, st.adapt_hold, st.adapt_wait_p90, st.adapt_rate);
+    }
+    for (i=0; i<st.n_depths; i++) {
+        if ((st.reserve_depth[i] > 0) || (st.overflow_running[i] > 0)) {
+            log_printf(ll, "Depth %2d  reserve: %d  overflow_running: %d\n", i, st.reserve_depth[i], st.overflow_running[i]);
+        }
+    }
+}
+
+//*************************************************************
+// thread_pool_direct_priority - Bypasses the _tp_exec GOP wrapper
+//     and directly submits the task to the executor with the given
+//     OP_PRIORITY_*
+//*************************************************************
+
+int thread_pool_direct_priority(thread_pool_context_t *tpc, int priority, apr_thread_start_t fn, void *arg)
+{
+    tp_direct_t *d;
+    int err;
+
+    if ((priority < OP_PRIORITY_LOW) || (priority > OP_PRIORITY_HIGH)) priority = OP_PRIORITY_NORMAL;
+    if (tpc->stats_enabled == 1) {  //** Wrap it so the queue wait gets sampled
+        type_slab_malloc(d, tp_direct_t, 1);
+        d->tpc = tpc;
+        d->fn = fn;
+        d->arg = arg;
+        d->submitted = apr_time_now();
+        err = _tp_push_lane(tpc, tp_lane(priority), _tp_direct_runner, d);
+        if (err != APR_SUCCESS) gop_slab_free(d);
+    } else {
+        err = _tp_push_lane(tpc, tp_lane(priority), fn, arg);
+    }
 
     atomic_inc(tpc->n_direct);
 
@@ -231,6 +942,51 @@ int thread_pool_direct(thread_pool_context_t *tpc, apr_thread_start_t fn, void *
     return((err == APR_SUCCESS) ? 0 : 1);
 }
 
+//*************************************************************
+// thread_pool_direct_batch_priority - Same as thread_pool_direct_priority()
+//     for n tasks sharing the same fn.  Much cheaper than pushing them
+//     one at a time.  Returns 1 if the batch couldn't be handed off, in
+//     which case none of the tasks will run.
+//*************************************************************
+
+int thread_pool_direct_batch_priority(thread_pool_context_t *tpc, int priority, apr_thread_start_t fn, void **args, int n)
+{
+    int err;
+
+    if (n <= 0) return(0);
+
+    if ((priority < OP_PRIORITY_LOW) || (priority > OP_PRIORITY_HIGH)) priority = OP_PRIORITY_NORMAL;
+    err = _tp_push_batch_lane(tpc, tp_lane(priority), fn, args, n);
+
+    apr_atomic_add32(&(tpc->n_direct), n);
+
+    log_printf(10, "n=%d tpd=%d\n", n, atomic_get(tpc->n_direct));
+    if (err != APR_SUCCESS) {
+        log_printf(0, "ERROR submiting batch!  err=%d n=%d\n", err, n);
+    }
+
+    return((err == APR_SUCCESS) ? 0 : 1);
+}
+
+//*************************************************************
+// thread_pool_direct_batch - Submits n NORMAL tasks sharing the same fn
+//*************************************************************
+
+int thread_pool_direct_batch(thread_pool_context_t *tpc, apr_thread_start_t fn, void **args, int n)
+{
+    return(thread_pool_direct_batch_priority(tpc, OP_PRIORITY_NORMAL, fn, args, n));
+}
+
+//*************************************************************
+// thread_pool_direct - Bypasses the _tp_exec GOP wrapper
+//     and directly submits the task to the executor
+//*************************************************************
+
+int thread_pool_direct(thread_pool_context_t *tpc, apr_thread_start_t fn, void *arg)
+{
+    return(thread_pool_direct_priority(tpc, OP_PRIORITY_NORMAL, fn, arg));
+}
+
 //**********************************************************
 // default_thread_pool_config - Sets the default thread pool config options
 //**********************************************************
@@ -247,10 +1003,25 @@ void default_thread_pool_config(thread_pool_context_t *tpc)
 
 
 //**********************************************************
-//  thread_pool_create_context - Creates a TP context
+//  thread_pool_create_context - Creates a TP context using the default executor
 //**********************************************************
 
 thread_pool_context_t *thread_pool_create_context(char *tp_name, int min_threads, int max_threads, int max_recursion_depth)
+{
+    return(thread_pool_create_context_ex(tp_name, min_threads, max_threads, max_recursion_depth, TP_EXEC_DEFAULT));
+}
+
+//**********************************************************
+//  thread_pool_create_context_ex - Creates a TP context using the given
+//     executor, TP_EXEC_APR or TP_EXEC_WS.  The work stealing executor
+//     starts all max_threads workers up front.
+//
+//     Pool threads that block in a gop wait are compensated for with an
+//     extra thread, up to TP_COMPENSATION_DEFAULT of them or max_threads
+//     for the work stealing executor.  See thread_pool_max_compensation_set().
+//**********************************************************
+
+thread_pool_context_t *thread_pool_create_context_ex(char *tp_name, int min_threads, int max_threads, int max_recursion_depth, int executor)
 {
 //  char buffer[1024];
     thread_pool_context_t *tpc;
@@ -267,11 +1038,14 @@ thread_pool_context_t *thread_pool_create_context(char *tp_name, int min_threads
         apr_pool_create(&_tp_pool, NULL);
         apr_thread_mutex_create(&_tp_lock, APR_THREAD_MUTEX_DEFAULT, _tp_pool);
         thread_pool_stats_init();
+        thread_pool_executor_init();
         init_opque_system();
     }
 
     if (thread_local_depth_key == NULL) apr_threadkey_private_create(&thread_local_depth_key,_thread_pool_destructor, _tp_pool);
+    if (thread_local_affinity_key == NULL) apr_threadkey_private_create(&thread_local_affinity_key, NULL, _tp_pool);
     tpc->pc = create_hportal_context(&_tp_base_portal);  //** Really just used for the submit
+    tpc->pc->arg = tpc;
 
     default_thread_pool_config(tpc);
     if (min_threads > 0) tpc->min_threads = min_threads;
@@ -284,25 +1058,49 @@ thread_pool_context_t *thread_pool_create_context(char *tp_name, int min_threads
         log_printf(0, "Specified max threads and recursion depth don't work. Adjusting max_threads=%d\n", tpc->max_threads);
     }
 
-    dt = tpc->min_idle * 1000000;
-    assert_result(apr_thread_pool_create(&(tpc->tp), tpc->min_threads, tpc->max_threads, _tp_pool), APR_SUCCESS);
-    apr_thread_pool_idle_wait_set(tpc->tp, dt);
-    apr_thread_pool_threshold_set(tpc->tp, 0);
-
     tpc->name = (tp_name == NULL) ? NULL : strdup(tp_name);
+    tpc->executor = (executor == TP_EXEC_DEFAULT) ? _tp_default_executor : executor;
+    if (tpc->executor == TP_EXEC_WS) {
+        tpc->ws = tp_ws_create(tpc->name, tpc->max_threads, tpc->max_threads);  //** Enough spares to cover every worker blocking
+    } else {
+        dt = tpc->min_idle * 1000000;
+        assert_result(apr_thread_pool_create(&(tpc->tp), tpc->min_threads, tpc->max_threads, _tp_pool), APR_SUCCESS);
+        apr_thread_pool_idle_wait_set(tpc->tp, dt);
+        apr_thread_pool_threshold_set(tpc->tp, 0);
+        apr_thread_mutex_create(&(tpc->lane_lock), APR_THREAD_MUTEX_DEFAULT, _tp_pool);
+        for (i=0; i<TP_LANES; i++) {
+            tpc->lane[i].size = TP_WS_DEQUE_MIN;
+            type_malloc(tpc->lane[i].ring, tp_ws_task_t, tpc->lane[i].size);
+        }
+    }
+
     atomic_set(tpc->n_ops, 0);
     atomic_set(tpc->n_completed, 0);
     atomic_set(tpc->n_started, 0);
     atomic_set(tpc->n_submitted, 0);
     atomic_set(tpc->n_running, 0);
 
-    type_malloc(tpc->overflow_running_depth, int, tpc->recursion_depth);
+    tpc->max_compensation = (tpc->executor == TP_EXEC_WS) ? tpc->max_threads : TP_COMPENSATION_DEFAULT;
+    tpc->blocker.begin = _tp_block_begin;
+    tpc->blocker.end = _tp_block_end;
+    tpc->blocker.arg = tpc;
+
+    type_malloc_clear(tpc->stats_shard, tp_stats_shard_t, TP_STATS_SHARDS);
+    if (_tp_stats > 0) tpc->stats_enabled = 1;
+
+    apr_thread_mutex_create(&(tpc->lock), APR_THREAD_MUTEX_DEFAULT, _tp_pool);
+    tp_coro_context_init(tpc);
+    tp_pfor_context_init(tpc);
+    tpc->n_bit_words = (tpc->recursion_depth + 31) / 32;
+    type_malloc_clear(tpc->reserve_bits, atomic_int_t, tpc->n_bit_words);
+    type_malloc_clear(tpc->running_bits, atomic_int_t, tpc->n_bit_words);
     type_malloc(tpc->reserve_stack, Stack_t *, tpc->recursion_depth);
     for (i=0; i<tpc->recursion_depth; i++) {
-        tpc->overflow_running_depth[i] = -1;
         tpc->reserve_stack[i] = new_stack();
     }
 
+    hportal_context_publish(tpc->pc);  //** Fully built so the cancel/help routines can see it
+
     return(tpc);
 }
 
@@ -316,14 +1114,33 @@ void thread_pool_destroy_context(thread_pool_context_t *tpc)
     int i;
     log_printf(15, "thread_pool_destroy_context: Shutting down! count=%d\n", _tp_context_count);
 
-    log_printf(15, "tpc->name=%s  high=%d idle=%d\n", tpc->name, apr_thread_pool_threads_high_count(tpc->tp),  apr_thread_pool_threads_idle_timeout_count(tpc->tp));
+    if (tpc->executor == TP_EXEC_APR) {
+        log_printf(15, "tpc->name=%s  high=%d idle=%d\n", tpc->name, apr_thread_pool_threads_high_count(tpc->tp),  apr_thread_pool_threads_idle_timeout_count(tpc->tp));
+    }
+    if (_tp_stats > 0) {
+        thread_pool_stats_log(0, tpc);
+        gop_latency_print(0, (tpc->name == NULL) ? "tp" : tpc->name, tpc->pc->lat);
+    }
+    thread_pool_adaptive_disable(tpc);
+    tp_coro_context_destroy(tpc);  //** Waits for parked coroutines so the executor still has to be up
     destroy_hportal_context(tpc->pc);
 
-    apr_thread_pool_destroy(tpc->tp);
+    if (tpc->executor == TP_EXEC_WS) {
+        tp_ws_destroy(tpc->ws);
+    } else {
+        apr_thread_pool_destroy(tpc->tp);
+        apr_thread_mutex_destroy(tpc->lane_lock);
+        for (i=0; i<TP_LANES; i++) free(tpc->lane[i].ring);
+    }
+    apr_thread_mutex_destroy(tpc->lock);
+    tp_pfor_context_destroy(tpc);
 
     if (atomic_dec(_tp_context_count) == 0) {
         if (_tp_stats > 0) thread_pool_stats_print();
         destroy_opque_system();
+        tp_ws_system_destroy();
+        tp_coro_system_destroy();
+        tp_affinity_system_destroy();
         apr_thread_mutex_destroy(_tp_lock);
         apr_pool_destroy(_tp_pool);
     }
@@ -336,7 +1153,10 @@ void thread_pool_destroy_context(thread_pool_context_t *tpc)
         free_stack(tpc->reserve_stack[i], 0);
     }
     free(tpc->reserve_stack);
-    free(tpc->overflow_running_depth);
+    free(tpc->reserve_bits);
+    free(tpc->running_bits);
+    tp_cpuset_destroy(tpc->cpuset);
+    free(tpc->stats_shard);
 
     free(tpc);
 }
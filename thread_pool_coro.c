@@ -0,0 +1,412 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// thread_pool_coro.c - Runs thread pool ops on pooled stackful coroutines.
+//
+//  A coroutine op's thread_pool_exec_fn() is re-entered on its own stack.
+//  While it runs the coroutine's blocker is installed so an untimed gop
+//  wait parks the coroutine on the gop instead of sleeping.  The pool
+//  thread switches back to its own stack, releases the gop lock, gives up
+//  the op's concurrency slot, and goes on to the next task.  When the gop
+//  wakes its waiters a resume task is pushed on the op's lane and
+//  whichever pool thread picks it up switches the coroutine back in.  The
+//  thread local recursion depth and blocker are swapped on every switch
+//  since the coroutine can move between threads.  Timed waits still block
+//  the thread but are compensated like any other pool thread.
+//
+//  Stacks are mmap'ed with a guard page at the bottom and kept on a per
+//  context idle list for reuse.
+//*************************************************************
+
+#define _log_module_index 136
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <apr_pools.h>
+#include "assert_result.h"
+#include "thread_pool.h"
+#include "type_malloc.h"
+#include "log.h"
+
+extern apr_pool_t *_tp_pool;
+
+int *_thread_local_depth_ptr();
+int _tpc_overflow_ready(thread_pool_context_t *tpc);
+void _tpc_overflow_kick(thread_pool_context_t *tpc);
+apr_status_t _tp_push_lane(thread_pool_context_t *tpc, int lane, apr_thread_start_t fn, void *arg);
+int _tp_block_begin(void *arg);
+void _tp_block_end(void *arg, int token);
+
+static apr_threadkey_t *_coro_key = NULL;  //** Coroutine running on the current thread if any
+static size_t _coro_page_size = 4096;
+
+//*************************************************************
+// tp_coro_system_init - Creates the thread local coroutine key
+//*************************************************************
+
+void tp_coro_system_init(apr_pool_t *mpool)
+{
+    long n;
+
+    if (_coro_key == NULL) apr_threadkey_private_create(&_coro_key, NULL, mpool);
+
+    n = sysconf(_SC_PAGESIZE);
+    if (n > 0) _coro_page_size = n;
+}
+
+//*************************************************************
+
+void tp_coro_system_destroy()
+{
+    if (_coro_key == NULL) return;
+
+    apr_threadkey_private_delete(_coro_key);
+    _coro_key = NULL;
+}
+
+//*************************************************************
+// tp_coro_current - Returns the coroutine running on the calling thread
+//     or NULL if it's on its own stack
+//*************************************************************
+
+tp_coro_t *tp_coro_current()
+{
+    tp_coro_t *c = NULL;
+
+    if (_coro_key != NULL) apr_threadkey_private_get((void **)&c, _coro_key);
+    return(c);
+}
+
+//*************************************************************
+// _tp_coro_block_[begin|end] - Timed waits can't park so they're
+//     compensated like a normal pool thread
+//*************************************************************
+
+int _tp_coro_block_begin(void *arg)
+{
+    tp_coro_t *c = (tp_coro_t *)arg;
+
+    return(_tp_block_begin(c->tpc));
+}
+
+void _tp_coro_block_end(void *arg, int token)
+{
+    tp_coro_t *c = (tp_coro_t *)arg;
+
+    _tp_block_end(c->tpc, token);
+}
+
+//*************************************************************
+// _tp_coro_resume - Pool task that switches a woken coroutine back in
+//*************************************************************
+
+void _tp_coro_run(tp_coro_t *c, apr_thread_t *th);
+
+void *_tp_coro_resume(apr_thread_t *th, void *arg)
+{
+    tp_coro_t *c = (tp_coro_t *)arg;
+    thread_pool_context_t *tpc = c->tpc;
+
+    c->state = TP_CORO_RUNNING;
+    atomic_dec(tpc->n_coro_parked);
+    atomic_inc(tpc->n_running);  //** Take back a slot.  Can briefly put us over the limit
+    _tp_coro_run(c, th);
+
+    return(NULL);
+}
+
+//*************************************************************
+// _tp_coro_wake - Parked waiter wake hook.  Called with the gop lock held.
+//*************************************************************
+
+void _tp_coro_wake(void *arg)
+{
+    tp_coro_t *c = (tp_coro_t *)arg;
+
+    _tp_push_lane(c->tpc, tp_lane(gop_priority(c->gop)), _tp_coro_resume, c);
+}
+
+//*************************************************************
+// _tp_coro_park - Blocker park hook.  Switches back to the pool thread
+//     which releases the lock.  Returns with it held once woken.
+//*************************************************************
+
+void _tp_coro_park(void *arg, gop_parked_t *p, apr_thread_mutex_t *lock)
+{
+    tp_coro_t *c = (tp_coro_t *)arg;
+
+    p->wake = _tp_coro_wake;
+    p->arg = c;
+    c->park_lock = lock;
+    c->state = TP_CORO_PARKED;
+
+    swapcontext(&(c->ctx), &(c->sched));
+
+    //** Woken and switched back in.  Possibly on a different thread
+    apr_thread_mutex_lock(lock);
+}
+
+//*************************************************************
+// _tp_coro_main - Coroutine entry point.  Re-enters the exec fn which
+//     sees it's already on a coroutine and runs the op.
+//*************************************************************
+
+void _tp_coro_main()
+{
+    tp_coro_t *c = tp_coro_current();
+
+    thread_pool_exec_fn(c->th, c->gop);
+
+    c->state = TP_CORO_DONE;
+    swapcontext(&(c->ctx), &(c->sched));  //** Never comes back
+}
+
+//*************************************************************
+// _tp_coro_get - Returns an idle coroutine or makes a new one.
+//     Returns NULL if the stack can't be allocated.
+//*************************************************************
+
+tp_coro_t *_tp_coro_get(thread_pool_context_t *tpc)
+{
+    tp_coro_t *c;
+    size_t size;
+
+    apr_thread_mutex_lock(tpc->coro_lock);
+    c = tpc->coro_idle;
+    if (c != NULL) {
+        tpc->coro_idle = c->next;
+        tpc->n_coro_idle--;
+    }
+    size = tpc->coro_stack_size;
+    apr_thread_mutex_unlock(tpc->coro_lock);
+
+    if (c != NULL) return(c);
+
+    type_malloc_clear(c, tp_coro_t, 1);
+    c->stack_size = (size + _coro_page_size - 1) & ~(_coro_page_size - 1);
+    c->stack = mmap(NULL, c->stack_size + _coro_page_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (c->stack == MAP_FAILED) {
+        log_printf(0, "ERROR: Unable to allocate a coroutine stack! size=%zu\n", c->stack_size);
+        free(c);
+        return(NULL);
+    }
+    mprotect(c->stack, _coro_page_size, PROT_NONE);  //** Guard page so an overflow faults instead of corrupting memory
+
+    c->tpc = tpc;
+    c->blocker.begin = _tp_coro_block_begin;
+    c->blocker.end = _tp_coro_block_end;
+    c->blocker.park = _tp_coro_park;
+    c->blocker.arg = c;
+
+    return(c);
+}
+
+//*************************************************************
+// _tp_coro_free - Releases the coroutine's stack
+//*************************************************************
+
+void _tp_coro_free(tp_coro_t *c)
+{
+    munmap(c->stack, c->stack_size + _coro_page_size);
+    free(c);
+}
+
+//*************************************************************
+// _tp_coro_release - Puts a finished coroutine on the idle list or
+//     frees it if the list is full or the stack size changed
+//*************************************************************
+
+void _tp_coro_release(tp_coro_t *c)
+{
+    thread_pool_context_t *tpc = c->tpc;
+
+    c->gop = NULL;
+    apr_thread_mutex_lock(tpc->coro_lock);
+    if ((tpc->n_coro_idle < TP_CORO_IDLE_MAX) && (c->stack_size == tpc->coro_stack_size)) {
+        c->next = tpc->coro_idle;
+        tpc->coro_idle = c;
+        tpc->n_coro_idle++;
+        c = NULL;
+    }
+    apr_thread_mutex_unlock(tpc->coro_lock);
+
+    if (c != NULL) _tp_coro_free(c);
+}
+
+//*************************************************************
+// _tp_coro_run - Switches the coroutine in on the calling pool thread
+//     and handles it once it parks or finishes
+//*************************************************************
+
+void _tp_coro_run(tp_coro_t *c, apr_thread_t *th)
+{
+    thread_pool_context_t *tpc = c->tpc;
+    apr_thread_mutex_t *lock;
+    gop_blocker_t *b;
+    int *my_depth;
+    int depth;
+
+    //** Swap in the coroutine's thread local state
+    my_depth = _thread_local_depth_ptr();
+    depth = *my_depth;
+    *my_depth = c->depth;
+    b = gop_blocker_set(c->saved_blocker);
+    c->th = th;
+    apr_threadkey_private_set(c, _coro_key);
+
+    swapcontext(&(c->sched), &(c->ctx));
+
+    //** Back on our own stack so put our state back
+    apr_threadkey_private_set(NULL, _coro_key);
+    c->saved_blocker = gop_blocker_set(b);
+    c->depth = *my_depth;
+    *my_depth = depth;
+
+    if (c->state == TP_CORO_DONE) {
+        _tp_coro_release(c);
+        atomic_dec(tpc->n_coro);  //** Last so tp_coro_context_destroy() can't free the lock under us
+        return;
+    }
+
+    //** Parked so give up the slot and let the waker have it.  Once the
+    //** lock is released the coroutine can be resumed so don't touch it.
+    atomic_inc(tpc->n_coro_parked);
+    atomic_dec(tpc->n_running);
+    lock = c->park_lock;
+    apr_thread_mutex_unlock(lock);
+
+    if (_tpc_overflow_ready(tpc)) {
+        apr_thread_mutex_lock(tpc->lock);
+        _tpc_overflow_kick(tpc);
+        apr_thread_mutex_unlock(tpc->lock);
+    }
+}
+
+//*************************************************************
+// tp_coro_exec - Runs the op's exec fn on a coroutine.  Falls back to
+//     running it on the calling thread if no stack is available.
+//*************************************************************
+
+void *tp_coro_exec(apr_thread_t *th, op_generic_t *gop)
+{
+    thread_pool_op_t *op = gop_get_tp(gop);
+    thread_pool_context_t *tpc = op->tpc;
+    tp_coro_t *c;
+
+    c = _tp_coro_get(tpc);
+    if (c == NULL) {
+        op->coro = 0;
+        return(thread_pool_exec_fn(th, gop));
+    }
+
+    c->gop = gop;
+    c->state = TP_CORO_RUNNING;
+    c->depth = *(_thread_local_depth_ptr());
+    c->saved_blocker = NULL;
+    getcontext(&(c->ctx));
+    c->ctx.uc_stack.ss_sp = c->stack + _coro_page_size;
+    c->ctx.uc_stack.ss_size = c->stack_size;
+    c->ctx.uc_link = NULL;
+    makecontext(&(c->ctx), _tp_coro_main, 0);
+
+    atomic_inc(tpc->n_coro);
+    _tp_coro_run(c, th);
+
+    return(NULL);
+}
+
+//*************************************************************
+// thread_pool_coro_stack_size_set - Sets the stack size for new coroutines
+//*************************************************************
+
+void thread_pool_coro_stack_size_set(thread_pool_context_t *tpc, size_t size)
+{
+    if (size < 16*1024) size = 16*1024;
+
+    apr_thread_mutex_lock(tpc->coro_lock);
+    tpc->coro_stack_size = size;
+    apr_thread_mutex_unlock(tpc->coro_lock);
+}
+
+//*************************************************************
+// tp_coro_context_[init|destroy] - Sets up and tears down the context's
+//     coroutine state
+//*************************************************************
+
+void tp_coro_context_init(thread_pool_context_t *tpc)
+{
+    apr_thread_mutex_create(&(tpc->coro_lock), APR_THREAD_MUTEX_DEFAULT, _tp_pool);
+    tpc->coro_stack_size = TP_CORO_STACK_DEFAULT;
+}
+
+void tp_coro_context_destroy(thread_pool_context_t *tpc)
+{
+    tp_coro_t *c;
+
+    //** Parked coroutines need the pool to resume them so wait for them all
+    //** to finish.  Called before the executor is torn down.
+    if (atomic_get(tpc->n_coro) > 0) {
+        log_printf(1, "name=%s waiting on %d coroutine ops still running. parked=%d\n", tpc->name, atomic_get(tpc->n_coro), atomic_get(tpc->n_coro_parked));
+        while (atomic_get(tpc->n_coro) > 0) {
+            usleep(1000);
+        }
+    }
+
+    while ((c = tpc->coro_idle) != NULL) {
+        tpc->coro_idle = c->next;
+        _tp_coro_free(c);
+    }
+    tpc->n_coro_idle = 0;
+
+    apr_thread_mutex_destroy(tpc->coro_lock);
+}
+
+//*************************************************************
+// new_thread_pool_coro_op - Same as new_thread_pool_op() but fn runs on
+//     a coroutine so untimed gop waits in it don't tie up a pool thread.
+//     NOTE: After an untimed gop wait fn can be running on a different
+//     pool thread.  Mutexes held across the wait are owned by the wrong
+//     thread and anything thread local (a cached thread ID, a stats shard
+//     index, etc) taken before it is stale.  Release or re-fetch them.
+//*************************************************************
+
+op_generic_t *new_thread_pool_coro_op(thread_pool_context_t *tpc, char *que, op_status_t (*fn)(void *arg, int id), void *arg, void (*my_op_free)(void *arg), int workload)
+{
+    op_generic_t *gop;
+    thread_pool_op_t *op;
+
+    gop = new_thread_pool_op(tpc, que, fn, arg, my_op_free, workload);
+    op = gop_get_tp(gop);
+    op->coro = 1;
+
+    return(gop);
+}
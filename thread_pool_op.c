@@ -41,6 +41,7 @@ http://www.accre.vanderbilt.edu
 #include "type_malloc.h"
 #include "append_printf.h"
 #include "atomic_counter.h"
+#include "gop_slab.h"
 
 #define TP_MAX_DEPTH 100
 
@@ -62,6 +63,7 @@ static atomic_int_t _tp_depth_total[TP_MAX_DEPTH];
 
 apr_threadkey_t *thread_local_stats_key = NULL;
 apr_threadkey_t *thread_local_depth_key = NULL;
+apr_threadkey_t *thread_local_affinity_key = NULL;
 
 void _tp_submit_op(void *arg, op_generic_t *gop);
 void _tp_op_free(op_generic_t *gop, int mode);
@@ -146,49 +148,180 @@ op_status_t tp_command(op_generic_t *gop, NetStream_t *ns)
     return(op_success_status);
 }
 
+//*************************************************************
+// _tp_bits_[set|clear|highest] - Atomic bitmap routines used to track
+//     the non-empty reserve stacks and the depths running in overflow
+//     slots.  Updates are done with the context lock held but reads
+//     don't need it.
+//*************************************************************
+
+void _tp_bits_set(atomic_int_t *bits, int i)
+{
+    apr_uint32_t old, mask;
+
+    mask = 1U << (i & 31);
+    do {
+        old = atomic_get(bits[i>>5]);
+    } while (atomic_cas(bits[i>>5], old | mask, old) != old);
+}
+
+//*************************************************************
+
+void _tp_bits_clear(atomic_int_t *bits, int i)
+{
+    apr_uint32_t old, mask;
+
+    mask = 1U << (i & 31);
+    do {
+        old = atomic_get(bits[i>>5]);
+    } while (atomic_cas(bits[i>>5], old & ~mask, old) != old);
+}
+
+//*************************************************************
+// Returns the highest bit set or -1 if none are
+
+int _tp_bits_highest(atomic_int_t *bits, int n_words)
+{
+    apr_uint32_t w;
+    int i;
+
+    for (i=n_words-1; i>=0; i--) {
+        w = atomic_get(bits[i]);
+        if (w != 0) return(32*i + 31 - __builtin_clz(w));
+    }
+
+    return(-1);
+}
+
+//*************************************************************
+// _tpc_overflow_ready - Returns 1 if _tpc_overflow_next() would find
+//     something to run.  Lock free so it can be checked on every completion.
+//*************************************************************
+
+int _tpc_overflow_ready(thread_pool_context_t *tpc)
+{
+    int dmax;
+
+    if (atomic_get(tpc->n_overflow) == 0) return(0);
+
+    dmax = (atomic_get(tpc->n_running) >= tp_concurrency(tpc)) ? _tp_bits_highest(tpc->running_bits, tpc->n_bit_words) : -1;
+    return((_tp_bits_highest(tpc->reserve_bits, tpc->n_bit_words) > dmax) ? 1 : 0);
+}
+
+//*************************************************************
+// _tpc_reserve_push - Places the op on the reserve stack for its depth
+//
+//  NOTE: The context lock should be held on entry!!!
+//*************************************************************
+
+void _tpc_reserve_push(thread_pool_context_t *tpc, op_generic_t *gop)
+{
+    thread_pool_op_t *op = gop_get_tp(gop);
+    int depth;
+
+    depth = op->depth;
+    if (depth >= tpc->recursion_depth) {  //** Check if we hit the max recursion
+        log_printf(0, "GOP has a recursion depth >= max specified in the TP!!!! gop depth=%d  TPC max=%d\n", op->depth, tpc->recursion_depth);
+        depth = tpc->recursion_depth-1;
+    }
+
+    atomic_inc(tpc->n_overflow);
+    push(tpc->reserve_stack[depth], gop);
+    _tp_bits_set(tpc->reserve_bits, depth);
+}
+
+//*************************************************************
+// _tpc_reserve_check - Clears the depth's bit if its reserve stack is
+//     now empty.  Used after ops are pulled out of the middle of a stack.
+//
+//  NOTE: The context lock should be held on entry!!!
+//*************************************************************
+
+void _tpc_reserve_check(thread_pool_context_t *tpc, int depth)
+{
+    if (stack_size(tpc->reserve_stack[depth]) == 0) _tp_bits_clear(tpc->reserve_bits, depth);
+}
+
+//*************************************************************
+// _tpc_overflow_release - Frees the op's overflow slot if it has one
+//
+//  NOTE: The context lock should be held on entry!!!
+//*************************************************************
+
+void _tpc_overflow_release(thread_pool_context_t *tpc, thread_pool_op_t *op)
+{
+    if (op->overflow_slot == -1) return;
+
+    _tp_bits_clear(tpc->running_bits, op->overflow_slot);
+    op->overflow_slot = -1;
+}
+
 //*************************************************************
 // _tpc_overflow_next - Returns the next task for execution in
-//     the overflow pool or NULL if none are available
+//     the overflow pool or NULL if none are available.
+//
+//     Once the pool is at max concurrency only ops deeper than anything
+//     already running in an overflow slot can go.  That makes the
+//     running overflow depths unique so the slot is just the depth's bit.
 //
-//  NOTE: _tp_lock should be held on entry!!!
+//  NOTE: The context lock should be held on entry!!!
 //*************************************************************
 
 op_generic_t *_tpc_overflow_next(thread_pool_context_t *tpc)
 {
-    op_generic_t *gop = NULL;
+    op_generic_t *gop;
     thread_pool_op_t *op;
-    int i, dmax, slot;
+    int i, dmax, track;
 
     //** Determine the currently running max depth
     dmax = -1;
-    slot = -1;
-    if (atomic_get(tpc->n_running) >= tpc->max_concurrency) { //** Don't care about a slot if less than the max concurrency
-        for (i=0; i<tpc->recursion_depth; i++) {
-            if (tpc->overflow_running_depth[i] > dmax) dmax = tpc->overflow_running_depth[i];
-            if (tpc->overflow_running_depth[i] == -1) slot = i;
-        }
+    track = 0;
+    if (atomic_get(tpc->n_running) >= tp_concurrency(tpc)) { //** Don't care about a slot if less than the max concurrency
+        dmax = _tp_bits_highest(tpc->running_bits, tpc->n_bit_words);
+        track = 1;
     }
 
-    //** Not look for a viable gop
-    for (i=tpc->recursion_depth-1; i>dmax; i--) {
-        gop = pop(tpc->reserve_stack[i]);
-        if (gop) {
-            atomic_dec(tpc->n_overflow);
-            op = gop_get_tp(gop);
-            op->overflow_slot = slot;
-            if (slot > -1) tpc->overflow_running_depth[slot] = i;
-            break;
-        }
+    //** Now look for a viable gop
+    i = _tp_bits_highest(tpc->reserve_bits, tpc->n_bit_words);
+    if (i <= dmax) {
+        log_printf(15, "dmax=%d reserve=%d gop=NULL n_running=%d max=%d\n", dmax, i, atomic_get(tpc->n_running), tp_concurrency(tpc));
+        return(NULL);
     }
 
-if (gop) {
-    log_printf(0, "dmax=%d reserve=%d slot=%d gid=%d n_running=%d max=%d\n", dmax, i, slot, gop_id(gop), atomic_get(tpc->n_running), tpc->max_concurrency);
-} else {
-    log_printf(0, "dmax=%d reserve=%d slot=%d gop=%p n_running=%d max=%d\n", dmax, i, slot, gop, atomic_get(tpc->n_running), tpc->max_concurrency);
-}
+    gop = pop(tpc->reserve_stack[i]);
+    _tpc_reserve_check(tpc, i);
+    atomic_dec(tpc->n_overflow);
+
+    op = gop_get_tp(gop);
+    op->overflow_slot = -1;
+    if (track) {
+        op->overflow_slot = i;
+        _tp_bits_set(tpc->running_bits, i);
+    }
+
+    log_printf(15, "dmax=%d reserve=%d slot=%d gid=%d n_running=%d max=%d\n", dmax, i, op->overflow_slot, gop_id(gop), atomic_get(tpc->n_running), tp_concurrency(tpc));
     return(gop);
 }
 
+//*************************************************************
+// _tp_affinity_check - Pins the calling APR pool thread to the context's
+//     CPU set if it hasn't been already.  The thread keeps the affinity
+//     generation it applied since a new set can reuse the old one's address.
+//*************************************************************
+
+void _tp_affinity_check(thread_pool_context_t *tpc)
+{
+    void *applied = NULL;
+    int gen;
+
+    gen = tpc->affinity_gen;
+    apr_threadkey_private_get(&applied, thread_local_affinity_key);
+    if ((int)(intptr_t)applied == gen) return;
+
+    tp_cpuset_apply(tpc->cpuset);
+    apr_threadkey_private_set((void *)(intptr_t)gen, thread_local_affinity_key);
+}
+
 //*************************************************************
 
 void  *thread_pool_exec_fn(apr_thread_t *th, void *arg)
@@ -197,14 +330,24 @@ void  *thread_pool_exec_fn(apr_thread_t *th, void *arg)
     thread_pool_op_t *op = gop_get_tp(gop);
     thread_pool_context_t *tpc = op->tpc;
     op_status_t status;
+    gop_blocker_t *prev_blocker;
+    tp_coro_t *coro;
+    tp_stats_shard_t *shard;
+    apr_time_t t0;
     thread_local_stats_t *my;
     int *my_depth;
     int tid;
-    int concurrent, start_depth;
+    int concurrent, start_depth, stats;
+
+    op = gop_get_tp(gop);
+    if ((op->coro == 1) && (op->via_submit == 1) && (tp_coro_current() == NULL)) {  //** Come back in on a coroutine
+        return(tp_coro_exec(th, gop));
+    }
 
     tid = atomic_thread_id;
 
-    op = gop_get_tp(gop);
+    if ((tpc->cpuset != NULL) && (op->via_submit == 1)) _tp_affinity_check(tpc);  //** Only pin our own pool threads
+
     my_depth = _thread_local_depth_ptr();
     start_depth = *my_depth;  //** Store the old depth for later
 
@@ -242,7 +385,41 @@ void  *thread_pool_exec_fn(apr_thread_t *th, void *arg)
 //    log_printf(4, "tp_recv: Start!!! gid=%d tid=%d depth=%d\n", gop_id(gop), tid, op->depth);
     atomic_inc(tpc->n_started);
 
-    status = op->fn(op->arg, gop_id(gop));
+    //** MQ responses were already dequeued and sent by the connection
+    if (gop->base.ts[GOP_TS_DEQUEUE] == 0) gop_timestamp(gop, GOP_TS_DEQUEUE);
+    if (gop->base.ts[GOP_TS_SEND] == 0) gop_timestamp(gop, GOP_TS_SEND);
+
+    //** Runtime stats go in this thread's shard so threads don't fight over them
+    shard = &(tpc->stats_shard[(unsigned int)tid % TP_STATS_SHARDS]);
+    stats = tpc->stats_enabled;
+    t0 = 0;
+    if (stats == 1) {
+        t0 = apr_time_now();
+        if ((op->submitted != 0) && (t0 > op->submitted)) {  //** Our own stamp so it works without GOP_LATENCY
+            gop_histo_add(&(shard->wait), t0 - op->submitted);
+        }
+        op->submitted = 0;
+    }
+    atomic_inc(shard->n_exec);
+
+    gop_trace(GOP_TP_TP_EXEC, gop_id(gop), op->depth);
+    if (gop_cancel_requested(gop) == 0) {
+        //** Pool threads tell the context when they block in a gop wait so it can compensate.
+        //** Coroutines park instead.  Ops run by a helper or sync_exec keep the caller's blocker.
+        prev_blocker = NULL;
+        if (op->via_submit == 1) {
+            coro = tp_coro_current();
+            prev_blocker = gop_blocker_set((coro != NULL) ? &(coro->blocker) : &(tpc->blocker));
+        }
+        status = op->fn(op->arg, gop_id(gop));
+        if (op->via_submit == 1) gop_blocker_set(prev_blocker);
+    } else {  //** Cancelled while waiting in the pool
+        log_printf(15, "tp_recv: gid=%d cancelled\n", gop_id(gop));
+        status = op_cancelled_status;
+    }
+    gop_trace(GOP_TP_TP_EXEC_END, gop_id(gop), status.op_status);
+    if (stats == 1) gop_histo_add(&(shard->exec), apr_time_now() - t0);
+    atomic_inc(shard->n_done);
     if (_tp_stats > 0) {
         if (tid != op->parent_tid) {
             atomic_dec(_tp_depth_concurrent[*(_thread_local_depth_ptr())]);
@@ -253,9 +430,9 @@ void  *thread_pool_exec_fn(apr_thread_t *th, void *arg)
     log_printf(4, "tp_recv: end!!! gid=%d ptid=%d status=%d op->depth=%d op->overflow_slot=%d n_overflow=%d\n", gop_id(gop), op->parent_tid, status.op_status, op->depth, op->overflow_slot, atomic_get(tpc->n_overflow));
 
     if (op->overflow_slot != -1) { //** Need to clean up our overflow slot
-        apr_thread_mutex_lock(_tp_lock);
-        tpc->overflow_running_depth[op->overflow_slot] = -1;
-        apr_thread_mutex_unlock(_tp_lock);
+        apr_thread_mutex_lock(tpc->lock);
+        _tpc_overflow_release(tpc, op);
+        apr_thread_mutex_unlock(tpc->lock);
     }
 
     atomic_inc(tpc->n_completed);
@@ -263,21 +440,21 @@ void  *thread_pool_exec_fn(apr_thread_t *th, void *arg)
 
     gop_mark_completed(gop, status);
 
-    //** Restore the original depth in case this is a sync_exec fn chain
+    //** Restore the original depth in case this is a sync_exec fn chain.  Refetched
+    //** since a coroutine op can finish on a different thread than it started on.
+    my_depth = _thread_local_depth_ptr();
     *my_depth = start_depth;
 
     //** Check if we need to get something from the overflow que
-    if (atomic_get(tpc->n_overflow) > 0) {
-        apr_thread_mutex_lock(_tp_lock);
+    if (_tpc_overflow_ready(tpc)) {
+        apr_thread_mutex_lock(tpc->lock);
         gop = _tpc_overflow_next(tpc);
 
-        if (gop) {
+        if (gop) {  //** Undo the overflow slot since the submit redoes it
             op = gop_get_tp(gop);
-            if (op->overflow_slot != -1) {   //** Check if we need to undo our overflow slot since this submit may fail
-                op->tpc->overflow_running_depth[op->overflow_slot] = -1;
-            }
+            _tpc_overflow_release(tpc, op);
         }
-        apr_thread_mutex_unlock(_tp_lock);
+        apr_thread_mutex_unlock(tpc->lock);
 
         if (gop) _tp_submit_op(NULL, gop); //** If we got one just loop around and process it
     }
@@ -337,7 +514,7 @@ op_generic_t *new_thread_pool_op(thread_pool_context_t *tpc, char *que, op_statu
     thread_pool_op_t *op;
 
     //** Make the struct and clear it
-    type_malloc(op, thread_pool_op_t, 1);
+    type_slab_malloc(op, thread_pool_op_t, 1);
 
     atomic_inc(tpc->n_ops);
 
@@ -348,4 +525,48 @@ op_generic_t *new_thread_pool_op(thread_pool_context_t *tpc, char *que, op_statu
     return(tp_get_gop(op));
 }
 
+//*************************************************************
+// new_thread_pool_inline_op - Same as new_thread_pool_op() but the
+//     size bytes of state are copied into storage allocated along with
+//     the op and fn gets a pointer to the copy.  If state is NULL the
+//     storage is zeroed instead and the caller fills it in through
+//     tp_op_arg().  The optional destructor is called on the inline
+//     state when the op is destroyed.  Nothing else is freed since the
+//     state goes away with the op.
+//*************************************************************
+
+op_generic_t *new_thread_pool_inline_op(thread_pool_context_t *tpc, char *que, op_status_t (*fn)(void *arg, int id), const void *state, int size, void (*destructor)(void *state), int workload)
+{
+    tp_inline_op_t *iop;
+
+    assert((size >= 0) && (size <= TP_OP_INLINE_MAX));
+
+    //** One allocation for both the op and the state
+    iop = (tp_inline_op_t *)gop_slab_malloc(sizeof(tp_inline_op_t) + size);
+
+    atomic_inc(tpc->n_ops);
+
+    init_tp_op(tpc, &(iop->op));
+
+    if (state != NULL) {
+        memcpy(iop->state, state, size);
+    } else {
+        memset(iop->state, 0, size);
+    }
+
+    set_thread_pool_op(&(iop->op), tpc, que, fn, iop->state, destructor, workload);
+
+    return(tp_get_gop(&(iop->op)));
+}
+
+//*************************************************************
+// thread_pool_op_coro_set - Selects whether the op runs on a coroutine.
+//     See new_thread_pool_coro_op().  Must be called before it's submitted.
+//*************************************************************
 
+void thread_pool_op_coro_set(op_generic_t *gop, int coro)
+{
+    thread_pool_op_t *op = gop_get_tp(gop);
+
+    op->coro = coro;
+}
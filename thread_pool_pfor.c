@@ -0,0 +1,385 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// thread_pool_pfor.c - Data parallel loops on a thread pool context.
+//
+//  A parallel for is a single thread pool op.  When it runs it splits
+//  [begin,end) into grain sized chunks, deals them out evenly to k slots,
+//  and pushes k-1 helper tasks as one direct batch.  The op itself works
+//  slot 0.  Each participant takes chunks off the front of its own slot
+//  and once it's empty steals the back half of the fullest slot so the
+//  split adapts to however many helpers actually show up and how long the
+//  chunks take.  The op returns when every chunk has finished so callers
+//  get one GOP for the whole loop instead of one per element.
+//
+//  Slots are protected by a set of striped locks shared by all the loops
+//  on the context.  Helpers that show up late just drop their reference.
+//*************************************************************
+
+#define _log_module_index 137
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <apr_pools.h>
+#include "assert_result.h"
+#include "thread_pool.h"
+#include "type_malloc.h"
+#include "log.h"
+
+extern apr_pool_t *_tp_pool;
+
+#define TP_PFOR_LINE 64   //** Cache line size the slots are aligned to
+
+typedef struct {        //** Chunks [lo,hi) a participant owns.  Each is on its own cache line
+    int64_t lo;
+    int64_t hi;
+} __attribute__((aligned(TP_PFOR_LINE))) tp_pfor_slot_t;
+
+typedef struct {        //** Shared state for one parallel loop
+    thread_pool_context_t *tpc;
+    int64_t begin;
+    int64_t end;
+    int64_t grain;
+    void (*fn)(int64_t lo, int64_t hi, void *arg);                  //** parallel_for body
+    void (*rfn)(int64_t lo, int64_t hi, void *partial, void *arg);  //** parallel_reduce body
+    void (*combine)(void *result, void *partial, void *arg);        //** Folds a partial into the result
+    void *arg;
+    op_generic_t *gop;  //** Op running the loop
+    void *result;       //** Reduce result.  Holds the identity until the loop runs
+    int size;           //** and its size
+    char *partial;      //** k partials of size bytes
+    int k;              //** Slots
+    int lock_base;      //** First lock stripe.  Slot i uses stripe (lock_base+i)
+    atomic_int_t next_slot;   //** Next slot handed to a helper
+    atomic_int_t refs;        //** Op plus helpers not yet finished
+    atomic_int_t n_pending;   //** Chunks not finished yet
+    tp_pfor_slot_t slot[];
+} tp_pfor_t;
+
+#define _pfor_lock(pf, i) (pf)->tpc->pfor_lock[((pf)->lock_base + (i)) % TP_PFOR_LOCKS]
+#define _pfor_cond(pf) (pf)->tpc->pfor_cond[(pf)->lock_base % TP_PFOR_LOCKS]
+
+//*************************************************************
+// _tp_pfor_release - Drops a reference to the loop freeing it on the last one
+//*************************************************************
+
+void _tp_pfor_release(void *arg)
+{
+    tp_pfor_t *pf = (tp_pfor_t *)arg;
+
+    if (atomic_dec(pf->refs) != 0) return;
+
+    if (pf->partial != NULL) free(pf->partial);
+    free(pf);
+}
+
+//*************************************************************
+// _tp_pfor_take - Takes the next chunk from the slot.  Returns 0 if it's empty
+//*************************************************************
+
+int _tp_pfor_take(tp_pfor_t *pf, int i, int64_t *chunk)
+{
+    tp_pfor_slot_t *s = &(pf->slot[i]);
+    int got = 0;
+
+    apr_thread_mutex_lock(_pfor_lock(pf, i));
+    if (s->lo < s->hi) {
+        *chunk = s->lo;
+        s->lo++;
+        got = 1;
+    }
+    apr_thread_mutex_unlock(_pfor_lock(pf, i));
+
+    return(got);
+}
+
+//*************************************************************
+// _tp_pfor_steal - Moves the back half of the fullest slot into slot i.
+//     Returns 0 if there was nothing left to steal
+//*************************************************************
+
+int _tp_pfor_steal(tp_pfor_t *pf, int i)
+{
+    tp_pfor_slot_t *s;
+    int64_t n, best_n, mid, hi;
+    int j, best;
+
+    while (1) {
+        //** Find the fullest slot.  The peek is racy so it's rechecked under the lock
+        best = -1;
+        best_n = 0;
+        for (j=0; j<pf->k; j++) {
+            if (j == i) continue;
+            n = pf->slot[j].hi - pf->slot[j].lo;
+            if (n > best_n) {
+                best_n = n;
+                best = j;
+            }
+        }
+        if (best == -1) return(0);
+
+        s = &(pf->slot[best]);
+        apr_thread_mutex_lock(_pfor_lock(pf, best));
+        n = s->hi - s->lo;
+        if (n <= 0) {  //** Somebody beat us to it so look again
+            apr_thread_mutex_unlock(_pfor_lock(pf, best));
+            continue;
+        }
+        hi = s->hi;
+        mid = (n == 1) ? s->lo : s->lo + (n+1)/2;  //** Leave the owner the front half
+        s->hi = mid;
+        apr_thread_mutex_unlock(_pfor_lock(pf, best));
+
+        s = &(pf->slot[i]);
+        apr_thread_mutex_lock(_pfor_lock(pf, i));
+        s->lo = mid;
+        s->hi = hi;
+        apr_thread_mutex_unlock(_pfor_lock(pf, i));
+        return(1);
+    }
+}
+
+//*************************************************************
+// _tp_pfor_work - Runs chunks from slot i, stealing when it runs dry,
+//     until there's nothing left to take
+//*************************************************************
+
+void _tp_pfor_work(tp_pfor_t *pf, int i)
+{
+    int64_t chunk, lo, hi;
+    void *partial;
+    int n;
+
+    partial = (pf->partial == NULL) ? NULL : pf->partial + (size_t)i*pf->size;
+
+    n = 0;
+    do {
+        while (_tp_pfor_take(pf, i, &chunk) == 1) {
+            lo = pf->begin + chunk * pf->grain;
+            hi = lo + pf->grain;
+            if (hi > pf->end) hi = pf->end;
+            if (pf->fn != NULL) {
+                pf->fn(lo, hi, pf->arg);
+            } else {
+                pf->rfn(lo, hi, partial, pf->arg);
+            }
+            n++;
+        }
+    } while (_tp_pfor_steal(pf, i) == 1);
+
+    if (n == 0) return;
+
+    //** Fold in our partial and retire our chunks.  The result is only touched under the op's lock
+    apr_thread_mutex_lock(_pfor_lock(pf, 0));
+    if (partial != NULL) pf->combine(pf->result, partial, pf->arg);
+    if (apr_atomic_add32(&(pf->n_pending), -n) == (apr_uint32_t)n) apr_thread_cond_broadcast(_pfor_cond(pf));
+    apr_thread_mutex_unlock(_pfor_lock(pf, 0));
+}
+
+//*************************************************************
+// _tp_pfor_helper - Direct task that joins a running loop
+//*************************************************************
+
+void *_tp_pfor_helper(apr_thread_t *th, void *arg)
+{
+    tp_pfor_t *pf = (tp_pfor_t *)arg;
+    int i;
+
+    i = atomic_inc(pf->next_slot);
+    if ((i < pf->k) && (atomic_get(pf->n_pending) > 0)) _tp_pfor_work(pf, i);
+
+    _tp_pfor_release(pf);
+    return(NULL);
+}
+
+//*************************************************************
+// _tp_pfor_op - Runs the loop.  This is the op's fn
+//*************************************************************
+
+op_status_t _tp_pfor_op(void *arg, int id)
+{
+    tp_pfor_t *pf = (tp_pfor_t *)arg;
+    void **helper;
+    int64_t n_chunks, per, extra, lo;
+    int i;
+
+    if (pf->end <= pf->begin) return(op_success_status);
+
+    //** Deal the chunks out evenly
+    n_chunks = (pf->end - pf->begin + pf->grain - 1) / pf->grain;
+    per = n_chunks / pf->k;
+    extra = n_chunks % pf->k;
+    lo = 0;
+    for (i=0; i<pf->k; i++) {
+        pf->slot[i].lo = lo;
+        lo += per + ((i < extra) ? 1 : 0);
+        pf->slot[i].hi = lo;
+    }
+    atomic_set(pf->n_pending, n_chunks);
+
+    //** Each partial starts out as the identity held in the result
+    if (pf->rfn != NULL) {
+        type_malloc(pf->partial, char, (size_t)pf->k * pf->size);
+        for (i=0; i<pf->k; i++) memcpy(pf->partial + (size_t)i*pf->size, pf->result, pf->size);
+    }
+
+    //** Kick off the helpers as a single batch at the op's priority.  If
+    //** that fails none of them run so take back their refs and do it all here.
+    if (pf->k > 1) {
+        atomic_set(pf->next_slot, 1);
+        apr_atomic_add32(&(pf->refs), pf->k-1);
+        type_malloc(helper, void *, pf->k-1);
+        for (i=0; i<pf->k-1; i++) helper[i] = pf;
+        if (thread_pool_direct_batch_priority(pf->tpc, gop_priority(pf->gop), _tp_pfor_helper, helper, pf->k-1) != 0) {
+            log_printf(0, "ERROR: Couldn't push the helpers!  Running the loop alone.  gid=%d k=%d\n", gop_id(pf->gop), pf->k);
+            apr_atomic_add32(&(pf->refs), -(pf->k-1));  //** The op still holds its own so this can't hit 0
+        }
+        free(helper);
+    }
+
+    _tp_pfor_work(pf, 0);
+
+    //** Wait for the chunks other participants are still running
+    apr_thread_mutex_lock(_pfor_lock(pf, 0));
+    while (atomic_get(pf->n_pending) > 0) {
+        apr_thread_cond_wait(_pfor_cond(pf), _pfor_lock(pf, 0));
+    }
+    apr_thread_mutex_unlock(_pfor_lock(pf, 0));
+
+    return(op_success_status);
+}
+
+//*************************************************************
+// _tp_pfor_new - Makes the loop and the op that runs it
+//*************************************************************
+
+op_generic_t *_tp_pfor_new(thread_pool_context_t *tpc, int64_t begin, int64_t end, int64_t grain, void *arg)
+{
+    tp_pfor_t *pf;
+    int64_t n, n_chunks;
+    int k;
+
+    //** If no grain was given aim for 8 chunks per thread
+    n = (end > begin) ? end - begin : 0;
+    if (grain <= 0) grain = n / (8 * (int64_t)tpc->max_threads);
+    if (grain < 1) grain = 1;
+    n_chunks = (n + grain - 1) / grain;
+    if (n_chunks > (1<<30)) {  //** Keep the pending count in range
+        grain = (n + (1<<30) - 1) / (1<<30);
+        n_chunks = (n + grain - 1) / grain;
+    }
+
+    k = (n_chunks < tpc->max_threads) ? n_chunks : tpc->max_threads;
+    if (k < 1) k = 1;
+
+    assert_result(posix_memalign((void **)&pf, TP_PFOR_LINE, sizeof(tp_pfor_t) + k*sizeof(tp_pfor_slot_t)), 0);
+    memset(pf, 0, sizeof(tp_pfor_t) + k*sizeof(tp_pfor_slot_t));
+    pf->tpc = tpc;
+    pf->begin = begin;
+    pf->end = end;
+    pf->grain = grain;
+    pf->arg = arg;
+    pf->k = k;
+    pf->lock_base = atomic_inc(tpc->pfor_seq) % TP_PFOR_LOCKS;
+    atomic_set(pf->refs, 1);  //** The op's reference.  Helpers get theirs when they're pushed
+
+    pf->gop = new_thread_pool_op(tpc, NULL, _tp_pfor_op, pf, _tp_pfor_release, 1);
+    return(pf->gop);
+}
+
+//*************************************************************
+// tp_parallel_for - Returns an op that calls fn(lo, hi, arg) over
+//     [begin,end) in chunks of grain iterations spread across the pool.
+//     If grain <= 0 one is picked.  The op completes once every chunk
+//     has finished.  fn is called concurrently for disjoint ranges.
+//*************************************************************
+
+op_generic_t *tp_parallel_for(thread_pool_context_t *tpc, int64_t begin, int64_t end, int64_t grain, void (*fn)(int64_t lo, int64_t hi, void *arg), void *arg)
+{
+    op_generic_t *gop;
+    tp_pfor_t *pf;
+
+    gop = _tp_pfor_new(tpc, begin, end, grain, arg);
+    pf = tp_op_arg(gop);
+    pf->fn = fn;
+
+    return(gop);
+}
+
+//*************************************************************
+// tp_parallel_reduce - Same as tp_parallel_for() but each participant
+//     accumulates into its own size byte partial with
+//     fn(lo, hi, partial, arg).  The partials start as a copy of *result,
+//     which must hold the identity, and are folded into it with
+//     combine(result, partial, arg) before the op completes.  combine
+//     must be associative and commutative since the fold order isn't fixed.
+//*************************************************************
+
+op_generic_t *tp_parallel_reduce(thread_pool_context_t *tpc, int64_t begin, int64_t end, int64_t grain, void (*fn)(int64_t lo, int64_t hi, void *partial, void *arg),
+                                 void (*combine)(void *result, void *partial, void *arg), void *arg, void *result, int size)
+{
+    op_generic_t *gop;
+    tp_pfor_t *pf;
+
+    gop = _tp_pfor_new(tpc, begin, end, grain, arg);
+    pf = tp_op_arg(gop);
+    pf->rfn = fn;
+    pf->combine = combine;
+    pf->result = result;
+    pf->size = size;
+
+    return(gop);
+}
+
+//*************************************************************
+// tp_pfor_context_init/destroy - Sets up and tears down the lock
+//     stripes shared by the context's loops
+//*************************************************************
+
+void tp_pfor_context_init(thread_pool_context_t *tpc)
+{
+    int i;
+
+    for (i=0; i<TP_PFOR_LOCKS; i++) {
+        apr_thread_mutex_create(&(tpc->pfor_lock[i]), APR_THREAD_MUTEX_DEFAULT, _tp_pool);
+        apr_thread_cond_create(&(tpc->pfor_cond[i]), _tp_pool);
+    }
+}
+
+void tp_pfor_context_destroy(thread_pool_context_t *tpc)
+{
+    int i;
+
+    for (i=0; i<TP_PFOR_LOCKS; i++) {
+        apr_thread_mutex_destroy(tpc->pfor_lock[i]);
+        apr_thread_cond_destroy(tpc->pfor_cond[i]);
+    }
+}
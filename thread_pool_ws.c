@@ -0,0 +1,671 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+//*************************************************************
+// thread_pool_ws.c - Work stealing executor.
+//
+//  Each worker has its own deque protected by its own lock so there's no
+//  single task list everybody fights over.  Tasks pushed by a worker go in
+//  its LIFO slot and the previous occupant drops to the bottom of its ring.
+//  The owner runs the LIFO slot first and then the ring newest first which
+//  keeps a task's children on the same core while they are cache hot.
+//  Idle workers steal the oldest task from the top of the other rings and
+//  only take a LIFO slot if the victim's ring is empty so work isn't
+//  stranded behind a worker blocked in a wait.  Submissions from threads
+//  outside the pool are spread round robin across the workers.  Workers
+//  with nothing to do park on a cond that's only signaled if somebody is
+//  actually sleeping.
+//
+//  Spare workers stand in for workers blocked in a gop wait.  They are
+//  only started the 1st time they're needed and are enabled and disabled
+//  with tp_ws_extra_set().  A disabled spare parks on its own cond so it
+//  never swallows a wakeup meant for a base worker.  If it stays disabled
+//  for TP_WS_SPARE_IDLE seconds its thread exits and it's restarted the
+//  next time it's enabled.
+//
+//  HIGH and LOW priority tasks go on shared FIFO lanes instead of the
+//  worker deques.  Workers check HIGH, then their own deque and the
+//  steals, then LOW.  Every TP_LANE_FAIR'th pick goes in the reverse
+//  order so a steady stream of HIGH tasks can't starve the rest.
+//
+//  Workers can be pinned to a CPU set.  In NUMA mode the workers are
+//  split round robin across the nodes, each pinned to its node's CPUs,
+//  and submissions from outside the pool go to a worker on the
+//  submitter's node.
+//*************************************************************
+
+#define _log_module_index 133
+
+#include <stdlib.h>
+#include <string.h>
+#include <apr_pools.h>
+#include <apr_atomic.h>
+#include <apr_time.h>
+#include "assert_result.h"
+#include "apr_wrapper.h"
+#include "type_malloc.h"
+#include "log.h"
+#include "thread_pool_ws.h"
+
+static apr_threadkey_t *_ws_worker_key = NULL;  //** Worker for the current thread if any
+
+//*************************************************************
+// tp_ws_system_init - Creates the thread local worker key
+//*************************************************************
+
+void tp_ws_system_init(apr_pool_t *mpool)
+{
+    if (_ws_worker_key == NULL) apr_threadkey_private_create(&_ws_worker_key, NULL, mpool);
+}
+
+//*************************************************************
+
+void tp_ws_system_destroy()
+{
+    if (_ws_worker_key == NULL) return;
+
+    apr_threadkey_private_delete(_ws_worker_key);
+    _ws_worker_key = NULL;
+}
+
+//*************************************************************
+// tp_ws_current_worker - Returns the calling thread's worker if it
+//     belongs to the executor and NULL otherwise
+//*************************************************************
+
+tp_ws_worker_t *tp_ws_current_worker(tp_ws_t *ws)
+{
+    tp_ws_worker_t *w = NULL;
+
+    apr_threadkey_private_get((void *)&w, _ws_worker_key);
+    if ((w != NULL) && (w->ws != ws)) w = NULL;
+
+    return(w);
+}
+
+//*************************************************************
+// _ws_ring_push - Adds the task to the bottom of the ring growing it if needed
+//    NOTE: The deque should be locked
+//*************************************************************
+
+void _ws_ring_push(tp_ws_deque_t *dq, tp_ws_task_t *t)
+{
+    tp_ws_task_t *ring;
+    int i;
+
+    if (dq->n == dq->size) {  //** Full so double it
+        type_malloc(ring, tp_ws_task_t, 2*dq->size);
+        for (i=0; i<dq->n; i++) {
+            ring[i] = dq->ring[(dq->top + i) & (dq->size-1)];
+        }
+        free(dq->ring);
+        dq->ring = ring;
+        dq->top = 0;
+        dq->size = 2*dq->size;
+    }
+
+    dq->ring[(dq->top + dq->n) & (dq->size-1)] = *t;
+    dq->n++;
+}
+
+//*************************************************************
+// _ws_ring_pop - Removes the oldest task from the ring.  Returns 1 if
+//    a task was found.
+//    NOTE: The deque should be locked
+//*************************************************************
+
+int _ws_ring_pop(tp_ws_deque_t *dq, tp_ws_task_t *t)
+{
+    if (dq->n == 0) return(0);
+
+    *t = dq->ring[dq->top];
+    dq->top = (dq->top + 1) & (dq->size-1);
+    dq->n--;
+    return(1);
+}
+
+//*************************************************************
+// _ws_take - Gets the owner's next task.  LIFO slot 1st then the
+//    newest task in the ring.  Returns 1 if a task was found.
+//*************************************************************
+
+int _ws_take(tp_ws_worker_t *w, tp_ws_task_t *t)
+{
+    tp_ws_deque_t *dq = &(w->dq);
+    int found = 1;
+
+    apr_thread_mutex_lock(dq->lock);
+    if (dq->has_lifo) {
+        *t = dq->lifo;
+        dq->has_lifo = 0;
+    } else if (dq->n > 0) {
+        dq->n--;
+        *t = dq->ring[(dq->top + dq->n) & (dq->size-1)];
+    } else {
+        found = 0;
+    }
+    apr_thread_mutex_unlock(dq->lock);
+
+    if (found) atomic_dec(w->ws->n_queued);
+    return(found);
+}
+
+//*************************************************************
+// _ws_steal - Tries to steal the oldest task from the other workers.
+//    Returns 1 if a task was found.
+//*************************************************************
+
+int _ws_steal(tp_ws_worker_t *w, tp_ws_task_t *t)
+{
+    tp_ws_t *ws = w->ws;
+    tp_ws_deque_t *dq;
+    int i, v, n, found;
+
+    n = atomic_get(ws->n_started);  //** Spares that were never started have nothing to steal
+    found = 0;
+    for (i=0; (i<n) && (found == 0); i++) {
+        v = (w->victim + i) % n;
+        if (v == w->id) continue;
+
+        dq = &(ws->worker[v].dq);
+        if ((dq->n == 0) && (dq->has_lifo == 0)) continue;  //** Unlocked peek.  Worst case we miss it this round
+
+        apr_thread_mutex_lock(dq->lock);
+        if (dq->n > 0) {
+            *t = dq->ring[dq->top];
+            dq->top = (dq->top + 1) & (dq->size-1);
+            dq->n--;
+            found = 1;
+        } else if (dq->has_lifo) {
+            *t = dq->lifo;
+            dq->has_lifo = 0;
+            found = 1;
+        }
+        apr_thread_mutex_unlock(dq->lock);
+
+        if (found) w->victim = v;  //** Come back to the same victim next time
+    }
+
+    if (found) {
+        atomic_dec(ws->n_queued);
+        atomic_inc(ws->n_steals);
+    }
+
+    return(found);
+}
+
+//*************************************************************
+// _ws_lane_pop - Gets the oldest task from a shared lane.  Returns 1 if
+//    a task was found.
+//*************************************************************
+
+int _ws_lane_pop(tp_ws_t *ws, int lane, tp_ws_task_t *t)
+{
+    tp_ws_deque_t *dq = &(ws->lane[lane]);
+    int found;
+
+    if (dq->n == 0) return(0);  //** Unlocked peek.  The common case is nothing there
+
+    apr_thread_mutex_lock(dq->lock);
+    found = _ws_ring_pop(dq, t);
+    apr_thread_mutex_unlock(dq->lock);
+
+    if (found) atomic_dec(ws->n_queued);
+    return(found);
+}
+
+//*************************************************************
+// _ws_pick - Gets the worker's next task from the lanes in priority
+//    order, reversed every TP_LANE_FAIR'th pick.  Returns 1 if a task
+//    was found.
+//*************************************************************
+
+int _ws_pick(tp_ws_worker_t *w, tp_ws_task_t *t)
+{
+    tp_ws_t *ws = w->ws;
+
+    w->n_picks++;
+    if ((w->n_picks % TP_LANE_FAIR) == 0) {
+        if (_ws_lane_pop(ws, TP_LANE_LOW, t) == 1) return(1);
+        if ((_ws_take(w, t) == 1) || (_ws_steal(w, t) == 1)) return(1);
+        return(_ws_lane_pop(ws, TP_LANE_HIGH, t));
+    }
+
+    if (_ws_lane_pop(ws, TP_LANE_HIGH, t) == 1) return(1);
+    if ((_ws_take(w, t) == 1) || (_ws_steal(w, t) == 1)) return(1);
+    return(_ws_lane_pop(ws, TP_LANE_LOW, t));
+}
+
+//*************************************************************
+// _ws_spare_idle - Returns 1 if the worker is a spare that's not active
+//*************************************************************
+
+int _ws_spare_idle(tp_ws_worker_t *w)
+{
+    tp_ws_t *ws = w->ws;
+
+    if (w->id < ws->n_base) return(0);
+    if (ws->shutdown == 1) return(0);  //** Everybody helps drain on shutdown
+
+    return(((w->id - ws->n_base) >= (int)atomic_get(ws->n_extra)) ? 1 : 0);
+}
+
+//*************************************************************
+// _ws_affinity_check - Re-pins the worker if the affinity changed
+//*************************************************************
+
+void _ws_affinity_check(tp_ws_worker_t *w)
+{
+    tp_ws_t *ws = w->ws;
+
+    apr_thread_mutex_lock(ws->lock);
+    w->affinity_gen = atomic_get(ws->affinity_gen);
+    tp_cpuset_apply(w->cpuset);
+    apr_thread_mutex_unlock(ws->lock);
+}
+
+//*************************************************************
+// _ws_worker_thread - Worker thread loop
+//*************************************************************
+
+void *_ws_worker_thread(apr_thread_t *th, void *arg)
+{
+    tp_ws_worker_t *w = (tp_ws_worker_t *)arg;
+    tp_ws_t *ws = w->ws;
+    tp_ws_task_t t;
+    apr_time_t timeout;
+
+    apr_threadkey_private_set(w, _ws_worker_key);
+
+    while (1) {
+        if (w->affinity_gen != (int)atomic_get(ws->affinity_gen)) _ws_affinity_check(w);
+
+        if (_ws_spare_idle(w) == 1) {  //** Disabled spare so wait until we're needed again
+            apr_thread_mutex_lock(ws->lock);
+            timeout = apr_time_now() + apr_time_from_sec(TP_WS_SPARE_IDLE);
+            while (_ws_spare_idle(w) == 1) {
+                //** Only the owner pushes on a spare's deque so once empty it stays that way
+                if ((apr_time_now() >= timeout) && (w->dq.n == 0) && (w->dq.has_lifo == 0)) {
+                    w->retired = 1;
+                    atomic_inc(ws->n_retired);
+                    log_printf(5, "name=%s retiring spare worker %d\n", ws->name, w->id);
+                    break;
+                }
+                apr_thread_cond_timedwait(ws->spare_cond, ws->lock, apr_time_from_sec(TP_WS_SPARE_IDLE));
+            }
+            apr_thread_mutex_unlock(ws->lock);
+            if (w->retired == 1) break;
+            continue;
+        }
+
+        if (_ws_pick(w, &t) == 1) {
+            t.fn(th, t.arg);
+            continue;
+        }
+
+        //** Nothing to do so park.  Pushers only signal if they see us
+        //** sleeping so we have to flag it before the final check.
+        apr_thread_mutex_lock(ws->lock);
+        atomic_inc(ws->n_sleeping);
+        while ((atomic_get(ws->n_queued) == 0) && (ws->shutdown == 0) && (_ws_spare_idle(w) == 0)) {
+            apr_thread_cond_wait(ws->cond, ws->lock);
+        }
+        atomic_dec(ws->n_sleeping);
+        if ((ws->shutdown == 1) && (atomic_get(ws->n_queued) == 0)) {
+            apr_thread_mutex_unlock(ws->lock);
+            break;
+        }
+        if ((_ws_spare_idle(w) == 1) && (atomic_get(ws->n_queued) > 0)) {
+            apr_thread_cond_signal(ws->cond);  //** Pass on a wakeup that may have been meant for somebody else
+        }
+        apr_thread_mutex_unlock(ws->lock);
+    }
+
+    apr_threadkey_private_set(NULL, _ws_worker_key);
+
+    return(NULL);
+}
+
+//*************************************************************
+// _ws_external_worker - Picks the worker for a task submitted from
+//    outside the pool.  Round robin across the submitter's NUMA node's
+//    workers if we know it or all the base workers otherwise.
+//*************************************************************
+
+tp_ws_worker_t *_ws_external_worker(tp_ws_t *ws)
+{
+    int node, n_nodes, per_node;
+
+    n_nodes = ws->n_nodes;
+    node = (n_nodes > 1) ? tp_numa_current_node() : -1;
+    per_node = ((node >= 0) && (node < n_nodes)) ? (ws->n_base - node + n_nodes - 1) / n_nodes : 0;
+    if (per_node > 0) {  //** Keep it on the submitter's node
+        return(&(ws->worker[node + n_nodes * (atomic_inc(ws->next_worker) % per_node)]));
+    }
+
+    return(&(ws->worker[atomic_inc(ws->next_worker) % ws->n_base]));
+}
+
+//*************************************************************
+// tp_ws_push_lane - Submits a task on the given TP_LANE_*.  NORMAL tasks
+//    from a worker go in its LIFO slot and everything else NORMAL is
+//    spread round robin.  HIGH and LOW tasks go on the shared lanes.
+//    Returns 0 on success.
+//*************************************************************
+
+int tp_ws_push_lane(tp_ws_t *ws, int lane, apr_thread_start_t fn, void *arg)
+{
+    tp_ws_worker_t *w;
+    tp_ws_deque_t *dq;
+    tp_ws_task_t t;
+
+    t.fn = fn;
+    t.arg = arg;
+
+    atomic_inc(ws->n_queued);  //** Done 1st so a parking worker never misses it
+
+    w = (lane == TP_LANE_NORMAL) ? tp_ws_current_worker(ws) : NULL;
+    if ((lane == TP_LANE_HIGH) || (lane == TP_LANE_LOW)) {
+        dq = &(ws->lane[lane]);
+        apr_thread_mutex_lock(dq->lock);
+        _ws_ring_push(dq, &t);
+        apr_thread_mutex_unlock(dq->lock);
+    } else if (w != NULL) {
+        dq = &(w->dq);
+        apr_thread_mutex_lock(dq->lock);
+        if (dq->has_lifo) _ws_ring_push(dq, &(dq->lifo));
+        dq->lifo = t;
+        dq->has_lifo = 1;
+        apr_thread_mutex_unlock(dq->lock);
+    } else {
+        dq = &(_ws_external_worker(ws)->dq);
+        apr_thread_mutex_lock(dq->lock);
+        _ws_ring_push(dq, &t);
+        apr_thread_mutex_unlock(dq->lock);
+    }
+
+    //** Wake somebody up if needed
+    if (atomic_get(ws->n_sleeping) > 0) {
+        apr_thread_mutex_lock(ws->lock);
+        apr_thread_cond_signal(ws->cond);
+        apr_thread_mutex_unlock(ws->lock);
+    }
+
+    return(0);
+}
+
+//*************************************************************
+// tp_ws_push_batch - Submits n tasks sharing the same fn on the given
+//    TP_LANE_*.  NORMAL tasks from a worker all go in its ring for the
+//    others to steal.  From outside the pool they're split across up to
+//    n workers taking each deque lock once.  Only as many sleeping
+//    workers as there are tasks are woken.  Returns 0 on success.
+//*************************************************************
+
+int tp_ws_push_batch(tp_ws_t *ws, int lane, apr_thread_start_t fn, void **args, int n)
+{
+    tp_ws_worker_t *w;
+    tp_ws_deque_t *dq;
+    tp_ws_task_t t;
+    int i, j, k, start, end, n_sleeping;
+
+    if (n <= 0) return(0);
+
+    t.fn = fn;
+    apr_atomic_add32(&(ws->n_queued), n);  //** Done 1st so a parking worker never misses them
+
+    w = (lane == TP_LANE_NORMAL) ? tp_ws_current_worker(ws) : NULL;
+    if ((lane == TP_LANE_HIGH) || (lane == TP_LANE_LOW) || (w != NULL)) {
+        dq = (w != NULL) ? &(w->dq) : &(ws->lane[lane]);
+        apr_thread_mutex_lock(dq->lock);
+        for (i=0; i<n; i++) {
+            t.arg = args[i];
+            _ws_ring_push(dq, &t);
+        }
+        apr_thread_mutex_unlock(dq->lock);
+    } else {
+        k = (n < ws->n_base) ? n : ws->n_base;
+        for (j=0; j<k; j++) {
+            start = (j * n) / k;
+            end = ((j+1) * n) / k;
+            dq = &(_ws_external_worker(ws)->dq);
+            apr_thread_mutex_lock(dq->lock);
+            for (i=start; i<end; i++) {
+                t.arg = args[i];
+                _ws_ring_push(dq, &t);
+            }
+            apr_thread_mutex_unlock(dq->lock);
+        }
+    }
+
+    //** Wake only as many as we need
+    n_sleeping = atomic_get(ws->n_sleeping);
+    if (n_sleeping > 0) {
+        apr_thread_mutex_lock(ws->lock);
+        if (n >= n_sleeping) {
+            apr_thread_cond_broadcast(ws->cond);
+        } else {
+            for (i=0; i<n; i++) apr_thread_cond_signal(ws->cond);
+        }
+        apr_thread_mutex_unlock(ws->lock);
+    }
+
+    return(0);
+}
+
+//*************************************************************
+// tp_ws_push - Submits a NORMAL priority task
+//*************************************************************
+
+int tp_ws_push(tp_ws_t *ws, apr_thread_start_t fn, void *arg)
+{
+    return(tp_ws_push_lane(ws, TP_LANE_NORMAL, fn, arg));
+}
+
+//*************************************************************
+// tp_ws_extra_set - Sets the number of active spare workers launching
+//    any that haven't been started yet or have retired
+//*************************************************************
+
+void tp_ws_extra_set(tp_ws_t *ws, int n)
+{
+    tp_ws_worker_t *w;
+    apr_status_t value;
+    int i, n_spare;
+
+    n_spare = ws->n_workers - ws->n_base;
+    if (n > n_spare) n = n_spare;
+    if (n < 0) n = 0;
+
+    apr_thread_mutex_lock(ws->lock);
+    for (i=ws->n_base; i<ws->n_base + n; i++) {
+        w = &(ws->worker[i]);
+        if (w->retired == 1) {  //** Its thread already exited so reap it and start over
+            apr_thread_join(&value, w->thread);
+            apr_pool_destroy(w->mpool);
+            w->thread = NULL;
+            w->retired = 0;
+            atomic_dec(ws->n_retired);
+        }
+        if (w->thread == NULL) {
+            if (w->dq.ring == NULL) {
+                w->dq.size = TP_WS_DEQUE_MIN;
+                type_malloc(w->dq.ring, tp_ws_task_t, w->dq.size);
+            }
+            assert_result(apr_pool_create(&(w->mpool), NULL), APR_SUCCESS);
+            thread_create_assert(&(w->thread), NULL, _ws_worker_thread, (void *)w, w->mpool);
+            log_printf(5, "name=%s starting spare worker %d\n", ws->name, i);
+        }
+    }
+    if (ws->n_base + n > (int)atomic_get(ws->n_started)) atomic_set(ws->n_started, ws->n_base + n);
+    atomic_set(ws->n_extra, n);
+    apr_thread_cond_broadcast(ws->spare_cond);
+    if (atomic_get(ws->n_sleeping) > 0) apr_thread_cond_broadcast(ws->cond); //** So disabled spares move over
+    apr_thread_mutex_unlock(ws->lock);
+}
+
+//*************************************************************
+// tp_ws_affinity_set - Pins the workers to the CPU set, NULL for any.
+//    If numa is set and there's more than 1 node the workers are split
+//    across the nodes and pinned to the node CPUs also in the set.
+//    Workers pick up the change before their next task.
+//*************************************************************
+
+void tp_ws_affinity_set(tp_ws_t *ws, tp_cpuset_t *cpuset, int numa)
+{
+    tp_ws_worker_t *w;
+    int i, n_nodes;
+
+    n_nodes = (numa == 1) ? tp_numa_nodes() : 1;
+
+    apr_thread_mutex_lock(ws->lock);
+    for (i=0; i<ws->n_workers; i++) {
+        w = &(ws->worker[i]);
+        tp_cpuset_destroy(w->cpuset);
+        w->node = i % n_nodes;
+        w->cpuset = (n_nodes > 1) ? tp_numa_node_cpuset(w->node, cpuset) : NULL;
+        if (w->cpuset == NULL) w->cpuset = tp_cpuset_dup(cpuset);  //** Node has none of the CPUs so use them all
+    }
+    ws->n_nodes = n_nodes;
+    atomic_inc(ws->affinity_gen);
+    apr_thread_mutex_unlock(ws->lock);
+
+    log_printf(5, "name=%s n_nodes=%d n_cpus=%d\n", ws->name, n_nodes, (cpuset == NULL) ? 0 : cpuset->n);
+}
+
+//*************************************************************
+// tp_ws_counts - Returns the number of running workers, how many of them
+//    are idle, and the tasks waiting.  Disabled spares count as idle.
+//*************************************************************
+
+void tp_ws_counts(tp_ws_t *ws, int *n_threads, int *n_idle, int *n_queued)
+{
+    int n_spare_idle;
+
+    *n_threads = atomic_get(ws->n_started) - atomic_get(ws->n_retired);
+    n_spare_idle = *n_threads - ws->n_base - (int)atomic_get(ws->n_extra);
+    if (n_spare_idle < 0) n_spare_idle = 0;
+    *n_idle = atomic_get(ws->n_sleeping) + n_spare_idle;
+    if (*n_idle > *n_threads) *n_idle = *n_threads;
+    *n_queued = atomic_get(ws->n_queued);
+}
+
+//*************************************************************
+// tp_ws_create - Creates the executor and launches the base workers.
+//    n_spare extra workers are available via tp_ws_extra_set().
+//*************************************************************
+
+tp_ws_t *tp_ws_create(const char *name, int n_workers, int n_spare)
+{
+    tp_ws_t *ws;
+    tp_ws_worker_t *w;
+    int i;
+
+    type_malloc_clear(ws, tp_ws_t, 1);
+
+    ws->name = (name == NULL) ? NULL : strdup(name);
+    ws->n_base = (n_workers < 1) ? 1 : n_workers;
+    ws->n_workers = ws->n_base + ((n_spare < 0) ? 0 : n_spare);
+    ws->n_nodes = 1;
+    assert_result(apr_pool_create(&(ws->mpool), NULL), APR_SUCCESS);
+    apr_thread_mutex_create(&(ws->lock), APR_THREAD_MUTEX_DEFAULT, ws->mpool);
+    apr_thread_cond_create(&(ws->cond), ws->mpool);
+    apr_thread_cond_create(&(ws->spare_cond), ws->mpool);
+
+    type_malloc_clear(ws->worker, tp_ws_worker_t, ws->n_workers);
+    for (i=0; i<ws->n_workers; i++) {
+        w = &(ws->worker[i]);
+        w->ws = ws;
+        w->id = i;
+        w->victim = (i+1) % ws->n_workers;
+        apr_thread_mutex_create(&(w->dq.lock), APR_THREAD_MUTEX_DEFAULT, ws->mpool);
+        if (i < ws->n_base) {  //** Spares get their ring when started
+            w->dq.size = TP_WS_DEQUE_MIN;
+            type_malloc(w->dq.ring, tp_ws_task_t, w->dq.size);
+        }
+    }
+    for (i=0; i<TP_LANES; i++) {
+        if (i == TP_LANE_NORMAL) continue;  //** Lives in the worker deques
+        apr_thread_mutex_create(&(ws->lane[i].lock), APR_THREAD_MUTEX_DEFAULT, ws->mpool);
+        ws->lane[i].size = TP_WS_DEQUE_MIN;
+        type_malloc(ws->lane[i].ring, tp_ws_task_t, ws->lane[i].size);
+    }
+    atomic_set(ws->n_started, ws->n_base);
+
+    //** Everything is set up so launch them.  Spares wait until needed
+    for (i=0; i<ws->n_base; i++) {
+        w = &(ws->worker[i]);
+        thread_create_assert(&(w->thread), NULL, _ws_worker_thread, (void *)w, ws->mpool);
+    }
+
+    log_printf(5, "name=%s n_workers=%d n_spare=%d\n", ws->name, ws->n_base, ws->n_workers - ws->n_base);
+
+    return(ws);
+}
+
+//*************************************************************
+// tp_ws_destroy - Runs any remaining tasks and shuts down the workers
+//*************************************************************
+
+void tp_ws_destroy(tp_ws_t *ws)
+{
+    apr_status_t value;
+    int i;
+
+    log_printf(5, "name=%s steals=%d\n", ws->name, atomic_get(ws->n_steals));
+
+    apr_thread_mutex_lock(ws->lock);
+    ws->shutdown = 1;
+    apr_thread_cond_broadcast(ws->cond);
+    apr_thread_cond_broadcast(ws->spare_cond);
+    apr_thread_mutex_unlock(ws->lock);
+
+    for (i=0; i<ws->n_workers; i++) {
+        if (ws->worker[i].thread != NULL) apr_thread_join(&value, ws->worker[i].thread);
+    }
+
+    for (i=0; i<ws->n_workers; i++) {
+        if (ws->worker[i].mpool != NULL) apr_pool_destroy(ws->worker[i].mpool);
+        apr_thread_mutex_destroy(ws->worker[i].dq.lock);
+        free(ws->worker[i].dq.ring);
+        tp_cpuset_destroy(ws->worker[i].cpuset);
+    }
+    free(ws->worker);
+    for (i=0; i<TP_LANES; i++) {
+        if (ws->lane[i].lock != NULL) apr_thread_mutex_destroy(ws->lane[i].lock);
+        if (ws->lane[i].ring != NULL) free(ws->lane[i].ring);
+    }
+
+    apr_thread_mutex_destroy(ws->lock);
+    apr_thread_cond_destroy(ws->cond);
+    apr_thread_cond_destroy(ws->spare_cond);
+    apr_pool_destroy(ws->mpool);
+
+    if (ws->name != NULL) free(ws->name);
+    free(ws);
+}
@@ -0,0 +1,130 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+
+//*************************************************************
+// thread_pool_ws.h - Work stealing executor used by thread pool
+//     contexts as an alternative to the APR thread pool
+//*************************************************************
+
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include "atomic_counter.h"
+#include "thread_pool_affinity.h"
+
+#ifndef __THREAD_POOL_WS_H_
+#define __THREAD_POOL_WS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TP_WS_DEQUE_MIN 64   //** Initial size of each worker's deque.  Grows as needed
+#ifndef TP_WS_SPARE_IDLE
+#define TP_WS_SPARE_IDLE 30  //** Seconds a disabled spare waits before its thread exits
+#endif
+
+#define TP_LANE_LOW     0    //** Priority lanes.  Tasks are picked from the highest non-empty lane 1st
+#define TP_LANE_NORMAL  1
+#define TP_LANE_HIGH    2
+#define TP_LANES        3
+#define TP_LANE_FAIR    16   //** Every TP_LANE_FAIR'th pick checks the lanes lowest 1st so nothing starves
+
+typedef struct {        //** A task is the same fn/arg pair the APR pool takes
+    apr_thread_start_t fn;
+    void *arg;
+} tp_ws_task_t;
+
+typedef struct {        //** Worker deque.  The owner works the bottom and thieves take from the top
+    apr_thread_mutex_t *lock;
+    tp_ws_task_t *ring;   //** Ring buffer.  Size is always a power of 2
+    int size;
+    int top;              //** Oldest task
+    int n;                //** Tasks in the ring
+    tp_ws_task_t lifo;    //** Last task pushed by the owner.  Run next by the owner and only stolen if the ring is empty
+    int has_lifo;
+} tp_ws_deque_t;
+
+struct tp_ws_s;
+
+typedef struct {        //** Worker thread
+    struct tp_ws_s *ws;
+    apr_thread_t *thread;
+    apr_pool_t *mpool;    //** Spare's own pool so restarting it doesn't grow the executor's
+    int id;
+    int retired;          //** Spare's thread exited after sitting idle.  Protected by the executor lock
+    int victim;           //** Where the next steal attempt starts
+    int node;             //** NUMA node the worker is bound to
+    int affinity_gen;     //** Affinity generation last applied
+    int n_picks;          //** Tasks picked so far.  Drives the lane fairness
+    tp_cpuset_t *cpuset;  //** CPUs to run on or NULL.  Protected by the executor lock
+    tp_ws_deque_t dq;
+} tp_ws_worker_t;
+
+typedef struct tp_ws_s {
+    char *name;
+    apr_pool_t *mpool;
+    apr_thread_mutex_t *lock;   //** Only used for parking idle workers
+    apr_thread_cond_t *cond;
+    apr_thread_cond_t *spare_cond;  //** Inactive spare workers park here
+    tp_ws_worker_t *worker;     //** Base workers followed by the spares
+    int n_workers;              //** Base + spare workers
+    int n_base;                 //** Always active workers
+    int shutdown;
+    atomic_int_t n_extra;       //** Spares currently active.  Spares are only started when 1st needed
+    atomic_int_t n_started;     //** Base workers + spares started so far.  Retired spares still count
+    atomic_int_t n_retired;     //** Spares whose thread exited and hasn't been restarted
+    atomic_int_t affinity_gen;  //** Bumped each time the affinity changes
+    int n_nodes;                //** Workers are split round robin across this many NUMA nodes
+    tp_ws_deque_t lane[TP_LANES];  //** Shared FIFOs for the HIGH and LOW lanes.  NORMAL tasks use the worker deques
+    atomic_int_t n_queued;      //** Tasks waiting in the deques and lanes
+    atomic_int_t n_sleeping;    //** Workers parked on the cond
+    atomic_int_t next_worker;   //** Round robin target for submissions from outside the pool
+    atomic_int_t n_steals;
+} tp_ws_t;
+
+void tp_ws_system_init(apr_pool_t *mpool);
+void tp_ws_system_destroy();
+tp_ws_t *tp_ws_create(const char *name, int n_workers, int n_spare);
+void tp_ws_extra_set(tp_ws_t *ws, int n);
+void tp_ws_affinity_set(tp_ws_t *ws, tp_cpuset_t *cpuset, int numa);
+void tp_ws_counts(tp_ws_t *ws, int *n_threads, int *n_idle, int *n_queued);
+void tp_ws_destroy(tp_ws_t *ws);
+int tp_ws_push(tp_ws_t *ws, apr_thread_start_t fn, void *arg);
+int tp_ws_push_lane(tp_ws_t *ws, int lane, apr_thread_start_t fn, void *arg);
+int tp_ws_push_batch(tp_ws_t *ws, int lane, apr_thread_start_t fn, void **args, int n);
+tp_ws_worker_t *tp_ws_current_worker(tp_ws_t *ws);
+void _ws_ring_push(tp_ws_deque_t *dq, tp_ws_task_t *t);
+int _ws_ring_pop(tp_ws_deque_t *dq, tp_ws_task_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
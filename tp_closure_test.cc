@@ -0,0 +1,186 @@
+/*
+Advanced Computing Center for Research and Education Proprietary License
+Version 1.0 (April 2006)
+
+Copyright (c) 2006, Advanced Computing Center for Research and Education,
+ Vanderbilt University, All rights reserved.
+
+This Work is the sole and exclusive property of the Advanced Computing Center
+for Research and Education department at Vanderbilt University.  No right to
+disclose or otherwise disseminate any of the information contained herein is
+granted by virtue of your possession of this software except in accordance with
+the terms and conditions of a separate License Agreement entered into with
+Vanderbilt University.
+
+THE AUTHOR OR COPYRIGHT HOLDERS PROVIDES THE "WORK" ON AN "AS IS" BASIS,
+WITHOUT WARRANTY OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT
+LIMITED TO THE WARRANTIES OF MERCHANTABILITY, TITLE, FITNESS FOR A PARTICULAR
+PURPOSE, AND NON-INFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Vanderbilt University
+Advanced Computing Center for Research and Education
+230 Appleton Place
+Nashville, TN 37203
+http://www.accre.vanderbilt.edu
+*/
+//*************************************************************
+// tp_closure_test.cc - Pass/fail tests for the C++ closure ops in
+//     thread_pool.hpp.  The exit status is the number of failed cases.
+//*************************************************************
+
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <stdexcept>
+#include "thread_pool.hpp"
+
+static int test_deleted = 0;   //** Number of captured objects freed
+static int test_ran = 0;       //** Number of closures that ran
+
+struct test_deleter_t {        //** Counts the frees of the captured object
+    void operator()(int *p) const
+    {
+        __sync_fetch_and_add(&test_deleted, 1);
+        delete p;
+    }
+};
+
+typedef std::unique_ptr<int, test_deleter_t> test_ptr_t;
+
+struct test_closure_t {        //** Move-only closure holding a unique_ptr
+    test_ptr_t p;
+    int expected;
+
+    test_closure_t(int v) : p(new int(v)), expected(v) {}
+
+    op_status_t operator()(int id)
+    {
+        __sync_fetch_and_add(&test_ran, 1);
+        return(((p != nullptr) && (*p == expected)) ? op_success_status : op_failure_status);
+    }
+};
+
+//*************************************************************
+// test_unique_ptr - Ops with a move-only capture run with it intact and
+//    the capture is destroyed exactly once when the op is freed
+//*************************************************************
+
+int test_unique_ptr(thread_pool_context_t *tpc)
+{
+    opque_t *q;
+    op_generic_t *gop;
+    int i, err = 0;
+
+    test_deleted = 0;
+    test_ran = 0;
+
+    //** A single op so the free can be checked on its own
+    gop = tp_closure_op(tpc, test_closure_t(42));
+    if (test_deleted != 0) err++;  //** Only the moved from temporary is gone and it's empty
+    if (gop_waitall(gop) != OP_STATE_SUCCESS) err++;
+    if (test_deleted != 0) err++;
+    gop_free(gop, OP_DESTROY);
+    if (test_deleted != 1) err++;
+
+    //** and a bunch in a que, some of them on coroutines
+    q = new_opque();
+    for (i=0; i<100; i++) opque_add(q, tp_closure_op(tpc, test_closure_t(i), 1, i%2));
+    if (opque_waitall(q) != OP_STATE_SUCCESS) err++;
+    opque_free(q, OP_DESTROY);
+
+    if (__sync_fetch_and_add(&test_ran, 0) != 101) err++;
+    if (__sync_fetch_and_add(&test_deleted, 0) != 101) {
+        printf("ERROR: deleted=%d\n", test_deleted);
+        err++;
+    }
+
+    return(err);
+}
+
+//*************************************************************
+// test_lambda - Same as test_unique_ptr but with a real lambda using
+//    an init-capture to move the unique_ptr in
+//*************************************************************
+
+int test_lambda(thread_pool_context_t *tpc)
+{
+    opque_t *q;
+    int i, err = 0;
+
+    test_deleted = 0;
+    test_ran = 0;
+
+    q = new_opque();
+    for (i=0; i<100; i++) {
+        test_ptr_t p(new int(i));
+        opque_add(q, tp_closure_op(tpc, [p = std::move(p), i](int id) {
+            __sync_fetch_and_add(&test_ran, 1);
+            return(((p != nullptr) && (*p == i)) ? op_success_status : op_failure_status);
+        }, 1, i%2));
+        if (p != nullptr) err++;  //** Should have been moved into the op
+    }
+    if (__sync_fetch_and_add(&test_deleted, 0) != 0) err++;  //** Nothing freed until the ops are
+    if (opque_waitall(q) != OP_STATE_SUCCESS) err++;
+    opque_free(q, OP_DESTROY);
+
+    if (__sync_fetch_and_add(&test_ran, 0) != 100) err++;
+    if (__sync_fetch_and_add(&test_deleted, 0) != 100) {
+        printf("ERROR: deleted=%d\n", test_deleted);
+        err++;
+    }
+
+    return(err);
+}
+
+//*************************************************************
+// test_throw - An exception thrown by the closure fails the op
+//*************************************************************
+
+struct test_throw_t {
+    op_status_t operator()(int id)
+    {
+        throw std::runtime_error("tp_closure_test");
+    }
+};
+
+int test_throw(thread_pool_context_t *tpc)
+{
+    op_generic_t *gop;
+    int err = 0;
+
+    gop = tp_closure_op(tpc, test_throw_t());
+    if (gop_waitall(gop) != OP_STATE_FAILURE) err++;
+    gop_free(gop, OP_DESTROY);
+
+    return(err);
+}
+
+//*************************************************************
+//*************************************************************
+
+int main(int argc, char **argv)
+{
+    thread_pool_context_t *tpc;
+    int nfailed, err;
+
+    tpc = thread_pool_create_context((char *)"tp_closure_test", 4, 4, 8);
+
+    nfailed = 0;
+    err = test_unique_ptr(tpc);
+    printf("TEST: unique_ptr = %s errors=%d\n", (err == 0) ? "PASS" : "FAIL", err);
+    if (err != 0) nfailed++;
+    err = test_lambda(tpc);
+    printf("TEST: lambda = %s errors=%d\n", (err == 0) ? "PASS" : "FAIL", err);
+    if (err != 0) nfailed++;
+    err = test_throw(tpc);
+    printf("TEST: throw = %s errors=%d\n", (err == 0) ? "PASS" : "FAIL", err);
+    if (err != 0) nfailed++;
+
+    thread_pool_destroy_context(tpc);
+
+    printf("%s: %d failed\n", (nfailed == 0) ? "PASS" : "FAIL", nfailed);
+    return(nfailed);
+}